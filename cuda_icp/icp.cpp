@@ -2,6 +2,7 @@
 #include <Eigen/Core>
 #include <Eigen/Cholesky>
 #include <Eigen/Geometry>
+#include <algorithm>
 
 namespace cuda_icp{
 Eigen::Matrix4d TransformVector6dToMatrix4d(const Eigen::Matrix<double, 6, 1> &input) {
@@ -182,6 +183,170 @@ template RegistrationResult ICP_Point2Plane_cpu(std::vector<Vec3f> &model_pcd, c
 const ICPConvergenceCriteria criteria);
 template RegistrationResult ICP_Point2Plane_cpu(std::vector<Vec3f> &model_pcd, const Scene_nn scene,
 const ICPConvergenceCriteria criteria);
+template RegistrationResult ICP_Point2Plane_cpu(std::vector<Vec3f> &model_pcd, const Scene_nn_linear scene,
+const ICPConvergenceCriteria criteria);
+
+// correspondences gathered before accumulating them, small enough to stay in L1
+static const uint32_t Ab_block_size = 64;
+
+// A & b rows of a block in SoA layout, invalid rows are 0 and add nothing
+struct Ab_block{
+    float A[6][Ab_block_size];
+    float b[Ab_block_size];
+    float valid[Ab_block_size];
+};
+
+static float simd_dot(const float* x, const float* y, uint32_t n){
+    float sum = 0;
+#pragma omp simd reduction(+: sum)
+    for(uint32_t i=0; i<n; i++) sum += x[i]*y[i];
+    return sum;
+}
+
+// same result as reducing thrust__pcd2Ab over the cloud, scene queries are scalar,
+// the 29 sums are vectorized over the block
+template<class Scene>
+Vec29f pcd2Ab_simd(const Vec3f* model_pcd, uint32_t pcd_num, const Scene& scene){
+    Vec29f Ab_tight;
+    Ab_block block;
+
+    for(uint32_t start=0; start<pcd_num; start+=Ab_block_size){
+        const uint32_t n = std::min(Ab_block_size, pcd_num - start);
+
+        for(uint32_t i=0; i<n; i++){
+            const Vec3f& src_pcd = model_pcd[start + i];
+            Vec3f dst_pcd, dst_normal; bool valid;
+            scene.query(src_pcd, dst_pcd, dst_normal, valid);
+            if(!valid){
+                for(int k=0; k<6; k++) block.A[k][i] = 0;
+                block.b[i] = 0;
+                block.valid[i] = 0;
+                continue;
+            }
+            block.b[i] = (dst_pcd - src_pcd).x * dst_normal.x +
+                         (dst_pcd - src_pcd).y * dst_normal.y +
+                         (dst_pcd - src_pcd).z * dst_normal.z;
+
+            block.A[0][i] = dst_normal.z*src_pcd.y - dst_normal.y*src_pcd.z;
+            block.A[1][i] = dst_normal.x*src_pcd.z - dst_normal.z*src_pcd.x;
+            block.A[2][i] = dst_normal.y*src_pcd.x - dst_normal.x*src_pcd.y;
+
+            block.A[3][i] = dst_normal.x;
+            block.A[4][i] = dst_normal.y;
+            block.A[5][i] = dst_normal.z;
+            block.valid[i] = 1;
+        }
+
+        // ATA lower, same order as thrust__pcd2Ab
+        int shift = 0;
+        for(int y=0; y<6; y++){
+            for(int x=y; x<6; x++){
+                Ab_tight[shift] += simd_dot(block.A[y], block.A[x], n);
+                shift++;
+            }
+        }
+        for(int k=0; k<6; k++) Ab_tight[21 + k] += simd_dot(block.A[k], block.b, n);
+        Ab_tight[27] += simd_dot(block.b, block.b, n);
+        Ab_tight[28] += simd_dot(block.valid, block.valid, n);
+    }
+    return Ab_tight;
+}
+
+// serial, poses are already refined in parallel
+static void transform_pcd(Vec3f* model_pcd, uint32_t pcd_num, const Mat4x4f& trans){
+    for(uint32_t i=0; i < pcd_num; i++){
+        Vec3f& pcd = model_pcd[i];
+        float new_x = trans[0][0]*pcd.x + trans[0][1]*pcd.y + trans[0][2]*pcd.z + trans[0][3];
+        float new_y = trans[1][0]*pcd.x + trans[1][1]*pcd.y + trans[1][2]*pcd.z + trans[1][3];
+        float new_z = trans[2][0]*pcd.x + trans[2][1]*pcd.y + trans[2][2]*pcd.z + trans[2][3];
+        pcd.x = new_x;
+        pcd.y = new_y;
+        pcd.z = new_z;
+    }
+}
+
+template<class Scene>
+std::vector<RegistrationResult> ICP_Point2Plane_cpu_batch(std::vector<Vec3f> &model_pcds,
+                                                          const std::vector<uint32_t> &pose_offsets,
+                                                          const Scene scene,
+                                                          const ICPConvergenceCriteria criteria)
+{
+    const int num_poses = pose_offsets.empty() ? 0 : int(pose_offsets.size()) - 1;
+    std::vector<RegistrationResult> results(num_poses);
+
+    std::vector<int> active(num_poses);
+    for(int n=0; n<num_poses; n++) active[n] = n;
+    std::vector<uint8_t> done;
+
+    // use one extra turn
+    for(uint32_t iter=0; iter<=criteria.max_iteration_ && !active.empty(); iter++){
+        done.assign(active.size(), 0);
+
+        // one pose per thread, so that no reduction is shared between threads
+#pragma omp parallel for schedule(dynamic)
+        for(size_t a=0; a<active.size(); a++){
+            const int n = active[a];
+            Vec3f* model_pcd = model_pcds.data() + pose_offsets[n];
+            const uint32_t pcd_num = pose_offsets[n + 1] - pose_offsets[n];
+            RegistrationResult& result = results[n];
+
+            Vec29f Ab_tight = pcd2Ab_simd(model_pcd, pcd_num, scene);
+
+            RegistrationResult backup = result;
+
+            float& count = Ab_tight[28];
+            float& total_error = Ab_tight[27];
+            if(count == 0){  // avoid divid 0
+                done[a] = 1;
+                continue;
+            }
+
+            result.fitness_ = float(count) / pcd_num;
+            result.inlier_rmse_ = std::sqrt(total_error / count);
+
+            // last extra iter, just compute fitness & mse
+            if(iter == criteria.max_iteration_ ||
+               (std::abs(result.fitness_ - backup.fitness_) < criteria.relative_fitness_ &&
+                std::abs(result.inlier_rmse_ - backup.inlier_rmse_) < criteria.relative_rmse_)){
+                done[a] = 1;
+                continue;
+            }
+
+            float A_host[36];
+            float b_host[6];
+            for(int i=0; i<6; i++) b_host[i] = Ab_tight[21 + i];
+
+            int shift = 0;
+            for(int y=0; y<6; y++){
+                for(int x=y; x<6; x++){
+                    A_host[x + y*6] = Ab_tight[shift];
+                    A_host[y + x*6] = Ab_tight[shift];
+                    shift++;
+                }
+            }
+
+            Mat4x4f extrinsic = eigen_slover_666(A_host, b_host);
+
+            transform_pcd(model_pcd, pcd_num, extrinsic);
+            result.transformation_ = extrinsic * result.transformation_;
+        }
+
+        // converged poses drop out
+        size_t kept = 0;
+        for(size_t a=0; a<active.size(); a++){
+            if(!done[a]) active[kept++] = active[a];
+        }
+        active.resize(kept);
+    }
+    return results;
+}
+
+template std::vector<RegistrationResult> ICP_Point2Plane_cpu_batch(std::vector<Vec3f> &model_pcds,
+const std::vector<uint32_t> &pose_offsets, const Scene_projective scene, const ICPConvergenceCriteria criteria);
+template std::vector<RegistrationResult> ICP_Point2Plane_cpu_batch(std::vector<Vec3f> &model_pcds,
+const std::vector<uint32_t> &pose_offsets, const Scene_nn scene, const ICPConvergenceCriteria criteria);
+template std::vector<RegistrationResult> ICP_Point2Plane_cpu_batch(std::vector<Vec3f> &model_pcds,
+const std::vector<uint32_t> &pose_offsets, const Scene_nn_linear scene, const ICPConvergenceCriteria criteria);
 
 
 /// !!!!!!!!!!!!!!!!!!!!! legacy
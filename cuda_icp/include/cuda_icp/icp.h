@@ -75,6 +75,24 @@ extern template RegistrationResult ICP_Point2Plane_cpu(std::vector<Vec3f> &model
 const ICPConvergenceCriteria criteria);
 extern template RegistrationResult ICP_Point2Plane_cpu(std::vector<Vec3f> &model_pcd, const Scene_nn scene,
 const ICPConvergenceCriteria criteria);
+extern template RegistrationResult ICP_Point2Plane_cpu(std::vector<Vec3f> &model_pcd, const Scene_nn_linear scene,
+const ICPConvergenceCriteria criteria);
+
+// many model clouds against one scene, e.g. every rendered pose of a batch
+// model_pcds: clouds concatenated pose by pose, pose n is [pose_offsets[n], pose_offsets[n+1])
+// each pose follows ICP_Point2Plane_cpu, poses are refined in parallel and leave once converged
+template <class Scene>
+std::vector<RegistrationResult> ICP_Point2Plane_cpu_batch(std::vector<Vec3f>& model_pcds,
+        const std::vector<uint32_t>& pose_offsets,
+        const Scene scene,
+        const ICPConvergenceCriteria criteria = ICPConvergenceCriteria());
+
+extern template std::vector<RegistrationResult> ICP_Point2Plane_cpu_batch(std::vector<Vec3f> &model_pcds,
+const std::vector<uint32_t> &pose_offsets, const Scene_projective scene, const ICPConvergenceCriteria criteria);
+extern template std::vector<RegistrationResult> ICP_Point2Plane_cpu_batch(std::vector<Vec3f> &model_pcds,
+const std::vector<uint32_t> &pose_offsets, const Scene_nn scene, const ICPConvergenceCriteria criteria);
+extern template std::vector<RegistrationResult> ICP_Point2Plane_cpu_batch(std::vector<Vec3f> &model_pcds,
+const std::vector<uint32_t> &pose_offsets, const Scene_nn_linear scene, const ICPConvergenceCriteria criteria);
 
 #ifdef CUDA_ON
 // depth can be int32, if we use our cuda renderer
@@ -2,6 +2,8 @@
 
 #include "common.h"
 
+#include <cfloat>
+
 struct Node_kdtree{
     // tree info
     int parent = -1;
@@ -137,3 +139,119 @@ public:
 };
 
 
+
+// Points in a leaf bucket of KDTree_linear, leaves are padded to it so that they are scanned at a fixed SIMD width
+#define KDTREE_LINEAR_LEAF_SIZE 16
+// Coordinate of the padding points, their squared distance stays finite in float
+#define KDTREE_LINEAR_PAD 1e18f
+
+struct Node_linear{
+    float split_v;
+    int split_dim;
+};
+
+// Cpu only tree for Scene_nn_linear, balanced by median splits so that it needs no pointers:
+// nodes are in breadth first order, children of node i are 2i+1 and 2i+2,
+// the 2^depth leaves are the last nodes and leaf k owns points [k*LEAF_SIZE, (k+1)*LEAF_SIZE)
+// of the SoA buckets. pcd_buffer & normal_buffer follow the same order for results.
+class KDTree_linear{
+public:
+    std::vector<Node_linear> nodes;
+    int depth = 0;
+    float bbox[6];  // x_min x_max y... z..
+
+    std::vector<float> x, y, z;
+    std::vector<Vec3f> pcd_buffer;
+    std::vector<Vec3f> normal_buffer;
+
+    void build_tree(const std::vector<Vec3f>& pcd, const std::vector<Vec3f>& normal);
+};
+
+// same query as Scene_nn for cpu icp,
+// left points of a split are <= split_v and right points >= split_v, so backtracking
+// only needs the split plane, and the parent of a node is implicit
+class Scene_nn_linear{
+    float max_dist_diff = 0.01f; // m
+    const Node_linear* node_ptr;
+    const float* x_ptr;
+    const float* y_ptr;
+    const float* z_ptr;
+    const Vec3f* pcd_ptr;
+    const Vec3f* normal_ptr;
+    int depth;
+    float bbox[6];
+public:
+    void init_Scene_nn_linear_cpu(cv::Mat& scene_depth, Mat3x3f& scene_K, KDTree_linear& kdtree);
+    // scene of a tree already built from a cloud & its normals, in any frame
+    void init_Scene_nn_linear_cpu(KDTree_linear& kdtree);
+    void set_max_dist_diff(float dist){ max_dist_diff = dist; }
+
+    void query(const Vec3f& src_pcd, Vec3f& dst_pcd, Vec3f& dst_normal, bool& valid) const {
+        const float q[3] = {src_pcd.x, src_pcd.y, src_pcd.z};
+        const int first_leaf = (1 << depth) - 1;
+
+        // points farther than max_dist_diff are invalid anyway, so they never need to be visited
+        float cloest_dist_sq = pow2(max_dist_diff);
+        int result_idx = -1;
+
+        int current = 0;
+        int last = -1;
+        bool backtrack = false;
+        while (current >= 0) {
+            if(!backtrack && current >= first_leaf){
+                const int start = (current - first_leaf) * KDTREE_LINEAR_LEAF_SIZE;
+                const float* lx = x_ptr + start;
+                const float* ly = y_ptr + start;
+                const float* lz = z_ptr + start;
+
+                float dist_sq[KDTREE_LINEAR_LEAF_SIZE];
+#pragma omp simd
+                for(int i=0; i<KDTREE_LINEAR_LEAF_SIZE; i++){
+                    dist_sq[i] = (q[0] - lx[i])*(q[0] - lx[i]) +
+                                 (q[1] - ly[i])*(q[1] - ly[i]) +
+                                 (q[2] - lz[i])*(q[2] - lz[i]);
+                }
+                for(int i=0; i<KDTREE_LINEAR_LEAF_SIZE; i++){
+                    if(dist_sq[i] < cloest_dist_sq){
+                        cloest_dist_sq = dist_sq[i];
+                        result_idx = start + i;
+                    }
+                }
+
+                backtrack = true;
+                last = current;
+                current = current > 0 ? (current - 1)/2 : -1;
+                continue;
+            }
+
+            const Node_linear& node_cur = node_ptr[current];
+            const float diff = q[node_cur.split_dim] - node_cur.split_v;
+            const int best_child = diff < 0 ? 2*current + 1 : 2*current + 2;
+            const int the_other = diff < 0 ? 2*current + 2 : 2*current + 1;
+
+            if(!backtrack){
+                last = current;
+                current = best_child; // go down
+            }else if(last == best_child && diff*diff < cloest_dist_sq){
+                last = current;
+                current = the_other;
+                backtrack = false;
+            }else{
+                last = current;
+                current = current > 0 ? (current - 1)/2 : -1;
+            }
+        }
+
+        if(result_idx >= 0){
+            valid = true;
+            dst_pcd = pcd_ptr[result_idx];
+            dst_normal = normal_ptr[result_idx];
+        }else{
+            valid = false;
+        }
+    }
+
+    // queries are visited in morton order of their position in the scene bbox,
+    // so that neighbouring queries walk the same nodes & leaves while they are still in cache
+    void query_batch(const Vec3f* src_pcd, size_t num, Vec3f* dst_pcd, Vec3f* dst_normal, bool* valid) const;
+};
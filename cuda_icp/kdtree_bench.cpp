@@ -0,0 +1,122 @@
+#include "cuda_icp/helper.h"
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <memory>
+
+#ifdef WITH_PCL
+#include <pcl/point_types.h>
+#include <pcl/kdtree/kdtree_flann.h>
+#endif
+
+using namespace std;
+
+// nearest neighbor micro benchmark of the cpu scenes:
+// Scene_nn (KDTree_cpu), Scene_nn_linear (KDTree_linear) single & batch query, and pcl KdTreeFLANN if found
+// usage: kdtree_bench [num_queries]
+
+int main(int argc, char const *argv[]){
+    const size_t num_queries = argc > 1 ? std::stoul(argv[1]) : 1000000;
+
+    // curved surface seen by a kinect like camera, depth in cm as the scenes expect
+    const int width = 640, height = 480;
+    float K_data[9] = {572.4f, 0, 325.3f,
+                       0, 573.6f, 242.0f,
+                       0, 0, 1};
+    Mat3x3f K(K_data);
+    cv::Mat scene_depth(height, width, CV_16U);
+    for(int r=0; r<height; r++){
+        for(int c=0; c<width; c++){
+            scene_depth.at<uint16_t>(r, c) = uint16_t(80 + 10*std::sin(c/40.0f) + 8*std::cos(r/30.0f));
+        }
+    }
+
+    Timer timer;
+    KDTree_cpu kdtree;
+    Scene_nn scene_nn;
+    scene_nn.init_Scene_nn_cpu(scene_depth, K, kdtree);
+    timer.out("KDTree_cpu build");
+
+    KDTree_linear kdtree_linear;
+    Scene_nn_linear scene_linear;
+    scene_linear.init_Scene_nn_linear_cpu(scene_depth, K, kdtree_linear);
+    timer.out("KDTree_linear build");
+
+    // queries near the surface, in random order
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<size_t> pick(0, kdtree.pcd_buffer.size() - 1);
+    std::normal_distribution<float> noise(0, 0.005f);
+    std::vector<Vec3f> queries(num_queries);
+    for(auto& q: queries){
+        const Vec3f& p = kdtree.pcd_buffer[pick(gen)];
+        q = Vec3f(p.x + noise(gen), p.y + noise(gen), p.z + noise(gen));
+    }
+    std::cout << "scene points: " << kdtree.pcd_buffer.size() << ", queries: " << num_queries << std::endl;
+
+    std::vector<Vec3f> dst_nn(num_queries), normal_nn(num_queries);
+    std::unique_ptr<bool[]> valid_nn(new bool[num_queries]);
+    timer.reset();
+#pragma omp parallel for
+    for(size_t i=0; i<num_queries; i++){
+        scene_nn.query(queries[i], dst_nn[i], normal_nn[i], valid_nn[i]);
+    }
+    timer.out("Scene_nn query");
+
+    std::vector<Vec3f> dst_linear(num_queries), normal_linear(num_queries);
+    std::unique_ptr<bool[]> valid_linear(new bool[num_queries]);
+    timer.reset();
+#pragma omp parallel for
+    for(size_t i=0; i<num_queries; i++){
+        scene_linear.query(queries[i], dst_linear[i], normal_linear[i], valid_linear[i]);
+    }
+    timer.out("Scene_nn_linear query");
+
+    std::vector<Vec3f> dst_batch(num_queries), normal_batch(num_queries);
+    std::unique_ptr<bool[]> valid_batch(new bool[num_queries]);
+    timer.reset();
+    scene_linear.query_batch(queries.data(), num_queries, dst_batch.data(), normal_batch.data(), valid_batch.get());
+    timer.out("Scene_nn_linear query_batch");
+
+    // equal distances are enough, ties may pick different points
+    size_t num_valid = 0, mismatch = 0;
+    for(size_t i=0; i<num_queries; i++){
+        if(valid_nn[i]) num_valid++;
+        if(valid_nn[i] != valid_linear[i] || valid_nn[i] != valid_batch[i]){
+            mismatch++;
+            continue;
+        }
+        if(!valid_nn[i]) continue;
+        const float d_nn = (dst_nn[i] - queries[i]).norm();
+        const float d_linear = (dst_linear[i] - queries[i]).norm();
+        const float d_batch = (dst_batch[i] - queries[i]).norm();
+        if(std::abs(d_nn - d_linear) > 1e-6f || std::abs(d_nn - d_batch) > 1e-6f) mismatch++;
+    }
+    std::cout << "valid: " << num_valid << ", mismatch: " << mismatch << std::endl;
+
+#ifdef WITH_PCL
+    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZ>);
+    cloud->points.reserve(kdtree.pcd_buffer.size());
+    for(const auto& p: kdtree.pcd_buffer) cloud->points.emplace_back(p.x, p.y, p.z);
+    cloud->width = cloud->points.size();
+    cloud->height = 1;
+
+    timer.reset();
+    pcl::KdTreeFLANN<pcl::PointXYZ> flann;
+    flann.setInputCloud(cloud);
+    timer.out("KdTreeFLANN build");
+
+    size_t num_valid_flann = 0;
+#pragma omp parallel for reduction(+:num_valid_flann)
+    for(size_t i=0; i<num_queries; i++){
+        std::vector<int> indices(1);
+        std::vector<float> sq_dists(1);
+        flann.nearestKSearch(pcl::PointXYZ(queries[i].x, queries[i].y, queries[i].z), 1, indices, sq_dists);
+        if(sq_dists[0] < 0.01f*0.01f) num_valid_flann++;
+    }
+    timer.out("KdTreeFLANN nearestKSearch");
+    std::cout << "valid: " << num_valid_flann << std::endl;
+#endif
+
+    return 0;
+}
@@ -1,10 +1,11 @@
 #include "cuda_icp/pcd_scene.h"
+#include <algorithm>
+#include <numeric>
 
-
-void Scene_nn::init_Scene_nn_cpu(cv::Mat &scene_depth__, Mat3x3f &scene_K, KDTree_cpu& kdtree)
+// valid pixels of the depth to pcd & normal, shared by the kdtree scenes
+static void depth2pcd_normal(cv::Mat &scene_depth__, Mat3x3f &scene_K,
+                             std::vector<Vec3f>& pcd_buffer, std::vector<Vec3f>& normal_buffer)
 {
-    printf("init_Scene_nn_cpu()\n");
-
     int depth_type = scene_depth__.type();
     assert(depth_type == CV_16U || depth_type == CV_32S);
 
@@ -16,21 +17,27 @@ void Scene_nn::init_Scene_nn_cpu(cv::Mat &scene_depth__, Mat3x3f &scene_K, KDTre
     }
 
     auto normal = get_normal(scene_depth, scene_K);
-    kdtree.pcd_buffer.clear();
-    kdtree.pcd_buffer.reserve(scene_depth.rows * scene_depth.cols);
-    kdtree.normal_buffer.clear();
-    kdtree.normal_buffer.reserve(scene_depth.rows * scene_depth.cols);
+    pcd_buffer.clear();
+    pcd_buffer.reserve(scene_depth.rows * scene_depth.cols);
+    normal_buffer.clear();
+    normal_buffer.reserve(scene_depth.rows * scene_depth.cols);
 
     for(int r=0; r<scene_depth.rows; r++){
         for(int c=0; c<scene_depth.cols; c++){
             auto& dep_at_rc = scene_depth.at<uint16_t>(r, c);
             if(dep_at_rc > 0){
-                kdtree.pcd_buffer.push_back(dep2pcd(c, r, dep_at_rc, scene_K));
-                kdtree.normal_buffer.push_back(normal[c + r*scene_depth.cols]);
+                pcd_buffer.push_back(dep2pcd(c, r, dep_at_rc, scene_K));
+                normal_buffer.push_back(normal[c + r*scene_depth.cols]);
             }
         }
     }
+}
 
+void Scene_nn::init_Scene_nn_cpu(cv::Mat &scene_depth, Mat3x3f &scene_K, KDTree_cpu& kdtree)
+{
+    printf("init_Scene_nn_cpu()\n");
+
+    depth2pcd_normal(scene_depth, scene_K, kdtree.pcd_buffer, kdtree.normal_buffer);
     kdtree.build_tree();
 
     pcd_ptr = kdtree.pcd_buffer.data();
@@ -180,3 +187,150 @@ void KDTree_cpu::build_tree(int max_num_pcd_in_leaf)
     }
     normal_buffer = v3f_buffer;
 }
+
+void Scene_nn_linear::init_Scene_nn_linear_cpu(cv::Mat &scene_depth, Mat3x3f &scene_K, KDTree_linear &kdtree)
+{
+    printf("init_Scene_nn_linear_cpu()\n");
+
+    std::vector<Vec3f> pcd, normal;
+    depth2pcd_normal(scene_depth, scene_K, pcd, normal);
+    kdtree.build_tree(pcd, normal);
+    init_Scene_nn_linear_cpu(kdtree);
+}
+
+void Scene_nn_linear::init_Scene_nn_linear_cpu(KDTree_linear &kdtree)
+{
+    node_ptr = kdtree.nodes.data();
+    x_ptr = kdtree.x.data();
+    y_ptr = kdtree.y.data();
+    z_ptr = kdtree.z.data();
+    pcd_ptr = kdtree.pcd_buffer.data();
+    normal_ptr = kdtree.normal_buffer.data();
+    depth = kdtree.depth;
+    for(int i=0; i<6; i++) bbox[i] = kdtree.bbox[i];
+}
+
+// level by level like KDTree_cpu::build_tree, but every node is split at its median,
+// so all leaves end at the same depth and hold at most KDTREE_LINEAR_LEAF_SIZE points
+void KDTree_linear::build_tree(const std::vector<Vec3f> &pcd, const std::vector<Vec3f> &normal)
+{
+    assert(pcd.size() > 0 && pcd.size() == normal.size()
+           && "no pcd yet, or pcd size != normal size");
+
+    const int num_pcd = int(pcd.size());
+    depth = 0;
+    while((size_t(1) << depth) * KDTREE_LINEAR_LEAF_SIZE < pcd.size()) depth++;
+    const int num_leaves = 1 << depth;
+
+    std::vector<int> index(num_pcd);
+    std::iota(std::begin(index), std::end(index), 0);
+
+    // node i of a level covers index[begin[i], begin[i+1])
+    std::vector<int> begin = {0, num_pcd};
+    std::vector<int> next_begin;
+
+    nodes.resize(num_leaves - 1);
+    for(int level=0; level<depth; level++){
+        const int first_node = (1 << level) - 1;
+        const int level_nodes = 1 << level;
+        next_begin.resize(2*level_nodes + 1);
+
+#pragma omp parallel for schedule(dynamic)
+        for(int i=0; i<level_nodes; i++){
+            const int left = begin[i];
+            const int right = begin[i + 1];
+            const int mid = (left + right)/2;
+
+            float lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+            float hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+            for(int idx_iter = left; idx_iter < right; idx_iter++){
+                const auto& p = pcd[index[idx_iter]];
+                for(int d=0; d<3; d++){
+                    if(p[d] < lo[d]) lo[d] = p[d];
+                    if(p[d] > hi[d]) hi[d] = p[d];
+                }
+            }
+            int split_dim = 0;
+            for(int d=1; d<3; d++){
+                if(hi[d] - lo[d] > hi[split_dim] - lo[split_dim]) split_dim = d;
+            }
+
+            Node_linear& node = nodes[first_node + i];
+            node.split_dim = split_dim;
+            if(mid < right){
+                std::nth_element(index.begin() + left, index.begin() + mid, index.begin() + right,
+                                 [&](int a, int b){ return pcd[a][split_dim] < pcd[b][split_dim]; });
+                node.split_v = pcd[index[mid]][split_dim];
+            }else{
+                node.split_v = 0;  // empty node, both children stay empty
+            }
+
+            next_begin[2*i] = left;
+            next_begin[2*i + 1] = mid;
+        }
+        next_begin[2*level_nodes] = num_pcd;
+        begin.swap(next_begin);
+    }
+
+    // SoA buckets, padded with far away points
+    const size_t num_slots = size_t(num_leaves) * KDTREE_LINEAR_LEAF_SIZE;
+    x.assign(num_slots, KDTREE_LINEAR_PAD);
+    y.assign(num_slots, KDTREE_LINEAR_PAD);
+    z.assign(num_slots, KDTREE_LINEAR_PAD);
+    pcd_buffer.assign(num_slots, Vec3f(0, 0, 0));
+    normal_buffer.assign(num_slots, Vec3f(0, 0, 0));
+
+    bbox[0] = bbox[2] = bbox[4] = FLT_MAX;
+    bbox[1] = bbox[3] = bbox[5] = -FLT_MAX;
+    for(int leaf=0; leaf<num_leaves; leaf++){
+        int slot = leaf * KDTREE_LINEAR_LEAF_SIZE;
+        for(int idx_iter = begin[leaf]; idx_iter < begin[leaf + 1]; idx_iter++, slot++){
+            const Vec3f& p = pcd[index[idx_iter]];
+            x[slot] = p.x;
+            y[slot] = p.y;
+            z[slot] = p.z;
+            pcd_buffer[slot] = p;
+            normal_buffer[slot] = normal[index[idx_iter]];
+            for(int d=0; d<3; d++){
+                if(p[d] < bbox[2*d]) bbox[2*d] = p[d];
+                if(p[d] > bbox[2*d + 1]) bbox[2*d + 1] = p[d];
+            }
+        }
+    }
+}
+
+// spread the low 10 bits of v to every third bit
+static inline uint32_t expand_bits_10(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+void Scene_nn_linear::query_batch(const Vec3f *src_pcd, size_t num,
+                                  Vec3f *dst_pcd, Vec3f *dst_normal, bool *valid) const
+{
+    // 10 bits per axis over the scene bbox, queries outside are clamped to its faces
+    std::vector<std::pair<uint32_t, uint32_t>> order(num);
+#pragma omp parallel for
+    for(size_t i=0; i<num; i++){
+        uint32_t code = 0;
+        for(int d=0; d<3; d++){
+            const float span = bbox[2*d + 1] - bbox[2*d];
+            float t = span > 0 ? (src_pcd[i][d] - bbox[2*d]) / span : 0;
+            t = std::min(std::max(t, 0.0f), 1.0f);
+            code |= expand_bits_10(uint32_t(t * 1023)) << (2 - d);
+        }
+        order[i] = {code, uint32_t(i)};
+    }
+    std::sort(order.begin(), order.end());
+
+    // static schedule, every thread keeps a contiguous run of the curve
+#pragma omp parallel for schedule(static)
+    for(size_t i=0; i<num; i++){
+        const uint32_t q = order[i].second;
+        query(src_pcd[q], dst_pcd[q], dst_normal[q], valid[q]);
+    }
+}
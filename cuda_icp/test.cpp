@@ -1,9 +1,115 @@
 #include "cuda_icp/icp.h"
 #include <iostream>
 #include <chrono>
+#include <cmath>
+#include <random>
 
 using namespace std;
 
+// ICP_Point2Plane_cpu_batch against one ICP_Point2Plane_cpu call per pose,
+// on a synthetic curved surface and model clouds cut from it with small pose offsets
+
+static Mat4x4f small_transform(float rx, float ry, float rz, float tx, float ty, float tz){
+    Mat4x4f trans = Mat4x4f::identity();
+    const float c[3] = {std::cos(rx), std::cos(ry), std::cos(rz)};
+    const float s[3] = {std::sin(rx), std::sin(ry), std::sin(rz)};
+    // R = Rz * Ry * Rx
+    trans[0][0] = c[2]*c[1]; trans[0][1] = c[2]*s[1]*s[0] - s[2]*c[0]; trans[0][2] = c[2]*s[1]*c[0] + s[2]*s[0];
+    trans[1][0] = s[2]*c[1]; trans[1][1] = s[2]*s[1]*s[0] + c[2]*c[0]; trans[1][2] = s[2]*s[1]*c[0] - c[2]*s[0];
+    trans[2][0] = -s[1];     trans[2][1] = c[1]*s[0];                  trans[2][2] = c[1]*c[0];
+    trans[0][3] = tx; trans[1][3] = ty; trans[2][3] = tz;
+    return trans;
+}
+
+template <class Scene>
+static int check_batch_parity(const Scene& scene, const std::vector<Vec3f>& scene_pcd, const char* name){
+    const int num_poses = 16;
+    const float tolerance = 1e-3f;
+
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<size_t> pick(0, scene_pcd.size() - 1);
+    std::uniform_real_distribution<float> angle(-0.02f, 0.02f);
+    std::uniform_real_distribution<float> shift(-0.003f, 0.003f);
+
+    std::vector<std::vector<Vec3f>> model_pcds(num_poses);
+    std::vector<Vec3f> batch_pcds;
+    std::vector<uint32_t> pose_offsets(1, 0);
+    for(int n=0; n<num_poses; n++){
+        // patch around a random scene point, of varying size so poses converge at different iterations;
+        // large enough to keep A well conditioned, as the batch sums in a different order
+        const Vec3f center = scene_pcd[pick(gen)];
+        const float radius = 0.10f + 0.02f*(n % 4);
+        for(const auto& p: scene_pcd){
+            if((p - center).norm() < radius) model_pcds[n].push_back(p);
+        }
+        const Mat4x4f offset = small_transform(angle(gen), angle(gen), angle(gen), shift(gen), shift(gen), shift(gen));
+        // rotate about the patch center, so that it stays within the correspondence distance
+        for(auto& p: model_pcds[n]){
+            const Vec3f d = p - center;
+            p = Vec3f(offset[0][0]*d.x + offset[0][1]*d.y + offset[0][2]*d.z + offset[0][3] + center.x,
+                      offset[1][0]*d.x + offset[1][1]*d.y + offset[1][2]*d.z + offset[1][3] + center.y,
+                      offset[2][0]*d.x + offset[2][1]*d.y + offset[2][2]*d.z + offset[2][3] + center.z);
+        }
+        batch_pcds.insert(batch_pcds.end(), model_pcds[n].begin(), model_pcds[n].end());
+        pose_offsets.push_back(batch_pcds.size());
+    }
+
+    std::vector<cuda_icp::RegistrationResult> batch_results =
+            cuda_icp::ICP_Point2Plane_cpu_batch(batch_pcds, pose_offsets, scene);
+
+    int failures = 0;
+    for(int n=0; n<num_poses; n++){
+        std::vector<Vec3f> single_pcd = model_pcds[n];
+        cuda_icp::RegistrationResult single = cuda_icp::ICP_Point2Plane_cpu(single_pcd, scene);
+        const cuda_icp::RegistrationResult& batch = batch_results[n];
+
+        float max_diff = 0;
+        for(int i=0; i<4; i++){
+            for(int j=0; j<4; j++){
+                max_diff = std::max(max_diff, std::abs(single.transformation_[i][j] - batch.transformation_[i][j]));
+            }
+        }
+        const float fitness_diff = std::abs(single.fitness_ - batch.fitness_);
+        const float rmse_diff = std::abs(single.inlier_rmse_ - batch.inlier_rmse_);
+        if(max_diff > tolerance || fitness_diff > tolerance || rmse_diff > tolerance){
+            std::cout << name << " pose " << n << " differs: transform " << max_diff
+                      << ", fitness " << fitness_diff << ", rmse " << rmse_diff << std::endl;
+            failures++;
+        }
+        if(!(batch.fitness_ > 0)){
+            std::cout << name << " pose " << n << " did not register" << std::endl;
+            failures++;
+        }
+    }
+    std::cout << name << ": " << num_poses - failures << "/" << num_poses << " poses match" << std::endl;
+    return failures;
+}
+
 int main(int argc, char const *argv[]){
-    return 0;
+    // curved surface seen by a kinect like camera, depth in cm as the scenes expect
+    const int width = 640, height = 480;
+    float K_data[9] = {572.4f, 0, 325.3f,
+                       0, 573.6f, 242.0f,
+                       0, 0, 1};
+    Mat3x3f K(K_data);
+    cv::Mat scene_depth(height, width, CV_16U);
+    for(int r=0; r<height; r++){
+        for(int c=0; c<width; c++){
+            scene_depth.at<uint16_t>(r, c) = uint16_t(80 + 15*std::sin(c/25.0f) + 12*std::cos(r/20.0f));
+        }
+    }
+
+    int failures = 0;
+
+    KDTree_cpu kdtree;
+    Scene_nn scene_nn;
+    scene_nn.init_Scene_nn_cpu(scene_depth, K, kdtree);
+    failures += check_batch_parity(scene_nn, kdtree.pcd_buffer, "Scene_nn");
+
+    KDTree_linear kdtree_linear;
+    Scene_nn_linear scene_linear;
+    scene_linear.init_Scene_nn_linear_cpu(scene_depth, K, kdtree_linear);
+    failures += check_batch_parity(scene_linear, kdtree.pcd_buffer, "Scene_nn_linear");
+
+    return failures == 0 ? 0 : 1;
 }
@@ -0,0 +1,130 @@
+#ifndef CUDA_RENDERER_COLOR_DISTANCE_H
+#define CUDA_RENDERER_COLOR_DISTANCE_H
+#include <cmath>
+#include <cstdint>
+
+#ifdef __CUDACC__
+#define COLOR_HOST_DEVICE __host__ __device__
+#else
+#define COLOR_HOST_DEVICE
+#endif
+
+namespace cuda_renderer {
+namespace color {
+
+/*
+ * CIELAB conversion and CIEDE2000 distance shared by the CPU and GPU cost steps, in single precision.
+ * Clouds store colors channel major (blue, green, red at i, i + n, i + 2n), Lab clouds use the same
+ * layout with L, a, b. The observed cloud is converted once per scene, so that a neighbour pair only
+ * costs the rendered point conversion and the distance.
+ */
+COLOR_HOST_DEVICE inline
+float srgb_to_linear(uint8_t c){
+    const float v = c / 255.0f;
+    return ((v > 0.04045f) ? powf((v + 0.055f) / 1.055f, 2.4f) : (v / 12.92f)) * 100.0f;
+}
+
+COLOR_HOST_DEVICE inline
+float lab_f(float t){
+    return (t > 0.008856f) ? cbrtf(t) : (7.787f * t + 16.0f / 116.0f);
+}
+
+COLOR_HOST_DEVICE inline
+void rgb_to_lab(uint8_t rr, uint8_t gg, uint8_t bb, float* lab){
+    const float r = srgb_to_linear(rr);
+    const float g = srgb_to_linear(gg);
+    const float b = srgb_to_linear(bb);
+
+    const float x = lab_f((r*0.4124564f + g*0.3575761f + b*0.1804375f) / 95.047f);
+    const float y = lab_f((r*0.2126729f + g*0.7151522f + b*0.0721750f) / 100.0f);
+    const float z = lab_f((r*0.0193339f + g*0.1191920f + b*0.9503041f) / 108.883f);
+
+    lab[0] = 116.0f * y - 16.0f;
+    lab[1] = 500.0f * (x - y);
+    lab[2] = 200.0f * (y - z);
+}
+
+COLOR_HOST_DEVICE inline
+float ciede2000(float l1, float a1, float b1, float l2, float a2, float b2){
+    const float kPi = 3.14159265358979f;
+    const float kDegToRad = kPi / 180.0f;
+    const float kPow25To7 = 6103515625.0f;
+    const float eps = 1e-5f;
+
+    float c1 = sqrtf(a1*a1 + b1*b1);
+    float c2 = sqrtf(a2*a2 + b2*b2);
+    float mean_c = (c1 + c2) / 2.0f;
+    float mean_c7 = mean_c*mean_c*mean_c*mean_c*mean_c*mean_c*mean_c;
+
+    const float g = 0.5f*(1 - sqrtf(mean_c7 / (mean_c7 + kPow25To7)));
+    const float a1p = a1 * (1 + g);
+    const float a2p = a2 * (1 + g);
+
+    c1 = sqrtf(a1p*a1p + b1*b1);
+    c2 = sqrtf(a2p*a2p + b2*b2);
+    const float h1 = fmodf(atan2f(b1, a1p) + 2*kPi, 2*kPi);
+    const float h2 = fmodf(atan2f(b2, a2p) + 2*kPi, 2*kPi);
+
+    // deltaL, deltaC, deltaH
+    const float delta_l = l2 - l1;
+    const float delta_c = c2 - c1;
+    float delta_h;
+    if (fabsf(h2 - h1) <= kPi) {
+        delta_h = h2 - h1;
+    }
+    else if (h2 > h1) {
+        delta_h = h2 - h1 - 2*kPi;
+    }
+    else {
+        delta_h = h2 - h1 + 2*kPi;
+    }
+    const float delta_H = 2 * sqrtf(c1*c2) * sinf(delta_h / 2);
+
+    const float mean_l = (l1 + l2) / 2;
+    mean_c = (c1 + c2) / 2.0f;
+    mean_c7 = mean_c*mean_c*mean_c*mean_c*mean_c*mean_c*mean_c;
+    float mean_h;
+    if (fabsf(h1 - h2) <= kPi + eps) {
+        mean_h = (h1 + h2) / 2;
+    }
+    else if (h1 + h2 < 2*kPi) {
+        mean_h = (h1 + h2 + 2*kPi) / 2;
+    }
+    else {
+        mean_h = (h1 + h2 - 2*kPi) / 2;
+    }
+
+    const float T = 1
+        - 0.17f*cosf(mean_h - 30*kDegToRad)
+        + 0.24f*cosf(2 * mean_h)
+        + 0.32f*cosf(3 * mean_h + 6*kDegToRad)
+        - 0.2f*cosf(4 * mean_h - 63*kDegToRad);
+    const float dl50 = (mean_l - 50)*(mean_l - 50);
+    const float sl = 1 + (0.015f*dl50) / sqrtf(20 + dl50);
+    const float sc = 1 + 0.045f*mean_c;
+    const float sh = 1 + 0.015f*mean_c*T;
+    const float rc = 2 * sqrtf(mean_c7 / (mean_c7 + kPow25To7));
+    const float dh = (mean_h / kDegToRad - 275) / 25;
+    const float rt = -sinf(60 * kDegToRad * expf(-dh*dh)) * rc;
+
+    const float tl = delta_l / sl, tc = delta_c / sc, th = delta_H / sh;
+    return sqrtf(tl*tl + tc*tc + th*th + rt * tc * th);
+}
+
+// Lab of a cloud of n colors, both channel major
+inline void colors_to_lab(const uint8_t* colors, int n, float* lab){
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++)
+    {
+        float point_lab[3];
+        rgb_to_lab(colors[i + 2*n], colors[i + 1*n], colors[i + 0*n], point_lab);
+        lab[i + 0*n] = point_lab[0];
+        lab[i + 1*n] = point_lab[1];
+        lab[i + 2*n] = point_lab[2];
+    }
+}
+
+}
+}
+
+#endif
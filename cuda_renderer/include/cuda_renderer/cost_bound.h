@@ -0,0 +1,46 @@
+#ifndef CUDA_RENDERER_COST_BOUND_H
+#define CUDA_RENDERER_COST_BOUND_H
+
+#ifdef __CUDACC__
+#define BOUND_HOST_DEVICE __host__ __device__
+#else
+#define BOUND_HOST_DEVICE
+#endif
+
+// Rendered cost returned for poses abandoned because their cost provably reaches their bound
+#define PRUNED_POSE_COST -2
+// Number of interleaved point chunks a pose is scored in when costs are bounded
+#define COST_BOUND_CHUNKS 4
+
+namespace cuda_renderer {
+namespace cost_bound {
+
+/*
+ * Branch and bound on the pose cost (rendered + observed percentage, as summed by the caller).
+ * After scoring some of its points, the final cost of a pose can only be higher than:
+ * - rendered : the unexplained points so far over all points of the pose
+ * - observed : every rendered point left explains at most one more observed point
+ * A pose whose integer lower bound reaches its bound can never become the best pose and is abandoned.
+ */
+BOUND_HOST_DEVICE inline
+float lower_bound(float pose_points, float scored_points, float unexplained_points,
+                  float observed_points_total, float observed_explained, bool calculate_observed_cost){
+    if (!(pose_points > 0)) return 0;
+    float bound = unexplained_points / pose_points * 100;
+    if (calculate_observed_cost && observed_points_total > 0)
+    {
+        const float remaining_points = pose_points - scored_points;
+        bound += (observed_points_total - observed_explained - remaining_points) / observed_points_total * 100;
+    }
+    return bound;
+}
+
+BOUND_HOST_DEVICE inline
+bool exceeds(float lower_bound, float cost_bound){
+    return (int) lower_bound >= cost_bound;
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef CPU_COMPUTE_COSTS_H
+#define CPU_COMPUTE_COSTS_H
+#include <vector>
+#include <cmath>
+#include <omp.h>
+
+#include "cuda_renderer/model.h"
+#include "cuda_renderer/color_distance.h"
+#include "cuda_renderer/cost_bound.h"
+
+namespace cuda_renderer {
+namespace cpu {
+
+void compute_costs(const int   num_images,
+                   const int   cost_type,
+                   const bool  calculate_observed_cost,
+                   const float sensor_resolution,
+                   const float color_distance_threshold,
+                   const float* observed_cloud_lab,
+                   const int observed_cloud_point_count,
+                   const std::vector<uint8_t>& rendered_cloud_color,
+                   const std::vector<int>&     rendered_cloud_pose_map,
+                   const std::vector<int>&     rendered_poses_occluded,
+                   const std::vector<float>&   rendered_poses_observed_points_total,
+                   const int rendered_cloud_point_count,
+                   const std::vector<float>& k_distances,
+                   const std::vector<int>&   k_indices,
+                   std::vector<float>& rendered_cost_vec,
+                   std::vector<float>& observed_cost_vec,
+                   std::vector<float>& pose_points_diff_cost_vec,
+                   const float* pose_cost_bound = NULL) {
+    /*
+     * CPU version of cuda_renderer::compute_costs, with the same cost definitions.
+     * @sensor_resolution - squared, same as the KNN distances
+     * @observed_cloud_lab - Lab colors of the observed cloud (color::colors_to_lab), only read for cost_type 1
+     * Rendered points are grouped by pose, so every pose is handled by one thread and the observed points
+     * it explains are marked in a per thread buffer instead of a dense num_images x observed points matrix.
+     * @pose_cost_bound - optional bound of every pose, see cost_bound.h. Poses are then scored in
+     * COST_BOUND_CHUNKS interleaved chunks of their points and abandoned with PRUNED_POSE_COST as rendered cost
+     * (other costs 0) once the bound is reached. Without it every pose is scored in one pass.
+     */
+    printf("cpu::compute_costs()\n");
+    rendered_cost_vec.assign(num_images, 0);
+    if (calculate_observed_cost)
+    {
+        observed_cost_vec.assign(num_images, 0);
+        pose_points_diff_cost_vec.assign(num_images, 0);
+    }
+
+    // Range of points of every pose in the rendered cloud
+    std::vector<int> pose_offsets(num_images + 1, 0);
+    for (int i = 0; i < rendered_cloud_point_count; i++)
+        pose_offsets[rendered_cloud_pose_map[i] + 1]++;
+    for (int n = 0; n < num_images; n++)
+        pose_offsets[n + 1] += pose_offsets[n];
+
+    const int N = rendered_cloud_point_count;
+    const int M = observed_cloud_point_count;
+
+    #pragma omp parallel
+    {
+        std::vector<uint8_t> observed_explained(calculate_observed_cost ? M : 0, 0);
+        std::vector<int> explained_indices;
+
+        #pragma omp for schedule(dynamic)
+        for (int n = 0; n < num_images; n++)
+        {
+            if (rendered_poses_occluded[n])
+            {
+                rendered_cost_vec[n] = -1;
+                if (calculate_observed_cost) observed_cost_vec[n] = 100;
+                continue;
+            }
+            float cost = 0;
+            float point_num = 0;
+            explained_indices.clear();
+            const int pose_points = pose_offsets[n + 1] - pose_offsets[n];
+            const int num_chunks = (pose_cost_bound != NULL) ? COST_BOUND_CHUNKS : 1;
+            bool pruned = false;
+            for (int chunk = 0; chunk < num_chunks && !pruned; chunk++)
+            {
+                for (int point_index = pose_offsets[n] + chunk; point_index < pose_offsets[n + 1]; point_index += num_chunks)
+                {
+                    point_num += 1;
+                    if (k_distances[point_index] > sensor_resolution)
+                    {
+                        cost += 1;
+                        continue;
+                    }
+                    int o_point_index = k_indices[point_index];
+                    if (cost_type == 1)
+                    {
+                        float lab2[3];
+                        color::rgb_to_lab(rendered_cloud_color[point_index + 2*N],
+                                          rendered_cloud_color[point_index + 1*N],
+                                          rendered_cloud_color[point_index + 0*N], lab2);
+                        float cur_dist = color::ciede2000(observed_cloud_lab[o_point_index + 0*M],
+                                                          observed_cloud_lab[o_point_index + 1*M],
+                                                          observed_cloud_lab[o_point_index + 2*M],
+                                                          lab2[0], lab2[1], lab2[2]);
+                        if (cur_dist > color_distance_threshold)
+                        {
+                            // add to render cost if color doesnt match
+                            cost += 1;
+                            continue;
+                        }
+                    }
+                    // the point is explained, so mark corresponding observed point explained
+                    if (calculate_observed_cost && !observed_explained[o_point_index])
+                    {
+                        observed_explained[o_point_index] = 1;
+                        explained_indices.push_back(o_point_index);
+                    }
+                }
+                if (chunk + 1 < num_chunks)
+                {
+                    const float bound = cost_bound::lower_bound(pose_points, point_num, cost,
+                                                                calculate_observed_cost ? rendered_poses_observed_points_total[n] : 0,
+                                                                explained_indices.size(), calculate_observed_cost);
+                    pruned = cost_bound::exceeds(bound, pose_cost_bound[n]);
+                }
+            }
+            if (pruned)
+            {
+                rendered_cost_vec[n] = PRUNED_POSE_COST;
+                for (int o_point_index : explained_indices)
+                    observed_explained[o_point_index] = 0;
+                continue;
+            }
+
+            // Convert cost to percentage out of 100
+            float rendered_explained = point_num - cost;
+            rendered_cost_vec[n] = (point_num == 0) ? -1 : cost/point_num * 100;
+
+            if (calculate_observed_cost)
+            {
+                float observed_explained_num = explained_indices.size();
+                pose_points_diff_cost_vec[n] = rendered_explained - observed_explained_num;
+                observed_cost_vec[n] = (rendered_poses_observed_points_total[n] - observed_explained_num)
+                                        / rendered_poses_observed_points_total[n] * 100;
+                // Reset only what this pose touched for the next one
+                for (int o_point_index : explained_indices)
+                    observed_explained[o_point_index] = 0;
+            }
+        }
+    }
+    printf("cpu::compute_costs() done\n");
+}
+}
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef CPU_COMPUTE_POINT_CLOUDS_H
+#define CPU_COMPUTE_POINT_CLOUDS_H
+#include <vector>
+#include <Eigen/Core>
+#include <omp.h>
+
+#include "cuda_renderer/model.h"
+
+namespace cuda_renderer {
+namespace cpu {
+namespace image_to_cloud {
+    inline void transform_point(int x, int y, int32_t depth,
+        float kCameraCX, float kCameraCY, float kCameraFX, float kCameraFY, float depth_factor,
+        const Eigen::Matrix4f* camera_transform,
+        float &x_pcd, float &y_pcd, float &z_pcd)
+    {
+        // depth factor here basically converts from cm depth to value in m
+        z_pcd = static_cast<float>(depth)/depth_factor;
+        x_pcd = (static_cast<float>(x) - kCameraCX)/kCameraFX * z_pcd;
+        y_pcd = (static_cast<float>(y) - kCameraCY)/kCameraFY * z_pcd;
+
+        if (camera_transform != NULL)
+        {
+            Eigen::Matrix<float, 3, 1> pt (x_pcd, y_pcd, z_pcd);
+            Eigen::Vector3f world_point = camera_transform->block<3,3>(0,0) * pt;
+            world_point += camera_transform->block<3,1>(0,3);
+            z_pcd = world_point[2];
+            y_pcd = world_point[1];
+            x_pcd = world_point[0];
+        }
+    }
+
+    inline bool is_valid_pixel(
+        const int32_t* depth, int x, int y, uint32_t idx_depth, const uint8_t* label_mask_data,
+        float kCameraCX, float kCameraCY, float kCameraFX, float kCameraFY, float depth_factor,
+        const double* observed_cloud_bounds, const Eigen::Matrix4f* camera_transform)
+    {
+        /**
+         * Same conditions as the GPU depth_to_mask, valid depth and optionally a label in the mask
+         * or a point within the bounds given in world frame for 3-Dof
+        */
+        if (depth[idx_depth] <= 0) return false;
+        if (label_mask_data != NULL)
+        {
+            return label_mask_data[idx_depth] > 0;
+        }
+        if (camera_transform != NULL && observed_cloud_bounds != NULL)
+        {
+            float x_pcd, y_pcd, z_pcd;
+            transform_point(x, y, depth[idx_depth], kCameraCX, kCameraCY, kCameraFX, kCameraFY,
+                            depth_factor, camera_transform, x_pcd, y_pcd, z_pcd);
+
+            if (x_pcd > (float) observed_cloud_bounds[0] || x_pcd < (float) observed_cloud_bounds[1]) return false;
+            if (y_pcd > (float) observed_cloud_bounds[2] || y_pcd < (float) observed_cloud_bounds[3]) return false;
+            if (z_pcd > (float) observed_cloud_bounds[4] || z_pcd < (float) observed_cloud_bounds[5]) return false;
+        }
+        return true;
+    }
+}
+
+void compute_point_clouds(const std::vector<int32_t>& depth_int,
+                          const std::vector<uint8_t>& red_int,
+                          const std::vector<uint8_t>& green_int,
+                          const std::vector<uint8_t>& blue_int,
+                          const int    num_poses,
+                          const int    width,
+                          const int    height,
+                          const float  kCameraCX,
+                          const float  kCameraCY,
+                          const float  kCameraFX,
+                          const float  kCameraFY,
+                          const float  depth_factor,
+                          const int    stride,
+                          std::vector<Eigen::Vector3f>& result_cloud_eigen,
+                          std::vector<float>&   result_point_cloud,
+                          std::vector<uint8_t>& result_point_cloud_color,
+                          int& result_cloud_point_count,
+                          std::vector<int>&     result_dc_index,
+                          std::vector<int>&     result_cloud_pose_map,
+                          std::vector<int>&     result_cloud_label,
+                          const Eigen::Matrix4f* camera_transform = NULL,
+                          const std::vector<uint8_t>& image_label = std::vector<uint8_t>(),
+                          const std::vector<double>&  observed_cloud_bounds = std::vector<double>(),
+                          const std::vector<int>&     pose_segmentation_label = std::vector<int>()
+                          ) {
+    /*
+     * CPU version of cuda_renderer::compute_point_clouds. The mask and its exclusive scan are done per pose
+     * in parallel, after which every pose knows where its points start in the combined cloud.
+     * Point order, dc_index values and the planar (x.., y.., z..) layout are the same as the GPU output.
+     */
+    printf("cpu::compute_point_clouds()\n");
+    printf("Num poses : %d\n", num_poses);
+    const int32_t* depth_data = depth_int.data();
+    const uint8_t* label_mask_data = image_label.empty() ? NULL : image_label.data();
+    const double*  cloud_bounds = observed_cloud_bounds.empty() ? NULL : observed_cloud_bounds.data();
+    const size_t image_size = (size_t) width*height;
+
+    assert(width % stride == 0);
+    result_dc_index.resize(image_size*num_poses);
+    std::vector<int> pose_point_count(num_poses + 1, 0);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int n = 0; n < num_poses; n++)
+    {
+        // dc_index holds the exclusive scan of the mask within this pose for now
+        int* dc_index = result_dc_index.data() + n*image_size;
+        int count = 0;
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                uint32_t idx_depth = n*image_size + x + y*width;
+                dc_index[x + y*width] = count;
+                if (x % stride != 0 || y % stride != 0) continue;
+                if (image_to_cloud::is_valid_pixel(depth_data, x, y, idx_depth, label_mask_data,
+                        kCameraCX, kCameraCY, kCameraFX, kCameraFY, depth_factor, cloud_bounds, camera_transform))
+                {
+                    count++;
+                }
+            }
+        }
+        pose_point_count[n + 1] = count;
+    }
+    for (int n = 0; n < num_poses; n++)
+        pose_point_count[n + 1] += pose_point_count[n];
+    result_cloud_point_count = pose_point_count[num_poses];
+    printf("Actual points in all clouds : %d\n", result_cloud_point_count);
+
+    const int point_count = result_cloud_point_count;
+    result_cloud_eigen.resize(point_count);
+    result_point_cloud.resize(POINT_DIM * point_count);
+    result_point_cloud_color.resize(POINT_DIM * point_count);
+    result_cloud_pose_map.resize(point_count);
+    const bool assign_label = label_mask_data != NULL || !pose_segmentation_label.empty();
+    if (assign_label)
+    {
+        result_cloud_label.resize(point_count);
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int n = 0; n < num_poses; n++)
+    {
+        // Offset the per pose scan to an index in the combined cloud
+        int* dc_index = result_dc_index.data() + n*image_size;
+        for (size_t i = 0; i < image_size; i++)
+            dc_index[i] += pose_point_count[n];
+
+        for (int y = 0; y < height; y += stride)
+        {
+            for (int x = 0; x < width; x += stride)
+            {
+                uint32_t idx_depth = n*image_size + x + y*width;
+                if (!image_to_cloud::is_valid_pixel(depth_data, x, y, idx_depth, label_mask_data,
+                        kCameraCX, kCameraCY, kCameraFX, kCameraFY, depth_factor, cloud_bounds, camera_transform))
+                {
+                    continue;
+                }
+                // Get actual point which should be in camera frame itself
+                float x_pcd, y_pcd, z_pcd;
+                image_to_cloud::transform_point(x, y, depth_data[idx_depth], kCameraCX, kCameraCY, kCameraFX, kCameraFY,
+                    depth_factor, NULL, x_pcd, y_pcd, z_pcd);
+
+                const int cloud_idx = dc_index[x + y*width];
+                result_point_cloud[cloud_idx + 0*point_count] = x_pcd;
+                result_point_cloud[cloud_idx + 1*point_count] = y_pcd;
+                result_point_cloud[cloud_idx + 2*point_count] = z_pcd;
+                result_cloud_eigen[cloud_idx] = Eigen::Vector3f(x_pcd, y_pcd, z_pcd);
+
+                result_point_cloud_color[cloud_idx + 0*point_count] = red_int[idx_depth];
+                result_point_cloud_color[cloud_idx + 1*point_count] = green_int[idx_depth];
+                result_point_cloud_color[cloud_idx + 2*point_count] = blue_int[idx_depth];
+
+                result_cloud_pose_map[cloud_idx] = n;
+                if (label_mask_data != NULL)
+                {
+                    // Do -1 to make it start from 0
+                    result_cloud_label[cloud_idx] = label_mask_data[idx_depth] - 1;
+                }
+                else if (!pose_segmentation_label.empty())
+                {
+                    result_cloud_label[cloud_idx] = pose_segmentation_label[n];
+                }
+            }
+        }
+    }
+    printf("cpu::compute_point_clouds() done\n");
+}
+}
+}
+
+#endif
@@ -0,0 +1,443 @@
+#ifndef CPU_RENDERER_IMAGE_RENDERER_H
+#define CPU_RENDERER_IMAGE_RENDERER_H
+#include <vector>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <omp.h>
+
+#include "cuda_renderer/model.h"
+#include "cuda_renderer/occlusion_pyramid.h"
+
+// Side of the square screen tiles triangles are binned into, chosen so that the
+// depth and color rows of a tile stay in L1 while all its triangles are rasterized
+#define CPU_TILE_SIZE 32
+
+namespace cuda_renderer {
+namespace cpu {
+namespace image_renderer {
+
+    inline Model::float3 mat_mul_v(const Model::mat4x4& tran, const Model::float3& v){
+        return {
+            tran.a0*v.x + tran.a1*v.y + tran.a2*v.z + tran.a3,
+            tran.b0*v.x + tran.b1*v.y + tran.b2*v.z + tran.b3,
+            tran.c0*v.x + tran.c1*v.y + tran.c2*v.z + tran.c3,
+        };
+    }
+
+    inline Model::Triangle transform_triangle(const Model::Triangle& tri, const Model::mat4x4& tran){
+        return {
+            mat_mul_v(tran, (tri.v0)),
+            mat_mul_v(tran, (tri.v1)),
+            mat_mul_v(tran, (tri.v2)),
+            tri.color
+        };
+    }
+
+    /*
+     * Screen space setup of one triangle for one pose, computed once and shared by every tile it overlaps.
+     * The barycentric coordinates beta and gamma are affine in the pixel position, so they are stored
+     * as edge equations bc = k_x * x + k_y * y + k_0 and evaluated a whole span at a time.
+     */
+    struct TriangleSetup {
+        float beta_x, beta_y, beta_0;
+        float gamma_x, gamma_y, gamma_0;
+        // 1/z at every vertex for perspective correct depth
+        float inv_z0, inv_z1, inv_z2;
+        int bbox_min_x, bbox_min_y, bbox_max_x, bbox_max_y;
+        uint8_t red, green, blue;
+    };
+
+    inline bool setup_triangle(const Model::Triangle& tri,
+                               const Model::mat4x4& pose,
+                               const Model::mat4x4& proj_mat,
+                               int width, int height,
+                               TriangleSetup& setup)
+    {
+        // model transform
+        Model::Triangle local_tri = transform_triangle(tri, pose);
+
+        // assume last column of projection matrix is  0 0 1 0
+        Model::float3 last_row = {
+            local_tri.v0.z,
+            local_tri.v1.z,
+            local_tri.v2.z
+        };
+        // projection transform
+        local_tri = transform_triangle(local_tri, proj_mat);
+
+        // viewport transform(0, 0, width, height), same as the GPU rasterizer
+        float pts2[3][2];
+        pts2[0][0] = local_tri.v0.x/last_row.x*width/2.0f+width/2.0f; pts2[0][1] = local_tri.v0.y/last_row.x*height/2.0f+height/2.0f;
+        pts2[1][0] = local_tri.v1.x/last_row.y*width/2.0f+width/2.0f; pts2[1][1] = local_tri.v1.y/last_row.y*height/2.0f+height/2.0f;
+        pts2[2][0] = local_tri.v2.x/last_row.z*width/2.0f+width/2.0f; pts2[2][1] = local_tri.v2.y/last_row.z*height/2.0f+height/2.0f;
+
+        float bboxmin[2] = {FLT_MAX,  FLT_MAX};
+        float bboxmax[2] = {-FLT_MAX, -FLT_MAX};
+        float clamp_max[2] = {float(width-1), float(height-1)};
+        for (int i=0; i<3; i++) {
+            for (int j=0; j<2; j++) {
+                bboxmin[j] = std::max(0.0f, std::min(bboxmin[j], pts2[i][j]));
+                bboxmax[j] = std::min(clamp_max[j], std::max(bboxmax[j], pts2[i][j]));
+            }
+        }
+        // GPU loop starts at size_t(min + 0.5) and runs while P <= max
+        setup.bbox_min_x = int(bboxmin[0] + 0.5f);
+        setup.bbox_min_y = int(bboxmin[1] + 0.5f);
+        setup.bbox_max_x = (int) std::floor(bboxmax[0]);
+        setup.bbox_max_y = (int) std::floor(bboxmax[1]);
+        if (!(bboxmax[0] >= 0 && bboxmax[1] >= 0)) return false;
+        if (setup.bbox_min_x > setup.bbox_max_x || setup.bbox_min_y > setup.bbox_max_y) return false;
+
+        // Signed area of (A, B, C), zero area triangles can not cover any pixel
+        const float* A = pts2[0];
+        const float* B = pts2[1];
+        const float* C = pts2[2];
+        float area = 0.5f*((C[0]-A[0])*(B[1]-A[1]) - (B[0]-A[0])*(C[1]-A[1]));
+        if (area == 0 || !std::isfinite(area)) return false;
+        float base_inv = 1/area;
+
+        // beta = area(A, P, C)/area(A, B, C), gamma = area(A, B, P)/area(A, B, C)
+        setup.beta_x = -0.5f*(C[1]-A[1])*base_inv;
+        setup.beta_y =  0.5f*(C[0]-A[0])*base_inv;
+        setup.beta_0 =  0.5f*(A[0]*(C[1]-A[1]) - A[1]*(C[0]-A[0]))*base_inv;
+        setup.gamma_x =  0.5f*(B[1]-A[1])*base_inv;
+        setup.gamma_y = -0.5f*(B[0]-A[0])*base_inv;
+        setup.gamma_0 =  0.5f*(A[1]*(B[0]-A[0]) - A[0]*(B[1]-A[1]))*base_inv;
+
+        setup.inv_z0 = 1/last_row.x;
+        setup.inv_z1 = 1/last_row.y;
+        setup.inv_z2 = 1/last_row.z;
+        setup.red = (uint8_t)(tri.color.v0);
+        setup.green = (uint8_t)(tri.color.v1);
+        setup.blue = (uint8_t)(tri.color.v2);
+        return true;
+    }
+
+    /*
+     * Rasterize one triangle clipped to a tile into the images of a pose.
+     * Occlusion with the source image is applied whenever a fragment wins the depth test, which gives the
+     * same images as the GPU rasterizer since a fragment farther than an occluded one is occluded as well.
+     */
+    inline void rasterize_in_tile(const TriangleSetup& setup,
+                                  int tile_x0, int tile_y0, int tile_x1, int tile_y1,
+                                  int width, int height,
+                                  int32_t* depth_entry,
+                                  uint8_t* red_entry, uint8_t* green_entry, uint8_t* blue_entry,
+                                  const int32_t* source_depth_entry,
+                                  const uint8_t* source_label_entry,
+                                  int pose_segmentation_label,
+                                  bool use_segmentation_label,
+                                  float occlusion_threshold,
+                                  int* pose_occluded_entry,
+                                  int* pose_occluded_other_entry,
+                                  float* pose_clutter_points_entry,
+                                  float* pose_total_points_entry)
+    {
+        const int x0 = std::max(setup.bbox_min_x, tile_x0);
+        const int x1 = std::min(setup.bbox_max_x, tile_x1);
+        const int y0 = std::max(setup.bbox_min_y, tile_y0);
+        const int y1 = std::min(setup.bbox_max_y, tile_y1);
+        if (x0 > x1 || y0 > y1) return;
+
+        const int span = x1 - x0 + 1;
+        int32_t span_depth[CPU_TILE_SIZE];
+
+        for (int py = y0; py <= y1; py++)
+        {
+            const float beta_row = setup.beta_y * py + setup.beta_0;
+            const float gamma_row = setup.gamma_y * py + setup.gamma_0;
+
+            // Evaluate the edge equations and depth for the whole span without branches
+            #pragma omp simd
+            for (int i = 0; i < span; i++)
+            {
+                const float px = float(x0 + i);
+                const float beta = setup.beta_x * px + beta_row;
+                const float gamma = setup.gamma_x * px + gamma_row;
+                const float alpha = 1.0f - beta - gamma;
+                const bool inside = alpha >= 0.0f && beta >= 0.0f && gamma >= 0.0f &&
+                                    alpha <= 1.0f && beta <= 1.0f && gamma <= 1.0f;
+                const float frag_depth = 1.0f/(alpha*setup.inv_z0 + beta*setup.inv_z1 + gamma*setup.inv_z2);
+                span_depth[i] = inside ? int32_t(frag_depth + 0.5f) : INT_MAX;
+            }
+
+            // image rows are flipped
+            const int row_offset = (height-1 - py)*width;
+            for (int i = 0; i < span; i++)
+            {
+                const int32_t curr_depth = span_depth[i];
+                if (curr_depth == INT_MAX) continue;
+                const int idx = row_offset + x0 + i;
+                if (USE_CLUTTER)
+                {
+                    #pragma omp atomic
+                    *pose_total_points_entry += 1;
+                }
+                if (curr_depth >= depth_entry[idx]) continue;
+
+                depth_entry[idx] = curr_depth;
+                red_entry[idx] = setup.red;
+                green_entry[idx] = setup.green;
+                blue_entry[idx] = setup.blue;
+
+                if (source_depth_entry == NULL) continue;
+                const int32_t source_depth = source_depth_entry[idx];
+                if (source_depth <= 0) continue;
+                // pose segmentation labels start from 0, but source mask have label starting from 1
+                if ((use_segmentation_label == false && abs(curr_depth - source_depth) > occlusion_threshold) ||
+                    (use_segmentation_label == true &&
+                    pose_segmentation_label != source_label_entry[idx]-1 && abs(curr_depth - source_depth) > 0.5))
+                {
+                    if (curr_depth > source_depth)
+                    {
+                        // source occludes render, add black
+                        depth_entry[idx] = INT_MAX;
+                        red_entry[idx] = 0;
+                        green_entry[idx] = 0;
+                        blue_entry[idx] = 0;
+                        if (USE_TREE)
+                        {
+                            #pragma omp atomic write
+                            *pose_occluded_other_entry = 1;
+                        }
+                        if (USE_CLUTTER && source_depth <= curr_depth - 5)
+                        {
+                            #pragma omp atomic
+                            *pose_clutter_points_entry += 1;
+                        }
+                    }
+                    else if (USE_TREE)
+                    {
+                        // invalid as render occludes source
+                        #pragma omp atomic write
+                        *pose_occluded_entry = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * Bin the triangles of one pose into screen tiles, stored as offsets into a single index array
+     */
+    inline void bin_triangles(const std::vector<TriangleSetup>& setups,
+                              int tiles_x, int tiles_y,
+                              std::vector<int>& tile_offsets,
+                              std::vector<int>& tile_tris)
+    {
+        const int num_tiles = tiles_x * tiles_y;
+        tile_offsets.assign(num_tiles + 1, 0);
+        for (const TriangleSetup& setup : setups)
+        {
+            for (int ty = setup.bbox_min_y/CPU_TILE_SIZE; ty <= setup.bbox_max_y/CPU_TILE_SIZE; ty++)
+                for (int tx = setup.bbox_min_x/CPU_TILE_SIZE; tx <= setup.bbox_max_x/CPU_TILE_SIZE; tx++)
+                    tile_offsets[ty * tiles_x + tx + 1]++;
+        }
+        for (int t = 0; t < num_tiles; t++)
+            tile_offsets[t + 1] += tile_offsets[t];
+
+        tile_tris.resize(tile_offsets[num_tiles]);
+        std::vector<int> tile_fill(tile_offsets.begin(), tile_offsets.end() - 1);
+        for (int s = 0; s < setups.size(); s++)
+        {
+            const TriangleSetup& setup = setups[s];
+            for (int ty = setup.bbox_min_y/CPU_TILE_SIZE; ty <= setup.bbox_max_y/CPU_TILE_SIZE; ty++)
+                for (int tx = setup.bbox_min_x/CPU_TILE_SIZE; tx <= setup.bbox_max_x/CPU_TILE_SIZE; tx++)
+                    tile_tris[tile_fill[ty * tiles_x + tx]++] = s;
+        }
+    }
+}
+
+void image_render(const std::vector<Model::Triangle>& tris,
+                  const std::vector<Model::mat4x4>& poses,
+                  const std::vector<int>& pose_model_map,
+                  const std::vector<int>& tris_model_count,
+                  const std::vector<int32_t>& source_depth,
+                  const std::vector<uint8_t>& source_mask_label,
+                  const std::vector<int>& pose_segmentation_label,
+                  const int num_images,
+                  const int width,
+                  const int height,
+                  const Model::mat4x4& proj_mat,
+                  const float occlusion_threshold,
+                  const int single_result_image,
+                  std::vector<int>& pose_occluded,
+                  std::vector<int>& pose_occluded_other,
+                  std::vector<float>& pose_clutter_points,
+                  std::vector<float>& pose_total_points,
+                  std::vector<int32_t>& depth_int,
+                  std::vector<uint8_t>& red_int,
+                  std::vector<uint8_t>& green_int,
+                  std::vector<uint8_t>& blue_int,
+                  const bool use_occlusion_culling = true) {
+
+    printf("cpu::image_render()\n");
+    /*
+    *   CPU version of cuda_renderer::image_render with the same outputs.
+    *   Poses are rendered in parallel, each one by binning its model triangles into screen tiles and
+    *   rasterizing tile by tile. When all poses go to a single image, the tiles are parallelized instead.
+    *   Poses are visited grouped by model, same as the GPU launches, so neighbouring iterations reuse the same triangles.
+    *   @use_occlusion_culling : skip poses whose model bounding box is entirely hidden by the source, same test as the GPU
+    */
+    // Create lower limits for model triangles
+    std::vector<int> tris_model_count_low(tris_model_count.size(), 0);
+    for (int m = 1; m < tris_model_count.size(); m++)
+        tris_model_count_low[m] = tris_model_count_low[m-1] + tris_model_count[m-1];
+
+    printf("Number of triangles : %d\n", (int) tris.size());
+    printf("Number of poses : %d\n", num_images);
+
+    pose_occluded.assign(num_images, 0);
+    pose_occluded_other.assign(num_images, 0);
+    pose_clutter_points.assign(num_images, 0);
+    pose_total_points.assign(num_images, 0);
+    depth_int.assign(num_images*width*height, INT_MAX);
+    red_int.assign(num_images*width*height, 0);
+    green_int.assign(num_images*width*height, 0);
+    blue_int.assign(num_images*width*height, 0);
+
+    const bool use_segmentation_label = pose_segmentation_label.size() > 0;
+    printf("use_segmentation_label : %d\n", use_segmentation_label);
+
+    const int tiles_x = (width + CPU_TILE_SIZE - 1)/CPU_TILE_SIZE;
+    const int tiles_y = (height + CPU_TILE_SIZE - 1)/CPU_TILE_SIZE;
+    const int num_tiles = tiles_x * tiles_y;
+
+    std::vector<int> model_pose_offsets, pose_order;
+    group_poses_by_model(pose_model_map, tris_model_count.size(), model_pose_offsets, pose_order);
+
+    // Culled poses are left out of the loop, their images stay empty
+    if (use_occlusion_culling && !single_result_image && !USE_TREE && !USE_CLUTTER &&
+        source_depth.size() == (size_t) width*height && num_images > 0)
+    {
+        std::vector<occlusion::ModelBox> model_boxes(tris_model_count.size(), occlusion::empty_box());
+        for (int m = 0; m < tris_model_count.size(); m++)
+        {
+            for (int tri_i = tris_model_count_low[m]; tri_i < tris_model_count_low[m] + tris_model_count[m]; tri_i++)
+                model_boxes[m] = occlusion::merge_boxes(model_boxes[m], occlusion::triangle_box(tris[tri_i]));
+        }
+
+        std::vector<occlusion::DepthCell> pyramid(occlusion::pyramid_size(width, height));
+        const int num_levels = occlusion::pyramid_num_levels(width, height);
+        for (int level = 0; level < num_levels; level++)
+        {
+            int cols, rows, offset;
+            occlusion::pyramid_level(width, height, level, cols, rows, offset);
+            #pragma omp parallel for
+            for (int cell_i = 0; cell_i < cols*rows; cell_i++)
+            {
+                if (level == 0)
+                    pyramid[cell_i] = occlusion::source_cell(source_depth.data(),
+                                                             use_segmentation_label ? source_mask_label.data() : NULL,
+                                                             width, height, cell_i % cols, cell_i / cols);
+                else
+                    pyramid[offset + cell_i] = occlusion::reduce_cell(pyramid.data(), width, height, level,
+                                                                      cell_i % cols, cell_i / cols);
+            }
+        }
+
+        std::vector<int> pose_culled(num_images);
+        #pragma omp parallel for
+        for (int pose_i = 0; pose_i < num_images; pose_i++)
+        {
+            pose_culled[pose_i] = occlusion::pose_occluded_by_source(
+                pyramid.data(), width, height, model_boxes[pose_model_map[pose_i]], poses[pose_i], proj_mat,
+                use_segmentation_label ? pose_segmentation_label[pose_i] : -1, occlusion_threshold);
+        }
+
+        // Drop culled poses from the order, offsets stay grouped by model
+        int num_kept = 0;
+        for (int m = 0; m < tris_model_count.size(); m++)
+        {
+            const int model_begin = model_pose_offsets[m];
+            model_pose_offsets[m] = num_kept;
+            for (int order_i = model_begin; order_i < model_pose_offsets[m + 1]; order_i++)
+            {
+                if (!pose_culled[pose_order[order_i]])
+                    pose_order[num_kept++] = pose_order[order_i];
+            }
+        }
+        model_pose_offsets[tris_model_count.size()] = num_kept;
+        pose_order.resize(num_kept);
+        printf("Poses culled by occlusion with source : %d\n", num_images - num_kept);
+    }
+    const int num_rendered = pose_order.size();
+
+    #pragma omp parallel if (!single_result_image)
+    {
+        std::vector<image_renderer::TriangleSetup> setups;
+        std::vector<int> tile_offsets;
+        std::vector<int> tile_tris;
+
+        #pragma omp for schedule(dynamic)
+        for (int order_i = 0; order_i < num_rendered; order_i++)
+        {
+            const int pose_i = pose_order[order_i];
+            const int model_id = pose_model_map[pose_i];
+            const int tri_low = tris_model_count_low[model_id];
+            const int tri_high = tri_low + tris_model_count[model_id];
+
+            setups.clear();
+            image_renderer::TriangleSetup setup;
+            for (int tri_i = tri_low; tri_i < tri_high; tri_i++)
+            {
+                if (image_renderer::setup_triangle(tris[tri_i], poses[pose_i], proj_mat, width, height, setup))
+                    setups.push_back(setup);
+            }
+            image_renderer::bin_triangles(setups, tiles_x, tiles_y, tile_offsets, tile_tris);
+
+            const int image_i = single_result_image ? 0 : pose_i;
+            const int flag_i = single_result_image ? 0 : pose_i;
+            const size_t image_offset = (size_t) image_i*width*height;
+            const int segmentation_label = use_segmentation_label ? pose_segmentation_label[pose_i] : 0;
+
+            // Only parallel when the outer loop is not, tiles cover disjoint pixels
+            #pragma omp parallel for schedule(dynamic) if (single_result_image)
+            for (int tile = 0; tile < num_tiles; tile++)
+            {
+                const int tile_x0 = (tile % tiles_x) * CPU_TILE_SIZE;
+                const int tile_y0 = (tile / tiles_x) * CPU_TILE_SIZE;
+                const int tile_x1 = std::min(tile_x0 + CPU_TILE_SIZE, width) - 1;
+                const int tile_y1 = std::min(tile_y0 + CPU_TILE_SIZE, height) - 1;
+                for (int t = tile_offsets[tile]; t < tile_offsets[tile + 1]; t++)
+                {
+                    image_renderer::rasterize_in_tile(
+                        setups[tile_tris[t]],
+                        tile_x0, tile_y0, tile_x1, tile_y1,
+                        width, height,
+                        depth_int.data() + image_offset,
+                        red_int.data() + image_offset,
+                        green_int.data() + image_offset,
+                        blue_int.data() + image_offset,
+                        source_depth.empty() ? NULL : source_depth.data(),
+                        use_segmentation_label ? source_mask_label.data() : NULL,
+                        segmentation_label,
+                        use_segmentation_label,
+                        occlusion_threshold,
+                        &pose_occluded[flag_i],
+                        &pose_occluded_other[flag_i],
+                        &pose_clutter_points[flag_i],
+                        &pose_total_points[flag_i]);
+                }
+            }
+        }
+    }
+
+    #pragma omp parallel for
+    for (size_t i = 0; i < depth_int.size(); i++)
+    {
+        if (depth_int[i] == INT_MAX) depth_int[i] = 0;
+    }
+    if (USE_CLUTTER)
+    {
+        for (int i = 0; i < num_images; i++)
+            pose_clutter_points[i] = pose_clutter_points[i]/pose_total_points[i] * 100;
+    }
+    printf("cpu::image_render() done\n");
+}
+}
+}
+
+#endif
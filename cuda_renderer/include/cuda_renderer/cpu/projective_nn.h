@@ -0,0 +1,65 @@
+#ifndef CPU_PROJECTIVE_NN_H
+#define CPU_PROJECTIVE_NN_H
+#include <vector>
+#include <Eigen/Core>
+
+#include "cuda_renderer/nearest_neighbor.h"
+
+namespace cuda_renderer {
+namespace cpu {
+
+/*
+ * Projective data association in the observed image, see nn::projective_nearest.
+ * Building is a counting sort of the observed points by grid cell, a query costs a few cells
+ * instead of a search of the whole cloud.
+ */
+class ProjectiveNN {
+public:
+    void build(const Eigen::Vector3f* points, int num_points, int width, int height, int stride,
+               float fx, float fy, float cx, float cy)
+    {
+        points_ = points;
+        grid_.stride = stride > 0 ? stride : 1;
+        grid_.cols = (width + grid_.stride - 1) / grid_.stride;
+        grid_.rows = (height + grid_.stride - 1) / grid_.stride;
+        grid_.fx = fx;
+        grid_.fy = fy;
+        grid_.cx = cx;
+        grid_.cy = cy;
+
+        std::vector<int> point_cell(num_points);
+        cell_offsets_.assign(grid_.cols * grid_.rows + 1, 0);
+        for (int i = 0; i < num_points; i++)
+        {
+            point_cell[i] = nn::projective_cell(grid_, points[i]);
+            cell_offsets_[point_cell[i] + 1]++;
+        }
+        for (int c = 0; c < grid_.cols * grid_.rows; c++)
+            cell_offsets_[c + 1] += cell_offsets_[c];
+
+        std::vector<int> fill(cell_offsets_.begin(), cell_offsets_.end() - 1);
+        cell_points_.resize(num_points);
+        for (int i = 0; i < num_points; i++)
+            cell_points_[fill[point_cell[i]]++] = i;
+
+        grid_.cell_offsets = cell_offsets_.data();
+        grid_.cell_points = cell_points_.data();
+    }
+
+    // Squared distance and index of the nearest observed point, exact whenever it is within radius
+    void nearest(const Eigen::Vector3f& query, float radius, float& sq_dist, int& index) const
+    {
+        nn::projective_nearest(grid_, points_, query, radius, sq_dist, index);
+    }
+
+private:
+    nn::ProjectiveGrid grid_;
+    const Eigen::Vector3f* points_;
+    std::vector<int> cell_offsets_;
+    std::vector<int> cell_points_;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef CPU_VOXEL_HASH_NN_H
+#define CPU_VOXEL_HASH_NN_H
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <cfloat>
+#include <cmath>
+#include <Eigen/Core>
+
+#include "cuda_renderer/nearest_neighbor.h"
+
+namespace cuda_renderer {
+namespace cpu {
+
+/*
+ * Nearest neighbour search in the observed cloud through a hash of voxels of the sensor resolution.
+ * Costs only look at neighbours closer than the sensor resolution, so searching the 27 voxels around
+ * a query always finds the true nearest point whenever it is within that radius.
+ * Optionally every point has a label and queries only return points with the same label (6-Dof).
+ */
+class VoxelHashNN {
+public:
+    VoxelHashNN(float cell_size) : cell_size_(cell_size > 0 ? cell_size : 0.01f) {}
+
+    void build(const Eigen::Vector3f* points, int num_points, const int* labels = NULL)
+    {
+        std::vector<std::pair<uint64_t, int>> keyed(num_points);
+        for (int i = 0; i < num_points; i++)
+        {
+            int label = labels == NULL ? -1 : labels[i];
+            keyed[i] = std::make_pair(key(cell(points[i]), label), i);
+        }
+        std::sort(keyed.begin(), keyed.end());
+
+        // Points are stored in voxel order so that a voxel is one contiguous range
+        points_.resize(num_points);
+        indices_.resize(num_points);
+        cells_.clear();
+        cells_.reserve(num_points);
+        for (int i = 0; i < num_points; i++)
+        {
+            points_[i] = points[keyed[i].second];
+            indices_[i] = keyed[i].second;
+            if (i == 0 || keyed[i].first != keyed[i-1].first)
+                cells_[keyed[i].first] = std::make_pair(i, i + 1);
+            else
+                cells_[keyed[i].first].second = i + 1;
+        }
+    }
+
+    // Returns squared distance and index of the nearest point, index is -1 if no point is within a voxel
+    void nearest(const Eigen::Vector3f& query, int label, float& sq_dist, int& index) const
+    {
+        sq_dist = FLT_MAX;
+        index = -1;
+        Eigen::Vector3i center = cell(query);
+        for (int dx = -1; dx <= 1; dx++)
+        for (int dy = -1; dy <= 1; dy++)
+        for (int dz = -1; dz <= 1; dz++)
+        {
+            auto it = cells_.find(key(center + Eigen::Vector3i(dx, dy, dz), label));
+            if (it == cells_.end()) continue;
+            for (int i = it->second.first; i < it->second.second; i++)
+            {
+                float d = (points_[i] - query).squaredNorm();
+                if (d < sq_dist)
+                {
+                    sq_dist = d;
+                    index = indices_[i];
+                }
+            }
+        }
+    }
+
+private:
+    Eigen::Vector3i cell(const Eigen::Vector3f& point) const
+    {
+        return Eigen::Vector3i((int) std::floor(point(0)/cell_size_),
+                               (int) std::floor(point(1)/cell_size_),
+                               (int) std::floor(point(2)/cell_size_));
+    }
+
+    static uint64_t key(const Eigen::Vector3i& c, int label)
+    {
+        return nn::voxel_key(c(0), c(1), c(2), label);
+    }
+
+    float cell_size_;
+    std::vector<Eigen::Vector3f> points_;
+    std::vector<int> indices_;
+    std::unordered_map<uint64_t, std::pair<int, int>> cells_;
+};
+
+}
+}
+
+#endif
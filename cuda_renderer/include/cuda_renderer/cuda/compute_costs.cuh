@@ -4,9 +4,18 @@
 #include <thrust/host_vector.h>
 #include <thrust/device_vector.h>
 #include <thrust/copy.h>
+#include <thrust/sort.h>
+#include <thrust/unique.h>
+#include <thrust/reduce.h>
+#include <thrust/scatter.h>
+#include <thrust/binary_search.h>
+#include <thrust/iterator/constant_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
 
 #include "cuda_renderer/model.h"
 #include "cuda_renderer/cuda/utils.cuh"
+#include "cuda_renderer/color_distance.h"
+#include "cuda_renderer/observed_explained.h"
 
 #define SQR(x) ((x)*(x))
 #define POW2(x) SQR(x)
@@ -54,110 +63,116 @@ namespace cost_computation {
         }
     };
 
-     __device__ void rgb2lab(uint8_t rr,uint8_t gg, uint8_t bbb, float* lab){
-        double r = rr / 255.0;
-        double g = gg / 255.0;
-        double b = bbb / 255.0;
-        double x;
-        double y;
-        double z;
-        r = ((r > 0.04045) ? pow((r + 0.055) / 1.055, 2.4) : (r / 12.92)) * 100.0;
-        g = ((g > 0.04045) ? pow((g + 0.055) / 1.055, 2.4) : (g / 12.92)) * 100.0;
-        b = ((b > 0.04045) ? pow((b + 0.055) / 1.055, 2.4) : (b / 12.92)) * 100.0;
-
-        x = r*0.4124564 + g*0.3575761 + b*0.1804375;
-        y = r*0.2126729 + g*0.7151522 + b*0.0721750;
-        z = r*0.0193339 + g*0.1191920 + b*0.9503041;
-
-        x = x / 95.047;
-        y = y / 100.00;
-        z = z / 108.883;
-
-        x = (x > 0.008856) ? cbrt(x) : (7.787 * x + 16.0 / 116.0);
-        y = (y > 0.008856) ? cbrt(y) : (7.787 * y + 16.0 / 116.0);
-        z = (z > 0.008856) ? cbrt(z) : (7.787 * z + 16.0 / 116.0);
-        float l,a,bb;
-
-        l = (116.0 * y) - 16;
-        a = 500 * (x - y);
-        bb = 200 * (y - z);
-
-        lab[0] = l;
-        lab[1] = a;
-        lab[2] = bb;
+    __global__ void colors_to_lab(const uint8_t* colors, int point_num, float* lab)
+    {
+        // Device version of color::colors_to_lab
+        size_t point_index = blockIdx.x*blockDim.x + threadIdx.x;
+        if(point_index >= point_num) return;
+
+        float point_lab[3];
+        color::rgb_to_lab(colors[point_index + 2*point_num], colors[point_index + 1*point_num],
+                          colors[point_index + 0*point_num], point_lab);
+        lab[point_index + 0*point_num] = point_lab[0];
+        lab[point_index + 1*point_num] = point_lab[1];
+        lab[point_index + 2*point_num] = point_lab[2];
     }
 
-    __device__ double color_distance(float l1,float a1,float b1,
-                        float l2,float a2,float b2){
-        double eps = 1e-5;
-        double c1 = sqrtf(SQR(a1) + SQR(b1));
-        double c2 = sqrtf(SQR(a2) + SQR(b2));
-        double meanC = (c1 + c2) / 2.0;
-        double meanC7 = POW7(meanC);
-
-        double g = 0.5*(1 - sqrtf(meanC7 / (meanC7 + 6103515625.))); // 0.5*(1-sqrt(meanC^7/(meanC^7+25^7)))
-        double a1p = a1 * (1 + g);
-        double a2p = a2 * (1 + g);
-
-        c1 = sqrtf(SQR(a1p) + SQR(b1));
-        c2 = sqrtf(SQR(a2p) + SQR(b2));
-        double h1 = fmodf(atan2f(b1, a1p) + 2*M_PI, 2*M_PI);
-        double h2 = fmodf(atan2f(b2, a2p) + 2*M_PI, 2*M_PI);
-
-        // compute deltaL, deltaC, deltaH
-        double deltaL = l2 - l1;
-        double deltaC = c2 - c1;
-        double deltah;
-
-        if (c1*c2 < eps) {
-            deltah = 0;
-        }
-        if (std::abs(h2 - h1) <= M_PI) {
-            deltah = h2 - h1;
-        }
-        else if (h2 > h1) {
-            deltah = h2 - h1 - 2* M_PI;
+    __device__ void mark_observed_explained(
+        size_t point_index,
+        int pose_index,
+        int o_point_index,
+        int observed_cloud_point_num,
+        int observed_explained_words,
+        unsigned int* cuda_observed_explained_bits,
+        unsigned long long* cuda_observed_explained_keys)
+    {
+        /*
+         * Marks observed point o_point_index explained for the pose, in whichever explained set is in use :
+         * @cuda_observed_explained_bits - one bit per observed point, observed_explained_words words per pose
+         * @cuda_observed_explained_keys - one (pose, observed point) key per rendered point
+         * Neither is set when the observed cost is not computed, see observed_explained.h for the layouts.
+         */
+        if (cuda_observed_explained_bits != NULL)
+        {
+            atomicOr(&cuda_observed_explained_bits[
+                         observed_explained::word_index(pose_index, o_point_index, observed_explained_words)],
+                     observed_explained::bit(o_point_index));
         }
-        else {
-            deltah = h2 - h1 + 2 * M_PI;
+        else if (cuda_observed_explained_keys != NULL)
+        {
+            cuda_observed_explained_keys[point_index] =
+                observed_explained::key(pose_index, o_point_index, observed_cloud_point_num);
         }
+    }
 
-        double deltaH = 2 * sqrtf(c1*c2)*sinf(deltah / 2);
-
-        // calculate CIEDE2000
-        double meanL = (l1 + l2) / 2;
-        meanC = (c1 + c2) / 2.0;
-        meanC7 = POW7(meanC);
-        double meanH;
-
-        if (c1*c2 < eps) {
-            meanH = h1 + h2;
-        }
-        if (std::abs(h1 - h2) <= M_PI + eps) {
-            meanH = (h1 + h2) / 2;
-        }
-        else if (h1 + h2 < 2*M_PI) {
-            meanH = (h1 + h2 + 2*M_PI) / 2;
+    __device__ void score_rendered_point(
+        size_t point_index,
+        int pose_index,
+        float knn_dist,
+        int o_point_index,
+        uint8_t color_0,
+        uint8_t color_1,
+        uint8_t color_2,
+        float* cuda_rendered_cost,
+        const float sensor_resolution,
+        const int observed_cloud_point_num,
+        float* cuda_pose_point_num,
+        const float* observed_cloud_lab,
+        unsigned int* cuda_observed_explained_bits,
+        const int observed_explained_words,
+        unsigned long long* cuda_observed_explained_keys,
+        int type,
+        const float color_distance_threshold)
+    {
+        /**
+        * Cost of one rendered point of a pose that is not occluded, shared by compute_render_cost
+        * and the fused render-to-cost kernel
+        * @knn_dist : squared distance to the observed nn, @o_point_index its index
+        * @color_* : color of the rendered point in cloud channel order (color_2 is read as red)
+        */
+        // count total number of points in this pose for normalization later
+        atomicAdd(&cuda_pose_point_num[pose_index], 1);
+        // float camera_z = rendered_cloud[point_index + 2 * rendered_cloud_point_num];
+        // float cost = 10 * camera_z;
+        float cost = 1.0;
+        // printf("KKN distance : %f\n", knn_dist);
+        if (knn_dist > sensor_resolution)
+        {
+            atomicAdd(&cuda_rendered_cost[pose_index], cost);
         }
-        else {
-            meanH = (h1 + h2 - 2*M_PI) / 2;
+        else
+        {
+            // compute color cost
+            if (type == 1)
+            {
+                float lab2[3];
+                color::rgb_to_lab(color_2, color_1, color_0, lab2);
+                float cur_dist = color::ciede2000(observed_cloud_lab[o_point_index + 0*observed_cloud_point_num],
+                                                  observed_cloud_lab[o_point_index + 1*observed_cloud_point_num],
+                                                  observed_cloud_lab[o_point_index + 2*observed_cloud_point_num],
+                                                  lab2[0], lab2[1], lab2[2]);
+                // printf("color distance :%f\n", cur_dist);
+                if(cur_dist > color_distance_threshold){
+                    // add to render cost if color doesnt match
+                    atomicAdd(&cuda_rendered_cost[pose_index], cost);
+                }
+                else {
+                    // the point is explained, so mark corresponding observed point explained
+                    mark_observed_explained(point_index, pose_index, o_point_index, observed_cloud_point_num,
+                                            observed_explained_words, cuda_observed_explained_bits,
+                                            cuda_observed_explained_keys);
+                }
+            }
+            else if (type == 0 || type == 2) {
+                // the point is explained, so mark corresponding observed point explained
+                // (type 2 : the segmentation labels are already matched by the nn search)
+                mark_observed_explained(point_index, pose_index, o_point_index, observed_cloud_point_num,
+                                        observed_explained_words, cuda_observed_explained_bits,
+                                        cuda_observed_explained_keys);
+            }
         }
-
-        double T = 1
-            - 0.17*cosf(meanH - DegToRad(30))
-            + 0.24*cosf(2 * meanH)
-            + 0.32*cosf(3 * meanH + DegToRad(6))
-            - 0.2*cosf(4 * meanH - DegToRad(63));
-        double sl = 1 + (0.015*SQR(meanL - 50)) / sqrtf(20 + SQR(meanL - 50));
-        double sc = 1 + 0.045*meanC;
-        double sh = 1 + 0.015*meanC*T;
-        double rc = 2 * sqrtf(meanC7 / (meanC7 + 6103515625.));
-        double rt = -sinf(DegToRad(60 * expf(-SQR((RadToDeg(meanH) - 275) / 25)))) * rc;
-
-        double cur_dist = sqrtf(SQR(deltaL / sl) + SQR(deltaC / sc) + SQR(deltaH / sh) + rt * deltaC / sc * deltaH / sh);
-        return cur_dist;
     }
-    
+
     __global__ void compute_render_cost(
         const float* cuda_knn_dist,
         const int* cuda_knn_index,
@@ -169,8 +184,10 @@ namespace cost_computation {
         const int observed_cloud_point_num,
         float* cuda_pose_point_num,
         const uint8_t* rendered_cloud_color,
-        const uint8_t* observed_cloud_color,
-        uint8_t* cuda_observed_explained,
+        const float* observed_cloud_lab,
+        unsigned int* cuda_observed_explained_bits,
+        const int observed_explained_words,
+        unsigned long long* cuda_observed_explained_keys,
         const int* pose_segmentation_label,
         const int* result_observed_cloud_label,
         int type,
@@ -181,7 +198,8 @@ namespace cost_computation {
         * @cuda_knn_dist : distance to nn from knn library
         * @cuda_knn_index : index of nn in observed cloud from knn library
         * @cuda_cloud_pose_map : the pose corresponding to every point in cloud
-        * @*_cloud_color : color values of clouds, to compare rgb cost of NNs
+        * @rendered_cloud_color, @observed_cloud_lab : colors of the clouds, to compare the Lab color of NNs
+        * @cuda_observed_explained_* : explained sets of the observed points, see mark_observed_explained
         * Returns :
         * @cuda_pose_point_num : Number of points in each rendered pose
         */
@@ -197,168 +215,66 @@ namespace cost_computation {
         }
         else
         {
-            // count total number of points in this pose for normalization later
-            atomicAdd(&cuda_pose_point_num[pose_index], 1);
-            // float camera_z = rendered_cloud[point_index + 2 * rendered_cloud_point_num];
-            // float cost = 10 * camera_z;
-            float cost = 1.0;
-            // printf("KKN distance : %f\n", cuda_knn_dist[point_index]);
-            if (cuda_knn_dist[point_index] > sensor_resolution)
-            {
-                atomicAdd(&cuda_rendered_cost[pose_index], cost);
-            }
-            else
-            {
-                // compute color cost
-                // printf("%d, %d\n", pose_segmentation_label[pose_index], result_observed_cloud_label[o_point_index]);
-                uint8_t red2  = rendered_cloud_color[point_index + 2*rendered_cloud_point_num];
-                uint8_t green2  = rendered_cloud_color[point_index + 1*rendered_cloud_point_num];
-                uint8_t blue2  = rendered_cloud_color[point_index + 0*rendered_cloud_point_num];
-
-                uint8_t red1  = observed_cloud_color[o_point_index + 2*observed_cloud_point_num];
-                uint8_t green1  = observed_cloud_color[o_point_index + 1*observed_cloud_point_num];
-                uint8_t blue1  = observed_cloud_color[o_point_index + 0*observed_cloud_point_num];
-
-                if (type == 1)
-                {
-                    
-                    float lab2[3];
-                    rgb2lab(red2,green2,blue2,lab2);
-                    float lab1[3];
-                    rgb2lab(red1,green1,blue1,lab1);
-                    double cur_dist = color_distance(lab1[0],lab1[1],lab1[2],lab2[0],lab2[1],lab2[2]);
-                    // printf("color distance :%f\n", cur_dist);
-                    if(cur_dist > color_distance_threshold){
-                        // add to render cost if color doesnt match
-                        atomicAdd(&cuda_rendered_cost[pose_index], cost);
-                    }
-                    else {
-                        // the point is explained, so mark corresponding observed point explained
-                        // atomicOr(cuda_observed_explained[o_point_index], 1);
-                        cuda_observed_explained[o_point_index + pose_index * observed_cloud_point_num] = 1;
-                    }
-                }
-                else if (type == 0) {
-                    // the point is explained, so mark corresponding observed point explained
-                    // atomicOr(cuda_observed_explained[o_point_index], 1);
-                    cuda_observed_explained[o_point_index + pose_index * observed_cloud_point_num] = 1;
-                }
-                else if (type == 2) {
-                    // printf("pose_segmentation_label :%d, result_observed_cloud_label %d\n", 
-                    //     pose_segmentation_label[pose_index], result_observed_cloud_label[o_point_index]);
-                    // if (pose_segmentation_label[pose_index] != result_observed_cloud_label[o_point_index])
-                    // {
-                    //     // the euclidean distance is fine, but segmentation labels dont match
-                    //     atomicAdd(&cuda_rendered_cost[pose_index], cost);
-                    // }
-                    // else
-                    // {
-                        // the point is explained, so mark corresponding observed point explained
-                        // atomicOr(cuda_observed_explained[o_point_index], 1);
-                        // float lab2[3];
-                        // rgb2lab(red2,green2,blue2,lab2);
-
-                        // float lab1[3];
-                        // rgb2lab(red1,green1,blue1,lab1);
-
-                        // double cur_dist = color_distance(lab1[0],lab1[1],lab1[2],lab2[0],lab2[1],lab2[2]);
-                        // if(cur_dist > 30)
-                        //     atomicAdd(&cuda_rendered_cost[pose_index], cost);
-                        // else
-                        cuda_observed_explained[o_point_index + pose_index * observed_cloud_point_num] = 1;
-                    // }
-                }
-            }
+            score_rendered_point(point_index, pose_index, cuda_knn_dist[point_index], o_point_index,
+                                 rendered_cloud_color[point_index + 0*rendered_cloud_point_num],
+                                 rendered_cloud_color[point_index + 1*rendered_cloud_point_num],
+                                 rendered_cloud_color[point_index + 2*rendered_cloud_point_num],
+                                 cuda_rendered_cost, sensor_resolution, observed_cloud_point_num,
+                                 cuda_pose_point_num, observed_cloud_lab,
+                                 cuda_observed_explained_bits, observed_explained_words,
+                                 cuda_observed_explained_keys, type, color_distance_threshold);
         }
     }
     __global__ void compute_observed_cost(
         int num_poses,
-        int observed_cloud_point_num,
-        uint8_t* cuda_observed_explained,
+        int observed_explained_words,
+        const unsigned int* cuda_observed_explained_bits,
         float* observed_total_explained)
     {
         /*
-         * @observed_cloud_point_num - number of points in each pose in observed scene
-         * @cuda_observed_explained - binary value indicating whether given point is explained or not based on distance
+         * @observed_explained_words - number of 32 bit words holding the explained bits of one pose
+         * @cuda_observed_explained_bits - bit set if given observed point is explained by the pose based on distance
          */
-        size_t point_index = blockIdx.x*blockDim.x + threadIdx.x;
-        if(point_index >= num_poses * observed_cloud_point_num) return;
+        size_t word_index = blockIdx.x*blockDim.x + threadIdx.x;
+        if(word_index >= (size_t) num_poses * observed_explained_words) return;
 
-        size_t pose_index = point_index/observed_cloud_point_num;
-        atomicAdd(&observed_total_explained[pose_index], (float) cuda_observed_explained[point_index]);
-        // printf("%d\n", cuda_observed_explained[point_index]);
+        unsigned int word = cuda_observed_explained_bits[word_index];
+        if (word == 0) return;
+        size_t pose_index = word_index/observed_explained_words;
+        atomicAdd(&observed_total_explained[pose_index], (float) observed_explained::popcount(word));
     }
+
+    struct explained_key_pose_functor{
+        const int observed_cloud_point_num;
+
+        explained_key_pose_functor(int _observed_cloud_point_num) : observed_cloud_point_num(_observed_cloud_point_num) {}
+
+        __host__ __device__
+        int operator()(const unsigned long long& key) const
+        {
+            return observed_explained::key_pose(key, observed_cloud_point_num);
+        }
+    };
 }
 
-void compute_costs(const int   num_images,
-                        const int   cost_type,
-                        const bool  calculate_observed_cost,
-                        const float sensor_resolution,
-                        const float color_distance_threshold,
-                        const thrust::device_vector<uint8_t>& observed_cloud_color,
-                        const thrust::device_vector<int>&     observed_cloud_label,
-                        const int observed_cloud_point_count,
-                        const thrust::device_vector<uint8_t>& rendered_cloud_color,
-                        const thrust::device_vector<int>&     rendered_cloud_pose_map,
-                        const thrust::device_vector<int>&     rendered_poses_occluded,
-                        const thrust::device_vector<int>&     rendered_poses_label,
-                        const thrust::device_vector<float> rendered_poses_observed_points_total,
-                        const int rendered_cloud_point_count,
-                        const thrust::device_vector<float>& k_distances,
-                        const thrust::device_vector<int>&   k_indices,
-                        thrust::device_vector<float>& cuda_rendered_cost_vec,
-                        thrust::device_vector<float>& cuda_observed_cost_vec,
-                        thrust::device_vector<float>& cuda_pose_points_diff_cost_vec,
-                        gpu_stats& stats                        
-                        ) {
+void normalize_costs(const int num_images,
+                     const bool calculate_observed_cost,
+                     const int observed_cloud_point_count,
+                     const thrust::device_vector<float>& cuda_pose_point_num_vec,
+                     const int observed_explained_words,
+                     const thrust::device_vector<unsigned int>& cuda_observed_explained_bits_vec,
+                     thrust::device_vector<unsigned long long>& cuda_observed_explained_keys_vec,
+                     const thrust::device_vector<float>& rendered_poses_observed_points_total,
+                     thrust::device_vector<float>& cuda_rendered_cost_vec,
+                     thrust::device_vector<float>& cuda_observed_cost_vec,
+                     thrust::device_vector<float>& cuda_pose_points_diff_cost_vec,
+                     gpu_stats& stats) {
         /*
-        * rendered_poses_observed_points_total - number of observed points in cylinder volume or in segmentation for given pose
-        * 
+        * Turns the per pose counts of the cost kernels into the percentage costs.
+        * cuda_rendered_cost_vec holds the number of unexplained rendered points on input, the explained sets are
+        * either the bits (observed_explained_words words per pose) or the keys, whichever is not empty
         */
-        printf("compute_costs()\n");
-        cuda_rendered_cost_vec.resize(num_images, 0);
-        float* cuda_rendered_cost = thrust::raw_pointer_cast(cuda_rendered_cost_vec.data());
-        thrust::device_vector<float> cuda_pose_point_num_vec(num_images, 0);
-        float* cuda_pose_point_num = thrust::raw_pointer_cast(cuda_pose_point_num_vec.data());
         thrust::device_vector<float> cuda_rendered_explained_vec(num_images, 0);
-
-        // Points in observed that get explained by render
-        thrust::device_vector<uint8_t> cuda_observed_explained_vec(num_images * observed_cloud_point_count, 0);
-        uint8_t* cuda_observed_explained = thrust::raw_pointer_cast(cuda_observed_explained_vec.data());
-
-        // Copy segmentation label of observed if required
-        const int* cuda_observed_cloud_label = (cost_type == 2) ? thrust::raw_pointer_cast(observed_cloud_label.data()) : NULL;
-        // peak_memory_usage = std::max(print_cuda_memory_usage(), peak_memory_usage);
-
-        const uint8_t* cuda_observed_cloud_color = thrust::raw_pointer_cast(observed_cloud_color.data());
-        const float* dist_dev = thrust::raw_pointer_cast(k_distances.data());
-        const int* index_dev = thrust::raw_pointer_cast(k_indices.data());
-        const int* cuda_cloud_pose_map = thrust::raw_pointer_cast(rendered_cloud_pose_map.data());
-        const int* device_pose_occluded_vec = thrust::raw_pointer_cast(rendered_poses_occluded.data());
-        const uint8_t* cuda_cloud_color = thrust::raw_pointer_cast(rendered_cloud_color.data());
-        const int* device_pose_segmentation_label_vec = thrust::raw_pointer_cast(rendered_poses_label.data());
-        
-        stats.peak_memory_usage = std::max(print_cuda_memory_usage(), stats.peak_memory_usage);
-
-        dim3 numBlocksR((rendered_cloud_point_count + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK, 1);
-        cost_computation::compute_render_cost<<<numBlocksR, THREADS_PER_BLOCK>>>(
-            dist_dev,
-            index_dev,
-            cuda_cloud_pose_map,
-            device_pose_occluded_vec,
-            cuda_rendered_cost,
-            sensor_resolution,
-            rendered_cloud_point_count,
-            observed_cloud_point_count,
-            cuda_pose_point_num, // Can be 0 if that pose had no points in it
-            cuda_cloud_color,
-            cuda_observed_cloud_color,
-            cuda_observed_explained,
-            device_pose_segmentation_label_vec,
-            cuda_observed_cloud_label,
-            cost_type,
-            color_distance_threshold);
-        
         thrust::device_vector<float> percentage_multiplier_val(num_images, 100);
         // Convert cost to percentage out of 100
         thrust::transform(
@@ -388,20 +304,47 @@ void compute_costs(const int   num_images,
         {
             thrust::device_vector<float> cuda_pose_observed_explained_vec(num_images, 0);
             float* cuda_pose_observed_explained = thrust::raw_pointer_cast(cuda_pose_observed_explained_vec.data());
-            cuda_pose_points_diff_cost_vec.resize(num_images, 0);
+            cuda_pose_points_diff_cost_vec.assign(num_images, 0);
 
             // peak_memory_usage = std::max(print_cuda_memory_usage(), peak_memory_usage);
         
-            dim3 numBlocksO((num_images * observed_cloud_point_count + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK, 1);
-            //// Calculate the number of explained points in every pose, by adding
+            //// Calculate the number of explained points in every pose
             stats.peak_memory_usage = std::max(print_cuda_memory_usage(), stats.peak_memory_usage);
 
-            cost_computation::compute_observed_cost<<<numBlocksO, THREADS_PER_BLOCK>>>(
-                num_images,
-                observed_cloud_point_count,
-                cuda_observed_explained,
-                cuda_pose_observed_explained
-            );
+            if (cuda_observed_explained_keys_vec.size() > 0)
+            {
+                // Every explained observed point is counted once per pose : sort the keys, drop duplicates
+                // and the unexplained keys at the end, then count the keys of every pose
+                thrust::sort(cuda_observed_explained_keys_vec.begin(), cuda_observed_explained_keys_vec.end());
+                thrust::device_vector<unsigned long long>::iterator keys_end =
+                    thrust::unique(cuda_observed_explained_keys_vec.begin(), cuda_observed_explained_keys_vec.end());
+                keys_end = thrust::lower_bound(cuda_observed_explained_keys_vec.begin(), keys_end, UNEXPLAINED_KEY);
+
+                const int num_keys = keys_end - cuda_observed_explained_keys_vec.begin();
+                thrust::device_vector<int> explained_poses(num_keys);
+                thrust::device_vector<float> explained_counts(num_keys);
+                thrust::pair<thrust::device_vector<int>::iterator, thrust::device_vector<float>::iterator> counts_end =
+                    thrust::reduce_by_key(
+                        thrust::make_transform_iterator(cuda_observed_explained_keys_vec.begin(),
+                                                        cost_computation::explained_key_pose_functor(observed_cloud_point_count)),
+                        thrust::make_transform_iterator(keys_end,
+                                                        cost_computation::explained_key_pose_functor(observed_cloud_point_count)),
+                        thrust::constant_iterator<float>(1),
+                        explained_poses.begin(),
+                        explained_counts.begin());
+                thrust::scatter(explained_counts.begin(), counts_end.second, explained_poses.begin(),
+                                cuda_pose_observed_explained_vec.begin());
+            }
+            else if (cuda_observed_explained_bits_vec.size() > 0)
+            {
+                dim3 numBlocksO(((size_t) num_images * observed_explained_words + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK, 1);
+                cost_computation::compute_observed_cost<<<numBlocksO, THREADS_PER_BLOCK>>>(
+                    num_images,
+                    observed_explained_words,
+                    thrust::raw_pointer_cast(cuda_observed_explained_bits_vec.data()),
+                    cuda_pose_observed_explained
+                );
+            }
             
             //// Get difference of explained points between rendered and observed
             thrust::transform(
@@ -418,7 +361,7 @@ void compute_costs(const int   num_images,
             
             // Subtract total observed points for each pose with explained points for each pose
             // thrust::device_vector<float> cuda_pose_observed_points_total_vec = pose_observed_points_total;
-            cuda_observed_cost_vec.resize(num_images, 0);
+            cuda_observed_cost_vec.assign(num_images, 0);
             thrust::transform(
                 rendered_poses_observed_points_total.begin(), rendered_poses_observed_points_total.end(), 
                 cuda_pose_observed_explained_vec.begin(), cuda_observed_cost_vec.begin(), 
@@ -453,6 +396,108 @@ void compute_costs(const int   num_images,
             // );
 
         }
+}
+
+void compute_costs(const int   num_images,
+                        const int   cost_type,
+                        const bool  calculate_observed_cost,
+                        const float sensor_resolution,
+                        const float color_distance_threshold,
+                        const thrust::device_vector<float>&   observed_cloud_lab,
+                        const thrust::device_vector<int>&     observed_cloud_label,
+                        const int observed_cloud_point_count,
+                        const thrust::device_vector<uint8_t>& rendered_cloud_color,
+                        const thrust::device_vector<int>&     rendered_cloud_pose_map,
+                        const thrust::device_vector<int>&     rendered_poses_occluded,
+                        const thrust::device_vector<int>&     rendered_poses_label,
+                        const thrust::device_vector<float>& rendered_poses_observed_points_total,
+                        const int rendered_cloud_point_count,
+                        const thrust::device_vector<float>& k_distances,
+                        const thrust::device_vector<int>&   k_indices,
+                        thrust::device_vector<float>& cuda_rendered_cost_vec,
+                        thrust::device_vector<float>& cuda_observed_cost_vec,
+                        thrust::device_vector<float>& cuda_pose_points_diff_cost_vec,
+                        gpu_stats& stats                        
+                        ) {
+        /*
+        * rendered_poses_observed_points_total - number of observed points in cylinder volume or in segmentation for given pose
+        * observed_cloud_lab - Lab colors of the observed cloud, only read for cost_type 1
+        * 
+        */
+        printf("compute_costs()\n");
+        cuda_rendered_cost_vec.assign(num_images, 0);
+        float* cuda_rendered_cost = thrust::raw_pointer_cast(cuda_rendered_cost_vec.data());
+        thrust::device_vector<float> cuda_pose_point_num_vec(num_images, 0);
+        float* cuda_pose_point_num = thrust::raw_pointer_cast(cuda_pose_point_num_vec.data());
+
+        // Points in observed that get explained by render, only kept when the observed cost is needed.
+        // Dense : one bit per observed point and pose. Sparse : one (pose, observed point) key per rendered point,
+        // used when the poses cover few observed points so that memory and reduction scale with the rendered points
+        const int observed_explained_words = observed_explained::words(observed_cloud_point_count);
+        const size_t dense_explained_bytes = observed_explained::bits_bytes(num_images, observed_cloud_point_count);
+        const size_t sparse_explained_bytes = observed_explained::keys_bytes(rendered_cloud_point_count);
+        const bool use_sparse_explained =
+            observed_explained::use_keys(num_images, observed_cloud_point_count, rendered_cloud_point_count);
+        thrust::device_vector<unsigned int> cuda_observed_explained_bits_vec;
+        thrust::device_vector<unsigned long long> cuda_observed_explained_keys_vec;
+        unsigned int* cuda_observed_explained_bits = NULL;
+        unsigned long long* cuda_observed_explained_keys = NULL;
+        if (calculate_observed_cost)
+        {
+            if (use_sparse_explained)
+            {
+                cuda_observed_explained_keys_vec.assign(rendered_cloud_point_count, UNEXPLAINED_KEY);
+                cuda_observed_explained_keys = thrust::raw_pointer_cast(cuda_observed_explained_keys_vec.data());
+            }
+            else
+            {
+                cuda_observed_explained_bits_vec.assign((size_t) num_images * observed_explained_words, 0);
+                cuda_observed_explained_bits = thrust::raw_pointer_cast(cuda_observed_explained_bits_vec.data());
+            }
+            printf("Observed explained set : %s, %zu bytes\n", use_sparse_explained ? "sparse" : "bit-packed",
+                   use_sparse_explained ? sparse_explained_bytes : dense_explained_bytes);
+        }
+
+        // Copy segmentation label of observed if required
+        const int* cuda_observed_cloud_label = (cost_type == 2) ? thrust::raw_pointer_cast(observed_cloud_label.data()) : NULL;
+        // peak_memory_usage = std::max(print_cuda_memory_usage(), peak_memory_usage);
+
+        const float* cuda_observed_cloud_lab = (cost_type == 1) ? thrust::raw_pointer_cast(observed_cloud_lab.data()) : NULL;
+        const float* dist_dev = thrust::raw_pointer_cast(k_distances.data());
+        const int* index_dev = thrust::raw_pointer_cast(k_indices.data());
+        const int* cuda_cloud_pose_map = thrust::raw_pointer_cast(rendered_cloud_pose_map.data());
+        const int* device_pose_occluded_vec = thrust::raw_pointer_cast(rendered_poses_occluded.data());
+        const uint8_t* cuda_cloud_color = thrust::raw_pointer_cast(rendered_cloud_color.data());
+        const int* device_pose_segmentation_label_vec = thrust::raw_pointer_cast(rendered_poses_label.data());
+        
+        stats.peak_memory_usage = std::max(print_cuda_memory_usage(), stats.peak_memory_usage);
+
+        dim3 numBlocksR((rendered_cloud_point_count + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK, 1);
+        cost_computation::compute_render_cost<<<numBlocksR, THREADS_PER_BLOCK>>>(
+            dist_dev,
+            index_dev,
+            cuda_cloud_pose_map,
+            device_pose_occluded_vec,
+            cuda_rendered_cost,
+            sensor_resolution,
+            rendered_cloud_point_count,
+            observed_cloud_point_count,
+            cuda_pose_point_num, // Can be 0 if that pose had no points in it
+            cuda_cloud_color,
+            cuda_observed_cloud_lab,
+            cuda_observed_explained_bits,
+            observed_explained_words,
+            cuda_observed_explained_keys,
+            device_pose_segmentation_label_vec,
+            cuda_observed_cloud_label,
+            cost_type,
+            color_distance_threshold);
+        
+        normalize_costs(num_images, calculate_observed_cost, observed_cloud_point_count,
+                        cuda_pose_point_num_vec, observed_explained_words,
+                        cuda_observed_explained_bits_vec, cuda_observed_explained_keys_vec,
+                        rendered_poses_observed_points_total,
+                        cuda_rendered_cost_vec, cuda_observed_cost_vec, cuda_pose_points_diff_cost_vec, stats);
         printf("compute_costs() done\n");
 }
 }
@@ -93,9 +93,8 @@ namespace image_to_cloud {
     }
     
     __global__ void depth_to_2d_cloud(
-        const int32_t* depth, const uint8_t* r_in, const uint8_t* g_in, const uint8_t* b_in, float* cloud, float* cloud_1d, 
+        const int32_t* depth, const uint8_t* r_in, const uint8_t* g_in, const uint8_t* b_in, float* cloud_1d, 
         Eigen::Vector3f* cloud_eigen,
-        size_t cloud_pitch, 
         uint8_t* cloud_color, int cloud_rendered_cloud_point_num, int* mask, int width, int height, 
         float kCameraCX, float kCameraCY, float kCameraFX, float kCameraFY, float depth_factor,
         int stride, int num_poses, int* cloud_pose_map, const uint8_t* label_mask_data,  int* cloud_mask_label,
@@ -145,13 +144,6 @@ namespace image_to_cloud {
         
         uint32_t idx_mask = n * width * height + x + y*width;
         int cloud_idx = mask[idx_mask];
-        float* row_0 = (float *)((char*)cloud + 0 * cloud_pitch);
-        float* row_1 = (float *)((char*)cloud + 1 * cloud_pitch);
-        float* row_2 = (float *)((char*)cloud + 2 * cloud_pitch);
-        row_0[cloud_idx] = x_pcd;
-        row_1[cloud_idx] = y_pcd;
-        row_2[cloud_idx] = z_pcd;
-    
         cloud_1d[cloud_idx + 0*cloud_rendered_cloud_point_num] = x_pcd;
         cloud_1d[cloud_idx + 1*cloud_rendered_cloud_point_num] = y_pcd;
         cloud_1d[cloud_idx + 2*cloud_rendered_cloud_point_num] = z_pcd;
@@ -199,8 +191,6 @@ void compute_point_clouds(const thrust::device_vector<int32_t>& device_depth_int
                           const float  depth_factor,
                           const int    stride,
                           const thrust::device_vector<int>&      device_pose_occluded,
-                          float* &result_2d_point_cloud,
-                          size_t& query_pitch_in_bytes,
                           thrust::device_vector<Eigen::Vector3f>& result_cloud_eigen,
                           thrust::device_vector<float>&   result_point_cloud,
                           thrust::device_vector<uint8_t>& result_point_cloud_color,
@@ -264,7 +254,8 @@ void compute_point_clouds(const thrust::device_vector<int32_t>& device_depth_int
     // }
     // thrust::device_vector<int> mask(width*height*num_poses, 0);
     // result_dc_index.clear();
-    result_dc_index.resize(width*height*num_poses, 0);
+    // assign instead of resize so that a reused buffer is zeroed, the mask kernel only writes valid pixels
+    result_dc_index.assign(width*height*num_poses, 0);
     int* mask_ptr = thrust::raw_pointer_cast(result_dc_index.data());
 
     dim3 threadsPerBlock(16, 16);
@@ -292,8 +283,6 @@ void compute_point_clouds(const thrust::device_vector<int32_t>& device_depth_int
     result_cloud_point_count = result_dc_index.back() + mask_back_temp;
     printf("Actual points in all clouds : %d\n", result_cloud_point_count);
 
-    cudaMallocPitch(&result_2d_point_cloud,   &query_pitch_in_bytes,   result_cloud_point_count * sizeof(float), POINT_DIM);
-    
     // result_cloud_eigen.clear();
     // result_point_cloud.clear();
     // result_point_cloud_color.clear();
@@ -317,15 +306,18 @@ void compute_point_clouds(const thrust::device_vector<int32_t>& device_depth_int
         result_cloud_label.resize(result_cloud_point_count, 0);
         cloud_mask_label = thrust::raw_pointer_cast(result_cloud_label.data());
     }
+    else
+    {
+        // Reused buffer may hold labels of a previous call, the KNN treats a non-empty vector as labelled
+        result_cloud_label.clear();
+    }
     stats.peak_memory_usage = std::max(print_cuda_memory_usage(), stats.peak_memory_usage);
     image_to_cloud::depth_to_2d_cloud<<<numBlocks, threadsPerBlock>>>(depth_data, 
                                                       red_in, 
                                                       green_in, 
                                                       blue_in,
-                                                      result_2d_point_cloud, 
                                                       cloud_1d,
                                                       cloud_eigen,
-                                                      query_pitch_in_bytes, 
                                                       cloud_color, 
                                                       result_cloud_point_count, 
                                                       mask_ptr, 
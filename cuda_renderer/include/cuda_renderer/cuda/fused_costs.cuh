@@ -0,0 +1,327 @@
+#ifndef CUDA_FUSED_COSTS_CUH
+#define CUDA_FUSED_COSTS_CUH
+#include <thrust/device_vector.h>
+#include <thrust/reduce.h>
+#include <thrust/replace.h>
+#include <thrust/functional.h>
+#include <Eigen/Core>
+
+#include "cuda_renderer/model.h"
+#include "cuda_renderer/cuda/utils.cuh"
+#include "cuda_renderer/cuda/image_renderer.cuh"
+#include "cuda_renderer/cuda/compute_point_clouds.cuh"
+#include "cuda_renderer/cuda/nearest_neighbor.cuh"
+#include "cuda_renderer/cuda/compute_costs.cuh"
+#include "cuda_renderer/cost_bound.h"
+#include "cuda_renderer/observed_explained.h"
+
+namespace cuda_renderer {
+namespace fused_costs {
+    __device__ inline bool visible_fragment(
+        const unsigned long long* packed_image_vec,
+        const int32_t* device_source_depth_vec,
+        const int pose_index,
+        const size_t pixel_i,
+        const int width,
+        const int height,
+        const float occlusion_threshold,
+        unsigned long long& packed,
+        int32_t& depth)
+    {
+        // Nearest fragment of the pose at the pixel, if any and not occluded by the source
+        packed = packed_image_vec[(size_t) pose_index*width*height + pixel_i];
+        depth = image_renderer::unpack_depth(packed);
+        if (depth == INT_MAX || depth <= 0) return false;
+        return image_renderer::source_occlusion(depth, device_source_depth_vec[pixel_i], 0, -1,
+                                                false, occlusion_threshold) <= 0;
+    }
+
+    __global__ void count_pose_points(
+        const unsigned long long* packed_image_vec,
+        const int32_t* device_source_depth_vec,
+        const int width,
+        const int height,
+        const int stride,
+        const int num_poses,
+        const float occlusion_threshold,
+        float* cuda_pose_points_total)
+    {
+        /**
+        * Number of points the rendered cloud of every pose would have, needed up front by the cost bound
+        */
+        const int cols = width/stride;
+        const int rows = (height + stride - 1)/stride;
+        size_t thread_index = blockIdx.x*blockDim.x + threadIdx.x;
+        if (thread_index >= (size_t) num_poses*cols*rows) return;
+        const int pose_index = thread_index/(cols*rows);
+        const int pixel_index = thread_index%(cols*rows);
+        const size_t pixel_i = (pixel_index%cols)*stride + (size_t) (pixel_index/cols)*stride*width;
+
+        unsigned long long packed;
+        int32_t depth;
+        if (visible_fragment(packed_image_vec, device_source_depth_vec, pose_index, pixel_i,
+                             width, height, occlusion_threshold, packed, depth))
+        {
+            atomicAdd(&cuda_pose_points_total[pose_index], 1);
+        }
+    }
+
+    __global__ void bound_poses(
+        const int num_poses,
+        const bool calculate_observed_cost,
+        const int* cuda_poses_occluded,
+        const float* cuda_pose_points_total,
+        const float* cuda_pose_point_num,
+        const float* cuda_rendered_cost,
+        const float* cuda_observed_points_total,
+        const unsigned int* cuda_observed_explained_bits,
+        const int observed_explained_words,
+        const float* cuda_pose_cost_bound,
+        int* cuda_poses_pruned)
+    {
+        /**
+        * One thread per pose, run between chunks of fused_render_cost.
+        * cuda_rendered_cost still holds the number of unexplained points scored so far.
+        */
+        const int pose_index = blockIdx.x*blockDim.x + threadIdx.x;
+        if (pose_index >= num_poses) return;
+        if (cuda_poses_pruned[pose_index] || cuda_poses_occluded[pose_index]) return;
+
+        float observed_explained = 0;
+        if (calculate_observed_cost)
+        {
+            const unsigned int* bits = cuda_observed_explained_bits + (size_t) pose_index*observed_explained_words;
+            for (int w = 0; w < observed_explained_words; w++)
+                observed_explained += observed_explained::popcount(bits[w]);
+        }
+        const float bound = cost_bound::lower_bound(cuda_pose_points_total[pose_index],
+                                                    cuda_pose_point_num[pose_index],
+                                                    cuda_rendered_cost[pose_index],
+                                                    calculate_observed_cost ? cuda_observed_points_total[pose_index] : 0,
+                                                    observed_explained, calculate_observed_cost);
+        if (cost_bound::exceeds(bound, cuda_pose_cost_bound[pose_index]))
+            cuda_poses_pruned[pose_index] = 1;
+    }
+
+    __global__ void fused_render_cost(
+        const unsigned long long* packed_image_vec,
+        const int32_t* device_source_depth_vec,
+        const int width,
+        const int height,
+        const int stride,
+        const int num_poses,
+        const int chunk,
+        const int num_chunks,
+        const int* cuda_poses_pruned,
+        const float kCameraCX,
+        const float kCameraCY,
+        const float kCameraFX,
+        const float kCameraFY,
+        const float depth_factor,
+        const float occlusion_threshold,
+        const int* cuda_poses_occluded,
+        const nn::ProjectiveGrid grid,
+        const Eigen::Vector3f* observed_points,
+        const float nn_radius,
+        float* cuda_rendered_cost,
+        const float sensor_resolution,
+        const int observed_cloud_point_num,
+        float* cuda_pose_point_num,
+        const float* observed_cloud_lab,
+        unsigned int* cuda_observed_explained_bits,
+        const int observed_explained_words,
+        int type,
+        const float color_distance_threshold)
+    {
+        /**
+        * One thread per pose and strided pixel, same pixels as image_to_cloud::depth_to_2d_cloud.
+        * Pixels are split in num_chunks interleaved chunks for the cost bound, this launch scores @chunk
+        * of the poses that are not in @cuda_poses_pruned (NULL : none).
+        * Reads the nearest fragment from the packed z-buffer, applies occlusion with the source
+        * (resolve_packed_depth without segmentation labels), back-projects it and scores it against
+        * its projective nearest neighbour, so neither the images nor the rendered cloud are written.
+        * @nn_radius : sensor resolution, @sensor_resolution : its square as for compute_render_cost
+        */
+        const int cols = width/stride;
+        const int rows = (height + stride - 1)/stride;
+        const int chunk_pixels = (cols*rows + num_chunks - 1)/num_chunks;
+        size_t thread_index = blockIdx.x*blockDim.x + threadIdx.x;
+        if (thread_index >= (size_t) num_poses*chunk_pixels) return;
+        const int pose_index = thread_index/chunk_pixels;
+        const int pixel_index = chunk + (thread_index%chunk_pixels)*num_chunks;
+        if (pixel_index >= cols*rows) return;
+        if (cuda_poses_pruned != NULL && cuda_poses_pruned[pose_index]) return;
+        const int x = (pixel_index%cols)*stride;
+        const int y = (pixel_index/cols)*stride;
+        const size_t pixel_i = x + (size_t) y*width;
+
+        unsigned long long packed;
+        int32_t depth;
+        if (!visible_fragment(packed_image_vec, device_source_depth_vec, pose_index, pixel_i,
+                              width, height, occlusion_threshold, packed, depth)) return;
+        if (cuda_poses_occluded[pose_index])
+        {
+            cuda_rendered_cost[pose_index] = -1;
+            return;
+        }
+
+        Eigen::Vector3f point;
+        image_to_cloud::transform_point(x, y, depth, kCameraCX, kCameraCY, kCameraFX, kCameraFY,
+                                        depth_factor, NULL, point(0), point(1), point(2));
+        float knn_dist;
+        int o_point_index;
+        nn::projective_nearest(grid, observed_points, point, nn_radius, knn_dist, o_point_index);
+
+        uint8_t red, green, blue;
+        image_renderer::unpack_color(packed, red, green, blue);
+        cost_computation::score_rendered_point(thread_index, pose_index, knn_dist, o_point_index,
+                                               red, green, blue,
+                                               cuda_rendered_cost, sensor_resolution, observed_cloud_point_num,
+                                               cuda_pose_point_num, observed_cloud_lab,
+                                               cuda_observed_explained_bits, observed_explained_words,
+                                               NULL, type, color_distance_threshold);
+    }
+}
+
+void compute_costs_fused(const int   num_images,
+                         const int   cost_type,
+                         const bool  calculate_observed_cost,
+                         const float sensor_resolution,
+                         const float color_distance_threshold,
+                         const float occlusion_threshold,
+                         const thrust::device_vector<unsigned long long>& packed_image,
+                         const thrust::device_vector<int32_t>& source_depth,
+                         const int width,
+                         const int height,
+                         const int stride,
+                         const float kCameraCX,
+                         const float kCameraCY,
+                         const float kCameraFX,
+                         const float kCameraFY,
+                         const float depth_factor,
+                         const thrust::device_vector<Eigen::Vector3f>& observed_cloud_eigen,
+                         const thrust::device_vector<float>& observed_cloud_lab,
+                         const int observed_cloud_point_count,
+                         const thrust::device_vector<int>& rendered_poses_occluded,
+                         const thrust::device_vector<float>& rendered_poses_observed_points_total,
+                         thrust::device_vector<int>& cell_keys,
+                         thrust::device_vector<int>& cell_offsets,
+                         thrust::device_vector<int>& cell_points,
+                         int& rendered_cloud_point_count,
+                         thrust::device_vector<float>& cuda_rendered_cost_vec,
+                         thrust::device_vector<float>& cuda_observed_cost_vec,
+                         thrust::device_vector<float>& cuda_pose_points_diff_cost_vec,
+                         gpu_stats& stats,
+                         const float* pose_cost_bound = NULL) {
+        /*
+        * Costs of compute_costs straight from the packed z-buffer of image_render (resolve_images false),
+        * for 3-Dof scoring without ICP or segmentation labels. Neighbours come from projective association,
+        * which is exact within the sensor resolution like every search the costs use.
+        * The explained sets are always bit-packed, one key per pixel slot would be larger than the bits.
+        * @sensor_resolution : not squared
+        * @rendered_cloud_point_count : number of points the rendered clouds would have had
+        * @pose_cost_bound : optional host bound of every pose (cost_bound.h), poses are then scored in
+        * COST_BOUND_CHUNKS launches and the ones whose lower bound reaches it skip the remaining chunks,
+        * with PRUNED_POSE_COST as rendered cost and 0 as observed cost
+        */
+        printf("compute_costs_fused()\n");
+        const nn::ProjectiveGrid grid = build_projective_grid(observed_cloud_eigen, width, height, stride,
+                                                              kCameraCX, kCameraCY, kCameraFX, kCameraFY,
+                                                              cell_keys, cell_offsets, cell_points);
+
+        cuda_rendered_cost_vec.assign(num_images, 0);
+        thrust::device_vector<float> cuda_pose_point_num_vec(num_images, 0);
+        const int observed_explained_words = observed_explained::words(observed_cloud_point_count);
+        thrust::device_vector<unsigned int> cuda_observed_explained_bits_vec;
+        thrust::device_vector<unsigned long long> cuda_observed_explained_keys_vec;
+        if (calculate_observed_cost)
+        {
+            cuda_observed_explained_bits_vec.assign((size_t) num_images * observed_explained_words, 0);
+        }
+        stats.peak_memory_usage = std::max(print_cuda_memory_usage(), stats.peak_memory_usage);
+
+        const int num_pixels = (width/stride) * ((height + stride - 1)/stride);
+        const int num_chunks = (pose_cost_bound != NULL) ? COST_BOUND_CHUNKS : 1;
+        thrust::device_vector<int> cuda_poses_pruned_vec;
+        thrust::device_vector<float> cuda_pose_points_total_vec;
+        thrust::device_vector<float> cuda_pose_cost_bound_vec;
+        if (num_chunks > 1 && num_images > 0 && num_pixels > 0)
+        {
+            cuda_poses_pruned_vec.assign(num_images, 0);
+            cuda_pose_points_total_vec.assign(num_images, 0);
+            cuda_pose_cost_bound_vec.assign(pose_cost_bound, pose_cost_bound + num_images);
+            const size_t num_threads = (size_t) num_images * num_pixels;
+            fused_costs::count_pose_points<<<(num_threads + THREADS_PER_BLOCK - 1)/THREADS_PER_BLOCK, THREADS_PER_BLOCK>>>(
+                thrust::raw_pointer_cast(packed_image.data()),
+                thrust::raw_pointer_cast(source_depth.data()),
+                width, height, stride, num_images,
+                occlusion_threshold,
+                thrust::raw_pointer_cast(cuda_pose_points_total_vec.data()));
+        }
+
+        const size_t chunk_threads = (size_t) num_images * ((num_pixels + num_chunks - 1)/num_chunks);
+        for (int chunk = 0; chunk < num_chunks && chunk_threads > 0; chunk++)
+        {
+            fused_costs::fused_render_cost<<<(chunk_threads + THREADS_PER_BLOCK - 1)/THREADS_PER_BLOCK, THREADS_PER_BLOCK>>>(
+                thrust::raw_pointer_cast(packed_image.data()),
+                thrust::raw_pointer_cast(source_depth.data()),
+                width, height, stride, num_images,
+                chunk, num_chunks,
+                (num_chunks > 1) ? thrust::raw_pointer_cast(cuda_poses_pruned_vec.data()) : NULL,
+                kCameraCX, kCameraCY, kCameraFX, kCameraFY, depth_factor,
+                occlusion_threshold,
+                thrust::raw_pointer_cast(rendered_poses_occluded.data()),
+                grid,
+                thrust::raw_pointer_cast(observed_cloud_eigen.data()),
+                sensor_resolution,
+                thrust::raw_pointer_cast(cuda_rendered_cost_vec.data()),
+                sensor_resolution * sensor_resolution,
+                observed_cloud_point_count,
+                thrust::raw_pointer_cast(cuda_pose_point_num_vec.data()),
+                (cost_type == 1) ? thrust::raw_pointer_cast(observed_cloud_lab.data()) : NULL,
+                calculate_observed_cost ? thrust::raw_pointer_cast(cuda_observed_explained_bits_vec.data()) : NULL,
+                observed_explained_words,
+                cost_type,
+                color_distance_threshold);
+            if (chunk + 1 < num_chunks)
+            {
+                fused_costs::bound_poses<<<(num_images + THREADS_PER_BLOCK - 1)/THREADS_PER_BLOCK, THREADS_PER_BLOCK>>>(
+                    num_images,
+                    calculate_observed_cost,
+                    thrust::raw_pointer_cast(rendered_poses_occluded.data()),
+                    thrust::raw_pointer_cast(cuda_pose_points_total_vec.data()),
+                    thrust::raw_pointer_cast(cuda_pose_point_num_vec.data()),
+                    thrust::raw_pointer_cast(cuda_rendered_cost_vec.data()),
+                    thrust::raw_pointer_cast(rendered_poses_observed_points_total.data()),
+                    calculate_observed_cost ? thrust::raw_pointer_cast(cuda_observed_explained_bits_vec.data()) : NULL,
+                    observed_explained_words,
+                    thrust::raw_pointer_cast(cuda_pose_cost_bound_vec.data()),
+                    thrust::raw_pointer_cast(cuda_poses_pruned_vec.data()));
+            }
+        }
+        rendered_cloud_point_count = (int) thrust::reduce(cuda_pose_point_num_vec.begin(), cuda_pose_point_num_vec.end());
+
+        normalize_costs(num_images, calculate_observed_cost, observed_cloud_point_count,
+                        cuda_pose_point_num_vec, observed_explained_words,
+                        cuda_observed_explained_bits_vec, cuda_observed_explained_keys_vec,
+                        rendered_poses_observed_points_total,
+                        cuda_rendered_cost_vec, cuda_observed_cost_vec, cuda_pose_points_diff_cost_vec, stats);
+        if (cuda_poses_pruned_vec.size() > 0)
+        {
+            const int num_pruned = (int) thrust::reduce(cuda_poses_pruned_vec.begin(), cuda_poses_pruned_vec.end());
+            printf("Poses pruned by the cost bound : %d/%d\n", num_pruned, num_images);
+            thrust::replace_if(cuda_rendered_cost_vec.begin(), cuda_rendered_cost_vec.end(),
+                               cuda_poses_pruned_vec.begin(), thrust::identity<int>(), (float) PRUNED_POSE_COST);
+            if (calculate_observed_cost)
+            {
+                thrust::replace_if(cuda_observed_cost_vec.begin(), cuda_observed_cost_vec.end(),
+                                   cuda_poses_pruned_vec.begin(), thrust::identity<int>(), 0.0f);
+                thrust::replace_if(cuda_pose_points_diff_cost_vec.begin(), cuda_pose_points_diff_cost_vec.end(),
+                                   cuda_poses_pruned_vec.begin(), thrust::identity<int>(), 0.0f);
+            }
+        }
+        printf("compute_costs_fused() done\n");
+}
+}
+
+#endif
@@ -4,8 +4,10 @@
 #include <thrust/host_vector.h>
 #include <thrust/device_vector.h>
 #include <thrust/copy.h>
+#include <thrust/transform_reduce.h>
 
 #include "cuda_renderer/model.h"
+#include "cuda_renderer/occlusion_pyramid.h"
 #include "cuda_renderer/cuda/utils.cuh"
 
 namespace cuda_renderer {
@@ -56,6 +58,95 @@ namespace image_renderer {
             };
         }
 
+        /*
+         * Packed z-buffer entry : depth in the upper 32 bits, color in the lower 24 bits.
+         * The sign bit of depth is flipped so that ordering the words as unsigned orders them by depth,
+         * which lets a single 64 bit atomicMin do the depth test and the color write together.
+         * Among fragments at the same depth the lowest color wins, which keeps the result deterministic.
+         */
+        __host__ __device__ inline
+        unsigned long long pack_depth_color(int32_t depth, uint8_t red, uint8_t green, uint8_t blue){
+            return ((unsigned long long)((uint32_t)depth ^ 0x80000000u) << 32) |
+                   ((uint32_t)red << 16) | ((uint32_t)green << 8) | (uint32_t)blue;
+        }
+
+        __host__ __device__ inline
+        int32_t unpack_depth(unsigned long long packed){
+            return (int32_t)((uint32_t)(packed >> 32) ^ 0x80000000u);
+        }
+
+        __host__ __device__ inline
+        void unpack_color(unsigned long long packed, uint8_t& red, uint8_t& green, uint8_t& blue){
+            red = (uint8_t)(packed >> 16);
+            green = (uint8_t)(packed >> 8);
+            blue = (uint8_t)packed;
+        }
+
+        __device__ inline
+        void atomic_min_packed(unsigned long long* address, unsigned long long value){
+#if __CUDA_ARCH__ >= 350
+            atomicMin(address, value);
+#else
+            // 64 bit atomicMin needs sm_35, older targets use a CAS loop that exits as soon as the stored value is lower
+            unsigned long long old = *address;
+            while (value < old) {
+                unsigned long long assumed = old;
+                old = atomicCAS(address, assumed, value);
+                if (old == assumed) break;
+            }
+#endif
+        }
+
+        __device__ void rasterization_packed(const Model::Triangle dev_tri, Model::float3 last_row,
+                                             unsigned long long* packed_entry, size_t width, size_t height,
+                                             float* pose_total_points_entry) {
+            // Same fragments as rasterization_with_source, occlusion with source is applied afterwards
+            // by resolve_packed_depth once the nearest fragment of every pixel is known
+            float pts2[3][2];
+
+            // viewport transform(0, 0, width, height)
+            pts2[0][0] = dev_tri.v0.x/last_row.x*width/2.0f+width/2.0f; pts2[0][1] = dev_tri.v0.y/last_row.x*height/2.0f+height/2.0f;
+            pts2[1][0] = dev_tri.v1.x/last_row.y*width/2.0f+width/2.0f; pts2[1][1] = dev_tri.v1.y/last_row.y*height/2.0f+height/2.0f;
+            pts2[2][0] = dev_tri.v2.x/last_row.z*width/2.0f+width/2.0f; pts2[2][1] = dev_tri.v2.y/last_row.z*height/2.0f+height/2.0f;
+
+            float bboxmin[2] = {FLT_MAX,  FLT_MAX};
+            float bboxmax[2] = {-FLT_MAX, -FLT_MAX};
+
+            float clamp_max[2] = {float(width-1), float(height-1)};
+            float clamp_min[2] = {0, 0};
+
+            for (int i=0; i<3; i++) {
+                for (int j=0; j<2; j++) {
+                    bboxmin[j] = std__max(clamp_min[j], std__min(bboxmin[j], pts2[i][j]));
+                    bboxmax[j] = std__min(clamp_max[j], std__max(bboxmax[j], pts2[i][j]));
+                }
+            }
+
+            size_t P[2];
+            for(P[1] = size_t(bboxmin[1]+0.5f); P[1]<=bboxmax[1]; P[1] += 1){
+                for(P[0] = size_t(bboxmin[0]+0.5f); P[0]<=bboxmax[0]; P[0] += 1){
+                    Model::float3 bc_screen  = barycentric(pts2[0], pts2[1], pts2[2], P);
+
+                    if (bc_screen.x<-0.0f || bc_screen.y<-0.0f || bc_screen.z<-0.0f ||
+                            bc_screen.x>1.0f || bc_screen.y>1.0f || bc_screen.z>1.0f ) continue;
+
+                    Model::float3 bc_over_z = {bc_screen.x/last_row.x, bc_screen.y/last_row.y, bc_screen.z/last_row.z};
+                    float frag_depth = (bc_screen.x + bc_screen.y + bc_screen.z)
+                            /(bc_over_z.x + bc_over_z.y + bc_over_z.z);
+
+                    size_t x_to_write = P[0];
+                    size_t y_to_write = height-1 - P[1];
+                    int32_t curr_depth = int32_t(frag_depth + 0.5f);
+
+                    atomic_min_packed(&packed_entry[x_to_write+y_to_write*width],
+                                      pack_depth_color(curr_depth, (uint8_t)(dev_tri.color.v0),
+                                                       (uint8_t)(dev_tri.color.v1), (uint8_t)(dev_tri.color.v2)));
+                    if (USE_CLUTTER)
+                        atomicAdd(pose_total_points_entry, 1);
+                }
+            }
+        }
+
         __device__ void rasterization_with_source(const Model::Triangle dev_tri, Model::float3 last_row,
                                                 int32_t* depth_entry, size_t width, size_t height,
                                                 const Model::ROI roi, 
@@ -213,8 +304,8 @@ namespace image_renderer {
             const Model::Triangle* device_tris_ptr, const size_t device_tris_size,
             const Model::mat4x4* device_poses_ptr, size_t device_poses_size,
             int32_t* depth_image_vec, size_t width, size_t height,
-            const int* device_pose_model_map_ptr, int* device_tris_model_count_low_ptr,  
-            int* device_tris_model_count_high_ptr,
+            const int* device_pose_index_ptr, const int model_tris_low,
+            const int model_tris_high,
             const Model::mat4x4 proj_mat, 
             const Model::ROI roi,
             uint8_t* red_image_vec,uint8_t* green_image_vec,uint8_t* blue_image_vec,
@@ -229,18 +320,17 @@ namespace image_renderer {
             float* pose_clutter_points_vec, 
             float* pose_total_points_vec,
             const uint8_t* device_source_mask_label_vec,
-            int* pose_segmentation_label_vec,
+            const int* pose_segmentation_label_vec,
             bool use_segmentation_label,
-            const float occlusion_threshold
+            const float occlusion_threshold,
+            unsigned long long* packed_image_vec
         ) {
-            size_t pose_i = blockIdx.y;
-            int model_id = device_pose_model_map_ptr[pose_i];
-            size_t tri_i = blockIdx.x*blockDim.x + threadIdx.x;
+            // Launched once per model, blockIdx.y indexes the poses of that model and
+            // threads only cover the triangle range of that model
+            size_t pose_i = device_pose_index_ptr[blockIdx.y];
+            size_t tri_i = model_tris_low + blockIdx.x*blockDim.x + threadIdx.x;
 
-            if(tri_i>=device_tris_size) return;
-
-            if (!(tri_i < device_tris_model_count_high_ptr[model_id] && tri_i >= device_tris_model_count_low_ptr[model_id]))
-                return; 
+            if(tri_i>=device_tris_size || tri_i>=model_tris_high) return;
 
             size_t real_width = width;
             size_t real_height = height;
@@ -257,7 +347,7 @@ namespace image_renderer {
             int* pose_occluded_other_entry;
             float* pose_clutter_points_entry;
             float* pose_total_points_entry;
-            int* pose_segmentation_label_entry = NULL;
+            const int* pose_segmentation_label_entry = NULL;
             // printf("device_single_result_image:%d\n",device_single_result_image);
             if (device_single_result_image)
             {
@@ -304,6 +394,13 @@ namespace image_renderer {
             // projection transform
             local_tri = transform_triangle(local_tri, proj_mat);
 
+            if (packed_image_vec != NULL)
+            {
+                unsigned long long* packed_entry = device_single_result_image ?
+                    packed_image_vec : packed_image_vec + pose_i*real_width*real_height;
+                rasterization_packed(local_tri, last_row, packed_entry, width, height, pose_total_points_entry);
+                return;
+            }
             rasterization_with_source(
                 local_tri, last_row, depth_entry, width, height, roi,
                 red_entry,green_entry,blue_entry,
@@ -320,7 +417,135 @@ namespace image_renderer {
                 occlusion_threshold);
         }
 
+        __device__ inline
+        int source_occlusion(int32_t new_depth, int32_t source_depth, uint8_t source_label, int pose_label,
+                             bool use_segmentation_label, const float occlusion_threshold){
+            /*
+             * Occlusion of a rendered fragment with the source image, same rules as rasterization_with_source.
+             * Returns 1 if the source occludes the fragment (which is dropped), -1 if the fragment occludes
+             * the source and 0 otherwise
+             */
+            // pose segmentation labels start from 0, but source mask have label starting from 1
+            if ((use_segmentation_label == false && abs(new_depth - source_depth) > occlusion_threshold) ||
+                (use_segmentation_label == true &&
+                pose_label != source_label-1 && abs(new_depth - source_depth) > 0.5))
+            {
+                if(new_depth > source_depth && source_depth > 0)
+                    return 1;
+                else if(new_depth <= source_depth && source_depth > 0)
+                    return -1;
+            }
+            return 0;
+        }
+
+        __global__ void resolve_packed_depth(
+            const unsigned long long* packed_image_vec, size_t width, size_t height, int num_images,
+            int32_t* depth_image_vec, uint8_t* red_image_vec, uint8_t* green_image_vec, uint8_t* blue_image_vec,
+            const int32_t* device_source_depth_vec,
+            const uint8_t* device_source_mask_label_vec,
+            const int* pose_segmentation_label_vec,
+            bool use_segmentation_label,
+            const float occlusion_threshold,
+            const int device_single_result_image,
+            int* pose_occluded_vec,
+            int* pose_occluded_other_vec,
+            float* pose_clutter_points_vec
+        ) {
+            /*
+             * Unpacks the nearest fragment of every pixel into depth and color images and applies occlusion
+             * with the source image. Same rules as rasterization_with_source, where a pixel occluded by the
+             * source is black with no depth. Empty pixels get 0 depth directly (no max2zero pass needed).
+             */
+            size_t idx = blockIdx.x*blockDim.x + threadIdx.x;
+            if (idx >= num_images*width*height) return;
+            size_t pixel_i = idx % (width*height);
+            size_t pose_i = device_single_result_image ? 0 : idx / (width*height);
+
+            unsigned long long packed = packed_image_vec[idx];
+            int32_t new_depth = unpack_depth(packed);
+            uint8_t red, green, blue;
+            unpack_color(packed, red, green, blue);
+            if (new_depth == INT_MAX)
+            {
+                depth_image_vec[idx] = 0;
+                red_image_vec[idx] = 0; green_image_vec[idx] = 0; blue_image_vec[idx] = 0;
+                return;
+            }
+            const int occlusion = source_occlusion(new_depth, device_source_depth_vec[pixel_i],
+                                                   use_segmentation_label ? device_source_mask_label_vec[pixel_i] : 0,
+                                                   use_segmentation_label ? pose_segmentation_label_vec[pose_i] : -1,
+                                                   use_segmentation_label, occlusion_threshold);
+            if (occlusion > 0)
+            {
+                // source occludes render, add black
+                if (USE_TREE)
+                    atomicOr(&pose_occluded_other_vec[pose_i], 1);
+                if (USE_CLUTTER && device_source_depth_vec[pixel_i] <= new_depth - 5)
+                    atomicAdd(&pose_clutter_points_vec[pose_i], 1);
+                new_depth = 0;
+                red = 0; green = 0; blue = 0;
+            }
+            else if (occlusion < 0)
+            {
+                // invalid as render occludes source
+                if (USE_TREE)
+                    atomicOr(&pose_occluded_vec[pose_i], 1);
+            }
+            depth_image_vec[idx] = new_depth;
+            red_image_vec[idx] = red;
+            green_image_vec[idx] = green;
+            blue_image_vec[idx] = blue;
+        }
         
+        __global__ void build_depth_pyramid(
+            const int32_t* device_source_depth_vec, const uint8_t* device_source_mask_label_vec,
+            size_t width, size_t height, int level, occlusion::DepthCell* pyramid_vec
+        ) {
+            // One thread per cell of the level, levels are built finest first
+            int cols, rows, offset;
+            occlusion::pyramid_level(width, height, level, cols, rows, offset);
+            int cell_i = blockIdx.x*blockDim.x + threadIdx.x;
+            if (cell_i >= cols*rows) return;
+            int col = cell_i % cols;
+            int row = cell_i / cols;
+            if (level == 0)
+                pyramid_vec[cell_i] = occlusion::source_cell(device_source_depth_vec, device_source_mask_label_vec,
+                                                             width, height, col, row);
+            else
+                pyramid_vec[offset + cell_i] = occlusion::reduce_cell(pyramid_vec, width, height, level, col, row);
+        }
+
+        __global__ void cull_occluded_poses(
+            const Model::mat4x4* device_poses_ptr, const int* device_pose_model_map_ptr, int num_images,
+            const occlusion::ModelBox* model_box_vec, const occlusion::DepthCell* pyramid_vec,
+            size_t width, size_t height, const Model::mat4x4 proj_mat,
+            const int* pose_segmentation_label_vec, bool use_segmentation_label,
+            const float occlusion_threshold, int* pose_culled_vec
+        ) {
+            int pose_i = blockIdx.x*blockDim.x + threadIdx.x;
+            if (pose_i >= num_images) return;
+            pose_culled_vec[pose_i] = occlusion::pose_occluded_by_source(
+                pyramid_vec, width, height, model_box_vec[device_pose_model_map_ptr[pose_i]],
+                device_poses_ptr[pose_i], proj_mat,
+                use_segmentation_label ? pose_segmentation_label_vec[pose_i] : -1, occlusion_threshold);
+        }
+
+    struct triangle_box_functor{
+        __host__ __device__
+        occlusion::ModelBox operator()(const Model::Triangle& tri) const
+        {
+            return occlusion::triangle_box(tri);
+        }
+    };
+
+    struct merge_boxes_functor{
+        __host__ __device__
+        occlusion::ModelBox operator()(const occlusion::ModelBox& a, const occlusion::ModelBox& b) const
+        {
+            return occlusion::merge_boxes(a, b);
+        }
+    };
+
     struct max2zero_functor_renderer{
 
         max2zero_functor_renderer(){}
@@ -337,12 +562,12 @@ void image_render(const thrust::device_vector<Model::Triangle>& device_tris,
                     const thrust::device_vector<Model::mat4x4>& device_poses,
                     const thrust::device_vector<int>& device_pose_model_map,
                     const thrust::device_vector<int>& device_tris_model_count,
-                    const thrust::device_vector<int32_t> device_source_depth,
-                    const thrust::device_vector<uint8_t> device_source_color_red,
-                    const thrust::device_vector<uint8_t> device_source_color_green,
-                    const thrust::device_vector<uint8_t> device_source_color_blue,
-                    const thrust::device_vector<uint8_t> device_source_mask_label,
-                    thrust::device_vector<int> device_pose_segmentation_label,
+                    const thrust::device_vector<int32_t>& device_source_depth,
+                    const thrust::device_vector<uint8_t>& device_source_color_red,
+                    const thrust::device_vector<uint8_t>& device_source_color_green,
+                    const thrust::device_vector<uint8_t>& device_source_color_blue,
+                    const thrust::device_vector<uint8_t>& device_source_mask_label,
+                    const thrust::device_vector<int>& device_pose_segmentation_label,
                     const int num_images,
                     const size_t width,
                     const size_t height,
@@ -357,56 +582,148 @@ void image_render(const thrust::device_vector<Model::Triangle>& device_tris,
                     thrust::device_vector<uint8_t>& device_red_int,
                     thrust::device_vector<uint8_t>& device_green_int,
                     thrust::device_vector<uint8_t>& device_blue_int,
-                    gpu_stats& stats) {
+                    gpu_stats& stats,
+                    const bool use_packed_depth_test = true,
+                    thrust::device_vector<unsigned long long>* device_packed_buffer = NULL,
+                    const bool use_occlusion_culling = true,
+                    const bool resolve_images = true) {
         
         printf("image_render()\n");
         /*
         *   Render image with occlusion, if segmentation label present, only do occlusion from different label (use seg label of pose and pixel label of source)
         *   If not seg label, do occlusion with entire source image (3dof)
         *   Both done with some threshold so that point doesnt occlude itself
+        *   @use_packed_depth_test : depth test with one 64 bit atomicMin on packed depth+color per fragment,
+        *   occlusion applied in a separate pass. Otherwise the older per pixel lock (kept for benchmarking)
+        *   @device_packed_buffer : reused packed depth buffer, allocated for this call if NULL
+        *   @use_occlusion_culling : skip rasterizing poses whose model bounding box is entirely hidden by the source,
+        *   tested against a min/max depth pyramid of the source (see occlusion_pyramid.h). Images are unchanged
+        *   @resolve_images : with the packed depth test, false leaves the nearest fragments in device_packed_buffer
+        *   without source occlusion and does not fill the depth and color images, for callers that read the packed
+        *   buffer directly (fused render-to-cost, see fused_costs.cuh)
+        *   Outputs are filled with assign() so vectors reused across calls keep their capacity
         */
         
         const Model::ROI roi= {0, 0, 0, 0};
-        // Create upper and lower limits for model triangles
-        thrust::device_vector<int> device_tris_model_count_low = device_tris_model_count;
-        thrust::device_vector<int> device_tris_model_count_high = device_tris_model_count;
-        thrust::exclusive_scan(
-            device_tris_model_count_low.begin(), device_tris_model_count_low.end(), 
-            device_tris_model_count_low.begin(), 0
-        ); // in-place scan
-        thrust::inclusive_scan(
-            device_tris_model_count_high.begin(), device_tris_model_count_high.end(), 
-            device_tris_model_count_high.begin()
-        ); // in-place scan
+        // Create lower limits for model triangles, these are small so scan on host
+        std::vector<int> tris_model_count(device_tris_model_count.size());
+        thrust::copy(device_tris_model_count.begin(), device_tris_model_count.end(), tris_model_count.begin());
+        std::vector<int> tris_model_count_low(tris_model_count.size(), 0);
+        for (int m = 1; m < tris_model_count.size(); m++)
+            tris_model_count_low[m] = tris_model_count_low[m-1] + tris_model_count[m-1];
+
+        // Group poses by model so that every launch only covers the triangles of one model
+        std::vector<int> pose_model_map(device_pose_model_map.size());
+        thrust::copy(device_pose_model_map.begin(), device_pose_model_map.end(), pose_model_map.begin());
+        std::vector<int> model_pose_offsets, pose_order;
+        group_poses_by_model(pose_model_map, tris_model_count.size(), model_pose_offsets, pose_order);
         printf("Number of triangles : %d\n", device_tris.size());
         printf("Number of poses : %d\n", num_images);
 
-        // Create output vectors 
-        device_pose_occluded.resize(num_images, 0);
-        device_pose_occluded_other.resize(num_images, 0);
-        device_pose_clutter_points.resize(num_images, 0);
-        device_pose_total_points.resize(num_images, 0);
+        // Segmentation label used when available to do occlusion only from another label
+        bool use_segmentation_label = false;
+        if (device_pose_segmentation_label.size() > 0)
+        {
+            //// 6-Dof case, segmentation label between pose and source image pixel would be compared for occlusion checking
+            use_segmentation_label = true ;
+        }
+        printf("use_segmentation_label : %d\n", use_segmentation_label);
+
+        // Culled poses are left out of the launches, their images stay empty. Not done with a single result image,
+        // where occlusion also affects the pixels of other poses, or when occlusion flags/clutter are needed per pose
+        if (use_occlusion_culling && !device_single_result_image && !USE_TREE && !USE_CLUTTER &&
+            device_source_depth.size() == width*height && num_images > 0)
+        {
+            std::vector<occlusion::ModelBox> model_boxes(tris_model_count.size(), occlusion::empty_box());
+            for (int m = 0; m < tris_model_count.size(); m++)
+            {
+                if (tris_model_count[m] == 0) continue;
+                model_boxes[m] = thrust::transform_reduce(device_tris.begin() + tris_model_count_low[m],
+                                                          device_tris.begin() + tris_model_count_low[m] + tris_model_count[m],
+                                                          image_renderer::triangle_box_functor(), occlusion::empty_box(),
+                                                          image_renderer::merge_boxes_functor());
+            }
+            thrust::device_vector<occlusion::ModelBox> device_model_boxes = model_boxes;
+
+            thrust::device_vector<occlusion::DepthCell> device_pyramid(occlusion::pyramid_size(width, height));
+            const int num_levels = occlusion::pyramid_num_levels(width, height);
+            for (int level = 0; level < num_levels; level++)
+            {
+                int cols, rows, offset;
+                occlusion::pyramid_level(width, height, level, cols, rows, offset);
+                image_renderer::build_depth_pyramid<<<(cols*rows + THREADS_PER_BLOCK - 1)/THREADS_PER_BLOCK, THREADS_PER_BLOCK>>>(
+                    thrust::raw_pointer_cast(device_source_depth.data()),
+                    use_segmentation_label ? thrust::raw_pointer_cast(device_source_mask_label.data()) : NULL,
+                    width, height, level, thrust::raw_pointer_cast(device_pyramid.data()));
+            }
 
-        thrust::device_vector<int32_t> device_lock_int(num_images*width*height, 0);
+            thrust::device_vector<int> device_pose_culled(num_images, 0);
+            image_renderer::cull_occluded_poses<<<(num_images + THREADS_PER_BLOCK - 1)/THREADS_PER_BLOCK, THREADS_PER_BLOCK>>>(
+                thrust::raw_pointer_cast(device_poses.data()),
+                thrust::raw_pointer_cast(device_pose_model_map.data()), num_images,
+                thrust::raw_pointer_cast(device_model_boxes.data()),
+                thrust::raw_pointer_cast(device_pyramid.data()),
+                width, height, proj_mat,
+                thrust::raw_pointer_cast(device_pose_segmentation_label.data()), use_segmentation_label,
+                occlusion_threshold, thrust::raw_pointer_cast(device_pose_culled.data()));
+            std::vector<int> pose_culled(num_images);
+            thrust::copy(device_pose_culled.begin(), device_pose_culled.end(), pose_culled.begin());
+
+            // Drop culled poses from the order, offsets stay grouped by model
+            int num_kept = 0;
+            for (int m = 0; m < tris_model_count.size(); m++)
+            {
+                const int model_begin = model_pose_offsets[m];
+                model_pose_offsets[m] = num_kept;
+                for (int order_i = model_begin; order_i < model_pose_offsets[m + 1]; order_i++)
+                {
+                    if (!pose_culled[pose_order[order_i]])
+                        pose_order[num_kept++] = pose_order[order_i];
+                }
+            }
+            model_pose_offsets[tris_model_count.size()] = num_kept;
+            pose_order.resize(num_kept);
+            printf("Poses culled by occlusion with source : %d\n", num_images - num_kept);
+        }
+        thrust::device_vector<int> device_pose_order = pose_order;
+
+        // Create output vectors 
+        device_pose_occluded.assign(num_images, 0);
+        device_pose_occluded_other.assign(num_images, 0);
+        device_pose_clutter_points.assign(num_images, 0);
+        device_pose_total_points.assign(num_images, 0);
+
+        thrust::device_vector<int32_t> device_lock_int;
+        thrust::device_vector<unsigned long long> local_packed_int;
+        thrust::device_vector<unsigned long long>& device_packed_int =
+            (device_packed_buffer != NULL) ? *device_packed_buffer : local_packed_int;
+        if (use_packed_depth_test)
+        {
+            device_packed_int.assign(num_images*width*height, image_renderer::pack_depth_color(INT_MAX, 0, 0, 0));
+        }
+        else
+        {
+            device_lock_int.assign(num_images*width*height, 0);
+        }
         // device_depth_int.clear();
         // device_red_int.clear();
         // device_green_int.clear();
         // device_blue_int.clear();
-        device_depth_int.resize(num_images*width*height, INT_MAX);
-        device_red_int.resize(num_images*width*height, 0);
-        device_green_int.resize(num_images*width*height, 0);
-        device_blue_int.resize(num_images*width*height, 0);
+        const bool write_images = resolve_images || !use_packed_depth_test;
+        if (write_images)
+        {
+            device_depth_int.assign(num_images*width*height, INT_MAX);
+            device_red_int.assign(num_images*width*height, 0);
+            device_green_int.assign(num_images*width*height, 0);
+            device_blue_int.assign(num_images*width*height, 0);
+        }
 
         // Create pointers for Kernel
         const Model::Triangle* device_tris_ptr = thrust::raw_pointer_cast(device_tris.data());
         const Model::mat4x4* device_poses_ptr = thrust::raw_pointer_cast(device_poses.data());
 
-        //// Mapping each pose to model
-        const int* device_pose_model_map_ptr = thrust::raw_pointer_cast(device_pose_model_map.data());
-
-        //// Mapping each model to triangle range
-        int* device_tris_model_count_low_ptr = thrust::raw_pointer_cast(device_tris_model_count_low.data());
-        int* device_tris_model_count_high_ptr = thrust::raw_pointer_cast(device_tris_model_count_high.data());
+        //// Pose indices sorted by model
+        const int* device_pose_order_ptr = thrust::raw_pointer_cast(device_pose_order.data());
 
         int* device_pose_occluded_vec = thrust::raw_pointer_cast(device_pose_occluded.data());
         int* device_pose_occluded_other_vec = thrust::raw_pointer_cast(device_pose_occluded_other.data());
@@ -421,55 +738,75 @@ void image_render(const thrust::device_vector<Model::Triangle>& device_tris,
         
         // Pixel wise segmentation label data of every pixel in source image
         const uint8_t* device_source_mask_label_vec = thrust::raw_pointer_cast(device_source_mask_label.data());
-        // Segmentation label used when available to do occlusion only from another label
-        int* device_pose_segmentation_label_vec = thrust::raw_pointer_cast(device_pose_segmentation_label.data());
-        bool use_segmentation_label = false;
-
-        if (device_pose_segmentation_label.size() > 0)
-        {
-            //// 6-Dof case, segmentation label between pose and source image pixel would be compared for occlusion checking
-            use_segmentation_label = true ;
-        }
-        printf("use_segmentation_label : %d\n", use_segmentation_label);
+        const int* device_pose_segmentation_label_vec = thrust::raw_pointer_cast(device_pose_segmentation_label.data());
 
         // Assign output data
         int32_t* depth_image_vec = thrust::raw_pointer_cast(device_depth_int.data());
-        int32_t* lock_int_vec = thrust::raw_pointer_cast(device_lock_int.data());
+        int32_t* lock_int_vec = use_packed_depth_test ? NULL : thrust::raw_pointer_cast(device_lock_int.data());
+        unsigned long long* packed_image_vec = use_packed_depth_test ? thrust::raw_pointer_cast(device_packed_int.data()) : NULL;
         uint8_t* red_image_vec = thrust::raw_pointer_cast(device_red_int.data());
         uint8_t* green_image_vec = thrust::raw_pointer_cast(device_green_int.data());
         uint8_t* blue_image_vec = thrust::raw_pointer_cast(device_blue_int.data());
 
         stats.peak_memory_usage = std::max(print_cuda_memory_usage(), stats.peak_memory_usage);
 
-        dim3 numBlocks((device_tris.size() + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK, num_images);
-        image_renderer::render_triangle_multi<<<numBlocks, THREADS_PER_BLOCK>>>(device_tris_ptr, device_tris.size(),
-                                                        device_poses_ptr, num_images,
-                                                        depth_image_vec, width, height, 
-                                                        device_pose_model_map_ptr, device_tris_model_count_low_ptr,
-                                                        device_tris_model_count_high_ptr,
-                                                        proj_mat, roi,
-                                                        red_image_vec,green_image_vec,blue_image_vec,
+        for (int model_id = 0; model_id < tris_model_count.size(); model_id++)
+        {
+            const int model_num_poses = model_pose_offsets[model_id + 1] - model_pose_offsets[model_id];
+            if (model_num_poses == 0 || tris_model_count[model_id] == 0) continue;
+            const int model_tris_low = tris_model_count_low[model_id];
+            const int model_tris_high = model_tris_low + tris_model_count[model_id];
+
+            dim3 numBlocks((tris_model_count[model_id] + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK, model_num_poses);
+            image_renderer::render_triangle_multi<<<numBlocks, THREADS_PER_BLOCK>>>(device_tris_ptr, device_tris.size(),
+                                                            device_poses_ptr, num_images,
+                                                            depth_image_vec, width, height, 
+                                                            device_pose_order_ptr + model_pose_offsets[model_id],
+                                                            model_tris_low, model_tris_high,
+                                                            proj_mat, roi,
+                                                            red_image_vec,green_image_vec,blue_image_vec,
+                                                            device_source_depth_vec,
+                                                            device_source_red_vec, device_source_green_vec, device_source_blue_vec,
+                                                            device_pose_occluded_vec,
+                                                            device_single_result_image,
+                                                            lock_int_vec,
+                                                            device_pose_occluded_other_vec,
+                                                            device_pose_clutter_points_vec,
+                                                            device_pose_total_points_vec,
+                                                            device_source_mask_label_vec,
+                                                            device_pose_segmentation_label_vec,
+                                                            use_segmentation_label,
+                                                            occlusion_threshold,
+                                                            packed_image_vec);
+        }
+
+        if (use_packed_depth_test && write_images)
+        {
+            size_t num_pixels = num_images*width*height;
+            dim3 numBlocksResolve((num_pixels + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK, 1);
+            image_renderer::resolve_packed_depth<<<numBlocksResolve, THREADS_PER_BLOCK>>>(packed_image_vec, width, height, num_images,
+                                                        depth_image_vec, red_image_vec, green_image_vec, blue_image_vec,
                                                         device_source_depth_vec,
-                                                        device_source_red_vec, device_source_green_vec, device_source_blue_vec,
-                                                        device_pose_occluded_vec,
-                                                        device_single_result_image,
-                                                        lock_int_vec,
-                                                        device_pose_occluded_other_vec,
-                                                        device_pose_clutter_points_vec,
-                                                        device_pose_total_points_vec,
                                                         device_source_mask_label_vec,
                                                         device_pose_segmentation_label_vec,
                                                         use_segmentation_label,
-                                                        occlusion_threshold);
-
-        thrust::transform(device_depth_int.begin(), device_depth_int.end(), 
-                          device_depth_int.begin(), image_renderer::max2zero_functor_renderer());
-        thrust::transform(device_red_int.begin(), device_red_int.end(),
-                          device_red_int.begin(), image_renderer::max2zero_functor_renderer());
-        thrust::transform(device_green_int.begin(), device_green_int.end(),
-                          device_green_int.begin(), image_renderer::max2zero_functor_renderer());
-        thrust::transform(device_blue_int.begin(), device_blue_int.end(),
-                          device_blue_int.begin(), image_renderer::max2zero_functor_renderer());
+                                                        occlusion_threshold,
+                                                        device_single_result_image,
+                                                        device_pose_occluded_vec,
+                                                        device_pose_occluded_other_vec,
+                                                        device_pose_clutter_points_vec);
+        }
+        else if (!use_packed_depth_test)
+        {
+            thrust::transform(device_depth_int.begin(), device_depth_int.end(), 
+                              device_depth_int.begin(), image_renderer::max2zero_functor_renderer());
+            thrust::transform(device_red_int.begin(), device_red_int.end(),
+                              device_red_int.begin(), image_renderer::max2zero_functor_renderer());
+            thrust::transform(device_green_int.begin(), device_green_int.end(),
+                              device_green_int.begin(), image_renderer::max2zero_functor_renderer());
+            thrust::transform(device_blue_int.begin(), device_blue_int.end(),
+                              device_blue_int.begin(), image_renderer::max2zero_functor_renderer());
+        }
         if (USE_CLUTTER)
         {
             // printf("Pose Clutter Ratio\n");
@@ -0,0 +1,192 @@
+#ifndef CUDA_NEAREST_NEIGHBOR_CUH
+#define CUDA_NEAREST_NEIGHBOR_CUH
+#include <thrust/device_vector.h>
+#include <thrust/sequence.h>
+#include <thrust/sort.h>
+#include <thrust/binary_search.h>
+#include <thrust/gather.h>
+#include <thrust/transform.h>
+#include <thrust/iterator/constant_iterator.h>
+#include <thrust/iterator/counting_iterator.h>
+
+#include "cuda_renderer/model.h"
+#include "cuda_renderer/nearest_neighbor.h"
+
+namespace cuda_renderer {
+namespace nearest_neighbor {
+    __global__ void projective_nearest(nn::ProjectiveGrid grid, const Eigen::Vector3f* observed_points,
+                                       const Eigen::Vector3f* query_points, int num_queries, float radius,
+                                       float* k_distances, int* k_indices)
+    {
+        int i = blockIdx.x*blockDim.x + threadIdx.x;
+        if (i >= num_queries) return;
+        nn::projective_nearest(grid, observed_points, query_points[i], radius, k_distances[i], k_indices[i]);
+    }
+
+    __global__ void sorted_voxel_nearest(const unsigned long long* keys, const Eigen::Vector3f* sorted_points,
+                                         const int* indices, int num_points, float cell_size,
+                                         const Eigen::Vector3f* query_points, const int* query_labels, int num_queries,
+                                         float* k_distances, int* k_indices)
+    {
+        int i = blockIdx.x*blockDim.x + threadIdx.x;
+        if (i >= num_queries) return;
+        nn::sorted_voxel_nearest(keys, sorted_points, indices, num_points, cell_size, query_points[i],
+                                 query_labels == NULL ? -1 : query_labels[i], k_distances[i], k_indices[i]);
+    }
+
+    struct projective_cell_functor{
+        const nn::ProjectiveGrid grid;
+
+        projective_cell_functor(const nn::ProjectiveGrid& _grid) : grid(_grid) {}
+
+        __host__ __device__
+        int operator()(const Eigen::Vector3f& point) const
+        {
+            return nn::projective_cell(grid, point);
+        }
+    };
+
+    struct voxel_key_functor{
+        const float cell_size;
+
+        voxel_key_functor(float _cell_size) : cell_size(_cell_size) {}
+
+        __host__ __device__
+        unsigned long long operator()(const Eigen::Vector3f& point, const int& label) const
+        {
+            int x, y, z;
+            nn::voxel_cell(point, cell_size, x, y, z);
+            return nn::voxel_key(x, y, z, label);
+        }
+    };
+}
+
+nn::ProjectiveGrid build_projective_grid(const thrust::device_vector<Eigen::Vector3f>& observed_points,
+                                         const int width,
+                                         const int height,
+                                         const int stride,
+                                         const float kCameraCX,
+                                         const float kCameraCY,
+                                         const float kCameraFX,
+                                         const float kCameraFY,
+                                         thrust::device_vector<int>& cell_keys,
+                                         thrust::device_vector<int>& cell_offsets,
+                                         thrust::device_vector<int>& cell_points)
+{
+    /*
+     * Grid of the observed points (in the camera frame) for nn::projective_nearest, bucketed by cell with a sort.
+     * cell_keys/cell_offsets/cell_points are scratch buffers kept by the caller, the grid points into them
+     */
+    nn::ProjectiveGrid grid;
+    grid.stride = stride > 0 ? stride : 1;
+    grid.cols = (width + grid.stride - 1) / grid.stride;
+    grid.rows = (height + grid.stride - 1) / grid.stride;
+    grid.fx = kCameraFX;
+    grid.fy = kCameraFY;
+    grid.cx = kCameraCX;
+    grid.cy = kCameraCY;
+    const int num_cells = grid.cols * grid.rows;
+
+    cell_keys.resize(observed_points.size());
+    cell_points.resize(observed_points.size());
+    thrust::transform(observed_points.begin(), observed_points.end(), cell_keys.begin(),
+                      nearest_neighbor::projective_cell_functor(grid));
+    thrust::sequence(cell_points.begin(), cell_points.end());
+    thrust::sort_by_key(cell_keys.begin(), cell_keys.end(), cell_points.begin());
+    cell_offsets.resize(num_cells + 1);
+    thrust::lower_bound(cell_keys.begin(), cell_keys.end(),
+                        thrust::counting_iterator<int>(0), thrust::counting_iterator<int>(num_cells + 1),
+                        cell_offsets.begin());
+    grid.cell_offsets = thrust::raw_pointer_cast(cell_offsets.data());
+    grid.cell_points = thrust::raw_pointer_cast(cell_points.data());
+    return grid;
+}
+
+void projective_knn_search(const thrust::device_vector<Eigen::Vector3f>& query_points,
+                           const thrust::device_vector<Eigen::Vector3f>& observed_points,
+                           const int width,
+                           const int height,
+                           const int stride,
+                           const float kCameraCX,
+                           const float kCameraCY,
+                           const float kCameraFX,
+                           const float kCameraFY,
+                           const float radius,
+                           thrust::device_vector<int>& cell_keys,
+                           thrust::device_vector<int>& cell_offsets,
+                           thrust::device_vector<int>& cell_points,
+                           thrust::device_vector<float>& k_distances,
+                           thrust::device_vector<int>& k_indices)
+{
+    /*
+     * Nearest observed point of every query by projective data association, see nn::projective_nearest.
+     * Both clouds are in the camera frame, the grid is built by build_projective_grid.
+     * @radius - sensor resolution, neighbours within it are exact
+     */
+    printf("projective_knn_search()\n");
+    const nn::ProjectiveGrid grid = build_projective_grid(observed_points, width, height, stride,
+                                                          kCameraCX, kCameraCY, kCameraFX, kCameraFY,
+                                                          cell_keys, cell_offsets, cell_points);
+
+    const int num_queries = query_points.size();
+    k_distances.resize(num_queries);
+    k_indices.resize(num_queries);
+    if (num_queries == 0) return;
+    nearest_neighbor::projective_nearest<<<(num_queries + THREADS_PER_BLOCK - 1)/THREADS_PER_BLOCK, THREADS_PER_BLOCK>>>(
+        grid, thrust::raw_pointer_cast(observed_points.data()),
+        thrust::raw_pointer_cast(query_points.data()), num_queries, radius,
+        thrust::raw_pointer_cast(k_distances.data()), thrust::raw_pointer_cast(k_indices.data()));
+    cudaDeviceSynchronize();
+}
+
+void voxel_hash_knn_search(const thrust::device_vector<Eigen::Vector3f>& query_points,
+                           const thrust::device_vector<int>& query_labels,
+                           const thrust::device_vector<Eigen::Vector3f>& observed_points,
+                           const thrust::device_vector<int>& observed_labels,
+                           const float cell_size,
+                           thrust::device_vector<unsigned long long>& voxel_keys,
+                           thrust::device_vector<int>& voxel_indices,
+                           thrust::device_vector<Eigen::Vector3f>& voxel_points,
+                           thrust::device_vector<float>& k_distances,
+                           thrust::device_vector<int>& k_indices)
+{
+    /*
+     * Nearest observed point of every query with the same label, from a voxel hash of the observed cloud
+     * sorted by key (cpu::VoxelHashNN on the CPU). Labels are ignored if either label vector is empty.
+     * voxel_keys/voxel_indices/voxel_points are scratch buffers kept by the caller.
+     */
+    printf("voxel_hash_knn_search()\n");
+    const bool use_label = query_labels.size() > 0 && observed_labels.size() > 0;
+    const int num_points = observed_points.size();
+    voxel_keys.resize(num_points);
+    voxel_indices.resize(num_points);
+    voxel_points.resize(num_points);
+    if (use_label)
+    {
+        thrust::transform(observed_points.begin(), observed_points.end(), observed_labels.begin(),
+                          voxel_keys.begin(), nearest_neighbor::voxel_key_functor(cell_size));
+    }
+    else
+    {
+        thrust::transform(observed_points.begin(), observed_points.end(), thrust::constant_iterator<int>(-1),
+                          voxel_keys.begin(), nearest_neighbor::voxel_key_functor(cell_size));
+    }
+    thrust::sequence(voxel_indices.begin(), voxel_indices.end());
+    thrust::sort_by_key(voxel_keys.begin(), voxel_keys.end(), voxel_indices.begin());
+    thrust::gather(voxel_indices.begin(), voxel_indices.end(), observed_points.begin(), voxel_points.begin());
+
+    const int num_queries = query_points.size();
+    k_distances.resize(num_queries);
+    k_indices.resize(num_queries);
+    if (num_queries == 0) return;
+    nearest_neighbor::sorted_voxel_nearest<<<(num_queries + THREADS_PER_BLOCK - 1)/THREADS_PER_BLOCK, THREADS_PER_BLOCK>>>(
+        thrust::raw_pointer_cast(voxel_keys.data()), thrust::raw_pointer_cast(voxel_points.data()),
+        thrust::raw_pointer_cast(voxel_indices.data()), num_points, cell_size,
+        thrust::raw_pointer_cast(query_points.data()),
+        use_label ? thrust::raw_pointer_cast(query_labels.data()) : NULL, num_queries,
+        thrust::raw_pointer_cast(k_distances.data()), thrust::raw_pointer_cast(k_indices.data()));
+    cudaDeviceSynchronize();
+}
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <iostream>
 #include <Eigen/Dense>
 #include <algorithm>
+#include <vector>
 #include "math.h"
 
 #include <opencv/cv.h>
@@ -26,6 +27,28 @@ struct gpu_stats {
     double peak_memory_usage;
 };
 
+/*
+ * Groups pose indices by model (counting sort, stable within a model).
+ * Poses of model m are pose_order[model_pose_offsets[m] .. model_pose_offsets[m+1]), so the
+ * renderers only visit the triangles of that model instead of the triangles of every loaded model.
+ */
+inline void group_poses_by_model(const std::vector<int>& pose_model_map,
+                                 const int num_models,
+                                 std::vector<int>& model_pose_offsets,
+                                 std::vector<int>& pose_order)
+{
+    model_pose_offsets.assign(num_models + 1, 0);
+    for (int model_id : pose_model_map)
+        model_pose_offsets[model_id + 1]++;
+    for (int m = 0; m < num_models; m++)
+        model_pose_offsets[m + 1] += model_pose_offsets[m];
+
+    pose_order.resize(pose_model_map.size());
+    std::vector<int> model_fill(model_pose_offsets.begin(), model_pose_offsets.end() - 1);
+    for (int pose_i = 0; pose_i < pose_model_map.size(); pose_i++)
+        pose_order[model_fill[pose_model_map[pose_i]]++] = pose_i;
+}
+
 class Model{
 public:
     Model();
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "cuda_renderer/model.h"
+#include <string>
+#include <vector>
+
+namespace cuda_renderer {
+
+/*
+ * Meshes shared by every render call, referred to by handle in pose_model_map.
+ * Triangles of all registered models are kept concatenated in registration order, which is the
+ * (tris, tris_model_count) layout taken by the renderers, so a model's handle is its index in tris_model_count.
+ * Triangles are only ever appended, the CUDA backend uploads the new tail and never the whole bank again.
+ * Removing a model only deactivates it, its mesh stays resident so requesting it again later is free.
+ * compact() drops inactive meshes, this changes the handles of the models registered after them.
+ */
+class ModelRegistry {
+public:
+    ModelRegistry();
+
+    // Handle of the model registered under name, the mesh is loaded from file_name only if it is not resident
+    int add(const std::string& name, const std::string& file_name);
+    int add(const std::string& name, const Model& model);
+    void remove(int handle);
+    // Deactivates every model, e.g. before registering the models of a new request
+    void remove_all();
+    // Drops the meshes of inactive models, returns true if any handle changed
+    bool compact();
+    void clear();
+
+    // -1 if no model is registered under name
+    int find(const std::string& name) const;
+    bool active(int handle) const { return active_[handle]; }
+    bool empty() const { return tris_.empty(); }
+    int num_models() const { return names_.size(); }
+    size_t inactive_tris() const;
+
+    const std::vector<Model::Triangle>& tris() const { return tris_; }
+    const std::vector<int>& tris_model_count() const { return tris_model_count_; }
+    // Incremented whenever triangles already registered are moved (compact/clear), otherwise new
+    // triangles are only appended at the end
+    int generation() const { return generation_; }
+
+private:
+    std::vector<std::string> names_;
+    std::vector<bool> active_;
+    std::vector<Model::Triangle> tris_;
+    std::vector<int> tris_model_count_;
+    int generation_;
+};
+
+}
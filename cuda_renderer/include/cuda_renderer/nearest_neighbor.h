@@ -0,0 +1,168 @@
+#ifndef CUDA_RENDERER_NEAREST_NEIGHBOR_H
+#define CUDA_RENDERER_NEAREST_NEIGHBOR_H
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <Eigen/Core>
+
+#ifdef __CUDACC__
+#define NN_HOST_DEVICE __host__ __device__
+#else
+#define NN_HOST_DEVICE
+#endif
+
+// Largest number of grid cells searched on each side of a projected point, only reached for points closer
+// to the camera than a few sensor resolutions
+#define PROJECTIVE_NN_MAX_RADIUS 8
+
+namespace cuda_renderer {
+
+// How the cost step finds the observed neighbour of every rendered point
+enum NearestNeighborMode {
+    // GPU : brute force KNN, CPU : voxel hash of the observed cloud
+    NN_BRUTE_FORCE = 0,
+    // Projective data association in the observed image, voxel hash when the search is restricted to labels (6-Dof)
+    NN_PROJECTIVE = 1
+};
+
+namespace nn {
+
+/*
+ * Nearest neighbour searches shared by the CPU and GPU cost steps, both return squared distances.
+ * Costs only use neighbours closer than the sensor resolution, so both searches only guarantee the true
+ * nearest point when it is within that radius and return index -1 when nothing was found.
+ *
+ * Projective association : rendered and observed clouds are back-projected from images of the same camera,
+ * so the observed points are stored in a grid of stride x stride pixel cells, in CSR layout
+ * (cell_offsets has cols*rows + 1 entries, cell_points the observed indices of every cell).
+ * A query is projected into the grid and only the cells its sensor resolution sphere projects onto are searched.
+ */
+struct ProjectiveGrid {
+    int cols;
+    int rows;
+    int stride;
+    float fx;
+    float fy;
+    float cx;
+    float cy;
+    const int* cell_offsets;
+    const int* cell_points;
+};
+
+NN_HOST_DEVICE inline
+int grid_coordinate(float pixel, int stride, int cells){
+    const float c = floorf(pixel/stride + 0.5f);
+    if (!(c >= 0)) return 0;
+    if (c > cells - 1) return cells - 1;
+    return (int) c;
+}
+
+// Cell of an observed point, points projecting outside the image go to the border cells
+NN_HOST_DEVICE inline
+int projective_cell(const ProjectiveGrid& grid, const Eigen::Vector3f& point){
+    const float u = point(0)/point(2)*grid.fx + grid.cx;
+    const float v = point(1)/point(2)*grid.fy + grid.cy;
+    return grid_coordinate(u, grid.stride, grid.cols) + grid_coordinate(v, grid.stride, grid.rows)*grid.cols;
+}
+
+NN_HOST_DEVICE inline
+void projective_nearest(const ProjectiveGrid& grid, const Eigen::Vector3f* observed_points,
+                        const Eigen::Vector3f& query, float radius, float& sq_dist, int& index){
+    sq_dist = FLT_MAX;
+    index = -1;
+    const float z = query(2);
+    if (!(z > 0)) return;
+    const float u = query(0)/z*grid.fx + grid.cx;
+    const float v = query(1)/z*grid.fy + grid.cy;
+
+    // Pixel offset of the projection of any point within radius of the query
+    const float near_z = z - radius;
+    const float ax = query(0)/z, ay = query(1)/z;
+    const float ru = near_z > 0 ? grid.fx*radius*sqrtf(1 + ax*ax)/near_z : FLT_MAX;
+    const float rv = near_z > 0 ? grid.fy*radius*sqrtf(1 + ay*ay)/near_z : FLT_MAX;
+    const float max_offset = (float) (PROJECTIVE_NN_MAX_RADIUS*grid.stride);
+
+    const int col0 = grid_coordinate(u - fminf(ru, max_offset), grid.stride, grid.cols);
+    const int col1 = grid_coordinate(u + fminf(ru, max_offset), grid.stride, grid.cols);
+    const int row0 = grid_coordinate(v - fminf(rv, max_offset), grid.stride, grid.rows);
+    const int row1 = grid_coordinate(v + fminf(rv, max_offset), grid.stride, grid.rows);
+    for (int row = row0; row <= row1; row++)
+    {
+        for (int col = col0; col <= col1; col++)
+        {
+            const int cell = col + row*grid.cols;
+            for (int i = grid.cell_offsets[cell]; i < grid.cell_offsets[cell + 1]; i++)
+            {
+                const int o = grid.cell_points[i];
+                const float d = (observed_points[o] - query).squaredNorm();
+                if (d < sq_dist)
+                {
+                    sq_dist = d;
+                    index = o;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Voxel hash : voxels of the sensor resolution, keyed together with the label of the point (-1 without labels)
+ * so that a query only sees points of its own label. Searching the 27 voxels around a query always finds
+ * the true nearest point within a voxel.
+ */
+NN_HOST_DEVICE inline
+void voxel_cell(const Eigen::Vector3f& point, float cell_size, int& x, int& y, int& z){
+    x = (int) floorf(point(0)/cell_size);
+    y = (int) floorf(point(1)/cell_size);
+    z = (int) floorf(point(2)/cell_size);
+}
+
+// 16 bits per coordinate and label, far away voxels may share a key which only adds candidates
+NN_HOST_DEVICE inline
+unsigned long long voxel_key(int x, int y, int z, int label){
+    return ((unsigned long long)(uint16_t) x) |
+           ((unsigned long long)(uint16_t) y << 16) |
+           ((unsigned long long)(uint16_t) z << 32) |
+           ((unsigned long long)(uint16_t) (label + 1) << 48);
+}
+
+/*
+ * Voxel hash stored as arrays sorted by key : keys[i] is the key of sorted_points[i], which is observed
+ * point indices[i]. Voxels are found by binary search, used where a hash map is not available (GPU).
+ */
+NN_HOST_DEVICE inline
+void sorted_voxel_nearest(const unsigned long long* keys, const Eigen::Vector3f* sorted_points, const int* indices,
+                          int num_points, float cell_size, const Eigen::Vector3f& query, int label,
+                          float& sq_dist, int& index){
+    sq_dist = FLT_MAX;
+    index = -1;
+    int x, y, z;
+    voxel_cell(query, cell_size, x, y, z);
+    for (int dx = -1; dx <= 1; dx++)
+    for (int dy = -1; dy <= 1; dy++)
+    for (int dz = -1; dz <= 1; dz++)
+    {
+        const unsigned long long key = voxel_key(x + dx, y + dy, z + dz, label);
+        int low = 0, high = num_points;
+        while (low < high)
+        {
+            const int mid = (low + high)/2;
+            if (keys[mid] < key) low = mid + 1;
+            else high = mid;
+        }
+        for (int i = low; i < num_points && keys[i] == key; i++)
+        {
+            const float d = (sorted_points[i] - query).squaredNorm();
+            if (d < sq_dist)
+            {
+                sq_dist = d;
+                index = indices[i];
+            }
+        }
+    }
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef CUDA_RENDERER_OBSERVED_EXPLAINED_H
+#define CUDA_RENDERER_OBSERVED_EXPLAINED_H
+#include <cstddef>
+
+#ifdef __CUDACC__
+#define EXPLAINED_HOST_DEVICE __host__ __device__
+#else
+#define EXPLAINED_HOST_DEVICE
+#endif
+
+// Key of a rendered point that explains no observed point in the sparse explained sets
+#define UNEXPLAINED_KEY 0xffffffffffffffffULL
+
+namespace cuda_renderer {
+namespace observed_explained {
+
+/*
+ * Sets of the observed points explained by every pose of a batch, from which the observed cost counts them :
+ * - bit-packed : one bit per (pose, observed point), words(observed_point_num) 32 bit words per pose,
+ *   counted with popcount per word
+ * - sparse : one (pose, observed point) key per rendered point, UNEXPLAINED_KEY if the point explains nothing,
+ *   counted per pose after sorting the keys and dropping duplicates
+ * The sparse set is used when it takes less memory, i.e. when the poses cover few observed points.
+ */
+EXPLAINED_HOST_DEVICE inline
+int words(int observed_point_num){
+    return (observed_point_num + 31) / 32;
+}
+
+EXPLAINED_HOST_DEVICE inline
+size_t word_index(int pose_index, int o_point_index, int observed_explained_words){
+    return (size_t) pose_index * observed_explained_words + o_point_index / 32;
+}
+
+EXPLAINED_HOST_DEVICE inline
+unsigned int bit(int o_point_index){
+    return 1u << (o_point_index % 32);
+}
+
+EXPLAINED_HOST_DEVICE inline
+int popcount(unsigned int word){
+#ifdef __CUDA_ARCH__
+    return __popc(word);
+#else
+    return __builtin_popcount(word);
+#endif
+}
+
+EXPLAINED_HOST_DEVICE inline
+unsigned long long key(int pose_index, int o_point_index, int observed_point_num){
+    return (unsigned long long) pose_index * observed_point_num + o_point_index;
+}
+
+EXPLAINED_HOST_DEVICE inline
+int key_pose(unsigned long long key, int observed_point_num){
+    return (int) (key / (unsigned long long) observed_point_num);
+}
+
+inline size_t bits_bytes(int num_poses, int observed_point_num){
+    return (size_t) num_poses * words(observed_point_num) * sizeof(unsigned int);
+}
+
+inline size_t keys_bytes(int rendered_point_num){
+    return (size_t) rendered_point_num * sizeof(unsigned long long);
+}
+
+inline bool use_keys(int num_poses, int observed_point_num, int rendered_point_num){
+    return keys_bytes(rendered_point_num) < bits_bytes(num_poses, observed_point_num);
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef CUDA_RENDERER_OCCLUSION_PYRAMID_H
+#define CUDA_RENDERER_OCCLUSION_PYRAMID_H
+#include <cmath>
+#include <cfloat>
+#include <climits>
+#include <cstdint>
+
+#include "cuda_renderer/model.h"
+
+#ifdef __CUDACC__
+#define OCCLUSION_HOST_DEVICE __host__ __device__
+#else
+#define OCCLUSION_HOST_DEVICE
+#endif
+
+// Side in pixels of the cells of the finest pyramid level, every coarser level halves the resolution
+#define OCCLUSION_CELL_SIZE 8
+// A pose is tested against the finest level on which its screen rectangle spans at most this many cells per side
+#define OCCLUSION_QUERY_CELLS 4
+
+namespace cuda_renderer {
+namespace occlusion {
+
+/*
+ * Coarse occlusion test of whole poses, shared by the CPU and GPU renderers.
+ * The source depth image is reduced to a min/max depth pyramid and the bounding box of a model, placed at
+ * a pose, is projected to a screen rectangle with the nearest depth of the box. If the source is valid and
+ * farther than the occlusion threshold in front of that depth over the whole rectangle, every fragment of the
+ * pose would be occluded by the source and the rendered image would be empty, so the pose needs no rasterization.
+ * The test is conservative, a pose that is not culled is rendered exactly as before.
+ */
+struct DepthCell {
+    // 0 if any pixel of the cell has no source depth
+    int32_t min_depth;
+    int32_t max_depth;
+    // Bit (label-1)%64 set for every segmentation label present in the cell
+    unsigned long long labels;
+};
+
+struct ModelBox {
+    Model::float3 min;
+    Model::float3 max;
+};
+
+OCCLUSION_HOST_DEVICE inline
+ModelBox empty_box(){
+    return {{FLT_MAX, FLT_MAX, FLT_MAX}, {-FLT_MAX, -FLT_MAX, -FLT_MAX}};
+}
+
+OCCLUSION_HOST_DEVICE inline
+ModelBox merge_boxes(const ModelBox& a, const ModelBox& b){
+    return {
+        {fminf(a.min.x, b.min.x), fminf(a.min.y, b.min.y), fminf(a.min.z, b.min.z)},
+        {fmaxf(a.max.x, b.max.x), fmaxf(a.max.y, b.max.y), fmaxf(a.max.z, b.max.z)}
+    };
+}
+
+OCCLUSION_HOST_DEVICE inline
+ModelBox triangle_box(const Model::Triangle& tri){
+    return {
+        {fminf(tri.v0.x, fminf(tri.v1.x, tri.v2.x)), fminf(tri.v0.y, fminf(tri.v1.y, tri.v2.y)), fminf(tri.v0.z, fminf(tri.v1.z, tri.v2.z))},
+        {fmaxf(tri.v0.x, fmaxf(tri.v1.x, tri.v2.x)), fmaxf(tri.v0.y, fmaxf(tri.v1.y, tri.v2.y)), fmaxf(tri.v0.z, fmaxf(tri.v1.z, tri.v2.z))}
+    };
+}
+
+OCCLUSION_HOST_DEVICE inline
+DepthCell merge_cells(const DepthCell& a, const DepthCell& b){
+    return {
+        a.min_depth < b.min_depth ? a.min_depth : b.min_depth,
+        a.max_depth > b.max_depth ? a.max_depth : b.max_depth,
+        a.labels | b.labels
+    };
+}
+
+// Cells per row and column of a level and its offset in the array holding all levels
+OCCLUSION_HOST_DEVICE inline
+void pyramid_level(int width, int height, int level, int& cols, int& rows, int& offset){
+    offset = 0;
+    cols = (width + OCCLUSION_CELL_SIZE - 1) / OCCLUSION_CELL_SIZE;
+    rows = (height + OCCLUSION_CELL_SIZE - 1) / OCCLUSION_CELL_SIZE;
+    for (int l = 0; l < level; l++)
+    {
+        offset += cols * rows;
+        cols = (cols + 1) / 2;
+        rows = (rows + 1) / 2;
+    }
+}
+
+// Levels down to a single cell
+OCCLUSION_HOST_DEVICE inline
+int pyramid_num_levels(int width, int height){
+    int cols, rows, offset;
+    int levels = 1;
+    pyramid_level(width, height, 0, cols, rows, offset);
+    while (cols > 1 || rows > 1)
+    {
+        cols = (cols + 1) / 2;
+        rows = (rows + 1) / 2;
+        levels++;
+    }
+    return levels;
+}
+
+OCCLUSION_HOST_DEVICE inline
+int pyramid_size(int width, int height){
+    int cols, rows, offset;
+    pyramid_level(width, height, pyramid_num_levels(width, height) - 1, cols, rows, offset);
+    return offset + cols * rows;
+}
+
+// Cell (col, row) of the finest level, from the source pixels it covers
+OCCLUSION_HOST_DEVICE inline
+DepthCell source_cell(const int32_t* source_depth, const uint8_t* source_label,
+                      int width, int height, int col, int row){
+    DepthCell cell = {INT_MAX, 0, 0};
+    const int x_end = (col + 1) * OCCLUSION_CELL_SIZE < width ? (col + 1) * OCCLUSION_CELL_SIZE : width;
+    const int y_end = (row + 1) * OCCLUSION_CELL_SIZE < height ? (row + 1) * OCCLUSION_CELL_SIZE : height;
+    for (int y = row * OCCLUSION_CELL_SIZE; y < y_end; y++)
+    {
+        for (int x = col * OCCLUSION_CELL_SIZE; x < x_end; x++)
+        {
+            const int32_t depth = source_depth[x + y*width];
+            cell.min_depth = depth < cell.min_depth ? depth : cell.min_depth;
+            cell.max_depth = depth > cell.max_depth ? depth : cell.max_depth;
+            if (source_label != NULL && source_label[x + y*width] > 0)
+                cell.labels |= 1ull << ((source_label[x + y*width] - 1) & 63);
+        }
+    }
+    return cell;
+}
+
+// Cell (col, row) of level > 0, from the up to 4 cells it covers on the level below
+OCCLUSION_HOST_DEVICE inline
+DepthCell reduce_cell(const DepthCell* pyramid, int width, int height, int level, int col, int row){
+    int cols, rows, offset;
+    pyramid_level(width, height, level - 1, cols, rows, offset);
+    DepthCell cell = pyramid[offset + 2*col + 2*row*cols];
+    if (2*col + 1 < cols)
+        cell = merge_cells(cell, pyramid[offset + 2*col + 1 + 2*row*cols]);
+    if (2*row + 1 < rows)
+    {
+        cell = merge_cells(cell, pyramid[offset + 2*col + (2*row + 1)*cols]);
+        if (2*col + 1 < cols)
+            cell = merge_cells(cell, pyramid[offset + 2*col + 1 + (2*row + 1)*cols]);
+    }
+    return cell;
+}
+
+/*
+ * True if the source hides every fragment the model can produce at this pose.
+ * Projection and pixel rows follow the rasterizer : viewport transform of the projected corners and
+ * rows flipped when written. @pose_segmentation_label is -1 without segmentation, otherwise source pixels
+ * of the pose's own label never occlude it, so cells containing that label keep the pose.
+ */
+OCCLUSION_HOST_DEVICE inline
+bool pose_occluded_by_source(const DepthCell* pyramid, int width, int height,
+                             const ModelBox& box, const Model::mat4x4& pose, const Model::mat4x4& proj_mat,
+                             int pose_segmentation_label, float occlusion_threshold){
+    float x_min = FLT_MAX, y_min = FLT_MAX, z_min = FLT_MAX;
+    float x_max = -FLT_MAX, y_max = -FLT_MAX;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        const float cx = (corner & 1) ? box.max.x : box.min.x;
+        const float cy = (corner & 2) ? box.max.y : box.min.y;
+        const float cz = (corner & 4) ? box.max.z : box.min.z;
+        const float z = pose.c0*cx + pose.c1*cy + pose.c2*cz + pose.c3;
+        // Box crossing the image plane, projection of the corners does not bound the fragments
+        if (!(z > 0)) return false;
+        const float vx = pose.a0*cx + pose.a1*cy + pose.a2*cz + pose.a3;
+        const float vy = pose.b0*cx + pose.b1*cy + pose.b2*cz + pose.b3;
+        const float px = proj_mat.a0*vx + proj_mat.a1*vy + proj_mat.a2*z + proj_mat.a3;
+        const float py = proj_mat.b0*vx + proj_mat.b1*vy + proj_mat.b2*z + proj_mat.b3;
+        const float sx = px/z*width/2.0f + width/2.0f;
+        const float sy = py/z*height/2.0f + height/2.0f;
+        x_min = fminf(x_min, sx); x_max = fmaxf(x_max, sx);
+        y_min = fminf(y_min, sy); y_max = fmaxf(y_max, sy);
+        z_min = fminf(z_min, z);
+    }
+    if (!(x_min <= x_max && y_min <= y_max)) return false;
+    // Entirely outside the image, nothing is rasterized
+    if (x_max < 0 || y_max < 0 || x_min > width - 1 || y_min > height - 1) return true;
+
+    // One pixel of margin around the projected box
+    const int x0 = (int) fmaxf(0.0f, floorf(x_min) - 1);
+    const int y0 = (int) fmaxf(0.0f, floorf(y_min) - 1);
+    const int x1 = (int) fminf(width - 1, ceilf(x_max) + 1);
+    const int y1 = (int) fminf(height - 1, ceilf(y_max) + 1);
+    const int row0 = height-1 - y1;
+    const int row1 = height-1 - y0;
+
+    const int num_levels = pyramid_num_levels(width, height);
+    int level = 0;
+    int cell_size = OCCLUSION_CELL_SIZE;
+    while (level < num_levels - 1 &&
+           (x1/cell_size - x0/cell_size >= OCCLUSION_QUERY_CELLS || row1/cell_size - row0/cell_size >= OCCLUSION_QUERY_CELLS))
+    {
+        level++;
+        cell_size *= 2;
+    }
+    int cols, rows, offset;
+    pyramid_level(width, height, level, cols, rows, offset);
+
+    // Fragment depths are rounded interpolations of the corner depths, 1 unit of margin for rounding
+    const int32_t nearest_depth = int32_t(z_min + 0.5f) - 1;
+    const float threshold = pose_segmentation_label >= 0 ? 0.5f : occlusion_threshold;
+    for (int row = row0/cell_size; row <= row1/cell_size; row++)
+    {
+        for (int col = x0/cell_size; col <= x1/cell_size; col++)
+        {
+            const DepthCell& cell = pyramid[offset + col + row*cols];
+            if (cell.min_depth <= 0) return false;
+            if (!(nearest_depth - cell.max_depth > threshold)) return false;
+            if (pose_segmentation_label >= 0 && ((cell.labels >> (pose_segmentation_label & 63)) & 1)) return false;
+        }
+    }
+    return true;
+}
+
+}
+}
+
+#endif
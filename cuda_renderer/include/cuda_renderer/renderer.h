@@ -33,6 +33,10 @@
 #include "math.h"
 #include <chrono>
 #include "cuda_renderer/model.h"
+#include "cuda_renderer/model_registry.h"
+#include "cuda_renderer/nearest_neighbor.h"
+#include "cuda_renderer/color_distance.h"
+#include "cuda_renderer/cost_bound.h"
 // #include <fast_gicp/gicp/fast_gicp_cuda.hpp>
 
 
@@ -218,6 +222,96 @@ bool depth2cloud_global(const std::vector<int32_t>& depth_data,
 //         float* &points_diff_cost,
 //         double& peak_memory_usage);
 
+/*
+ * Buffers owned across calls of render_cuda_multi_unified/render_cpu_multi_unified.
+ * Every buffer is sized for a pose capacity (rounded up to a power of two), images of width x height and
+ * clouds of width/stride x height/stride points per pose, so batches up to that size never allocate.
+ * A batch larger than the capacity grows the arenas to the next size class once.
+ * When a context is passed, the host outputs (result_cloud, result_cloud_color, result_dc_index,
+ * result_cloud_pose_map and the costs) point into the context, they stay valid until the next call with
+ * the same context and must not be freed by the caller.
+ * If models are registered in the context, the renderers take the meshes from it (kept on the device by the
+ * CUDA backend) and pose_model_map holds registry handles, the tris/tris_model_count arguments are ignored.
+ */
+class RendererContext {
+public:
+    // Intermediate buffers of the CPU backend and host outputs of both backends
+    struct HostBuffers {
+        std::vector<int> pose_occluded;
+        std::vector<int> pose_occluded_other;
+        std::vector<float> pose_clutter_points;
+        std::vector<float> pose_total_points;
+        std::vector<int32_t> depth_int;
+        std::vector<uint8_t> red_int;
+        std::vector<uint8_t> green_int;
+        std::vector<uint8_t> blue_int;
+
+        std::vector<Eigen::Vector3f> rendered_cloud_eigen;
+        std::vector<float> rendered_point_cloud;
+        std::vector<uint8_t> rendered_point_cloud_color;
+        std::vector<int> rendered_dc_index;
+        std::vector<int> rendered_cloud_pose_map;
+        std::vector<int> rendered_cloud_label;
+        std::vector<float> k_distances;
+        std::vector<int> k_indices;
+        std::vector<float> observed_cloud_lab;
+        std::vector<float> rendered_cost_v;
+        std::vector<float> observed_cost_v;
+        std::vector<float> points_diff_cost_v;
+
+        // Outputs returned to the caller
+        std::vector<float> result_cloud;
+        std::vector<uint8_t> result_cloud_color;
+        std::vector<int> result_dc_index;
+        std::vector<int> result_cloud_pose_map;
+        std::vector<float> rendered_cost;
+        std::vector<float> observed_cost;
+        std::vector<float> points_diff_cost;
+    };
+    // Device buffers of the CUDA backend, defined in renderer.cu
+    struct DeviceBuffers;
+
+    RendererContext();
+    ~RendererContext();
+    RendererContext(const RendererContext&) = delete;
+    RendererContext& operator=(const RendererContext&) = delete;
+
+    // Sizes the arenas for batches of max_poses poses, does nothing if the current size class is enough
+    void reserve(int max_poses, int width, int height, int stride);
+    // Frees all arenas, the next call reserves them again
+    void release();
+
+    int pose_capacity() const { return pose_capacity_; }
+    // Memory held by the arenas in MB
+    double host_memory_usage() const;
+    double device_memory_usage() const { return device_memory_mb_; }
+
+    ModelRegistry models;
+    HostBuffers host;
+    DeviceBuffers* device;
+
+private:
+#ifdef CUDA_ON
+    void reserve_device(size_t num_poses, size_t num_pixels, size_t num_points);
+    void release_device();
+#endif
+    int pose_capacity_;
+    int width_;
+    int height_;
+    int stride_;
+    double device_memory_mb_;
+};
+
+// Whether a FUSED_COST call runs fused on either backend. It falls back to COST with ICP, segmentation labels,
+// a single result image, tree or clutter.
+inline bool runs_fused_cost(const std::string& stage, bool do_icp, bool has_segmentation_labels,
+                            int single_result_image) {
+    return stage.find("FUSED") != std::string::npos && !do_icp && !has_segmentation_labels &&
+           !single_result_image && !USE_TREE && !USE_CLUTTER;
+}
+
+// stage : DEBUG, RENDER, CLOUD, COST or FUSED_COST (costs without materializing the images and rendered clouds,
+// 3-Dof without ICP only, otherwise same as COST)
 void render_cuda_multi_unified(
         const std::string stage, 
         const std::vector<Model::Triangle>& tris,
@@ -265,7 +359,99 @@ void render_cuda_multi_unified(
         float* &rendered_cost,
         float* &observed_cost,
         float* &points_diff_cost,
-        gpu_stats& stats);
+        gpu_stats& stats,
+        // Reused buffers, allocated per call if NULL
+        RendererContext* context = NULL,
+        NearestNeighborMode nn_mode = NN_BRUTE_FORCE,
+        // Lab colors of the observed cloud (color::colors_to_lab of observed_color), converted per call if NULL
+        const float* observed_lab = NULL,
+        // Cost bound of every pose (cost_bound.h), poses that reach it get PRUNED_POSE_COST as rendered cost.
+        // Only applied when the stage runs fused (runs_fused_cost), every cost is computed otherwise
+        const float* pose_cost_bound = NULL);
+
+// CPU backend of the unified flow (OpenMP), same arguments and outputs as render_cuda_multi_unified
+// Available with or without CUDA, do_icp is not supported and returns the input poses
+void render_cpu_multi_unified(
+        const std::string stage,
+        const std::vector<Model::Triangle>& tris,
+        const std::vector<Model::mat4x4>& poses,
+        const std::vector<int> pose_model_map,
+        const std::vector<int> tris_model_count,
+        size_t width, size_t height, const Model::mat4x4& proj_mat,
+        const std::vector<int32_t>& source_depth,
+        const std::vector<std::vector<uint8_t>>& source_color,
+        int single_result_image,
+        std::vector<float>& clutter_cost,
+        const std::vector<uint8_t>& source_mask_label,
+        const std::vector<int>& pose_segmentation_label,
+        int stride,
+        int point_dim,
+        int depth_factor,
+        float kCameraCX,
+        float kCameraCY,
+        float kCameraFX,
+        float kCameraFY,
+        float* observed_depth,
+        Eigen::Vector3f* observed_depth_eigen,
+        uint8_t* observed_color,
+        int observed_point_num,
+        // Cost calculation specific stuff
+        std::vector<float> pose_observed_points_total,
+        int* result_observed_cloud_label,
+        int cost_type,
+        bool calculate_observed_cost,
+        float sensor_resolution,
+        float color_distance_threshold,
+        float occlusion_threshold,
+        bool do_icp,
+        //// Outputs
+        std::vector<int32_t>& result_depth,
+        std::vector<std::vector<uint8_t>>& result_color,
+        float* &result_cloud,
+        uint8_t* &result_cloud_color,
+        int& result_cloud_point_num,
+        int* &result_cloud_pose_map,
+        int* &result_dc_index,
+        // ICP stuff
+        std::vector<Model::mat4x4>& adjusted_poses,
+        // Costs
+        float* &rendered_cost,
+        float* &observed_cost,
+        float* &points_diff_cost,
+        gpu_stats& stats,
+        // Reused buffers, allocated per call if NULL
+        RendererContext* context = NULL,
+        NearestNeighborMode nn_mode = NN_BRUTE_FORCE,
+        // Lab colors of the observed cloud (color::colors_to_lab of observed_color), converted per call if NULL
+        const float* observed_lab = NULL,
+        // Cost bound of every pose (cost_bound.h), poses that reach it get PRUNED_POSE_COST as rendered cost.
+        // Only applied when the stage runs fused (runs_fused_cost), every cost is computed otherwise
+        const float* pose_cost_bound = NULL);
+
+// CPU version of depth2cloud_global
+bool depth2cloud_global_cpu(const std::vector<int32_t>& depth_data,
+                        const std::vector<std::vector<uint8_t>> &color_data,
+                        Eigen::Vector3f* &result_cloud_eigen,
+                        float *&result_cloud,
+                        uint8_t *&result_cloud_color,
+                        int *&dc_index,
+                        int &point_num,
+                        int *&cloud_pose_map,
+                        int *&result_observed_cloud_label,
+                        const int width,
+                        const int height,
+                        const int num_poses,
+                        const std::vector<int>& pose_occluded,
+                        const float kCameraCX,
+                        const float kCameraCY,
+                        const float kCameraFX,
+                        const float kCameraFY,
+                        const float depth_factor,
+                        const int stride,
+                        const int point_dim,
+                        const std::vector<uint8_t>& label_mask_data = std::vector<uint8_t>(),
+                        const std::vector<double>& observed_cloud_bounds = std::vector<double>(),
+                        const Eigen::Matrix4f *camera_transform = NULL);
 
 // #endif
 
@@ -0,0 +1,501 @@
+#include "cuda_renderer/cpu/image_renderer.h"
+#include "cuda_renderer/cpu/compute_point_clouds.h"
+#include "cuda_renderer/cpu/compute_costs.h"
+#include "cuda_renderer/cpu/voxel_hash_nn.h"
+#include "cuda_renderer/cpu/projective_nn.h"
+#include "cuda_renderer/renderer.h"
+
+namespace cuda_renderer {
+
+    // Shared by the CPU and CUDA backends
+    Model::mat4x4 compute_proj(const cv::Mat &K, int width, int height, float near, float far)
+    {
+        Model::mat4x4 p;
+        p.a0 = 2*K.at<float>(0, 0)/width;
+        p.a1 = -2*K.at<float>(0, 1)/width; p.a1 = -p.a1;  // yz flip
+        p.a2 = -2*K.at<float>(0, 2)/width + 1; p.a2 = -p.a2;
+        p.a3 = 0;
+
+        p.b0 = 0;
+        p.b1 = 2*K.at<float>(1, 1)/height; p.b1 = -p.b1;
+        p.b2 = 2*K.at<float>(1, 2)/height - 1; p.b2 = -p.b2;
+        p.b3 = 0;
+
+        p.c0 = 0;
+        p.c1 = 0;
+        p.c2 = -(far+near)/(far-near); p.c2 = -p.c2;
+        p.c3 = -2*far*near/(far-near);
+
+        p.d0 = 0;
+        p.d1 = 0;
+        p.d2 = -1; p.d2 = -p.d2;
+        p.d3 = 0;
+
+        return p;
+    }
+
+    namespace {
+        // Next power of two, the pose capacity of a context only grows in these size classes
+        int pose_size_class(int num_poses)
+        {
+            int size_class = 1;
+            while (size_class < num_poses) size_class *= 2;
+            return size_class;
+        }
+
+        template <typename T>
+        double vector_bytes(const std::vector<T>& v)
+        {
+            return v.capacity() * sizeof(T);
+        }
+
+        // Host output either in the context arena or malloc'd for the caller to free
+        template <typename T>
+        T* host_output(std::vector<T>* arena, size_t size)
+        {
+            if (arena == NULL) return (T*) malloc(size * sizeof(T));
+            arena->resize(size);
+            return arena->data();
+        }
+    }
+
+    RendererContext::RendererContext()
+        : device(NULL), pose_capacity_(0), width_(0), height_(0), stride_(1), device_memory_mb_(0) {}
+
+    RendererContext::~RendererContext()
+    {
+        release();
+    }
+
+    void RendererContext::reserve(int max_poses, int width, int height, int stride)
+    {
+        if (max_poses <= pose_capacity_ && width == width_ && height == height_ && stride == stride_)
+            return;
+
+        pose_capacity_ = pose_size_class(std::max(max_poses, pose_capacity_));
+        width_ = width;
+        height_ = height;
+        stride_ = std::max(stride, 1);
+        const size_t num_pixels = (size_t) pose_capacity_ * width_ * height_;
+        const size_t num_points = (size_t) pose_capacity_ * (width_/stride_) * (height_/stride_);
+        printf("RendererContext::reserve() for %d poses, %d x %d, stride %d\n", pose_capacity_, width_, height_, stride_);
+
+        host.result_cloud.reserve(POINT_DIM * num_points);
+        host.result_cloud_color.reserve(POINT_DIM * num_points);
+        host.result_dc_index.reserve(num_pixels);
+        host.result_cloud_pose_map.reserve(num_points);
+        host.rendered_cost.reserve(pose_capacity_);
+        host.observed_cost.reserve(pose_capacity_);
+        host.points_diff_cost.reserve(pose_capacity_);
+#ifdef CUDA_ON
+        reserve_device(pose_capacity_, num_pixels, num_points);
+#endif
+    }
+
+    void RendererContext::release()
+    {
+        host = HostBuffers();
+#ifdef CUDA_ON
+        release_device();
+#endif
+        pose_capacity_ = 0;
+        width_ = 0;
+        height_ = 0;
+        device_memory_mb_ = 0;
+    }
+
+    double RendererContext::host_memory_usage() const
+    {
+        double bytes = vector_bytes(host.pose_occluded) + vector_bytes(host.pose_occluded_other) +
+                       vector_bytes(host.pose_clutter_points) + vector_bytes(host.pose_total_points) +
+                       vector_bytes(host.depth_int) + vector_bytes(host.red_int) +
+                       vector_bytes(host.green_int) + vector_bytes(host.blue_int) +
+                       vector_bytes(host.rendered_cloud_eigen) + vector_bytes(host.rendered_point_cloud) +
+                       vector_bytes(host.rendered_point_cloud_color) + vector_bytes(host.rendered_dc_index) +
+                       vector_bytes(host.rendered_cloud_pose_map) + vector_bytes(host.rendered_cloud_label) +
+                       vector_bytes(host.k_distances) + vector_bytes(host.k_indices) +
+                       vector_bytes(host.observed_cloud_lab) +
+                       vector_bytes(host.rendered_cost_v) + vector_bytes(host.observed_cost_v) +
+                       vector_bytes(host.points_diff_cost_v) +
+                       vector_bytes(host.result_cloud) + vector_bytes(host.result_cloud_color) +
+                       vector_bytes(host.result_dc_index) + vector_bytes(host.result_cloud_pose_map) +
+                       vector_bytes(host.rendered_cost) + vector_bytes(host.observed_cost) +
+                       vector_bytes(host.points_diff_cost);
+        return bytes/1024.0/1024.0;
+    }
+
+    void render_cpu_multi_unified(
+        const std::string stage,
+        const std::vector<Model::Triangle>& tris,
+        const std::vector<Model::mat4x4>& poses,
+        const std::vector<int> pose_model_map,
+        const std::vector<int> tris_model_count,
+        size_t width, size_t height, const Model::mat4x4& proj_mat,
+        const std::vector<int32_t>& source_depth,
+        const std::vector<std::vector<uint8_t>>& source_color,
+        int single_result_image,
+        std::vector<float>& clutter_cost,
+        const std::vector<uint8_t>& source_mask_label,
+        const std::vector<int>& pose_segmentation_label,
+        int stride,
+        int point_dim,
+        int depth_factor,
+        float kCameraCX,
+        float kCameraCY,
+        float kCameraFX,
+        float kCameraFY,
+        float* observed_depth,
+        Eigen::Vector3f* observed_depth_eigen,
+        uint8_t* observed_color,
+        int observed_point_num,
+        std::vector<float> pose_observed_points_total,
+        int* result_observed_cloud_label,
+        int cost_type,
+        bool calculate_observed_cost,
+        float sensor_resolution,
+        float color_distance_threshold,
+        float occlusion_threshold,
+        bool do_icp,
+        std::vector<int32_t>& result_depth,
+        std::vector<std::vector<uint8_t>>& result_color,
+        float* &result_cloud,
+        uint8_t* &result_cloud_color,
+        int& result_cloud_point_num,
+        int* &result_cloud_pose_map,
+        int* &result_dc_index,
+        std::vector<Model::mat4x4>& adjusted_poses,
+        float* &rendered_cost,
+        float* &observed_cost,
+        float* &points_diff_cost,
+        gpu_stats& stats,
+        RendererContext* context,
+        NearestNeighborMode nn_mode,
+        const float* observed_lab,
+        const float* pose_cost_bound) {
+        /*
+         * CPU backend of render_cuda_multi_unified, same inputs, stages and outputs.
+         * Runs the render, cloud and cost steps with OpenMP and nearest neighbours from a voxel hash of the
+         * observed cloud. GPU ICP (@do_icp) is not available here, poses are returned unadjusted and ICP
+         * should be done by the caller on the clouds returned in the CLOUD stage.
+         * FUSED_COST is handled as COST.
+         * @stats.peak_memory_usage - host memory held by the intermediate buffers in MB
+         * @context - if set, intermediate buffers and host outputs live in the context arenas
+         * @nn_mode - NN_PROJECTIVE searches neighbours in the observed image unless labels restrict the search
+         * @observed_lab - Lab colors of the observed cloud for the color cost, converted here if NULL
+         * @pose_cost_bound - if set, poses are abandoned once their cost reaches the bound (cpu::compute_costs).
+         * Only applied where the CUDA backend applies it (runs_fused_cost), so both return the same costs
+         */
+        printf("---------------------------------------\n");
+        printf("Stage : %s (CPU)\n", stage.c_str());
+        printf("sensor_resolution : %f\n", sensor_resolution);
+        printf("color_distance_threshold : %f\n", color_distance_threshold);
+        printf("cost_type : %d\n", cost_type);
+        printf("stride : %d\n", stride);
+        printf("depth_factor : %d\n", depth_factor);
+        printf("observed_point_num : %d\n", observed_point_num);
+        printf("occlusion_threshold : %f\n", occlusion_threshold);
+        printf("calculate_observed_cost : %d\n", calculate_observed_cost);
+        printf("nn_mode : %d\n", nn_mode);
+        printf("Threads : %d\n", omp_get_max_threads());
+
+        std::chrono::time_point<std::chrono::system_clock> start, end_1, end_2, end_3, end_4;
+        start = std::chrono::system_clock::now();
+        int num_images = poses.size();
+
+        RendererContext::HostBuffers local_buffers;
+        if (context != NULL) context->reserve(num_images, width, height, stride);
+        RendererContext::HostBuffers& buffers = (context != NULL) ? context->host : local_buffers;
+
+        ///////////////////////////////////////////////////////////////
+        // Create candidate pose images
+        std::vector<int>& pose_occluded = buffers.pose_occluded;
+        std::vector<int>& pose_occluded_other = buffers.pose_occluded_other;
+        std::vector<float>& pose_clutter_points = buffers.pose_clutter_points;
+        std::vector<float>& pose_total_points = buffers.pose_total_points;
+        std::vector<int32_t>& depth_int = buffers.depth_int;
+        std::vector<uint8_t>& red_int = buffers.red_int;
+        std::vector<uint8_t>& green_int = buffers.green_int;
+        std::vector<uint8_t>& blue_int = buffers.blue_int;
+        const bool use_registry = context != NULL && !context->models.empty();
+        cpu::image_render(use_registry ? context->models.tris() : tris,
+                          poses,
+                          pose_model_map,
+                          use_registry ? context->models.tris_model_count() : tris_model_count,
+                          source_depth,
+                          source_mask_label,
+                          pose_segmentation_label,
+                          num_images,
+                          width,
+                          height,
+                          proj_mat,
+                          occlusion_threshold,
+                          single_result_image,
+                          pose_occluded,
+                          pose_occluded_other,
+                          pose_clutter_points,
+                          pose_total_points,
+                          depth_int,
+                          red_int,
+                          green_int,
+                          blue_int);
+
+        if (USE_CLUTTER) {
+            std::copy(pose_clutter_points.begin(), pose_clutter_points.end(), clutter_cost.begin());
+        }
+        double buffer_bytes = depth_int.size() * (sizeof(int32_t) + 3 * sizeof(uint8_t));
+        stats.peak_memory_usage = std::max(context != NULL ? context->host_memory_usage() : buffer_bytes/1024.0/1024.0,
+                                           stats.peak_memory_usage);
+
+        end_1 = std::chrono::system_clock::now();
+        std::chrono::duration<double> elapsed_seconds = end_1-start;
+        printf("*************Rendering Images Done**********\n");
+        printf("*************Render time : %f*************\n", elapsed_seconds.count());
+        if (stage.compare("DEBUG") == 0 || stage.compare("RENDER") == 0)
+        {
+            result_depth = depth_int;
+            result_color.push_back(red_int);
+            result_color.push_back(green_int);
+            result_color.push_back(blue_int);
+
+            if (stage.compare("RENDER") == 0) return;
+        }
+        ///////////////////////////////////////////////////////////////
+        // Project to point clouds
+        std::vector<Eigen::Vector3f>& rendered_cloud_eigen = buffers.rendered_cloud_eigen;
+        std::vector<float>&   rendered_point_cloud = buffers.rendered_point_cloud;
+        std::vector<uint8_t>& rendered_point_cloud_color = buffers.rendered_point_cloud_color;
+        std::vector<int>&     rendered_dc_index = buffers.rendered_dc_index;
+        std::vector<int>&     rendered_cloud_pose_map = buffers.rendered_cloud_pose_map;
+        std::vector<int>&     rendered_cloud_label = buffers.rendered_cloud_label;
+        cpu::compute_point_clouds(
+            depth_int,
+            red_int,
+            green_int,
+            blue_int,
+            num_images,
+            width,
+            height,
+            kCameraCX,
+            kCameraCY,
+            kCameraFX,
+            kCameraFY,
+            depth_factor,
+            stride,
+            rendered_cloud_eigen,
+            rendered_point_cloud,
+            rendered_point_cloud_color,
+            result_cloud_point_num,
+            rendered_dc_index,
+            rendered_cloud_pose_map,
+            rendered_cloud_label,
+            NULL,
+            std::vector<uint8_t>(),
+            std::vector<double>(),
+            pose_segmentation_label
+        );
+        buffer_bytes += rendered_dc_index.size() * sizeof(int) +
+                        result_cloud_point_num * (sizeof(Eigen::Vector3f) + point_dim * (sizeof(float) + sizeof(uint8_t)) + 2 * sizeof(int));
+        stats.peak_memory_usage = std::max(context != NULL ? context->host_memory_usage() : buffer_bytes/1024.0/1024.0,
+                                           stats.peak_memory_usage);
+        printf("************Point clouds created*************\n");
+        end_2 = std::chrono::system_clock::now();
+        elapsed_seconds = end_2-end_1;
+        printf("************Cloud contruction time : %f************\n", elapsed_seconds.count());
+
+        if (do_icp)
+        {
+            printf("GPU ICP is not available on the CPU renderer, returning unadjusted poses\n");
+            adjusted_poses = poses;
+        }
+
+        if (stage.compare("DEBUG") == 0 || stage.find("CLOUD") != std::string::npos)
+        {
+            printf("Copying point clouds\n");
+            RendererContext::HostBuffers* outputs = (context != NULL) ? &context->host : NULL;
+            result_cloud = host_output(outputs ? &outputs->result_cloud : NULL, point_dim * result_cloud_point_num);
+            result_cloud_color = host_output(outputs ? &outputs->result_cloud_color : NULL, point_dim * result_cloud_point_num);
+            result_dc_index = host_output(outputs ? &outputs->result_dc_index : NULL, num_images * width * height);
+            result_cloud_pose_map = host_output(outputs ? &outputs->result_cloud_pose_map : NULL, result_cloud_point_num);
+
+            std::copy(rendered_point_cloud.begin(), rendered_point_cloud.end(), result_cloud);
+            std::copy(rendered_point_cloud_color.begin(), rendered_point_cloud_color.end(), result_cloud_color);
+            std::copy(rendered_dc_index.begin(), rendered_dc_index.end(), result_dc_index);
+            std::copy(rendered_cloud_pose_map.begin(), rendered_cloud_pose_map.end(), result_cloud_pose_map);
+
+            if (stage.compare("CLOUD") == 0) return;
+        }
+        // With a context the capacity is kept for the next batch
+        rendered_dc_index.clear();
+        if (context == NULL) rendered_dc_index.shrink_to_fit();
+
+        ///////////////////////////////////////////////////////////////
+        // Nearest neighbour of every rendered point in the observed cloud, restricted to the same label in 6-Dof
+        const bool use_label = !pose_segmentation_label.empty() && result_observed_cloud_label != NULL;
+        std::vector<float>& k_distances = buffers.k_distances;
+        std::vector<int>& k_indices = buffers.k_indices;
+        k_distances.resize(result_cloud_point_num);
+        k_indices.resize(result_cloud_point_num);
+        if (nn_mode == NN_PROJECTIVE && !use_label)
+        {
+            // Both clouds are in the camera frame
+            cpu::ProjectiveNN observed_nn;
+            observed_nn.build(observed_depth_eigen, observed_point_num, width, height, stride,
+                              kCameraFX, kCameraFY, kCameraCX, kCameraCY);
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i < result_cloud_point_num; i++)
+            {
+                observed_nn.nearest(rendered_cloud_eigen[i], sensor_resolution, k_distances[i], k_indices[i]);
+            }
+        }
+        else
+        {
+            cpu::VoxelHashNN observed_nn(sensor_resolution);
+            observed_nn.build(observed_depth_eigen, observed_point_num, use_label ? result_observed_cloud_label : NULL);
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i < result_cloud_point_num; i++)
+            {
+                int label = use_label ? rendered_cloud_label[i] : -1;
+                observed_nn.nearest(rendered_cloud_eigen[i], label, k_distances[i], k_indices[i]);
+            }
+        }
+        printf("*************KNN distances computed**********\n");
+        end_3 = std::chrono::system_clock::now();
+        elapsed_seconds = end_3-end_2;
+        printf("*************KNN time : %f************\n", elapsed_seconds.count());
+        // Square the threshold because KNN distances are actually squares
+        sensor_resolution = sensor_resolution * sensor_resolution;
+
+        ///////////////////////////////////////////////////////////////
+        std::vector<float>& rendered_cost_v = buffers.rendered_cost_v;
+        std::vector<float>& observed_cost_v = buffers.observed_cost_v;
+        std::vector<float>& pose_points_diff_cost_v = buffers.points_diff_cost_v;
+        // Same cost bound contract as the CUDA backend
+        const bool use_cost_bound = runs_fused_cost(stage, do_icp, !pose_segmentation_label.empty(),
+                                                    single_result_image);
+        if (pose_cost_bound != NULL && !use_cost_bound)
+        {
+            printf("Cost bound is only used by the FUSED stage, computing every cost\n");
+        }
+        if (cost_type == 1 && observed_lab == NULL)
+        {
+            buffers.observed_cloud_lab.resize(3 * observed_point_num);
+            color::colors_to_lab(observed_color, observed_point_num, buffers.observed_cloud_lab.data());
+            observed_lab = buffers.observed_cloud_lab.data();
+        }
+        cpu::compute_costs(num_images,
+            cost_type,
+            calculate_observed_cost,
+            sensor_resolution,
+            color_distance_threshold,
+            observed_lab,
+            observed_point_num,
+            rendered_point_cloud_color,
+            rendered_cloud_pose_map,
+            pose_occluded,
+            pose_observed_points_total,
+            result_cloud_point_num,
+            k_distances,
+            k_indices,
+            rendered_cost_v,
+            observed_cost_v,
+            pose_points_diff_cost_v,
+            use_cost_bound ? pose_cost_bound : NULL
+        );
+        if (stage.compare("DEBUG") == 0 || stage.find("COST") != std::string::npos)
+        {
+            RendererContext::HostBuffers* outputs = (context != NULL) ? &context->host : NULL;
+            rendered_cost = host_output(outputs ? &outputs->rendered_cost : NULL, num_images);
+            std::copy(rendered_cost_v.begin(), rendered_cost_v.end(), rendered_cost);
+            if (calculate_observed_cost)
+            {
+                observed_cost = host_output(outputs ? &outputs->observed_cost : NULL, num_images);
+                points_diff_cost = host_output(outputs ? &outputs->points_diff_cost : NULL, num_images);
+                std::copy(observed_cost_v.begin(), observed_cost_v.end(), observed_cost);
+                std::copy(pose_points_diff_cost_v.begin(), pose_points_diff_cost_v.end(), points_diff_cost);
+            }
+        }
+        end_4 = std::chrono::system_clock::now();
+        elapsed_seconds = end_4-end_3;
+        printf("*************Costs computed**********\n");
+        printf("************Cost Computation time : %f************\n", elapsed_seconds.count());
+    }
+
+    bool depth2cloud_global_cpu(const std::vector<int32_t>& depth_data,
+                                const std::vector<std::vector<uint8_t>>& color_data,
+                                Eigen::Vector3f* &result_cloud_eigen,
+                                float* &result_cloud,
+                                uint8_t* &result_cloud_color,
+                                int* &dc_index,
+                                int &rendered_cloud_point_num,
+                                int* &cloud_pose_map,
+                                int* &result_observed_cloud_label,
+                                const int width,
+                                const int height,
+                                const int num_poses,
+                                const std::vector<int>& pose_occluded,
+                                const float kCameraCX,
+                                const float kCameraCY,
+                                const float kCameraFX,
+                                const float kCameraFY,
+                                const float depth_factor,
+                                const int stride,
+                                const int point_dim,
+                                const std::vector<uint8_t>& label_mask_data,
+                                const std::vector<double>& observed_cloud_bounds,
+                                const Eigen::Matrix4f* camera_transform)
+    {
+        printf("depth2cloud_global_cpu()\n");
+        /**
+            CPU version of depth2cloud_global, returns host arrays allocated with malloc in the same layout
+        */
+        std::vector<Eigen::Vector3f> cloud_eigen;
+        std::vector<float>   point_cloud;
+        std::vector<uint8_t> point_cloud_color;
+        std::vector<int>     cloud_dc_index;
+        std::vector<int>     cloud_pose_map_v;
+        std::vector<int>     cloud_label;
+        cpu::compute_point_clouds(
+            depth_data,
+            color_data[0],
+            color_data[1],
+            color_data[2],
+            num_poses,
+            width,
+            height,
+            kCameraCX,
+            kCameraCY,
+            kCameraFX,
+            kCameraFY,
+            depth_factor,
+            stride,
+            cloud_eigen,
+            point_cloud,
+            point_cloud_color,
+            rendered_cloud_point_num,
+            cloud_dc_index,
+            cloud_pose_map_v,
+            cloud_label,
+            camera_transform,
+            label_mask_data,
+            observed_cloud_bounds
+        );
+
+        result_cloud = (float*) malloc(point_dim * rendered_cloud_point_num * sizeof(float));
+        result_cloud_eigen = (Eigen::Vector3f*) malloc(rendered_cloud_point_num * sizeof(Eigen::Vector3f));
+        result_cloud_color = (uint8_t*) malloc(point_dim * rendered_cloud_point_num * sizeof(uint8_t));
+        dc_index = (int*) malloc(num_poses * width * height * sizeof(int));
+        cloud_pose_map = (int*) malloc(rendered_cloud_point_num * sizeof(int));
+        result_observed_cloud_label = (int*) malloc(rendered_cloud_point_num * sizeof(int));
+
+        std::copy(point_cloud.begin(), point_cloud.end(), result_cloud);
+        std::copy(cloud_eigen.begin(), cloud_eigen.end(), result_cloud_eigen);
+        std::copy(point_cloud_color.begin(), point_cloud_color.end(), result_cloud_color);
+        std::copy(cloud_dc_index.begin(), cloud_dc_index.end(), dc_index);
+        std::copy(cloud_pose_map_v.begin(), cloud_pose_map_v.end(), cloud_pose_map);
+        if (label_mask_data.size() > 0)
+        {
+            std::copy(cloud_label.begin(), cloud_label.end(), result_observed_cloud_label);
+        }
+        return true;
+    }
+}
@@ -0,0 +1,254 @@
+/*
+ * Times image_render() with the packed 64 bit depth test against the older per pixel lock
+ * on batches of random poses of one model, and checks that both give the same depth images.
+ * Poses are rendered against a synthetic observation : a few copies of the model in front of a wall,
+ * so that source occlusion, occlusion culling and the occlusion flags are part of the timing.
+ * Usage : render_benchmark <model.ply> [batch_size ...]
+ * Default batch sizes are the gpu_batch_size values used in sbpl_perception/config
+ */
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <Eigen/Geometry>
+
+#include "cuda_renderer/renderer.h"
+#include "cuda_renderer/cuda/image_renderer.cuh"
+
+using namespace cuda_renderer;
+
+// Depth of the wall behind the observed objects, in the cm units of the rendered depth
+static const int32_t kWallDepth = 150;
+static const uint8_t kWallColor = 128;
+
+// Observed image the poses are rendered against
+struct SourceImage
+{
+    thrust::device_vector<int32_t> depth;
+    thrust::device_vector<uint8_t> red;
+    thrust::device_vector<uint8_t> green;
+    thrust::device_vector<uint8_t> blue;
+    thrust::device_vector<uint8_t> mask_label;
+};
+
+// Random poses in front of the camera, depth between min_depth and max_depth meters
+static std::vector<Model::mat4x4> random_poses(int num_poses, double min_depth, double max_depth,
+                                               std::mt19937& generator)
+{
+    std::uniform_real_distribution<float> unit(0.0, 1.0);
+    std::vector<Model::mat4x4> poses(num_poses);
+    for (int n = 0; n < num_poses; n++)
+    {
+        Eigen::Isometry3d pose = Eigen::Isometry3d::Identity();
+        pose.translation() << (unit(generator) - 0.5) * 0.3,
+                              (unit(generator) - 0.5) * 0.3,
+                              min_depth + unit(generator) * (max_depth - min_depth);
+        pose.rotate(Eigen::AngleAxisd(unit(generator) * 2 * M_PI, Eigen::Vector3d::UnitZ()));
+        pose.rotate(Eigen::AngleAxisd(unit(generator) * 2 * M_PI, Eigen::Vector3d::UnitX()));
+        poses[n].init_from_eigen(pose.matrix(), 100);
+    }
+    return poses;
+}
+
+// Renders num_objects copies of the model into a single image and fills the empty pixels with a wall
+static void make_source_image(const thrust::device_vector<Model::Triangle>& device_tris,
+                              const thrust::device_vector<int>& device_tris_model_count,
+                              const int num_objects,
+                              const size_t width,
+                              const size_t height,
+                              const Model::mat4x4& proj_mat,
+                              std::mt19937& generator,
+                              SourceImage& source)
+{
+    thrust::device_vector<Model::mat4x4> device_poses = random_poses(num_objects, 0.8, 1.0, generator);
+    thrust::device_vector<int> device_pose_model_map(num_objects, 0);
+    thrust::device_vector<int32_t> empty_depth(width*height, 0);
+    thrust::device_vector<uint8_t> empty_color(width*height, 0);
+    thrust::device_vector<int> device_pose_segmentation_label;
+    thrust::device_vector<int> device_pose_occluded;
+    thrust::device_vector<int> device_pose_occluded_other;
+    thrust::device_vector<float> device_pose_clutter_points;
+    thrust::device_vector<float> device_pose_total_points;
+    thrust::device_vector<int32_t> device_depth_int;
+    thrust::device_vector<uint8_t> device_red_int;
+    thrust::device_vector<uint8_t> device_green_int;
+    thrust::device_vector<uint8_t> device_blue_int;
+    gpu_stats stats;
+    // Per pixel lock, which handles a single result image in the depth test itself
+    image_render(device_tris,
+                device_poses,
+                device_pose_model_map,
+                device_tris_model_count,
+                empty_depth,
+                empty_color,
+                empty_color,
+                empty_color,
+                empty_color,
+                device_pose_segmentation_label,
+                num_objects,
+                width,
+                height,
+                proj_mat,
+                0.5,
+                1,
+                device_pose_occluded,
+                device_pose_occluded_other,
+                device_pose_clutter_points,
+                device_pose_total_points,
+                device_depth_int,
+                device_red_int,
+                device_green_int,
+                device_blue_int,
+                stats,
+                false,
+                NULL,
+                false);
+
+    std::vector<int32_t> depth(width*height);
+    std::vector<uint8_t> red(width*height), green(width*height), blue(width*height);
+    thrust::copy(device_depth_int.begin(), device_depth_int.begin() + width*height, depth.begin());
+    thrust::copy(device_red_int.begin(), device_red_int.begin() + width*height, red.begin());
+    thrust::copy(device_green_int.begin(), device_green_int.begin() + width*height, green.begin());
+    thrust::copy(device_blue_int.begin(), device_blue_int.begin() + width*height, blue.begin());
+    size_t object_pixels = 0;
+    for (size_t i = 0; i < depth.size(); i++)
+    {
+        if (depth[i] > 0)
+        {
+            object_pixels++;
+            continue;
+        }
+        depth[i] = kWallDepth;
+        red[i] = green[i] = blue[i] = kWallColor;
+    }
+    printf("Source image : %d objects covering %zu of %zu pixels, wall at %d cm\n",
+           num_objects, object_pixels, depth.size(), kWallDepth);
+
+    source.depth = depth;
+    source.red = red;
+    source.green = green;
+    source.blue = blue;
+    source.mask_label.assign(width*height, 0);
+}
+
+static double time_render(const thrust::device_vector<Model::Triangle>& device_tris,
+                          const thrust::device_vector<Model::mat4x4>& device_poses,
+                          const thrust::device_vector<int>& device_pose_model_map,
+                          const thrust::device_vector<int>& device_tris_model_count,
+                          const int num_images,
+                          const size_t width,
+                          const size_t height,
+                          const Model::mat4x4& proj_mat,
+                          const SourceImage& source,
+                          const bool use_packed_depth_test,
+                          thrust::device_vector<int32_t>& device_depth_int)
+{
+    thrust::device_vector<int> device_pose_segmentation_label;
+    thrust::device_vector<int> device_pose_occluded;
+    thrust::device_vector<int> device_pose_occluded_other;
+    thrust::device_vector<float> device_pose_clutter_points;
+    thrust::device_vector<float> device_pose_total_points;
+    thrust::device_vector<uint8_t> device_red_int;
+    thrust::device_vector<uint8_t> device_green_int;
+    thrust::device_vector<uint8_t> device_blue_int;
+    gpu_stats stats;
+    device_depth_int.clear();
+
+    cudaDeviceSynchronize();
+    std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+    image_render(device_tris,
+                device_poses,
+                device_pose_model_map,
+                device_tris_model_count,
+                source.depth,
+                source.red,
+                source.green,
+                source.blue,
+                source.mask_label,
+                device_pose_segmentation_label,
+                num_images,
+                width,
+                height,
+                proj_mat,
+                0.5,
+                0,
+                device_pose_occluded,
+                device_pose_occluded_other,
+                device_pose_clutter_points,
+                device_pose_total_points,
+                device_depth_int,
+                device_red_int,
+                device_green_int,
+                device_blue_int,
+                stats,
+                use_packed_depth_test);
+    cudaDeviceSynchronize();
+    std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+    return elapsed_seconds.count();
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage : render_benchmark <model.ply> [batch_size ...]\n");
+        return 1;
+    }
+    std::vector<int> batch_sizes;
+    for (int i = 2; i < argc; i++) batch_sizes.push_back(atoi(argv[i]));
+    if (batch_sizes.empty()) batch_sizes = {500, 600, 700, 1100};
+
+    Model model(argv[1]);
+    const size_t width = 640;
+    const size_t height = 480;
+    cv::Mat K = (cv::Mat_<float>(3,3) << 619.2578, 0.0, 320.0, 0.0, 619.2578, 240.0, 0.0, 0.0, 1.0);
+    Model::mat4x4 proj_mat = compute_proj(K, width, height);
+
+    thrust::device_vector<Model::Triangle> device_tris = model.tris;
+    std::vector<int> tris_model_count(1, model.tris.size());
+    thrust::device_vector<int> device_tris_model_count = tris_model_count;
+
+    std::mt19937 generator(0);
+    const int warmup_runs = 1;
+    const int timed_runs = 5;
+
+    printf("Triangles : %d\n", (int) model.tris.size());
+    SourceImage source;
+    make_source_image(device_tris, device_tris_model_count, 6, width, height, proj_mat, generator, source);
+    printf("batch_size\tlock (s)\tpacked (s)\tspeedup\tmismatched pixels\n");
+    for (int num_images : batch_sizes)
+    {
+        // In front of, among and behind the observed objects
+        thrust::device_vector<Model::mat4x4> device_poses = random_poses(num_images, 0.6, 1.2, generator);
+        thrust::device_vector<int> device_pose_model_map(num_images, 0);
+
+        thrust::device_vector<int32_t> device_depth_lock;
+        thrust::device_vector<int32_t> device_depth_packed;
+        double lock_time = 0, packed_time = 0;
+        for (int run = 0; run < warmup_runs + timed_runs; run++)
+        {
+            double t_lock = time_render(device_tris, device_poses, device_pose_model_map, device_tris_model_count,
+                                        num_images, width, height, proj_mat, source, false, device_depth_lock);
+            double t_packed = time_render(device_tris, device_poses, device_pose_model_map, device_tris_model_count,
+                                          num_images, width, height, proj_mat, source, true, device_depth_packed);
+            if (run < warmup_runs) continue;
+            lock_time += t_lock;
+            packed_time += t_packed;
+        }
+        lock_time /= timed_runs;
+        packed_time /= timed_runs;
+
+        std::vector<int32_t> depth_lock(device_depth_lock.size());
+        std::vector<int32_t> depth_packed(device_depth_packed.size());
+        thrust::copy(device_depth_lock.begin(), device_depth_lock.end(), depth_lock.begin());
+        thrust::copy(device_depth_packed.begin(), device_depth_packed.end(), depth_packed.begin());
+        size_t mismatched = 0;
+        for (size_t i = 0; i < depth_lock.size(); i++)
+        {
+            if (depth_lock[i] != depth_packed[i]) mismatched++;
+        }
+        printf("%d\t%f\t%f\t%.2fx\t%zu\n", num_images, lock_time, packed_time, lock_time/packed_time, mismatched);
+    }
+    return 0;
+}
@@ -2,6 +2,8 @@
 #include "cuda_renderer/cuda/image_renderer.cuh"
 #include "cuda_renderer/cuda/compute_point_clouds.cuh"
 #include "cuda_renderer/cuda/compute_costs.cuh"
+#include "cuda_renderer/cuda/nearest_neighbor.cuh"
+#include "cuda_renderer/cuda/fused_costs.cuh"
 #include "cuda_renderer/cuda/utils.cuh"
 #include "cuda_renderer/renderer.h"
 #include <fast_gicp/cuda/brute_force_knn.cuh>
@@ -1383,32 +1385,6 @@ namespace cuda_renderer {
 
     // }
     
-    Model::mat4x4 compute_proj(const cv::Mat &K, int width, int height, float near, float far)
-    {
-        Model::mat4x4 p;
-        p.a0 = 2*K.at<float>(0, 0)/width;
-        p.a1 = -2*K.at<float>(0, 1)/width; p.a1 = -p.a1;  // yz flip
-        p.a2 = -2*K.at<float>(0, 2)/width + 1; p.a2 = -p.a2;
-        p.a3 = 0;
-
-        p.b0 = 0;
-        p.b1 = 2*K.at<float>(1, 1)/height; p.b1 = -p.b1;
-        p.b2 = 2*K.at<float>(1, 2)/height - 1; p.b2 = -p.b2;
-        p.b3 = 0;
-
-        p.c0 = 0;
-        p.c1 = 0;
-        p.c2 = -(far+near)/(far-near); p.c2 = -p.c2;
-        p.c3 = -2*far*near/(far-near);
-
-        p.d0 = 0;
-        p.d1 = 0;
-        p.d2 = -1; p.d2 = -p.d2;
-        p.d3 = 0;
-
-        return p;
-    }
-
     struct concatenate_transforms{
 
         concatenate_transforms(){}
@@ -1428,6 +1404,224 @@ namespace cuda_renderer {
         }
     };
 
+    // Host output either in the context arena or malloc'd for the caller to free
+    template <typename T>
+    static T* host_output(std::vector<T>* arena, size_t size)
+    {
+        if (arena == NULL) return (T*) malloc(size * sizeof(T));
+        arena->resize(size);
+        return arena->data();
+    }
+
+    struct RendererContext::DeviceBuffers {
+        // Meshes of the context ModelRegistry, generation of the registry they were uploaded from
+        thrust::device_vector<Model::Triangle> model_tris;
+        thrust::device_vector<int> model_tris_count;
+        int model_generation = -1;
+
+        // Inputs
+        thrust::device_vector<Model::Triangle> tris;
+        thrust::device_vector<Model::mat4x4> poses;
+        thrust::device_vector<Model::mat4x4> poses_adjusted;
+        thrust::device_vector<int> tris_model_count;
+        thrust::device_vector<int> pose_model_map;
+        thrust::device_vector<int> pose_segmentation_label;
+        thrust::device_vector<int32_t> source_depth;
+        thrust::device_vector<uint8_t> source_color_red;
+        thrust::device_vector<uint8_t> source_color_green;
+        thrust::device_vector<uint8_t> source_color_blue;
+        thrust::device_vector<uint8_t> source_mask_label;
+
+        // Images
+        thrust::device_vector<int> pose_occluded;
+        thrust::device_vector<int> pose_occluded_other;
+        thrust::device_vector<float> pose_clutter_points;
+        thrust::device_vector<float> pose_total_points;
+        thrust::device_vector<unsigned long long> packed_int;
+        thrust::device_vector<int32_t> depth_int;
+        thrust::device_vector<uint8_t> red_int;
+        thrust::device_vector<uint8_t> green_int;
+        thrust::device_vector<uint8_t> blue_int;
+
+        // Rendered clouds
+        thrust::device_vector<float> rendered_point_cloud;
+        thrust::device_vector<uint8_t> rendered_point_cloud_color;
+        thrust::device_vector<int> rendered_dc_index;
+        thrust::device_vector<int> rendered_cloud_pose_map;
+        thrust::device_vector<int> rendered_cloud_label;
+        thrust::device_vector<Eigen::Vector3f> rendered_cloud_eigen;
+
+        // Observed cloud and costs
+        thrust::device_vector<Eigen::Vector3f> observed_cloud_eigen;
+        thrust::device_vector<int> observed_cloud_label;
+        thrust::device_vector<int> observed_label_indices;
+        thrust::device_vector<uint8_t> observed_cloud_color;
+        thrust::device_vector<float> observed_cloud_lab;
+        thrust::device_vector<thrust::pair<float, int>> k_neighbors;
+        // Scratch of the projective and voxel hash searches
+        thrust::device_vector<int> nn_cell_keys;
+        thrust::device_vector<int> nn_cell_offsets;
+        thrust::device_vector<int> nn_cell_points;
+        thrust::device_vector<unsigned long long> nn_voxel_keys;
+        thrust::device_vector<int> nn_voxel_indices;
+        thrust::device_vector<Eigen::Vector3f> nn_voxel_points;
+        thrust::device_vector<float> k_distances;
+        thrust::device_vector<int> k_indices;
+        thrust::device_vector<float> poses_observed_points_total;
+        thrust::device_vector<float> rendered_cost;
+        thrust::device_vector<float> observed_cost;
+        thrust::device_vector<float> points_diff_cost;
+    };
+
+    template <typename T>
+    static double device_vector_bytes(const thrust::device_vector<T>& v)
+    {
+        return v.capacity() * sizeof(T);
+    }
+
+    // Brings the device copy of the registered meshes up to date, only triangles registered since the last
+    // call are uploaded unless the registry was compacted
+    static void upload_models(const ModelRegistry& models, RendererContext::DeviceBuffers& buffers)
+    {
+        const std::vector<Model::Triangle>& tris = models.tris();
+        if (buffers.model_generation != models.generation() || buffers.model_tris.size() > tris.size())
+        {
+            buffers.model_tris.assign(tris.begin(), tris.end());
+            buffers.model_generation = models.generation();
+        }
+        else if (buffers.model_tris.size() < tris.size())
+        {
+            printf("Uploading %d new model triangles\n", (int) (tris.size() - buffers.model_tris.size()));
+            buffers.model_tris.insert(buffers.model_tris.end(), tris.begin() + buffers.model_tris.size(), tris.end());
+        }
+        buffers.model_tris_count.assign(models.tris_model_count().begin(), models.tris_model_count().end());
+    }
+
+    // Lab colors of the observed cloud for the color cost, from the caller if it converted them once for the scene
+    static void upload_observed_lab(int cost_type, const uint8_t* observed_color, const float* observed_lab,
+                                    int observed_point_num, int point_dim, RendererContext::DeviceBuffers& buffers)
+    {
+        thrust::device_vector<uint8_t>& observed_cloud_color = buffers.observed_cloud_color;
+        observed_cloud_color.assign(observed_color, observed_color + point_dim * observed_point_num);
+        thrust::device_vector<float>& observed_cloud_lab = buffers.observed_cloud_lab;
+        if (cost_type == 1)
+        {
+            observed_cloud_lab.resize(3 * observed_point_num);
+            if (observed_lab != NULL)
+            {
+                thrust::copy(observed_lab, observed_lab + 3 * observed_point_num, observed_cloud_lab.begin());
+            }
+            else if (observed_point_num > 0)
+            {
+                cost_computation::colors_to_lab<<<(observed_point_num + THREADS_PER_BLOCK - 1)/THREADS_PER_BLOCK, THREADS_PER_BLOCK>>>(
+                    thrust::raw_pointer_cast(observed_cloud_color.data()), observed_point_num,
+                    thrust::raw_pointer_cast(observed_cloud_lab.data()));
+            }
+        }
+    }
+
+    static void copy_costs_to_host(int num_images, bool calculate_observed_cost,
+                                   const RendererContext::DeviceBuffers& buffers,
+                                   RendererContext::HostBuffers* host_outputs,
+                                   float* &rendered_cost, float* &observed_cost, float* &points_diff_cost)
+    {
+        printf("Copying rendered cost to CPU\n");
+        rendered_cost = host_output(host_outputs ? &host_outputs->rendered_cost : NULL, num_images);
+        cudaMemcpy(rendered_cost, thrust::raw_pointer_cast(buffers.rendered_cost.data()), num_images * sizeof(float), cudaMemcpyDeviceToHost);
+        if (calculate_observed_cost)
+        {
+            printf("Copying observed cost to CPU\n");
+            observed_cost = host_output(host_outputs ? &host_outputs->observed_cost : NULL, num_images);
+            points_diff_cost = host_output(host_outputs ? &host_outputs->points_diff_cost : NULL, num_images);
+
+            cudaMemcpy(observed_cost, thrust::raw_pointer_cast(buffers.observed_cost.data()), num_images * sizeof(float), cudaMemcpyDeviceToHost);
+            cudaMemcpy(points_diff_cost, thrust::raw_pointer_cast(buffers.points_diff_cost.data()), num_images * sizeof(float), cudaMemcpyDeviceToHost);
+        }
+    }
+
+    void RendererContext::reserve_device(size_t num_poses, size_t num_pixels, size_t num_points)
+    {
+        if (device == NULL) device = new DeviceBuffers();
+        DeviceBuffers& d = *device;
+        const size_t image_pixels = num_pixels / num_poses;
+        const size_t image_points = num_points / num_poses;
+
+        d.poses.reserve(num_poses);
+        d.pose_model_map.reserve(num_poses);
+        d.pose_segmentation_label.reserve(num_poses);
+        d.source_depth.reserve(image_pixels);
+        d.source_color_red.reserve(image_pixels);
+        d.source_color_green.reserve(image_pixels);
+        d.source_color_blue.reserve(image_pixels);
+        d.source_mask_label.reserve(image_pixels);
+
+        d.pose_occluded.reserve(num_poses);
+        d.pose_occluded_other.reserve(num_poses);
+        d.pose_clutter_points.reserve(num_poses);
+        d.pose_total_points.reserve(num_poses);
+        d.packed_int.reserve(num_pixels);
+        d.depth_int.reserve(num_pixels);
+        d.red_int.reserve(num_pixels);
+        d.green_int.reserve(num_pixels);
+        d.blue_int.reserve(num_pixels);
+
+        d.rendered_point_cloud.reserve(POINT_DIM * num_points);
+        d.rendered_point_cloud_color.reserve(POINT_DIM * num_points);
+        d.rendered_dc_index.reserve(num_pixels);
+        d.rendered_cloud_pose_map.reserve(num_points);
+        d.rendered_cloud_label.reserve(num_points);
+        d.rendered_cloud_eigen.reserve(num_points);
+
+        d.observed_cloud_eigen.reserve(image_points);
+        d.observed_cloud_label.reserve(image_points);
+        d.observed_cloud_color.reserve(POINT_DIM * image_points);
+        d.observed_cloud_lab.reserve(3 * image_points);
+        d.k_neighbors.reserve(num_points);
+        d.nn_cell_keys.reserve(image_points);
+        d.nn_cell_offsets.reserve(image_points + 1);
+        d.nn_cell_points.reserve(image_points);
+        d.nn_voxel_keys.reserve(image_points);
+        d.nn_voxel_indices.reserve(image_points);
+        d.nn_voxel_points.reserve(image_points);
+        d.k_distances.reserve(num_points);
+        d.k_indices.reserve(num_points);
+        d.poses_observed_points_total.reserve(num_poses);
+        d.rendered_cost.reserve(num_poses);
+        d.observed_cost.reserve(num_poses);
+        d.points_diff_cost.reserve(num_poses);
+
+        double bytes = device_vector_bytes(d.tris) + device_vector_bytes(d.poses) + device_vector_bytes(d.poses_adjusted) +
+                       device_vector_bytes(d.tris_model_count) + device_vector_bytes(d.pose_model_map) +
+                       device_vector_bytes(d.pose_segmentation_label) + device_vector_bytes(d.source_depth) +
+                       device_vector_bytes(d.source_color_red) + device_vector_bytes(d.source_color_green) +
+                       device_vector_bytes(d.source_color_blue) + device_vector_bytes(d.source_mask_label) +
+                       device_vector_bytes(d.pose_occluded) + device_vector_bytes(d.pose_occluded_other) +
+                       device_vector_bytes(d.pose_clutter_points) + device_vector_bytes(d.pose_total_points) +
+                       device_vector_bytes(d.packed_int) + device_vector_bytes(d.depth_int) +
+                       device_vector_bytes(d.red_int) + device_vector_bytes(d.green_int) + device_vector_bytes(d.blue_int) +
+                       device_vector_bytes(d.rendered_point_cloud) + device_vector_bytes(d.rendered_point_cloud_color) +
+                       device_vector_bytes(d.rendered_dc_index) + device_vector_bytes(d.rendered_cloud_pose_map) +
+                       device_vector_bytes(d.rendered_cloud_label) + device_vector_bytes(d.rendered_cloud_eigen) +
+                       device_vector_bytes(d.observed_cloud_eigen) + device_vector_bytes(d.observed_cloud_label) +
+                       device_vector_bytes(d.observed_label_indices) + device_vector_bytes(d.observed_cloud_color) +
+                       device_vector_bytes(d.observed_cloud_lab) +
+                       device_vector_bytes(d.k_neighbors) + device_vector_bytes(d.nn_cell_keys) +
+                       device_vector_bytes(d.nn_cell_offsets) + device_vector_bytes(d.nn_cell_points) +
+                       device_vector_bytes(d.nn_voxel_keys) + device_vector_bytes(d.nn_voxel_indices) +
+                       device_vector_bytes(d.nn_voxel_points) + device_vector_bytes(d.k_distances) +
+                       device_vector_bytes(d.k_indices) + device_vector_bytes(d.poses_observed_points_total) +
+                       device_vector_bytes(d.rendered_cost) + device_vector_bytes(d.observed_cost) +
+                       device_vector_bytes(d.points_diff_cost);
+        device_memory_mb_ = bytes/1024.0/1024.0;
+        printf("RendererContext device arenas : %f MB\n", device_memory_mb_);
+    }
+
+    void RendererContext::release_device()
+    {
+        delete device;
+        device = NULL;
+    }
+
     void render_cuda_multi_unified(
         const std::string stage,
         const std::vector<Model::Triangle>& tris,
@@ -1471,12 +1665,18 @@ namespace cuda_renderer {
         float* &rendered_cost,
         float* &observed_cost,
         float* &points_diff_cost,
-        gpu_stats& stats) {
+        gpu_stats& stats,
+        RendererContext* context,
+        NearestNeighborMode nn_mode,
+        const float* observed_lab,
+        const float* pose_cost_bound) {
         /* 
          * Currently doesnt support pose occlusion or pose occlusion 'other'. Takes the observed point cloud as input.
          * Inputs :
          * - @tris  : mesh triangles from all models concatenated into a vector
          * - @stage : can be DEBUG (copied everything), RENDER to return images, CLOUD to return clouds, COST to do whole flow and return costs
+         *   FUSED_COST returns the costs of COST from one kernel over the z-buffer, without building images or rendered clouds
+         *   (see fused_costs.cuh). Only for 3-Dof without ICP, single result image, tree or clutter, otherwise same as COST
          * - @poses : Set of candidate poses
          * - @pose_model_map    : mapping of every pose to a model
          * - @tris_model_count : total number of triangles in every model
@@ -1499,6 +1699,11 @@ namespace cuda_renderer {
          * - @calculate_observed_cost - set to true to calculate observed cost (in 3dof or 6dof)
          * - @occlusion_threshold - used to prevent very close depth points in input from occluding rendered points 
          * - @do_icp - set to true to parallel GICP on GPU
+         * - @nn_mode - NN_BRUTE_FORCE for brute force KNN, NN_PROJECTIVE for projective association
+         *   (voxel hash when the search is restricted to labels in 6-Dof)
+         * - @observed_lab - Lab colors of the observed cloud for cost_type 1, converted on the GPU if NULL
+         * - @pose_cost_bound - cost bound of every pose, poses reaching it get PRUNED_POSE_COST. Only applied
+         *   when FUSED_COST runs fused (runs_fused_cost)
          * Ouputs :
          * - @result_cloud - the set of all rendered point clouds as a float (row-major indexing) (copied if stage was CLOUD/DEBUG)
          * - @result_cloud_color - the set of all rendered point cloud color values (row-major indexing) (copied if stage was CLOUD/DEBUG)
@@ -1507,6 +1712,7 @@ namespace cuda_renderer {
          * - @adjusted_poses - the GICP adjusted poses (copied if ICP was done on GPU)
          * - @rendered_cost/observed_cost/points_diff_cost - various costs 
          * - @stats - runtime, rendered count etc.
+         * - @context - if set, device buffers and host outputs live in the context arenas and are reused by the next call
          */
         
         printf("---------------------------------------\n");
@@ -1527,37 +1733,72 @@ namespace cuda_renderer {
         start = std::chrono::system_clock::now();
         int num_images = poses.size();
 
+        // Buffers come from the context if given, otherwise they are allocated for this call only
+        RendererContext::DeviceBuffers local_buffers;
+        if (context != NULL) context->reserve(num_images, width, height, stride);
+        RendererContext::DeviceBuffers& buffers = (context != NULL) ? *context->device : local_buffers;
+        RendererContext::HostBuffers* host_outputs = (context != NULL) ? &context->host : NULL;
+
         // Create candidate pose images
-        //// Copy things to GPU
-        thrust::device_vector<Model::Triangle> device_tris = tris;
-        thrust::device_vector<Model::mat4x4> device_poses = poses;
+        //// Copy things to GPU, assign() reuses the capacity of the buffers
+        //// Registered meshes are already on the GPU, otherwise the triangles of this call are uploaded
+        const bool use_registry = context != NULL && !context->models.empty();
+        if (use_registry)
+        {
+            upload_models(context->models, buffers);
+        }
+        else
+        {
+            buffers.tris.assign(tris.begin(), tris.end());
+            buffers.tris_model_count.assign(tris_model_count.begin(), tris_model_count.end());
+        }
+        const thrust::device_vector<Model::Triangle>& device_tris = use_registry ? buffers.model_tris : buffers.tris;
+        thrust::device_vector<Model::mat4x4>& device_poses = buffers.poses;
+        device_poses.assign(poses.begin(), poses.end());
         //// Every index maps a model id to a range of triangles in the triangle vector 
-        thrust::device_vector<int> device_tris_model_count_low = tris_model_count;
-        thrust::device_vector<int> device_tris_model_count_high = tris_model_count;
-        thrust::device_vector<int> device_pose_model_map = pose_model_map;
-        thrust::device_vector<int> device_pose_segmentation_label = pose_segmentation_label;
-
-        thrust::device_vector<int32_t> device_source_depth = source_depth;
-        thrust::device_vector<uint8_t> device_source_color_red = source_color[0];
-        thrust::device_vector<uint8_t> device_source_color_green = source_color[1];
-        thrust::device_vector<uint8_t> device_source_color_blue = source_color[2];
-        thrust::device_vector<uint8_t> device_source_mask_label = source_mask_label;
+        const thrust::device_vector<int>& device_tris_model_count_low = use_registry ? buffers.model_tris_count : buffers.tris_model_count;
+        thrust::device_vector<int>& device_pose_model_map = buffers.pose_model_map;
+        thrust::device_vector<int>& device_pose_segmentation_label = buffers.pose_segmentation_label;
+        device_pose_model_map.assign(pose_model_map.begin(), pose_model_map.end());
+        device_pose_segmentation_label.assign(pose_segmentation_label.begin(), pose_segmentation_label.end());
+
+        thrust::device_vector<int32_t>& device_source_depth = buffers.source_depth;
+        thrust::device_vector<uint8_t>& device_source_color_red = buffers.source_color_red;
+        thrust::device_vector<uint8_t>& device_source_color_green = buffers.source_color_green;
+        thrust::device_vector<uint8_t>& device_source_color_blue = buffers.source_color_blue;
+        thrust::device_vector<uint8_t>& device_source_mask_label = buffers.source_mask_label;
+        device_source_depth.assign(source_depth.begin(), source_depth.end());
+        device_source_color_red.assign(source_color[0].begin(), source_color[0].end());
+        device_source_color_green.assign(source_color[1].begin(), source_color[1].end());
+        device_source_color_blue.assign(source_color[2].begin(), source_color[2].end());
+        device_source_mask_label.assign(source_mask_label.begin(), source_mask_label.end());
 
         size_t real_width = width;
         size_t real_height = height;
 
         ///////////////////////////////////////////////////////////////
         // Create  image render device outputs
-        thrust::device_vector<int> device_pose_occluded;
-        thrust::device_vector<int> device_pose_occluded_other;
-        thrust::device_vector<float> device_pose_clutter_points;
-        thrust::device_vector<float> device_pose_total_points;
-
-        thrust::device_vector<int32_t> device_depth_int;
-        thrust::device_vector<int32_t> device_lock_int;
-        thrust::device_vector<uint8_t> device_red_int;
-        thrust::device_vector<uint8_t> device_green_int;
-        thrust::device_vector<uint8_t> device_blue_int;
+        thrust::device_vector<int>& device_pose_occluded = buffers.pose_occluded;
+        thrust::device_vector<int>& device_pose_occluded_other = buffers.pose_occluded_other;
+        thrust::device_vector<float>& device_pose_clutter_points = buffers.pose_clutter_points;
+        thrust::device_vector<float>& device_pose_total_points = buffers.pose_total_points;
+
+        thrust::device_vector<int32_t>& device_depth_int = buffers.depth_int;
+        thrust::device_vector<uint8_t>& device_red_int = buffers.red_int;
+        thrust::device_vector<uint8_t>& device_green_int = buffers.green_int;
+        thrust::device_vector<uint8_t>& device_blue_int = buffers.blue_int;
+
+        // Fused render-to-cost : costs straight from the z-buffer, without images or rendered clouds
+        const bool use_fused = runs_fused_cost(stage, do_icp, device_pose_segmentation_label.size() > 0,
+                                               single_result_image);
+        if (!use_fused && stage.find("FUSED") != std::string::npos)
+        {
+            printf("FUSED stage needs 3-Dof without ICP, single result image, tree or clutter, using the unfused flow\n");
+        }
+        if (pose_cost_bound != NULL && !use_fused)
+        {
+            printf("Cost bound is only used by the FUSED stage, computing every cost\n");
+        }
         image_render(device_tris,
                     device_poses,
                     device_pose_model_map,
@@ -1582,7 +1823,11 @@ namespace cuda_renderer {
                     device_red_int,
                     device_green_int,
                     device_blue_int,
-                    stats);
+                    stats,
+                    true,
+                    &buffers.packed_int,
+                    true,
+                    !use_fused);
                     
         if (USE_CLUTTER) {
             thrust::copy(device_pose_clutter_points.begin(), device_pose_clutter_points.end(), clutter_cost.begin());
@@ -1591,6 +1836,54 @@ namespace cuda_renderer {
         std::chrono::duration<double> elapsed_seconds = end_1-start;
         printf("*************Rendering Images Done**********\n");
         printf("*************Render time : %f*************\n", elapsed_seconds.count());
+        if (use_fused)
+        {
+            buffers.observed_cloud_eigen.assign(observed_depth_eigen, observed_depth_eigen + observed_point_num);
+            upload_observed_lab(cost_type, observed_color, observed_lab, observed_point_num, point_dim, buffers);
+            buffers.poses_observed_points_total.assign(pose_observed_points_total.begin(), pose_observed_points_total.end());
+            compute_costs_fused(num_images,
+                cost_type,
+                calculate_observed_cost,
+                sensor_resolution,
+                color_distance_threshold,
+                occlusion_threshold,
+                buffers.packed_int,
+                device_source_depth,
+                width,
+                height,
+                stride,
+                kCameraCX,
+                kCameraCY,
+                kCameraFX,
+                kCameraFY,
+                depth_factor,
+                buffers.observed_cloud_eigen,
+                buffers.observed_cloud_lab,
+                observed_point_num,
+                device_pose_occluded,
+                buffers.poses_observed_points_total,
+                buffers.nn_cell_keys,
+                buffers.nn_cell_offsets,
+                buffers.nn_cell_points,
+                result_cloud_point_num,
+                buffers.rendered_cost,
+                buffers.observed_cost,
+                buffers.points_diff_cost,
+                stats,
+                pose_cost_bound
+            );
+            copy_costs_to_host(num_images, calculate_observed_cost, buffers, host_outputs,
+                               rendered_cost, observed_cost, points_diff_cost);
+            end_4 = std::chrono::system_clock::now();
+            elapsed_seconds = end_4-end_1;
+            printf("*************Fused costs computed**********\n");
+            printf("************Fused Cost Computation time : %f************\n", elapsed_seconds.count());
+            if (context != NULL)
+            {
+                stats.peak_memory_usage = std::max(context->device_memory_usage(), stats.peak_memory_usage);
+            }
+            return;
+        }
         if (stage.compare("DEBUG") == 0 || stage.compare("RENDER") == 0)
         {
             printf("Copying images to CPU\n");
@@ -1618,15 +1911,12 @@ namespace cuda_renderer {
         const unsigned int size_of_float = sizeof(float);
         const unsigned int size_of_int   = sizeof(int);
         const unsigned int size_of_uint   = sizeof(uint8_t);
-        float* cuda_cloud;
-        size_t query_pitch_in_bytes;
-        thrust::device_vector<float>   rendered_point_cloud;
-        thrust::device_vector<uint8_t> rendered_point_cloud_color;
-        thrust::device_vector<int>     rendered_dc_index;
-        thrust::device_vector<int>     rendered_cloud_pose_map;
-        thrust::device_vector<int>     rendered_cloud_label;
-        thrust::device_vector<int>     dummy_vec;
-        thrust::device_vector<Eigen::Vector3f> result_cloud_eigen;
+        thrust::device_vector<float>&   rendered_point_cloud = buffers.rendered_point_cloud;
+        thrust::device_vector<uint8_t>& rendered_point_cloud_color = buffers.rendered_point_cloud_color;
+        thrust::device_vector<int>&     rendered_dc_index = buffers.rendered_dc_index;
+        thrust::device_vector<int>&     rendered_cloud_pose_map = buffers.rendered_cloud_pose_map;
+        thrust::device_vector<int>&     rendered_cloud_label = buffers.rendered_cloud_label;
+        thrust::device_vector<Eigen::Vector3f>& result_cloud_eigen = buffers.rendered_cloud_eigen;
         compute_point_clouds(
             device_depth_int,
             device_red_int,
@@ -1642,8 +1932,6 @@ namespace cuda_renderer {
             depth_factor,
             stride,
             device_pose_occluded,
-            cuda_cloud,
-            query_pitch_in_bytes,
             result_cloud_eigen,
             rendered_point_cloud,
             rendered_point_cloud_color,
@@ -1665,11 +1953,14 @@ namespace cuda_renderer {
         end_3a = std::chrono::system_clock::now();
         
         // Copy observed cloud to GPU
-        thrust::device_vector<Eigen::Vector3f> observed_cloud_eigen(observed_depth_eigen, observed_depth_eigen + observed_point_num);
+        thrust::device_vector<Eigen::Vector3f>& observed_cloud_eigen = buffers.observed_cloud_eigen;
+        observed_cloud_eigen.assign(observed_depth_eigen, observed_depth_eigen + observed_point_num);
         printf("observed_cloud_eigen() size : %d\n", observed_cloud_eigen.size());
 
-        thrust::device_vector<int> observed_cloud_label;
-        thrust::device_vector<int> observed_label_indices;
+        thrust::device_vector<int>& observed_cloud_label = buffers.observed_cloud_label;
+        thrust::device_vector<int>& observed_label_indices = buffers.observed_label_indices;
+        observed_cloud_label.clear();
+        observed_label_indices.clear();
 
         if (device_pose_segmentation_label.size() > 0)
         {
@@ -1720,7 +2011,8 @@ namespace cuda_renderer {
             vgicp_cuda->optimize_multi(estimated);
             // Apply ICP transform on actual poses to get the final pose
             d_estimated = estimated;
-            thrust::device_vector<Model::mat4x4> device_poses_adjusted(device_poses.size());
+            thrust::device_vector<Model::mat4x4>& device_poses_adjusted = buffers.poses_adjusted;
+            device_poses_adjusted.resize(device_poses.size());
             thrust::host_vector<Model::mat4x4> host_poses_adjusted(device_poses.size());
             thrust::transform(
                 device_poses.begin(), device_poses.end(), d_estimated.begin(), device_poses_adjusted.begin(),
@@ -1740,18 +2032,21 @@ namespace cuda_renderer {
             printf("*******************Rerendering after ICP****************\n");
 
             // Clear everything thats the output of rendering to give max gpu space for re-rendering flow
-            device_depth_int.clear(); device_depth_int.shrink_to_fit();
-            device_red_int.clear(); device_red_int.shrink_to_fit();
-            device_green_int.clear(); device_green_int.shrink_to_fit();
-            device_blue_int.clear(); device_blue_int.shrink_to_fit();
-
-            rendered_dc_index.clear(); rendered_dc_index.shrink_to_fit();
-            result_cloud_eigen.clear(); result_cloud_eigen.shrink_to_fit();
-            rendered_point_cloud.clear(); rendered_point_cloud.shrink_to_fit();
-            rendered_point_cloud_color.clear(); rendered_point_cloud_color.shrink_to_fit();
-            rendered_cloud_pose_map.clear(); rendered_cloud_pose_map.shrink_to_fit();
-            rendered_cloud_label.clear(); rendered_cloud_label.shrink_to_fit();
-            cudaFree(cuda_cloud);
+            // With a context the re-rendering reuses the same arenas, so they are kept
+            if (context == NULL)
+            {
+                device_depth_int.clear(); device_depth_int.shrink_to_fit();
+                device_red_int.clear(); device_red_int.shrink_to_fit();
+                device_green_int.clear(); device_green_int.shrink_to_fit();
+                device_blue_int.clear(); device_blue_int.shrink_to_fit();
+
+                rendered_dc_index.clear(); rendered_dc_index.shrink_to_fit();
+                result_cloud_eigen.clear(); result_cloud_eigen.shrink_to_fit();
+                rendered_point_cloud.clear(); rendered_point_cloud.shrink_to_fit();
+                rendered_point_cloud_color.clear(); rendered_point_cloud_color.shrink_to_fit();
+                rendered_cloud_pose_map.clear(); rendered_cloud_pose_map.shrink_to_fit();
+                rendered_cloud_label.clear(); rendered_cloud_label.shrink_to_fit();
+            }
             vgicp_cuda.reset();
 
             // Rerender images
@@ -1779,7 +2074,9 @@ namespace cuda_renderer {
                 device_red_int,
                 device_green_int,
                 device_blue_int,
-                stats);
+                stats,
+                true,
+                &buffers.packed_int);
 
             // Regenerate point clouds
             compute_point_clouds(
@@ -1798,8 +2095,6 @@ namespace cuda_renderer {
                 stride,
                 device_pose_occluded,
                 // Output
-                cuda_cloud,
-                query_pitch_in_bytes,
                 result_cloud_eigen,
                 rendered_point_cloud,
                 rendered_point_cloud_color,
@@ -1822,15 +2117,13 @@ namespace cuda_renderer {
         {
             printf("Copying point clouds to CPU\n");
             //// Allocate CPU memory
-            result_cloud = (float*) malloc(point_dim * result_cloud_point_num * sizeof(float));
-            result_cloud_color = (uint8_t*) malloc(point_dim * result_cloud_point_num * sizeof(uint8_t));
-            result_dc_index = (int*) malloc(num_images * width * height * sizeof(int));
-            result_cloud_pose_map = (int*) malloc(result_cloud_point_num * sizeof(int));
-
-            //// Copy to CPU if needed
-            cudaMemcpy2D(
-                result_cloud,  result_cloud_point_num * size_of_float, cuda_cloud,  query_pitch_in_bytes,  result_cloud_point_num * size_of_float, point_dim, cudaMemcpyDeviceToHost);
-            // cudaMemcpy(result_cloud, cuda_cloud, point_dim * result_cloud_point_num * sizeof(float), cudaMemcpyDeviceToHost);
+            result_cloud = host_output(host_outputs ? &host_outputs->result_cloud : NULL, point_dim * result_cloud_point_num);
+            result_cloud_color = host_output(host_outputs ? &host_outputs->result_cloud_color : NULL, point_dim * result_cloud_point_num);
+            result_dc_index = host_output(host_outputs ? &host_outputs->result_dc_index : NULL, num_images * width * height);
+            result_cloud_pose_map = host_output(host_outputs ? &host_outputs->result_cloud_pose_map : NULL, result_cloud_point_num);
+
+            //// Copy to CPU if needed, rendered_point_cloud is already row-major (all x, then all y, then all z)
+            cudaMemcpy(result_cloud, thrust::raw_pointer_cast(rendered_point_cloud.data()), point_dim * result_cloud_point_num * size_of_float, cudaMemcpyDeviceToHost);
             cudaMemcpy(result_cloud_color, thrust::raw_pointer_cast(rendered_point_cloud_color.data()), point_dim * result_cloud_point_num * sizeof(uint8_t), cudaMemcpyDeviceToHost);
             cudaMemcpy(result_dc_index, thrust::raw_pointer_cast(rendered_dc_index.data()), num_images * width * height * sizeof(int), cudaMemcpyDeviceToHost);
             cudaMemcpy(result_cloud_pose_map, thrust::raw_pointer_cast(rendered_cloud_pose_map.data()), result_cloud_point_num * sizeof(int), cudaMemcpyDeviceToHost);
@@ -1839,36 +2132,70 @@ namespace cuda_renderer {
             /// Free copied stuff
             
             if (stage.compare("CLOUD") == 0) {
-                cudaFree(cuda_cloud);
-                // cudaFree(cuda_cloud_color);
-                // cudaFree(cuda_cloud_pose_map);
                 return;
             }
         }
-        rendered_dc_index.clear(); rendered_dc_index.shrink_to_fit();
+        rendered_dc_index.clear();
+        if (context == NULL) rendered_dc_index.shrink_to_fit();
         ///////////////////////////////////////////////////////////////
         
         // Cost calculation
-        thrust::device_vector<thrust::pair<float, int>> k_neighbors;
-        fast_gicp::brute_force_knn_search(result_cloud_eigen, 
-                                        observed_cloud_eigen, 
-                                        1, 
-                                        k_neighbors,
-                                        //// thrust::device_vector<int>(0), // NN will not be segmentation specific
-                                        //// thrust::device_vector<int>(0), // NN will not be segmentation specific
-                                        // rendered_cloud_label_subtracted,
-                                        rendered_cloud_label,
-                                        observed_label_indices
-                                        //*source_pose_map,
-                                        //adjusted_x0s,
-                                        //mask_pose_icp);
-                                        );              
-
-               
-        thrust::device_vector<float> k_distances(k_neighbors.size());
-        thrust::device_vector<int> k_indices(k_neighbors.size());
-        thrust::transform(k_neighbors.begin(), k_neighbors.end(), k_indices.begin(), fast_gicp::untie_pair_second());
-        thrust::transform(k_neighbors.begin(), k_neighbors.end(), k_distances.begin(), fast_gicp::untie_pair_first());
+        thrust::device_vector<float>& k_distances = buffers.k_distances;
+        thrust::device_vector<int>& k_indices = buffers.k_indices;
+        if (nn_mode == NN_PROJECTIVE && device_pose_segmentation_label.size() == 0)
+        {
+            projective_knn_search(result_cloud_eigen,
+                                  observed_cloud_eigen,
+                                  width,
+                                  height,
+                                  stride,
+                                  kCameraCX,
+                                  kCameraCY,
+                                  kCameraFX,
+                                  kCameraFY,
+                                  sensor_resolution,
+                                  buffers.nn_cell_keys,
+                                  buffers.nn_cell_offsets,
+                                  buffers.nn_cell_points,
+                                  k_distances,
+                                  k_indices);
+        }
+        else if (nn_mode == NN_PROJECTIVE)
+        {
+            // Observed cloud and labels are both sorted by label here, indices refer to that order as with brute force
+            voxel_hash_knn_search(result_cloud_eigen,
+                                  rendered_cloud_label,
+                                  observed_cloud_eigen,
+                                  observed_cloud_label,
+                                  sensor_resolution,
+                                  buffers.nn_voxel_keys,
+                                  buffers.nn_voxel_indices,
+                                  buffers.nn_voxel_points,
+                                  k_distances,
+                                  k_indices);
+        }
+        else
+        {
+            thrust::device_vector<thrust::pair<float, int>>& k_neighbors = buffers.k_neighbors;
+            fast_gicp::brute_force_knn_search(result_cloud_eigen, 
+                                            observed_cloud_eigen, 
+                                            1, 
+                                            k_neighbors,
+                                            //// thrust::device_vector<int>(0), // NN will not be segmentation specific
+                                            //// thrust::device_vector<int>(0), // NN will not be segmentation specific
+                                            // rendered_cloud_label_subtracted,
+                                            rendered_cloud_label,
+                                            observed_label_indices
+                                            //*source_pose_map,
+                                            //adjusted_x0s,
+                                            //mask_pose_icp);
+                                            );              
+
+            k_distances.resize(k_neighbors.size());
+            k_indices.resize(k_neighbors.size());
+            thrust::transform(k_neighbors.begin(), k_neighbors.end(), k_indices.begin(), fast_gicp::untie_pair_second());
+            thrust::transform(k_neighbors.begin(), k_neighbors.end(), k_distances.begin(), fast_gicp::untie_pair_first());
+        }
         printf("*************KNN distances computed**********\n");
         end_3 = std::chrono::system_clock::now();
         elapsed_seconds = end_3-end_3a;
@@ -1878,18 +2205,20 @@ namespace cuda_renderer {
         //////////////////////////////////////////////////////////////
 
         // Testing new cost compute interface
-        thrust::device_vector<uint8_t> observed_cloud_color(observed_color, observed_color + point_dim * observed_point_num);
-
-        thrust::device_vector<float> rendered_poses_observed_points_total = pose_observed_points_total;
-        thrust::device_vector<float> cuda_rendered_cost_v;
-        thrust::device_vector<float> cuda_observed_cost_v;
-        thrust::device_vector<float> cuda_pose_points_diff_cost_vec;
+        upload_observed_lab(cost_type, observed_color, observed_lab, observed_point_num, point_dim, buffers);
+        thrust::device_vector<float>& observed_cloud_lab = buffers.observed_cloud_lab;
+
+        thrust::device_vector<float>& rendered_poses_observed_points_total = buffers.poses_observed_points_total;
+        rendered_poses_observed_points_total.assign(pose_observed_points_total.begin(), pose_observed_points_total.end());
+        thrust::device_vector<float>& cuda_rendered_cost_v = buffers.rendered_cost;
+        thrust::device_vector<float>& cuda_observed_cost_v = buffers.observed_cost;
+        thrust::device_vector<float>& cuda_pose_points_diff_cost_vec = buffers.points_diff_cost;
         compute_costs(num_images,
             cost_type,
             calculate_observed_cost,
             sensor_resolution,
             color_distance_threshold,
-            observed_cloud_color,
+            observed_cloud_lab,
             observed_cloud_label,
             observed_point_num,
             rendered_point_cloud_color,
@@ -1907,18 +2236,8 @@ namespace cuda_renderer {
         );
         if (stage.compare("DEBUG") == 0 || stage.find("COST") != std::string::npos)
         {
-            printf("Copying rendered cost to CPU\n");
-            rendered_cost = (float*) malloc(num_images * size_of_float);
-            cudaMemcpy(rendered_cost, thrust::raw_pointer_cast(cuda_rendered_cost_v.data()), num_images * size_of_float, cudaMemcpyDeviceToHost);
-            if (calculate_observed_cost)
-            {
-                printf("Copying observed cost to CPU\n");
-                observed_cost = (float*) malloc(num_images * size_of_float);
-                points_diff_cost = (float*) malloc(num_images * size_of_float);
-
-                cudaMemcpy(observed_cost, thrust::raw_pointer_cast(cuda_observed_cost_v.data()), num_images * size_of_float, cudaMemcpyDeviceToHost);
-                cudaMemcpy(points_diff_cost, thrust::raw_pointer_cast(cuda_pose_points_diff_cost_vec.data()), num_images * size_of_float, cudaMemcpyDeviceToHost);
-            }
+            copy_costs_to_host(num_images, calculate_observed_cost, buffers, host_outputs,
+                               rendered_cost, observed_cost, points_diff_cost);
         }
         // cudaFree(index_dev);
         // cudaFree(dist_dev);
@@ -1929,6 +2248,10 @@ namespace cuda_renderer {
         elapsed_seconds = end_4-end_3;
         printf("*************Costs computed**********\n");
         printf("************Cost Computation time : %f************\n", elapsed_seconds.count());
+        if (context != NULL)
+        {
+            stats.peak_memory_usage = std::max(context->device_memory_usage(), stats.peak_memory_usage);
+        }
         return;
         ///////////////////////////////////////////////////////////////////
     }
@@ -1992,8 +2315,6 @@ namespace cuda_renderer {
             cudaMemcpy(d_camera_transform, camera_transform, sizeof(Eigen::Matrix4f), cudaMemcpyHostToDevice);
         }
 
-        float* result_2d_point_cloud;
-        size_t result_2d_pitch_in_bytes;
         gpu_stats stats;
         compute_point_clouds(
             d_depth_data,
@@ -2010,8 +2331,6 @@ namespace cuda_renderer {
             depth_factor,
             stride,
             d_poses_occluded,
-            result_2d_point_cloud,
-            result_2d_pitch_in_bytes,
             d_result_cloud_eigen,
             result_point_cloud,
             result_point_cloud_color,
@@ -2049,8 +2368,7 @@ namespace cuda_renderer {
         cloud_pose_map = (int*) malloc(rendered_cloud_point_num * sizeof(int));
         result_observed_cloud_label = (int*) malloc(rendered_cloud_point_num * sizeof(int));
 
-        cudaMemcpy2D(
-            result_cloud,  rendered_cloud_point_num * sizeof(float), result_2d_point_cloud,  result_2d_pitch_in_bytes,  rendered_cloud_point_num * sizeof(float), point_dim, cudaMemcpyDeviceToHost);
+        cudaMemcpy(result_cloud, thrust::raw_pointer_cast(result_point_cloud.data()), point_dim * rendered_cloud_point_num * sizeof(float), cudaMemcpyDeviceToHost);
 
         // cudaMemcpy(result_cloud, thrust::raw_pointer_cast(result_point_cloud.data()), point_dim * rendered_cloud_point_num * sizeof(float), cudaMemcpyDeviceToHost);
         cudaMemcpy(result_cloud_eigen, thrust::raw_pointer_cast(d_result_cloud_eigen.data()), rendered_cloud_point_num * sizeof(Eigen::Vector3f), cudaMemcpyDeviceToHost);
@@ -2065,7 +2383,6 @@ namespace cuda_renderer {
         {
             cudaFree(d_camera_transform);
         }
-        cudaFree(result_2d_point_cloud);
         return true;
         
         // thrust::device_vector<uint8_t> d_red_in = color_data[0];
@@ -3,6 +3,11 @@
 
 using namespace cuda_renderer;
 
+cuda_renderer::Model::Model() : scene(nullptr)
+{
+
+}
+
 cuda_renderer::Model::~Model()
 {
 
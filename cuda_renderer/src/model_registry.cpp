@@ -0,0 +1,99 @@
+#include "cuda_renderer/model_registry.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace cuda_renderer {
+
+    ModelRegistry::ModelRegistry() : generation_(0) {}
+
+    int ModelRegistry::add(const std::string& name, const std::string& file_name)
+    {
+        int handle = find(name);
+        if (handle >= 0)
+        {
+            active_[handle] = true;
+            return handle;
+        }
+        return add(name, Model(file_name));
+    }
+
+    int ModelRegistry::add(const std::string& name, const Model& model)
+    {
+        int handle = find(name);
+        if (handle >= 0)
+        {
+            active_[handle] = true;
+            return handle;
+        }
+        names_.push_back(name);
+        active_.push_back(true);
+        tris_.insert(tris_.end(), model.tris.begin(), model.tris.end());
+        tris_model_count_.push_back(model.tris.size());
+        printf("Registered model %s with handle %d, %d triangles\n", name.c_str(), (int) names_.size() - 1, (int) model.tris.size());
+        return names_.size() - 1;
+    }
+
+    void ModelRegistry::remove(int handle)
+    {
+        active_[handle] = false;
+    }
+
+    void ModelRegistry::remove_all()
+    {
+        active_.assign(active_.size(), false);
+    }
+
+    bool ModelRegistry::compact()
+    {
+        if (std::find(active_.begin(), active_.end(), false) == active_.end())
+            return false;
+
+        std::vector<std::string> names;
+        std::vector<Model::Triangle> tris;
+        std::vector<int> tris_model_count;
+        int tris_low = 0;
+        for (int handle = 0; handle < names_.size(); handle++)
+        {
+            if (active_[handle])
+            {
+                names.push_back(names_[handle]);
+                tris.insert(tris.end(), tris_.begin() + tris_low, tris_.begin() + tris_low + tris_model_count_[handle]);
+                tris_model_count.push_back(tris_model_count_[handle]);
+            }
+            tris_low += tris_model_count_[handle];
+        }
+        printf("Compacted model registry from %d to %d models\n", (int) names_.size(), (int) names.size());
+        names_.swap(names);
+        tris_.swap(tris);
+        tris_model_count_.swap(tris_model_count);
+        active_.assign(names_.size(), true);
+        generation_++;
+        return true;
+    }
+
+    void ModelRegistry::clear()
+    {
+        names_.clear();
+        active_.clear();
+        tris_.clear();
+        tris_model_count_.clear();
+        generation_++;
+    }
+
+    int ModelRegistry::find(const std::string& name) const
+    {
+        auto it = std::find(names_.begin(), names_.end(), name);
+        return it == names_.end() ? -1 : it - names_.begin();
+    }
+
+    size_t ModelRegistry::inactive_tris() const
+    {
+        size_t count = 0;
+        for (int handle = 0; handle < names_.size(); handle++)
+        {
+            if (!active_[handle]) count += tris_model_count_[handle];
+        }
+        return count;
+    }
+}
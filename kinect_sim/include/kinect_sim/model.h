@@ -91,6 +91,11 @@ namespace pcl
         //Indices indices_;
     };
 
+    /**
+     * Draws the polygons of a mesh from one vertex buffer, uploaded on the first draw
+     * and kept for the lifetime of the model. A mesh seen at many poses is built once
+     * and placed with Scene::add (model, pose).
+     */
     class PCL_EXPORTS PolygonMeshModel : public Model
     {
       public:
@@ -101,7 +106,15 @@ namespace pcl
         typedef boost::shared_ptr<PolygonMeshModel> Ptr;
         typedef boost::shared_ptr<const PolygonMeshModel> ConstPtr;
       private:
-        std::vector<SinglePoly> polygons;
+        // Uploads the vertex array to vbo_ and releases it, needs the GL context
+        void upload();
+
+        // Positions (3 floats) and colors (4 floats) of every polygon vertex, until uploaded
+        std::vector<float> vertices_;
+        std::vector<float> colors_;
+        // First vertex and vertex count of every polygon
+        std::vector<GLint> firsts_;
+        std::vector<GLsizei> counts_;
 
         /*
           GL_POINTS;
@@ -116,6 +129,8 @@ namespace pcl
           GL_POLYGON;
         */
         GLenum mode_;
+        GLuint vbo_;
+        size_t nvertices_;
     };
 
     class PCL_EXPORTS PointCloudModel : public Model
@@ -182,6 +182,71 @@ class PCL_EXPORTS RangeLikelihood {
   const float *
   getScoreBuffer ();
 
+  /**
+   * Render up to rows x cols poses in one pass, pose n into the tile at
+   * row n / cols and column n % cols (rows counted from the bottom of the
+   * framebuffer). Tiles without a pose are left empty.
+   */
+  void
+  renderTiles (const
+               std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+               &poses);
+
+  /**
+   * Score every tile of the last render against reference, a tile sized
+   * depth buffer, and sum the scores of each tile into scores (rows x cols).
+   * Uses the likelihood shader and SumReduce, or the CPU as set by
+   * setComputeOnCPU and setSumOnCPU.
+   */
+  void
+  computeTileScores (float *reference, std::vector<float> &scores);
+
+  /**
+   * Depth of the last render in millimeters with rows top down, as
+   * SimExample::get_depth_image_uint returns it. The depth is linearized in
+   * a shader, only the 16 bit image is read back.
+   */
+  const unsigned short *
+  getDepthBufferMM ();
+
+  /**
+   * Set the number of frames that renderAsync keeps in flight, each with its
+   * own pixel buffer objects. 0 releases them.
+   */
+  void
+  setReadbackFrames (int frames);
+  int
+  getReadbackFrames () const {
+    return static_cast<int> (readback_frames_.size ());
+  }
+
+  /**
+   * Render the poses and start reading back the depth (linearized as in
+   * getDepthBufferMM) and the color into pixel buffer objects, without waiting
+   * for the GPU. Rendering the next frame overlaps with this readback.
+   *
+   * @return the id of the frame, its images can be fetched with
+   *         getDepthImageMM and getColorImage until setReadbackFrames newer
+   *         frames have been started.
+   */
+  int
+  renderAsync (const
+               std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+               &poses);
+
+  /**
+   * Wait for the readback of a frame from renderAsync and copy its depth in
+   * millimeters, rows top down. Returns false if the frame was overwritten.
+   */
+  bool
+  getDepthImageMM (int frame, std::vector<unsigned short> *depth_image);
+
+  /**
+   * Same as getDepthImageMM for the color image, laid out as getColorBuffer.
+   */
+  bool
+  getColorImage (int frame, std::vector<uint8_t> *color_image);
+
  private:
   /**
    * Evaluate the likelihood/score for a set of particles
@@ -215,6 +280,22 @@ class PCL_EXPORTS RangeLikelihood {
   void
   setupProjectionMatrix ();
 
+  // Writes the depth of the last render in millimeters to depth_mm_texture_
+  void
+  linearizeDepth ();
+
+  struct ReadbackFrame {
+    GLuint depth_pbo;
+    GLuint color_pbo;
+    GLsync fence;
+    int id;
+  };
+
+  // Frame of renderAsync with the given id once its readback is complete,
+  // NULL if it was overwritten
+  ReadbackFrame *
+  waitReadback (int frame);
+
   Scene::Ptr scene_;
   int rows_;
   int cols_;
@@ -241,6 +322,7 @@ class PCL_EXPORTS RangeLikelihood {
   bool depth_buffer_dirty_;
   bool color_buffer_dirty_;
   bool score_buffer_dirty_;
+  bool depth_mm_buffer_dirty_;
 
   int which_cost_function_;
   double floor_proportion_;
@@ -265,6 +347,17 @@ class PCL_EXPORTS RangeLikelihood {
   bool use_color_;
 
   gllib::Program::Ptr likelihood_program_;
+
+  // Depth in millimeters, rendered by linearize_program_
+  GLuint depth_mm_fbo_;
+  GLuint depth_mm_texture_;
+  gllib::Program::Ptr linearize_program_;
+  unsigned short *depth_mm_buffer_;
+
+  // Ring of in flight readbacks of renderAsync, next_frame_ is the id of the
+  // next frame and frame i uses readback_frames_[i % size]
+  std::vector<ReadbackFrame> readback_frames_;
+  int next_frame_;
   GLuint quad_vbo_;
   std::vector<Eigen::Vector3f> vertices_;
   float *score_buffer_;
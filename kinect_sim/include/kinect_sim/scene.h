@@ -9,6 +9,7 @@
 #define PCL_SIMULATION_SCENE_HPP_
 
 #include <boost/shared_ptr.hpp>
+#include <Eigen/StdVector>
 
 #include <pcl/pcl_macros.h>
 //#include <pcl/win32_macros.h>
@@ -32,6 +33,10 @@ namespace pcl
       void
       add (Model::Ptr model);
 
+      /** Adds a model drawn with pose as its model matrix (model to world). */
+      void
+      add (Model::Ptr model, const Eigen::Matrix4f &pose);
+
       void
       addCompleteModel (std::vector<Model::Ptr> model);
 
@@ -40,6 +45,7 @@ namespace pcl
 
     private:
       std::vector<Model::Ptr> models_;
+      std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> > poses_;
     };
   
   } // namespace - simulation
@@ -44,15 +44,48 @@ namespace pcl
         typedef boost::shared_ptr<SimExample> Ptr;
         typedef boost::shared_ptr<const SimExample> ConstPtr;
     	
+        // Where the OpenGL context comes from. GLUT_WINDOW needs an X display,
+        // HEADLESS_EGL creates an offscreen EGL context (surfaceless, or a
+        // pbuffer) current on the constructing thread, so that every thread or
+        // rank can own a simulator on a machine without display. All rendering
+        // goes to framebuffer objects either way.
+        enum ContextBackend { GLUT_WINDOW, HEADLESS_EGL };
+
         SimExample (int argc, char** argv,
-    		int height,int width, bool use_opengl = true);
+    		int height,int width, bool use_opengl = true,
+    		ContextBackend context_backend = GLUT_WINDOW);
+        ~SimExample ();
         void initializeGL (int argc, char** argv);
+        // Creates the EGL context of HEADLESS_EGL, false if EGL is unavailable
+        bool initializeEGL ();
+        // Makes the context of this simulator current on the calling thread,
+        // only needed with HEADLESS_EGL when rendering from another thread
+        void makeCurrent ();
         
         Scene::Ptr scene_;
         Camera::Ptr camera_;
         RangeLikelihood::Ptr rl_;  
     
         void doSim (Eigen::Isometry3d pose_in);
+        // Renders pose_in without scoring it and returns the frame to fetch
+        // the images from once read back, see RangeLikelihood::renderAsync.
+        // The render of the next pose overlaps with the readback of this one.
+        int doSimAsync (Eigen::Isometry3d pose_in);
+
+        // Creates tiled_rl_, rows x cols tiles of tile_height x tile_width
+        // pixels sharing scene_. The intrinsics are scaled to the tile size.
+        void initTiles (int rows, int cols, int tile_height, int tile_width);
+        // Renders up to rows x cols poses into the tiles of tiled_rl_ in one
+        // pass. With a reference (a tile sized depth buffer), scores gets the
+        // likelihood of every tile.
+        void doSimBatch (const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>> &poses,
+                         float* reference = NULL, std::vector<float>* scores = NULL);
+        // Views of tile n (pose n) of the last doSimBatch, depth in millimeters
+        // and color as get_rgb_image_cv, valid until the next doSimBatch
+        cv::Mat get_tile_depth_image_cv (int tile);
+        cv::Mat get_tile_rgb_image_cv (int tile);
+
+        RangeLikelihood::Ptr tiled_rl_;
     
         void write_score_image(const float* score_buffer,std::string fname);
         void write_depth_image(const float* depth_buffer,std::string fname);
@@ -61,10 +94,34 @@ namespace pcl
 
         void get_depth_image_uint(const float* depth_buffer, std::vector<unsigned short>* depth_img_uint);
         void get_depth_image_cv(const float* depth_buffer, cv::Mat &depth_image);
+        // Depth of the last render, linearized to millimeters on the GPU
+        void get_depth_image_uint(std::vector<unsigned short>* depth_img_uint);
+        void get_depth_image_cv(cv::Mat &depth_image);
+        // Depth of a frame of doSimAsync, false if it was overwritten
+        bool get_depth_image_uint(int frame, std::vector<unsigned short>* depth_img_uint);
+        // Color buffer of a frame of doSimAsync for the rgb getters, valid until
+        // the next call, NULL if the frame was overwritten
+        const uint8_t* get_rgb_buffer(int frame);
         void get_rgb_image_uchar(const uint8_t* rgb_buffer, std::vector<std::vector<uchar>>* color_image_uchar);
         void get_rgb_image_cv(const uint8_t *rgb_buffer, cv::Mat &color_image);
       private:
         uint16_t t_gamma[2048];  
+        std::vector<uint8_t> frame_color_;
+
+        // Loads the GL entry points for the current context
+        void initializeGLEW ();
+
+        ContextBackend context_backend_;
+        // EGLDisplay, EGLContext and EGLSurface of HEADLESS_EGL, kept opaque so
+        // that the layout does not depend on how kinect_sim was built
+        void *egl_display_;
+        void *egl_context_;
+        void *egl_surface_;
+        // Images of the last doSimBatch, rows top down
+        cv::Mat tiled_depth_;
+        cv::Mat tiled_color_;
+        // Tile of pose n in tiled_depth_ and tiled_color_
+        cv::Rect tileRect (int tile) const;
     
         // of platter, usually 640x480
         int width_;
@@ -0,0 +1,21 @@
+#version 130
+#extension GL_ARB_explicit_attrib_location : enable
+#extension GL_ARB_explicit_uniform_location : enable
+
+layout(location = 0) out uvec4 DepthMM;
+
+uniform sampler2D DepthSampler;
+
+uniform int height;
+uniform float near;
+uniform float far;
+
+// Depth buffer value to millimeters, flipped up down so that rows come out top down
+void main()
+{
+  ivec2 pixel = ivec2(gl_FragCoord.xy);
+  float d = texelFetch(DepthSampler, ivec2(pixel.x, height - 1 - pixel.y), 0).r;
+  float z = far * near / (far - (far - near) * d);
+
+  DepthMM = uvec4(uint(clamp(floor(1000.0 * z + 0.5), 0.0, 65535.0)), 0u, 0u, 0u);
+}
@@ -112,103 +112,121 @@ pcl::simulation::TriangleMeshModel::~TriangleMeshModel ()
 }
 
 // Create a PolygonMeshModel by converting the PolygonMesh to our format
-pcl::simulation::PolygonMeshModel::PolygonMeshModel (GLenum mode, pcl::PolygonMesh::Ptr plg) : mode_ (mode)
+// All polygons share one vertex array, which is uploaded to a vertex buffer on the first draw
+pcl::simulation::PolygonMeshModel::PolygonMeshModel (GLenum mode, pcl::PolygonMesh::Ptr plg) : mode_ (mode), vbo_ (0), nvertices_ (0)
 {
   bool found_rgb=false;
   for (size_t i=0; i<plg->cloud.fields.size () ;i++)
     if (plg->cloud.fields[i].name.compare ("rgb") == 0)
       found_rgb = true;
-  
+
+  size_t nvertices = 0;
+  for (size_t i = 0; i < plg->polygons.size (); i++)
+    nvertices += plg->polygons[i].vertices.size ();
+  vertices_.reserve (3*nvertices);
+  colors_.reserve (4*nvertices);
+  firsts_.reserve (plg->polygons.size ());
+  counts_.reserve (plg->polygons.size ());
+
   // printf("found_rgb : %d\n", found_rgb);
   if (found_rgb)
   {
     pcl::PointCloud<pcl::PointXYZRGB> newcloud;  
     pcl::fromPCLPointCloud2 (plg->cloud, newcloud);
-    Eigen::Vector4f tmp;
     for(size_t i = 0; i< plg->polygons.size (); i++)
     { // each triangle/polygon
-      pcl::Vertices apoly_in = plg->polygons[i];
-      SinglePoly apoly;
-      apoly.nvertices_ = apoly_in.vertices.size ();
-      apoly.vertices_ = new float[3*apoly_in.vertices.size ()];
-      apoly.colors_ = new float[4*apoly_in.vertices.size ()]; 
+      const pcl::Vertices &apoly_in = plg->polygons[i];
+      firsts_.push_back (static_cast<GLint> (vertices_.size () / 3));
+      counts_.push_back (static_cast<GLsizei> (apoly_in.vertices.size ()));
 
       for(size_t j=0; j< apoly_in.vertices.size (); j++)
       { // each point
-	uint32_t pt = apoly_in.vertices[j];
-	tmp = newcloud.points[pt].getVector4fMap ();
+	const pcl::PointXYZRGB &pt = newcloud.points[apoly_in.vertices[j]];
 	// x,y,z
-	apoly.vertices_[3*j + 0] = tmp (0);
-	apoly.vertices_[3*j + 1] = tmp (1);
-	apoly.vertices_[3*j + 2] = tmp (2);
+	vertices_.push_back (pt.x);
+	vertices_.push_back (pt.y);
+	vertices_.push_back (pt.z);
 	// r,g,b: input is ints 0->255, opengl wants floats 0->1
-	apoly.colors_[4*j + 0] = newcloud.points[pt].r/255.0f; // Red
-	apoly.colors_[4*j + 1] = newcloud.points[pt].g/255.0f; // Green
-	apoly.colors_[4*j + 2] = newcloud.points[pt].b/255.0f; // Blue
-	apoly.colors_[4*j + 3] = 1.0f; // transparancy? unnecessary?
+	colors_.push_back (pt.r/255.0f); // Red
+	colors_.push_back (pt.g/255.0f); // Green
+	colors_.push_back (pt.b/255.0f); // Blue
+	colors_.push_back (1.0f); // transparancy? unnecessary?
       }
-      polygons.push_back (apoly);
     }
   }
   else
   {
     pcl::PointCloud<pcl::PointXYZ> newcloud;  
     pcl::fromPCLPointCloud2 (plg->cloud, newcloud);
-    Eigen::Vector4f tmp;
     for(size_t i=0; i< plg->polygons.size (); i++)
     { // each triangle/polygon
-      pcl::Vertices apoly_in = plg->polygons[i];
-      SinglePoly apoly;
-      apoly.nvertices_ = apoly_in.vertices.size ();
-      apoly.vertices_ = new float [3*apoly_in.vertices.size ()];
-      apoly.colors_ = new float [4*apoly_in.vertices.size ()];
+      const pcl::Vertices &apoly_in = plg->polygons[i];
+      firsts_.push_back (static_cast<GLint> (vertices_.size () / 3));
+      counts_.push_back (static_cast<GLsizei> (apoly_in.vertices.size ()));
 
       for(size_t j=0; j< apoly_in.vertices.size (); j++)
       { // each point
-	uint32_t pt = apoly_in.vertices[j];
-	tmp = newcloud.points[pt].getVector4fMap ();
+	const pcl::PointXYZ &pt = newcloud.points[apoly_in.vertices[j]];
 	// x,y,z
-	apoly.vertices_[3*j + 0] = tmp (0);
-	apoly.vertices_[3*j + 1] = tmp (1);
-	apoly.vertices_[3*j + 2] = tmp (2);
+	vertices_.push_back (pt.x);
+	vertices_.push_back (pt.y);
+	vertices_.push_back (pt.z);
 	// r,g,b: input is ints 0->255, opengl wants floats 0->1
-	apoly.colors_[4*j + 0] = 1.0f; // Red
-	apoly.colors_[4*j + 1] = 0.0f; // Green
-	apoly.colors_[4*j + 2] = 0.0f; // Blue
-	apoly.colors_[4*j + 3] = 1.0;
+	colors_.push_back (1.0f); // Red
+	colors_.push_back (0.0f); // Green
+	colors_.push_back (0.0f); // Blue
+	colors_.push_back (1.0f);
       }
-      polygons.push_back (apoly);
     }
   }
+  nvertices_ = vertices_.size () / 3;
 }
 
 pcl::simulation::PolygonMeshModel::~PolygonMeshModel ()
 {
-  // TODO: memory management!
-  for (size_t i = 0; i < polygons.size (); ++i)
-  {
-    delete [] polygons[i].vertices_;
-    delete [] polygons[i].colors_;
-  }
+  if (vbo_ != 0 && glIsBuffer (vbo_) == GL_TRUE)
+    glDeleteBuffers (1, &vbo_);
+}
+
+void
+pcl::simulation::PolygonMeshModel::upload ()
+{
+  // Positions followed by colors, the host copies are not needed afterwards
+  const size_t vertices_size = vertices_.size () * sizeof (float);
+  const size_t colors_size = colors_.size () * sizeof (float);
+  glGenBuffers (1, &vbo_);
+  glBindBuffer (GL_ARRAY_BUFFER, vbo_);
+  glBufferData (GL_ARRAY_BUFFER, vertices_size + colors_size, NULL, GL_STATIC_DRAW);
+  glBufferSubData (GL_ARRAY_BUFFER, 0, vertices_size, vertices_.data ());
+  glBufferSubData (GL_ARRAY_BUFFER, vertices_size, colors_size, colors_.data ());
+  glBindBuffer (GL_ARRAY_BUFFER, 0);
+
+  std::vector<float> ().swap (vertices_);
+  std::vector<float> ().swap (colors_);
 }
 
 void
 pcl::simulation::PolygonMeshModel::draw ()
 {
-  // This might be a little quicker than drawing using individual polygons
-  // TODO: test by how much
+  if (counts_.empty ())
+    return;
+  if (vbo_ == 0)
+    upload ();
+
   glEnable (GL_DEPTH_TEST);
+  glBindBuffer (GL_ARRAY_BUFFER, vbo_);
   glEnableClientState (GL_VERTEX_ARRAY);
   glEnableClientState (GL_COLOR_ARRAY);
 
-  for (size_t i = 0; i < polygons.size (); i++)
-  {
-    glVertexPointer (3, GL_FLOAT, 0, polygons[i].vertices_);
-    glColorPointer (4, GL_FLOAT, 0, polygons[i].colors_);
-    glDrawArrays (mode_, 0, polygons[i].nvertices_);
-  }
+  glVertexPointer (3, GL_FLOAT, 0, 0);
+  glColorPointer (4, GL_FLOAT, 0, reinterpret_cast<GLvoid*> (3*nvertices_*sizeof (float)));
+  glMultiDrawArrays (mode_, firsts_.data (), counts_.data (), static_cast<GLsizei> (counts_.size ()));
+
   glDisableClientState (GL_COLOR_ARRAY);
   glDisableClientState (GL_VERTEX_ARRAY);
+  glVertexPointer (3, GL_FLOAT, 0, 0);
+  glColorPointer (4, GL_FLOAT, 0, 0);
+  glBindBuffer (GL_ARRAY_BUFFER, 0);
 }
 
 pcl::simulation::PointCloudModel::PointCloudModel (GLenum mode, pcl::PointCloud<pcl::PointXYZRGB>::Ptr pc) : mode_ (mode)
@@ -1,5 +1,6 @@
 #include <GL/glew.h>
 #include <time.h>
+#include <cstring>
 
 #include <pcl/pcl_config.h>
 #ifdef OPENGL_IS_A_FRAMEWORK
@@ -29,6 +30,8 @@ const string kComputeScoreVertFile =  ros::package::getPath("kinect_sim") +
                                       "/src/compute_score.vert";
 const string kComputeScoreFragFile =  ros::package::getPath("kinect_sim") +
                                       "/src/compute_score.frag";
+const string kLinearizeDepthFragFile =  ros::package::getPath("kinect_sim") +
+                                        "/src/linearize_depth.frag";
 
 // 301 values, 0.0 uniform  1.0 normal. properly truncated/normalized
 float normal_sigma0x5_normal1x0_range0to3_step0x01[] = {1.59576912f, 1.59545000f, 1.59449302f, 1.59289932f, 1.59067083f,
@@ -161,6 +164,7 @@ pcl::simulation::RangeLikelihood::RangeLikelihood (int rows, int cols,
   depth_buffer_dirty_(true),
   color_buffer_dirty_(true),
   score_buffer_dirty_(true),
+  depth_mm_buffer_dirty_(true),
   fbo_ (0),
   depth_render_buffer_ (0),
   color_render_buffer_ (0),
@@ -173,6 +177,9 @@ pcl::simulation::RangeLikelihood::RangeLikelihood (int rows, int cols,
   aggregate_on_cpu_ (false),
   use_instancing_ (false),
   use_color_ (true),
+  depth_mm_fbo_ (0),
+  depth_mm_texture_ (0),
+  next_frame_ (0),
   sum_reduce_ (cols *col_width, rows *row_height, max_level (col_width,
                                                              row_height)) {
   height_ = rows_ * row_height;
@@ -180,6 +187,7 @@ pcl::simulation::RangeLikelihood::RangeLikelihood (int rows, int cols,
 
   depth_buffer_ = new float[width_ * height_];
   color_buffer_ = new uint8_t[width_ * height_ * 3];
+  depth_mm_buffer_ = new unsigned short[width_ * height_];
 
   // Set Default Camera Intrinstic Parameters. techquad
   // Correspond closely to those stated here:
@@ -312,6 +320,23 @@ pcl::simulation::RangeLikelihood::RangeLikelihood (int rows, int cols,
                           score_texture_, 0);
   glBindFramebuffer (GL_FRAMEBUFFER, 0);
 
+  // Texture and framebuffer for the depth in millimeters
+  glGenTextures (1, &depth_mm_texture_);
+  glBindTexture (GL_TEXTURE_2D, depth_mm_texture_);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_R16UI, width_, height_, 0, GL_RED_INTEGER,
+                GL_UNSIGNED_SHORT, NULL);
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  glGenFramebuffers (1, &depth_mm_fbo_);
+  glBindFramebuffer (GL_FRAMEBUFFER, depth_mm_fbo_);
+  glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                          depth_mm_texture_, 0);
+  glBindFramebuffer (GL_FRAMEBUFFER, 0);
+
   // Load shader
   likelihood_program_ = gllib::Program::Ptr (new gllib::Program ());
 
@@ -330,6 +355,22 @@ pcl::simulation::RangeLikelihood::RangeLikelihood (int rows, int cols,
 
   likelihood_program_->link ();
 
+  linearize_program_ = gllib::Program::Ptr (new gllib::Program ());
+
+  if (!linearize_program_->addShaderFile (kComputeScoreVertFile.c_str(),
+                                          gllib::VERTEX)) {
+    std::cout << "Failed loading vertex shader" << std::endl;
+    exit (-1);
+  }
+
+  if (!linearize_program_->addShaderFile (kLinearizeDepthFragFile.c_str(),
+                                          gllib::FRAGMENT)) {
+    std::cout << "Failed loading fragment shader" << std::endl;
+    exit (-1);
+  }
+
+  linearize_program_->link ();
+
   vertices_.push_back (Eigen::Vector3f (-1.0,  1.0, 0.0));
   vertices_.push_back (Eigen::Vector3f ( 1.0,  1.0, 0.0));
   vertices_.push_back (Eigen::Vector3f ( 1.0, -1.0, 0.0));
@@ -351,6 +392,7 @@ pcl::simulation::RangeLikelihood::RangeLikelihood (int rows, int cols,
 }
 
 pcl::simulation::RangeLikelihood::~RangeLikelihood () {
+  setReadbackFrames (0);
   glDeleteBuffers (1, &quad_vbo_);
   glDeleteTextures (1, &depth_texture_);
   glDeleteTextures (1, &color_texture_);
@@ -360,12 +402,15 @@ pcl::simulation::RangeLikelihood::~RangeLikelihood () {
   glDeleteTextures (1, &likelihood_texture_);
   glDeleteFramebuffers (1, &fbo_);
   glDeleteFramebuffers (1, &score_fbo_);
+  glDeleteTextures (1, &depth_mm_texture_);
+  glDeleteFramebuffers (1, &depth_mm_fbo_);
   glDeleteRenderbuffers (1, &depth_render_buffer_);
   glDeleteRenderbuffers (1, &color_render_buffer_);
 
   delete [] depth_buffer_;
   delete [] color_buffer_;
   delete [] score_buffer_;
+  delete [] depth_mm_buffer_;
 }
 
 double
@@ -444,9 +489,11 @@ pcl::simulation::RangeLikelihood::drawParticles (
   std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
   poses) {
   int n = 0;
+  const int num_poses = static_cast<int> (poses.size ());
 
-  for (int i = 0; i < rows_; ++i) {
-    for (int j = 0; j < cols_; ++j) {
+  // Tiles without a pose stay cleared
+  for (int i = 0; i < rows_ && n < num_poses; ++i) {
+    for (int j = 0; j < cols_ && n < num_poses; ++j) {
       glMatrixMode (GL_MODELVIEW);
       glLoadIdentity ();
 
@@ -1475,6 +1522,7 @@ RangeLikelihood::render (const
   color_buffer_dirty_ = true;
   depth_buffer_dirty_ = true;
   score_buffer_dirty_ = true;
+  depth_mm_buffer_dirty_ = true;
 }
 
 const float *
@@ -1543,3 +1591,273 @@ RangeLikelihood::getScoreBuffer () {
 
   return score_buffer_;
 }
+
+void
+RangeLikelihood::linearizeDepth () {
+  GLboolean enable_depth_test;
+  glGetBooleanv (GL_DEPTH_TEST, &enable_depth_test);
+  glDisable (GL_DEPTH_TEST);
+
+  linearize_program_->use ();
+  linearize_program_->setUniform ("DepthSampler", 0);
+  linearize_program_->setUniform ("height", height_);
+  linearize_program_->setUniform ("near", z_near_);
+  linearize_program_->setUniform ("far", z_far_);
+
+  glBindFramebuffer (GL_FRAMEBUFFER, depth_mm_fbo_);
+  glDrawBuffer (GL_COLOR_ATTACHMENT0);
+  glViewport (0, 0, width_, height_);
+
+  glActiveTexture (GL_TEXTURE0);
+  glBindTexture (GL_TEXTURE_2D, depth_texture_);
+  quad_.render ();
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  glUseProgram (0);
+  glBindFramebuffer (GL_FRAMEBUFFER, 0);
+
+  if (enable_depth_test == GL_TRUE) {
+    glEnable (GL_DEPTH_TEST);
+  }
+
+  if (gllib::getGLError () != GL_NO_ERROR) {
+    std::cerr << "GL Error: RangeLikelihood::linearizeDepth" << std::endl;
+  }
+}
+
+const unsigned short *
+RangeLikelihood::getDepthBufferMM () {
+  if (depth_mm_buffer_dirty_) {
+    linearizeDepth ();
+
+    GLint old_read_buffer;
+    GLint old_pack_alignment;
+    glGetIntegerv (GL_READ_BUFFER, &old_read_buffer);
+    glGetIntegerv (GL_PACK_ALIGNMENT, &old_pack_alignment);
+
+    glPixelStorei (GL_PACK_ALIGNMENT, 1);
+    glBindFramebuffer (GL_FRAMEBUFFER, depth_mm_fbo_);
+    glReadBuffer (GL_COLOR_ATTACHMENT0);
+    glReadPixels (0, 0, width_, height_, GL_RED_INTEGER, GL_UNSIGNED_SHORT,
+                  depth_mm_buffer_);
+    glBindFramebuffer (GL_FRAMEBUFFER, 0);
+    glReadBuffer (old_read_buffer);
+    glPixelStorei (GL_PACK_ALIGNMENT, old_pack_alignment);
+
+    if (gllib::getGLError () != GL_NO_ERROR) {
+      std::cerr << "GL Error: RangeLikelihood::getDepthBufferMM" << std::endl;
+    }
+
+    depth_mm_buffer_dirty_ = false;
+  }
+
+  return depth_mm_buffer_;
+}
+
+void
+RangeLikelihood::setReadbackFrames (int frames) {
+  for (size_t i = 0; i < readback_frames_.size (); ++i) {
+    if (readback_frames_[i].fence) {
+      glDeleteSync (readback_frames_[i].fence);
+    }
+
+    glDeleteBuffers (1, &readback_frames_[i].depth_pbo);
+    glDeleteBuffers (1, &readback_frames_[i].color_pbo);
+  }
+
+  readback_frames_.resize (frames);
+
+  for (int i = 0; i < frames; ++i) {
+    ReadbackFrame &frame = readback_frames_[i];
+    frame.fence = 0;
+    frame.id = -1;
+
+    glGenBuffers (1, &frame.depth_pbo);
+    glBindBuffer (GL_PIXEL_PACK_BUFFER, frame.depth_pbo);
+    glBufferData (GL_PIXEL_PACK_BUFFER, width_ * height_ * sizeof (unsigned short),
+                  NULL, GL_STREAM_READ);
+
+    glGenBuffers (1, &frame.color_pbo);
+    glBindBuffer (GL_PIXEL_PACK_BUFFER, frame.color_pbo);
+    glBufferData (GL_PIXEL_PACK_BUFFER, width_ * height_ * 3, NULL,
+                  GL_STREAM_READ);
+  }
+
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+}
+
+int
+RangeLikelihood::renderAsync (const
+                              std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+                              &poses) {
+  assert (!readback_frames_.empty ());
+
+  render (poses);
+  linearizeDepth ();
+
+  // An unread frame in this slot is dropped
+  ReadbackFrame &frame = readback_frames_[next_frame_ % readback_frames_.size ()];
+
+  if (frame.fence) {
+    glDeleteSync (frame.fence);
+  }
+
+  GLint old_read_buffer;
+  GLint old_pack_alignment;
+  glGetIntegerv (GL_READ_BUFFER, &old_read_buffer);
+  glGetIntegerv (GL_PACK_ALIGNMENT, &old_pack_alignment);
+  glPixelStorei (GL_PACK_ALIGNMENT, 1);
+
+  // With a pixel pack buffer bound, glReadPixels only queues the copy
+  glBindFramebuffer (GL_FRAMEBUFFER, depth_mm_fbo_);
+  glReadBuffer (GL_COLOR_ATTACHMENT0);
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, frame.depth_pbo);
+  glReadPixels (0, 0, width_, height_, GL_RED_INTEGER, GL_UNSIGNED_SHORT, 0);
+
+  if (use_color_) {
+    glBindFramebuffer (GL_FRAMEBUFFER, fbo_);
+    glReadBuffer (GL_COLOR_ATTACHMENT0);
+    glBindBuffer (GL_PIXEL_PACK_BUFFER, frame.color_pbo);
+    glReadPixels (0, 0, width_, height_, GL_RGB, GL_UNSIGNED_BYTE, 0);
+  }
+
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+  glBindFramebuffer (GL_FRAMEBUFFER, 0);
+  glReadBuffer (old_read_buffer);
+  glPixelStorei (GL_PACK_ALIGNMENT, old_pack_alignment);
+
+  frame.fence = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  frame.id = next_frame_;
+
+  if (gllib::getGLError () != GL_NO_ERROR) {
+    std::cerr << "GL Error: RangeLikelihood::renderAsync" << std::endl;
+  }
+
+  return next_frame_++;
+}
+
+RangeLikelihood::ReadbackFrame *
+RangeLikelihood::waitReadback (int frame_id) {
+  if (frame_id < 0 || readback_frames_.empty ()) {
+    return NULL;
+  }
+
+  ReadbackFrame &frame = readback_frames_[frame_id % readback_frames_.size ()];
+
+  if (frame.id != frame_id || !frame.fence) {
+    return NULL;
+  }
+
+  // Flushes the commands up to the fence on the first wait
+  GLenum status;
+
+  do {
+    status = glClientWaitSync (frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                               1000000);
+  } while (status == GL_TIMEOUT_EXPIRED);
+
+  if (status == GL_WAIT_FAILED) {
+    std::cerr << "GL Error: RangeLikelihood::waitReadback" << std::endl;
+    return NULL;
+  }
+
+  return &frame;
+}
+
+bool
+RangeLikelihood::getDepthImageMM (int frame_id,
+                                  std::vector<unsigned short> *depth_image) {
+  ReadbackFrame *frame = waitReadback (frame_id);
+
+  if (frame == NULL) {
+    return false;
+  }
+
+  depth_image->resize (width_ * height_);
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, frame->depth_pbo);
+  const void *data = glMapBuffer (GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+
+  if (data) {
+    memcpy (depth_image->data (), data, depth_image->size () * sizeof (unsigned short));
+    glUnmapBuffer (GL_PIXEL_PACK_BUFFER);
+  }
+
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+  return data != NULL;
+}
+
+bool
+RangeLikelihood::getColorImage (int frame_id,
+                                std::vector<uint8_t> *color_image) {
+  // It's only possible to read the color buffer if it
+  // was rendered in the first place.
+  assert (use_color_);
+
+  ReadbackFrame *frame = waitReadback (frame_id);
+
+  if (frame == NULL) {
+    return false;
+  }
+
+  color_image->resize (width_ * height_ * 3);
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, frame->color_pbo);
+  const void *data = glMapBuffer (GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+
+  if (data) {
+    memcpy (color_image->data (), data, color_image->size ());
+    glUnmapBuffer (GL_PIXEL_PACK_BUFFER);
+  }
+
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+  return data != NULL;
+}
+
+void
+RangeLikelihood::renderTiles (const
+                              std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+                              &poses) {
+  assert (static_cast<int> (poses.size ()) <= rows_ * cols_);
+  render (poses);
+}
+
+void
+RangeLikelihood::computeTileScores (float *reference,
+                                    std::vector<float> &scores) {
+  scores.resize (cols_ * rows_);
+  std::fill (scores.begin (), scores.end (), 0);
+
+  if (compute_likelihood_on_cpu_) {
+    computeScores (reference, scores);
+    return;
+  }
+
+  computeScoresShader (reference);
+
+  if (aggregate_on_cpu_) {
+    const float *score_buffer = getScoreBuffer ();
+
+    for (int n = 0, row = 0; row < height_; ++row) {
+      for (int col = 0; col < width_; ++col, ++n) {
+        scores[row / row_height_ * cols_ + col / col_width_] += score_buffer[n];
+      }
+    }
+  } else {
+    // Each level of the reduction halves the tiles, the tiles stay aligned
+    // as long as both of their sides are even
+    int levels = max_level (row_height_, col_width_);
+    int reduced_width = width_ >> levels;
+    int reduced_height = height_ >> levels;
+    int reduced_col_width = col_width_ >> levels;
+    int reduced_row_height = row_height_ >> levels;
+
+    std::vector<float> score_sum (reduced_width * reduced_height);
+    sum_reduce_.sum (score_texture_, score_sum.data ());
+
+    for (int n = 0, row = 0; row < reduced_height; ++row) {
+      for (int col = 0; col < reduced_width; ++col, ++n) {
+        scores[row / reduced_row_height * cols_ + col / reduced_col_width] +=
+          score_sum[n];
+      }
+    }
+  }
+}
@@ -16,26 +16,41 @@ namespace simulation
 void
 Scene::add (Model::Ptr model)
 {
-  models_.push_back(model);
+  add (model, Eigen::Matrix4f::Identity ());
+}
+
+void
+Scene::add (Model::Ptr model, const Eigen::Matrix4f &pose)
+{
+  models_.push_back (model);
+  poses_.push_back (pose);
 }
 
 void
 Scene::addCompleteModel (std::vector<Model::Ptr> model)
 {
-  models_.push_back (model[0]);
+  add (model[0]);
 }
 
 void
 Scene::draw ()
 {
-  for (std::vector<Model::Ptr>::iterator model = models_.begin (); model != models_.end (); ++model)
-    (*model)->draw ();
+  glMatrixMode (GL_MODELVIEW);
+  for (size_t i = 0; i < models_.size (); ++i)
+  {
+    glPushMatrix ();
+    // Eigen matrices are column major like OpenGL
+    glMultMatrixf (poses_[i].data ());
+    models_[i]->draw ();
+    glPopMatrix ();
+  }
 }
 
 void
 Scene::clear ()
 {
   models_.clear();
+  poses_.clear();
 }
 
 } // namespace - simulation
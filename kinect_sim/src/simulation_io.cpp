@@ -3,12 +3,27 @@
 #include <pcl/io/png_io.h>
 
 #include <opencv2/core/core.hpp>
+#include <cstring>
 
-pcl::simulation::SimExample::SimExample(int argc, char **argv,
-                                        int height, int width, bool use_opengl):
-  height_(height), width_(width) {
+#ifdef KINECT_SIM_WITH_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 
-  initializeGL (argc, argv);
+pcl::simulation::SimExample::SimExample(int argc, char **argv,
+                                        int height, int width, bool use_opengl,
+                                        ContextBackend context_backend):
+  height_(height), width_(width), context_backend_(context_backend),
+  egl_display_(NULL), egl_context_(NULL), egl_surface_(NULL) {
+
+  if (context_backend_ == HEADLESS_EGL) {
+    if (!initializeEGL ()) {
+      std::cerr << "Error: could not create a headless EGL context" << std::endl;
+      exit (-1);
+    }
+  } else {
+    initializeGL (argc, argv);
+  }
 
   // 1. construct member elements:
   camera_ = Camera::Ptr (new Camera ());
@@ -22,6 +37,8 @@ pcl::simulation::SimExample::SimExample(int argc, char **argv,
   // Actually corresponds to default parameters:
   rl_->setCameraIntrinsicsParameters (width_, height_, kCameraFX,
                                       kCameraFY, kCameraCX, kCameraCY);
+  // Renders of doSimAsync in flight
+  rl_->setReadbackFrames (2);
   rl_->setComputeOnCPU (false);
   rl_->setSumOnCPU (true);
   rl_->setUseColor (true);
@@ -78,8 +95,133 @@ pcl::simulation::SimExample::initializeGL (int argc, char **argv) {
   //glutInitWindowSize (window_width_, window_height_);
   glutCreateWindow ("OpenGL range likelihood");
 
+  initializeGLEW ();
+}
+
+pcl::simulation::SimExample::~SimExample () {
+  // The GL objects go with the context they were created in
+  makeCurrent ();
+  tiled_rl_.reset ();
+  rl_.reset ();
+  scene_.reset ();
+
+#ifdef KINECT_SIM_WITH_EGL
+  if (context_backend_ == HEADLESS_EGL) {
+    eglMakeCurrent (egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (egl_surface_ != EGL_NO_SURFACE) {
+      eglDestroySurface (egl_display_, egl_surface_);
+    }
+    eglDestroyContext (egl_display_, egl_context_);
+    eglTerminate (egl_display_);
+  }
+#endif
+}
+
+bool
+pcl::simulation::SimExample::initializeEGL () {
+#ifdef KINECT_SIM_WITH_EGL
+  egl_display_ = EGL_NO_DISPLAY;
+  egl_context_ = EGL_NO_CONTEXT;
+  egl_surface_ = EGL_NO_SURFACE;
+
+  // Prefer the first GPU device, which needs no display server, then the
+  // default display (Mesa picks surfaceless or llvmpipe through EGL_PLATFORM)
+  PFNEGLQUERYDEVICESEXTPROC query_devices =
+    (PFNEGLQUERYDEVICESEXTPROC) eglGetProcAddress ("eglQueryDevicesEXT");
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress ("eglGetPlatformDisplayEXT");
+  EGLDeviceEXT device;
+  EGLint num_devices = 0;
+
+  if (query_devices && get_platform_display &&
+      query_devices (1, &device, &num_devices) && num_devices > 0) {
+    egl_display_ = get_platform_display (EGL_PLATFORM_DEVICE_EXT, device, NULL);
+  }
+
+  if (egl_display_ == EGL_NO_DISPLAY) {
+    egl_display_ = eglGetDisplay (EGL_DEFAULT_DISPLAY);
+  }
+
+  EGLint major, minor;
+  if (egl_display_ == EGL_NO_DISPLAY || !eglInitialize (egl_display_, &major, &minor)) {
+    std::cerr << "Error: eglInitialize failed" << std::endl;
+    return false;
+  }
+
+  std::cout << "Status: Using EGL " << major << "." << minor << std::endl;
+
+  const EGLint config_attribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 24,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint num_configs = 0;
+
+  if (!eglChooseConfig (egl_display_, config_attribs, &config, 1, &num_configs) ||
+      num_configs < 1) {
+    std::cerr << "Error: no EGL config for desktop OpenGL" << std::endl;
+    return false;
+  }
+
+  // Desktop GL without a requested version gives a compatibility context, the
+  // renderer uses the fixed function pipeline
+  eglBindAPI (EGL_OPENGL_API);
+  egl_context_ = eglCreateContext (egl_display_, config, EGL_NO_CONTEXT, NULL);
+
+  if (egl_context_ == EGL_NO_CONTEXT) {
+    std::cerr << "Error: eglCreateContext failed" << std::endl;
+    return false;
+  }
+
+  // Everything is drawn into framebuffer objects, a surface is only created
+  // when the driver can not make a context current without one
+  const char *extensions = eglQueryString (egl_display_, EGL_EXTENSIONS);
+
+  if (extensions == NULL || strstr (extensions, "EGL_KHR_surfaceless_context") == NULL) {
+    const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    egl_surface_ = eglCreatePbufferSurface (egl_display_, config, pbuffer_attribs);
+  }
+
+  if (!eglMakeCurrent (egl_display_, egl_surface_, egl_surface_, egl_context_)) {
+    std::cerr << "Error: eglMakeCurrent failed" << std::endl;
+    return false;
+  }
+
+  initializeGLEW ();
+  return true;
+#else
+  std::cerr << "Error: kinect_sim was built without EGL" << std::endl;
+  return false;
+#endif
+}
+
+void
+pcl::simulation::SimExample::makeCurrent () {
+#ifdef KINECT_SIM_WITH_EGL
+  if (context_backend_ == HEADLESS_EGL) {
+    eglMakeCurrent (egl_display_, egl_surface_, egl_surface_, egl_context_);
+  }
+#endif
+}
+
+void
+pcl::simulation::SimExample::initializeGLEW () {
+  // The entry points are looked up through the current context
+  glewExperimental = GL_TRUE;
   GLenum err = glewInit ();
 
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+  // GLEW built for GLX can not query GLX extensions of an EGL context
+  if (err == GLEW_ERROR_NO_GLX_DISPLAY && context_backend_ == HEADLESS_EGL) {
+    err = GLEW_OK;
+  }
+#endif
+
   if (GLEW_OK != err) {
     std::cerr << "Error: " << glewGetErrorString (err) << std::endl;
     exit (-1);
@@ -134,6 +276,14 @@ pcl::simulation::SimExample::doSim (Eigen::Isometry3d pose_in) {
   delete [] reference;
 }
 
+int
+pcl::simulation::SimExample::doSimAsync (Eigen::Isometry3d pose_in) {
+  std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+                                                                           poses;
+  poses.push_back (pose_in);
+  return rl_->renderAsync (poses);
+}
+
 
 
 void
@@ -395,6 +545,82 @@ pcl::simulation::SimExample::get_depth_image_uint(const float *depth_buffer,
   }
 }
 
+void
+pcl::simulation::SimExample::initTiles (int rows, int cols, int tile_height, int tile_width) {
+  tiled_rl_ = RangeLikelihood::Ptr (new RangeLikelihood (rows, cols, tile_height, tile_width, scene_));
+  tiled_rl_->setCameraIntrinsicsParameters (width_, height_, kCameraFX,
+                                            kCameraFY, kCameraCX, kCameraCY);
+  tiled_rl_->setComputeOnCPU (false);
+  tiled_rl_->setSumOnCPU (false);
+}
+
+void
+pcl::simulation::SimExample::doSimBatch (const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>> &poses,
+                                         float *reference, std::vector<float> *scores) {
+  assert (tiled_rl_);
+  tiled_rl_->renderTiles (poses);
+
+  if (reference != NULL && scores != NULL) {
+    tiled_rl_->computeTileScores (reference, *scores);
+  }
+
+  const int width = tiled_rl_->getWidth ();
+  const int height = tiled_rl_->getHeight ();
+  cv::Mat (height, width, CV_16UC1,
+           const_cast<unsigned short *> (tiled_rl_->getDepthBufferMM ())).copyTo (tiled_depth_);
+  // The color buffer has its rows bottom up
+  cv::flip (cv::Mat (height, width, CV_8UC3,
+                     const_cast<uint8_t *> (tiled_rl_->getColorBuffer ())), tiled_color_, 0);
+}
+
+cv::Rect
+pcl::simulation::SimExample::tileRect (int tile) const {
+  // Tile rows are counted from the bottom of the framebuffer
+  const int tile_width = tiled_rl_->getColWidth ();
+  const int tile_height = tiled_rl_->getRowHeight ();
+  const int row = tile / tiled_rl_->getCols ();
+  const int col = tile % tiled_rl_->getCols ();
+  return cv::Rect (col * tile_width, tiled_rl_->getHeight () - (row + 1) * tile_height,
+                   tile_width, tile_height);
+}
+
+cv::Mat
+pcl::simulation::SimExample::get_tile_depth_image_cv (int tile) {
+  return tiled_depth_ (tileRect (tile));
+}
+
+cv::Mat
+pcl::simulation::SimExample::get_tile_rgb_image_cv (int tile) {
+  return tiled_color_ (tileRect (tile));
+}
+
+void
+pcl::simulation::SimExample::get_depth_image_uint(std::vector<unsigned short> *depth_img) {
+  const unsigned short *depth_buffer = rl_->getDepthBufferMM();
+  depth_img->assign(depth_buffer, depth_buffer + rl_->getWidth() * rl_->getHeight());
+}
+
+void
+pcl::simulation::SimExample::get_depth_image_cv(cv::Mat &depth_image) {
+  const unsigned short *depth_buffer = rl_->getDepthBufferMM();
+  depth_image.create(height_, width_, CV_16UC1);
+  memcpy(depth_image.data, depth_buffer, width_ * height_ * sizeof(unsigned short));
+}
+
+bool
+pcl::simulation::SimExample::get_depth_image_uint(int frame,
+                                                  std::vector<unsigned short> *depth_img) {
+  return rl_->getDepthImageMM(frame, depth_img);
+}
+
+const uint8_t *
+pcl::simulation::SimExample::get_rgb_buffer(int frame) {
+  if (!rl_->getColorImage(frame, &frame_color_)) {
+    return NULL;
+  }
+  return frame_color_.data();
+}
+
 void pcl::simulation::SimExample::get_depth_image_cv(const float *depth_buffer,
                                                      cv::Mat &depth_image) {
   int npixels = rl_->getWidth() * rl_->getHeight();
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace sbpl_perception {
+
+// Shared-memory executor for the cost computations of one MPI rank.
+// The jobs run on a team of OpenMP worker threads, and each worker takes the
+// next job from a shared counter when it finishes one. A slow job therefore
+// never holds back a fixed partition of the other jobs.
+// The simulator renders through an OpenGL context that is current only on the
+// thread that created it. So the calling thread does not run jobs: it serves
+// the renders that the workers hand over through Render().
+class CostExecutor {
+ public:
+  CostExecutor();
+
+  // Runs job(ii) for every ii in [0, num_jobs) and returns once all are done.
+  // With num_threads <= 1 the jobs run in order on the calling thread.
+  // If a job throws, no further jobs are started and the first exception is
+  // rethrown once the running ones have finished.
+  void Run(int num_jobs, int num_threads, const std::function<void(int)> &job);
+
+  // Runs render on the thread serving renders and waits for it. Outside of
+  // Run, or on the serving thread itself, it is called directly. An exception
+  // thrown by render is rethrown here.
+  void Render(const std::function<void()> &render);
+
+ private:
+  struct RenderRequest {
+    const std::function<void()> *render;
+    bool done;
+    std::exception_ptr error;
+  };
+
+  // Runs the queued renders until all jobs are done.
+  void ServeRenders(int num_jobs);
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<RenderRequest *> requests_;
+  std::thread::id render_thread_;
+  bool running_;
+  int jobs_done_;
+  // First exception thrown by a job of the current run.
+  std::exception_ptr error_;
+};
+
+}  // namespace sbpl_perception
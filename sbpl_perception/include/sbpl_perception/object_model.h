@@ -51,6 +51,11 @@ class ObjectModel {
 
   pcl::PolygonMeshPtr GetTransformedMesh(const Eigen::Matrix4f &transform) const;
 
+  // Transform of the mesh at pose p with the translation moved so that the mesh
+  // centroid lands at the pose position, as GetTransformedMeshWithShift does. p is
+  // updated to the shifted pose.
+  Eigen::Matrix4f GetShiftedTransform(ContPose &p) const;
+
   // Returns true if point is within the mesh model, where the model has been
   // transformed by the given pose and height.
   std::vector<bool> PointsInsideMesh(const std::vector<Eigen::Vector3d> &points, const ContPose &pose) const;
@@ -129,6 +134,8 @@ class ObjectModel {
   double max_x_, max_y_, max_z_;
   PointCloudPtr convex_hull_footprint_; // Convex polygon footprint for the object in default orientation.
   Eigen::Affine3f preprocessing_transform_;
+  // Mean of the vertices of mesh_
+  Eigen::Vector3f mesh_centroid_;
   // Inflation factor for the mesh, which is a function of the inscribed
   // radius. This is used in methods that check if a point is within the
   // footprint or volume of the mesh.
@@ -3,6 +3,8 @@
 #include <boost/serialization/serialization.hpp>
 
 #include <iostream>
+#include <string>
+#include <type_traits>
 
 #include <Eigen/Geometry>
 
@@ -19,42 +21,49 @@ class ContPose {
   ContPose(const DiscPose &disc_pose);
   ContPose(int external_pose_id, std::string external_render_path, double x, double y, double z, double roll, double pitch, double yaw);
 
-  const int &external_pose_id() const {
+  // Render roots are interned once into a process-wide table so that poses
+  // only carry a small id. Id 0 is the default root.
+  static int InternRenderRoot(const std::string &render_root);
+  static const std::string &RenderRoot(int render_root_id);
+
+  int external_pose_id() const {
     return external_pose_id_;
   }
-
+  int render_root_id() const {
+    return render_root_id_;
+  }
   const std::string &external_render_path() const {
-    return external_render_path_;
+    return RenderRoot(render_root_id_);
   }
 
-  const double &x() const {
+  double x() const {
     return x_;
   }
-  const double &y() const {
+  double y() const {
     return y_;
   }
-  const double &z() const {
+  double z() const {
     return z_;
   }
-  const double &roll() const {
+  double roll() const {
     return roll_;
   }
-  const double &pitch() const {
+  double pitch() const {
     return pitch_;
   }
-  const double &yaw() const {
+  double yaw() const {
     return yaw_;
   }
-  const double &qx() const {
+  double qx() const {
     return qx_;
   }
-  const double &qy() const {
+  double qy() const {
     return qy_;
   }
-  const double &qz() const {
+  double qz() const {
     return qz_;
   }
-  const double &qw() const {
+  double qw() const {
     return qw_;
   }
   Eigen::Isometry3d GetTransform() const;
@@ -72,23 +81,30 @@ class ContPose {
   // second, and yaw finally. All rotations are wrt. the fixed world frame, and
   // not the body frame. More details here:
   // http://planning.cs.uiuc.edu/node102.html.
-  double x_ = 0.0;
-  double y_ = 0.0;
-  double z_ = 0.0;
-  double roll_ = 0.0;
-  double pitch_ = 0.0;
-  double yaw_ = 0.0;
-  double qx_ = 0.0;
-  double qy_ = 0.0;
-  double qz_ = 0.0;
-  double qw_ = 0.0;
+  // The Euler angles only index the discrete lattice. The rotation itself is
+  // always the quaternion, kept normalized with qw >= 0 so that equal
+  // rotations compare equal component-wise.
+  float x_ = 0.0f;
+  float y_ = 0.0f;
+  float z_ = 0.0f;
+  float roll_ = 0.0f;
+  float pitch_ = 0.0f;
+  float yaw_ = 0.0f;
+  float qx_ = 0.0f;
+  float qy_ = 0.0f;
+  float qz_ = 0.0f;
+  float qw_ = 1.0f;
   int external_pose_id_ = -1;
-  std::string external_render_path_= "/media/aditya/A69AFABA9AFA85D9/Cruzr/code/DOPE/catkin_ws/src/perception/sbpl_perception/data/YCB_Video_Dataset/rendered/";
+  // Index into this process's render root table. It is not serialized, so a
+  // pose received over MPI refers to the default root.
+  int render_root_id_ = 0;
+
+  void SetQuaternion(const Eigen::Quaterniond &quaternion);
 
   friend class boost::serialization::access;
   template <typename Ar> void serialize(Ar &ar, const unsigned int) {
     ar &external_pose_id_;
-    // ar &external_render_path_;
+    // ar &render_root_id_;
     ar &x_;
     ar &y_;
     ar &z_;
@@ -178,6 +194,9 @@ class ObjectState {
   bool operator==(const ObjectState &other) const;
   bool operator!=(const ObjectState &other) const;
 
+  // Hash over the discrete pose, consistent with operator==.
+  size_t GetHash() const;
+
  private:
   int id_;
   int segmentation_label_id_ = -1;
@@ -195,6 +214,15 @@ class ObjectState {
 
 };
 
+// States are copied into every successor, hash entry and MPI message, so
+// they must stay plain bitwise-copyable values (see mpi_utils.h).
+static_assert(std::is_trivially_copyable<ContPose>::value,
+              "ContPose must be trivially copyable");
+static_assert(std::is_trivially_copyable<DiscPose>::value,
+              "DiscPose must be trivially copyable");
+static_assert(std::is_trivially_copyable<ObjectState>::value,
+              "ObjectState must be trivially copyable");
+
 std::ostream &operator<< (std::ostream &stream, const DiscPose &disc_pose);
 std::ostream &operator<< (std::ostream &stream, const ContPose &cont_pose);
 std::ostream &operator<< (std::ostream &stream,
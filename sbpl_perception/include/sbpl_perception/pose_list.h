@@ -0,0 +1,78 @@
+#pragma once
+
+#include <sbpl_perception/object_state.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sbpl_perception {
+
+// Binary pose list stored next to the text poses.txt written by the external
+// pose generator (<rendered_root_dir>/<model>/poses.bin). The file is a
+// PoseListHeader followed by num_poses rows of
+// kPoseListDim doubles (x y z qx qy qz qw), in the same order as poses.txt.
+constexpr char kPoseListMagic[8] = {'P', 'E', 'R', 'C', 'H', 'P', 'L', '\0'};
+constexpr uint32_t kPoseListVersion = 1;
+constexpr uint32_t kPoseListDim = 7;
+
+struct PoseListHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t pose_dim;
+  uint64_t num_poses;
+};
+
+// Read-only view of a binary pose list. The file is memory-mapped, so opening
+// it costs nothing regardless of the number of poses and pages are only read
+// as the poses are streamed.
+class PoseList {
+ public:
+  PoseList();
+  ~PoseList();
+  PoseList(const PoseList &) = delete;
+  PoseList &operator=(const PoseList &) = delete;
+
+  // Maps the binary pose list at bin_path. Returns false if the file is
+  // missing or not a valid pose list.
+  bool Open(const std::string &bin_path);
+  // Parses a text poses.txt into memory, used when the binary cannot be
+  // written (e.g. read-only dataset directory).
+  bool OpenText(const std::string &txt_path);
+  void Close();
+
+  bool is_open() const {
+    return poses_ != nullptr;
+  }
+  size_t size() const {
+    return num_poses_;
+  }
+  ContPose pose(size_t index) const;
+
+ private:
+  void *mapped_data_;
+  size_t mapped_size_;
+  const double *poses_;
+  size_t num_poses_;
+  std::vector<double> text_poses_;
+};
+
+// Parses poses.txt and writes it as a binary pose list. The output is written
+// to a temporary file and renamed, so other processes never see a partial
+// file. Returns the number of poses written, or -1 on failure.
+int ConvertPoseListToBinary(const std::string &txt_path,
+                            const std::string &bin_path);
+
+// Opens <model_dir>/poses.bin, converting <model_dir>/poses.txt first if the
+// binary is missing or older than the text file.
+bool OpenModelPoseList(const std::string &model_dir, PoseList *pose_list);
+
+// Position of a streaming read over the pose lists of all models, see
+// EnvObjectRecognition::GetNextExternalPoseBatch.
+struct PoseListCursor {
+  int model_id = 0;
+  size_t pose_index = 0;
+  PoseList pose_list;
+};
+
+}  // namespace sbpl_perception
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <sbpl_perception/object_state.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace sbpl_perception {
+
+// Identifies the rendering of a single object: the image only depends on the
+// model, its discrete pose and the camera it is rendered from. Rotations of
+// symmetric models are zeroed by the caller, so that all of their yaws share
+// one entry just like they share one ObjectState.
+struct RenderCacheKey {
+  int model_id;
+  DiscPose disc_pose;
+  size_t camera_hash;
+
+  bool operator==(const RenderCacheKey &other) const {
+    return model_id == other.model_id && disc_pose == other.disc_pose &&
+           camera_hash == other.camera_hash;
+  }
+};
+
+struct RenderCacheKeyHash {
+  size_t operator()(const RenderCacheKey &key) const;
+};
+
+// Memory-budgeted LRU cache of single object depth images.
+// Only the bounding rectangle of the pixels covered by the object is stored,
+// together with its offset in the frame; the rest of the frame is the empty
+// depth value and is filled back in on lookup. When the budget is exceeded,
+// the least recently used images are evicted. Thread-safe.
+class RenderCache {
+ public:
+  // A budget of 0 means unbounded.
+  explicit RenderCache(size_t budget_bytes = 0);
+
+  void SetBudget(size_t budget_bytes);
+
+  // Stores a width x height image, pixels equal to empty_depth are not part
+  // of the object. Replaces any image stored for the same key.
+  void Insert(const RenderCacheKey &key, const std::vector<unsigned short> &image,
+              int width, int height, unsigned short empty_depth);
+  // Returns false if the key is not cached, otherwise fills image with the full
+  // frame and marks the entry as most recently used.
+  bool Lookup(const RenderCacheKey &key, std::vector<unsigned short> *image);
+  void Clear();
+
+  size_t NumEntries() const;
+  size_t SizeBytes() const;
+  uint64_t hits() const;
+  uint64_t misses() const;
+  uint64_t evictions() const;
+
+ private:
+  struct Entry {
+    RenderCacheKey key;
+    int frame_width;
+    int frame_height;
+    unsigned short empty_depth;
+    // Region of interest, row-major
+    int roi_x;
+    int roi_y;
+    int roi_width;
+    int roi_height;
+    std::vector<unsigned short> roi;
+  };
+
+  static size_t EntryBytes(const Entry &entry);
+  // Must be called with mutex_ held.
+  void Erase(std::list<Entry>::iterator it);
+  void EvictToBudget();
+
+  size_t budget_bytes_;
+  size_t size_bytes_;
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t evictions_;
+  // Most recently used first.
+  std::list<Entry> entries_;
+  std::unordered_map<RenderCacheKey, std::list<Entry>::iterator, RenderCacheKeyHash>
+  index_;
+  mutable std::mutex mutex_;
+};
+
+}  // namespace sbpl_perception
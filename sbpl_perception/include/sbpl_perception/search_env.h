@@ -8,6 +8,7 @@
  */
 
 #include <cuda_renderer/renderer.h>
+#include <cuda_renderer/cpu/projective_nn.h>
 // #include <cuda_icp/icp.h>
 // #include <cuda_icp/helper.h>
 #include <cuda_renderer/knncuda.h>
@@ -21,9 +22,14 @@
 #include <sbpl_perception/graph_state.h>
 #include <sbpl_perception/mpi_utils.h>
 #include <sbpl_perception/object_model.h>
+#include <sbpl_perception/pose_list.h>
 #include <sbpl_perception/rcnn_heuristic_factory.h>
+#include <sbpl_perception/cost_executor.h>
+#include <sbpl_perception/render_cache.h>
+#include <sbpl_perception/utils/bounded_queue.h>
 #include <sbpl_perception/utils/utils.h>
 #include <sbpl_utils/hash_manager/hash_manager.h>
+#include <cuda_icp/icp.h>
 
 #include <boost/mpi.hpp>
 #include <Eigen/Dense>
@@ -53,6 +59,7 @@
 #include <fast_gicp/gicp/fast_gicp_st.hpp>
 #include <fast_gicp/gicp/fast_gicp_cuda.hpp>
 
+#include <climits>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -145,7 +152,38 @@ struct PERCHParams {
 
   bool use_color_cost;
   int gpu_batch_size;
+  // Number of validated batches that can wait for the renderer in the greedy pipeline
+  int gpu_pipeline_depth;
   bool use_gpu;
+  // Run the unified render/cost flow with the OpenMP backend of cuda_renderer
+  bool use_cpu_renderer;
+  // Greedy search first ranks poses on a coarse pose grid rendered at a lower
+  // resolution, then does the full resolution render and ICP only around the
+  // best coarse_top_k poses of every model.
+  bool use_coarse_to_fine;
+  // Camera resolution is divided by this factor for the coarse render.
+  int coarse_image_scale;
+  // x, y and yaw resolutions are multiplied by this factor for the coarse grid (3-Dof).
+  int coarse_grid_factor;
+  int coarse_top_k;
+  // Find the observed neighbours of rendered points by projecting them into
+  // the observed image instead of a brute force search. The CPU cost functions
+  // search the pixel grids of the observed and rendered clouds instead of kd-trees.
+  bool use_projective_association;
+  // Score poses that are not refined on the GPU with the fused render-to-cost
+  // kernel, which skips the rendered images and clouds. Needs projective association.
+  bool use_fused_cost;
+  // Keep the lowest greedy cost of every model across GPU batches and stop
+  // scoring poses of later batches once their cost provably reaches it.
+  bool use_cost_bound;
+  // Memory budget of each of the single object depth image caches, 0 for unbounded.
+  int render_cache_mb;
+  // Threads computing the successor costs of each MPI rank, renders stay on the
+  // thread of the rank that owns the OpenGL context. 1 computes them serially.
+  int num_cost_threads;
+  // Render the CPU flow through an offscreen EGL context instead of a GLUT
+  // window, for machines without a display.
+  bool headless_render;
   double color_distance_threshold;
   double gpu_stride;
   bool use_cylinder_observed;
@@ -154,6 +192,9 @@ struct PERCHParams {
 
   double depth_median_blur;
   int icp_type;
+  // Refine the 3-Dof poses of icp_type 0 and 1 with one batched point to plane ICP
+  // against the observed cloud, instead of one PCL ICP per pose.
+  bool use_batch_icp;
 
   PERCHParams() : initialized(false) {}
 
@@ -178,7 +219,19 @@ struct PERCHParams {
     ar &downsampling_leaf_size;
     ar &use_color_cost;
     ar &gpu_batch_size;
+    ar &gpu_pipeline_depth;
     ar &use_gpu;
+    ar &use_cpu_renderer;
+    ar &use_coarse_to_fine;
+    ar &coarse_image_scale;
+    ar &coarse_grid_factor;
+    ar &coarse_top_k;
+    ar &use_projective_association;
+    ar &use_fused_cost;
+    ar &use_cost_bound;
+    ar &render_cache_mb;
+    ar &num_cost_threads;
+    ar &headless_render;
     ar &color_distance_threshold;
     ar &gpu_stride;
     ar &use_cylinder_observed;
@@ -186,11 +239,36 @@ struct PERCHParams {
     ar &footprint_tolerance;
     ar &depth_median_blur;
     ar &icp_type;
+    ar &use_batch_icp;
   }
 };
 // BOOST_IS_MPI_DATATYPE(PERCHParams);
 // BOOST_IS_BITWISE_SERIALIZABLE(PERCHParams);
 
+// Images of one simulator render, as GetDepthImage returns them
+struct RenderedImages {
+  std::vector<unsigned short> depth_image;
+  std::vector<std::vector<unsigned char>> color_image;
+  cv::Mat cv_depth_image;
+  cv::Mat cv_color_image;
+};
+
+// Per pose inputs of the unified GPU flow, see GetGPURenderInputs
+struct GPURenderInputs {
+  std::vector<cuda_renderer::Model::mat4x4> poses;
+  std::vector<int> pose_model_map;
+  std::vector<int> pose_segmentation_label;
+  std::vector<float> pose_observed_points_total;
+};
+
+// Batch of greedy states handed from the producer to the renderer thread
+struct GPUPoseBatch {
+  // Index of the first state in the cost outputs
+  int start_index;
+  std::vector<ObjectState> states;
+  GPURenderInputs render_inputs;
+};
+
 class EnvObjectRecognition : public EnvironmentMHA {
  public:
   explicit EnvObjectRecognition(const std::shared_ptr<boost::mpi::communicator>
@@ -234,6 +312,39 @@ class EnvObjectRecognition : public EnvironmentMHA {
                              cv::Mat *cv_color_image,
                              int* num_occluders_in_input_cloud);
 
+  // The two above, run on the thread that renders for cost_executor_. The returned
+  // depth buffer belongs to the simulator and is only valid until the next render,
+  // it is null for the simulator render, whose depth is only read back in millimeters.
+  const float *GetDepthImageOnRenderThread(GraphState &s,
+                                           std::vector<unsigned short> *depth_image,
+                                           std::vector<std::vector<unsigned char>> *color_image,
+                                           cv::Mat &cv_depth_image,
+                                           cv::Mat &cv_color_image,
+                                           int* num_occluders_in_input_cloud,
+                                           bool shift_centroid);
+  // Renders the states in order into images, skipping states without objects.
+  // Up to the simulator's readback frames renders are queued before the oldest
+  // is read back, so reading back one overlaps with rendering the next ones.
+  void GetDepthImages(std::vector<GraphState> &states,
+                      std::vector<RenderedImages> *images);
+  void GetDepthImagesOnRenderThread(std::vector<GraphState> &states,
+                                    std::vector<RenderedImages> *images);
+  // The two halves of GetDepthImageOnRenderThread: SubmitDepthImage sets up the
+  // scene of s and starts its render, FetchDepthImage waits for the frame it returned.
+  int SubmitDepthImage(GraphState &s, bool shift_centroid);
+  void FetchDepthImage(int frame,
+                       std::vector<unsigned short> *depth_image,
+                       std::vector<std::vector<unsigned char>> *color_image,
+                       cv::Mat &cv_depth_image,
+                       cv::Mat &cv_color_image,
+                       int* num_occluders_in_input_cloud);
+  const float *GetDepthImageOnRenderThread(GraphState s,
+                                           std::vector<unsigned short> *depth_image,
+                                           std::vector<std::vector<unsigned char>> *color_image,
+                                           cv::Mat *cv_depth_image,
+                                           cv::Mat *cv_color_image,
+                                           int* num_occluders_in_input_cloud);
+
   const float *GetDepthImage(GraphState s,
                              std::vector<unsigned short> *depth_image);
 
@@ -392,12 +503,22 @@ class EnvObjectRecognition : public EnvironmentMHA {
   //                                 int start_index);
   vector<float> segmented_observed_point_count;
   std::vector<pcl::search::KdTree<PointT>::Ptr> segmented_object_knn;
+  // ICP targets built once per observation in SetObservation, only read by the ICP workers
+  PointCloudPtr icp_target_cloud_;
+  pcl::search::KdTree<PointT>::Ptr icp_target_knn_;
+  // icp_target_cloud_ with its normals for the batched ICP, the scene points into the tree
+  KDTree_linear icp_target_tree_;
+  Scene_nn_linear icp_target_scene_;
+  std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> segmented_object_clouds_xyz_;
+  // fast_gicp keeps the target kd-tree and covariances in the registration object, so
+  // every OpenMP thread keeps one per segmented object, created on first use
+  std::vector<std::vector<std::shared_ptr<fast_gicp::FastGICP<pcl::PointXYZ, pcl::PointXYZ>>>> segmented_object_gicp_;
+  // Index of a segmented object cloud in segmented_object_clouds, -1 for other clouds
+  int SegmentedObjectIndex(const PointCloudPtr &cloud) const;
   std::vector<uint8_t> predicted_mask_image;
   // std::vector<int32_t> input_depth_image_vec;
 
   // CUDA GPU stuff
-  std::unordered_map<int, std::vector<int32_t>> gpu_depth_image_cache_;
-  std::unordered_map<int, std::vector<std::vector<uint8_t>>> gpu_color_image_cache_;
   // Function do tree search with GPU expansions - doesnt work as of now
   void ComputeCostsInParallelGPU(std::vector<CostComputationInput> &input,
                               std::vector<CostComputationOutput> *output, bool lazy);
@@ -405,17 +526,43 @@ class EnvObjectRecognition : public EnvironmentMHA {
   void ComputeGreedyCostsInParallelGPU(const std::vector<int32_t> &source_result_depth,
                                       const std::vector<ObjectState> &last_object_states,
                                       std::vector<CostComputationOutput> &output,
-                                      int batch_index);
-  vector<int> tris_model_count;
-  vector<cuda_renderer::Model::Triangle> tris;
+                                      int batch_index,
+                                      const GPURenderInputs *render_inputs = nullptr);
+  // Appends the pre-ICP cost of every state rendered at 1/coarse_image_scale of
+  // the camera resolution, -1 for invalid states. Used to rank states only.
+  void ComputeCoarseCostsGPU(const std::vector<int32_t> &source_result_depth,
+                             const std::vector<ObjectState> &object_states,
+                             std::vector<int> *costs,
+                             const GPURenderInputs *render_inputs = nullptr);
+  // States to score at full resolution : the coarse_top_k lowest cost states
+  // of every model and, for 3-Dof, the fine grid states around them.
+  std::vector<ObjectState> GetCoarseToFineStates(
+    const std::vector<ObjectState> &coarse_states,
+    const std::vector<int> &coarse_costs,
+    const std::vector<ObjectState> &fine_states);
+  // Cost type used by the unified GPU flow for the current scene type
+  int GetGPUCostType() const;
+  // Stage of the unified GPU flow that only returns costs, FUSED_COST when
+  // enabled (the renderer falls back to COST where it does not apply).
+  std::string FusedCostStage() const;
+  // Lowest greedy candidate cost of every model in the batches scored so far,
+  // INT_MAX before the first candidate. Bounds the costs of the next batches.
+  vector<int> greedy_cost_bound_;
+  // Handle in renderer_context_.models of every model in obj_models_
+  vector<int> model_render_handles_;
   float gpu_depth_factor = 100.0;
   float input_depth_factor;
   int gpu_point_dim = 3;
   // Stride should divide width exactly
   int gpu_stride = 5;
+  // Buffers reused by every GetStateImagesUnifiedGPU call, outputs returned by the renderer
+  // (result_cloud, costs etc.) point into it and are valid until the next call
+  cuda_renderer::RendererContext renderer_context_;
   float* result_observed_cloud;
   Eigen::Vector3f* result_observed_cloud_eigen;
   uint8_t* result_observed_cloud_color;
+  // Lab colors of result_observed_cloud_color, same layout
+  std::vector<float> result_observed_cloud_lab;
   int observed_point_num;
   int* observed_dc_index;
   int32_t* observed_depth_data;
@@ -443,6 +590,13 @@ class EnvObjectRecognition : public EnvironmentMHA {
                               bool do_icp,
                               ros::Publisher render_point_cloud_topic,
                               bool print_cloud);
+  // 3-Dof ICP of the clouds of all occluded poses in one cuda_icp batch against
+  // icp_target_scene_, poses that are not occluded are copied
+  void GetBatchICPAdjustedPoses(const vector<ObjectState>& objects,
+                                const vector<PointCloudPtr>& clouds,
+                                const Eigen::Isometry3d& cloud_to_world,
+                                int* pose_occluded,
+                                vector<ObjectState>& modified_objects);
   // Print clouds from GPU to rviz
   void PrintGPUClouds(const vector<ObjectState>& objects,
                       float* cloud, 
@@ -493,7 +647,14 @@ class EnvObjectRecognition : public EnvironmentMHA {
                       float sensor_resolution,
                       bool do_gpu_icp,
                       int cost_type = 0,
-                      bool calculate_observed_cost = false);
+                      bool calculate_observed_cost = false,
+                      int image_scale = 1,
+                      // Cost bound of every pose, see cuda_renderer/cost_bound.h
+                      const std::vector<float> &pose_cost_bound = std::vector<float>(),
+                      const GPURenderInputs *render_inputs = nullptr);
+  // Camera frame poses and per pose cost inputs of objects for GetStateImagesUnifiedGPU
+  void GetGPURenderInputs(const vector<ObjectState> &objects,
+                          GPURenderInputs *render_inputs);
 
   // void GetICPAdjustedPosesGPU(float* result_rendered_clouds,
   //                             int* dc_index,
@@ -522,8 +683,14 @@ class EnvObjectRecognition : public EnvironmentMHA {
 
   
   std::vector<ObjectModel> obj_models_;
-  std::vector<cuda_renderer::Model> render_models_;
   pcl::simulation::Scene::Ptr scene_;
+  // Mesh of every model in obj_models_ for scene_, its vertex buffer is uploaded on
+  // the first render and kept. Objects are placed with their pose as model matrix.
+  std::vector<pcl::simulation::PolygonMeshModel::Ptr> scene_models_;
+  // Runs the successor costs of ComputeCostsInParallel on perch_params_.num_cost_threads
+  // threads. GetDepthImage hands its renders to the thread that owns scene_ and the
+  // OpenGL context through it.
+  CostExecutor cost_executor_;
 
   EnvParams env_params_;
   PERCHParams perch_params_;
@@ -560,11 +727,10 @@ class EnvObjectRecognition : public EnvironmentMHA {
   // so far in the state. For the last level states, this *does not* include the points that
   // lie outside the union volumes of all assigned objects.
   std::unordered_map<int, std::vector<int>> counted_pixels_map_;
-  // Maps state hash to depth image.
-  std::unordered_map<GraphState, std::vector<unsigned short>>
-                                                           unadjusted_single_object_depth_image_cache_;
-  std::unordered_map<GraphState, std::vector<unsigned short>>
-                                                           adjusted_single_object_depth_image_cache_;
+  // Depth images of the valid single object states, keyed by the unadjusted
+  // state. Bounded, an evicted image is rendered again on demand.
+  RenderCache unadjusted_single_object_depth_image_cache_;
+  RenderCache adjusted_single_object_depth_image_cache_;
   std::unordered_map<GraphState, GraphState> adjusted_single_object_state_cache_;
   // Maps state hash to color image.
   std::unordered_map<GraphState, std::vector<std::vector<unsigned char>>>
@@ -582,6 +748,13 @@ class EnvObjectRecognition : public EnvironmentMHA {
   std::vector<unsigned short> observed_depth_image_;
   PointCloudPtr original_input_cloud_, observed_cloud_, downsampled_observed_cloud_,
                 observed_organized_cloud_, projected_cloud_, downsampled_projected_cloud_;
+  // Lab colors of observed_cloud_ points, for the color cost
+  std::vector<Eigen::Vector3f> observed_cloud_lab_;
+  // With projective association, the CPU cost functions find neighbours in the camera image:
+  // observed_cloud_ points in the optical frame (z along the view) and their pixel grid
+  Eigen::Affine3f world_to_optical_;
+  std::vector<Eigen::Vector3f> observed_optical_points_;
+  cuda_renderer::cpu::ProjectiveNN observed_projective_nn_;
   // Refer RecognitionInput::constraint_cloud for details.
   // This is an unorganized point cloud.
   PointCloudPtr constraint_cloud_, projected_constraint_cloud_;
@@ -593,6 +766,8 @@ class EnvObjectRecognition : public EnvironmentMHA {
 
   Eigen::Matrix4f gl_inverse_transform_;
   Eigen::Isometry3d cam_to_world_;
+  // Hash of env_params_.camera_pose, part of the render cache keys.
+  size_t camera_pose_hash_;
 
   EnvStats env_stats_;
 
@@ -603,6 +778,11 @@ class EnvObjectRecognition : public EnvironmentMHA {
   void GenerateSuccessorStates(const GraphState &source_state,
                                std::vector<GraphState> *succ_states);
 
+  // Returns the next batch of at most batch_size valid object states from the
+  // external pose lists, false once all models are read.
+  bool GetNextExternalPoseBatch(PoseListCursor *cursor, int batch_size,
+                                std::vector<ObjectState> *batch);
+
   // Returns true if a valid depth image was composed.
   static bool GetComposedDepthImage(const std::vector<unsigned short>
                                     &source_depth_image, const std::vector<unsigned short>
@@ -615,6 +795,12 @@ class EnvObjectRecognition : public EnvironmentMHA {
                                   std::vector<unsigned short> *composed_depth_image,
                                   std::vector<std::vector<unsigned char>> *composed_color_image);
 
+  RenderCacheKey GetRenderCacheKey(const GraphState &single_object_graph_state) const;
+  void CacheSingleObjectDepthImage(const GraphState &single_object_graph_state,
+                                   const std::vector<unsigned short> &single_object_depth_image,
+                                   bool after_refinement);
+  // Returns false if single_object_graph_state is not a valid first level
+  // state. The image is rendered again if it has been evicted from the cache.
   bool GetSingleObjectDepthImage(const GraphState &single_object_graph_state,
                                  std::vector<unsigned short> *single_object_depth_image, bool after_refinement);
 
@@ -623,6 +809,8 @@ class EnvObjectRecognition : public EnvironmentMHA {
 
   // Computes the cost for the parent-child edge. Returns the adjusted child state, where the pose
   // of the last added object is adjusted using ICP and the computed state properties.
+  // last_object_images, if given, is the render of the last object alone at its child pose,
+  // its images are moved out.
   int GetCost(const GraphState &source_state, const GraphState &child_state,
               const std::vector<unsigned short> &source_depth_image,
               const std::vector<std::vector<unsigned char>> &source_color_image,
@@ -634,7 +822,8 @@ class EnvObjectRecognition : public EnvironmentMHA {
               std::vector<std::vector<unsigned char>> *adjusted_child_color_image,
               std::vector<unsigned short> *unadjusted_child_depth_image,
               std::vector<std::vector<unsigned char>> *unadjusted_child_color_image,
-              double &histogram_score);
+              double &histogram_score,
+              RenderedImages *last_object_images = nullptr);
 
   int GetColorOnlyCost(const GraphState &source_state, const GraphState &child_state,
               const std::vector<unsigned short> &source_depth_image,
@@ -653,6 +842,17 @@ class EnvObjectRecognition : public EnvironmentMHA {
   double getColorDistance(uint8_t r1,uint8_t g1,uint8_t b1,uint8_t r2,uint8_t g2,uint8_t b2) const;
   int getNumColorNeighboursCMC(PointT point, const PointCloudPtr point_cloud) const;
   int getNumColorNeighbours(PointT point, vector<int> indices, const PointCloudPtr point_cloud) const;
+  // Same, with the Lab colors of the cloud precomputed
+  int getNumColorNeighbours(PointT point, const vector<int> &indices,
+                            const vector<Eigen::Vector3f> &cloud_lab) const;
+
+  // Optical frame points of a cloud, see world_to_optical_
+  void GetOpticalFramePoints(const PointCloudPtr &cloud,
+                             std::vector<Eigen::Vector3f> *optical_points) const;
+  // Same result as radiusSearch(point, sensor_resolution, indices, sqr_dists, 1), on the pixel
+  // grid of a cloud instead of its kd-tree
+  int ProjectiveRadiusSearch(const cuda_renderer::cpu::ProjectiveNN &projective_nn,
+                             const PointT &point, vector<int> &indices) const;
 
   // Cost for newly rendered object. Input cloud must contain only newly rendered points.
   int GetTargetCost(const PointCloudPtr
@@ -695,6 +895,9 @@ class EnvObjectRecognition : public EnvironmentMHA {
   bool IsValidPose(GraphState s, int model_id, ContPose p,
                    bool after_refinement, int required_object_id) const;
 
+  // x, y resolution of the 3-Dof successor grid of a model
+  double GetSearchResolution(int model_id) const;
+
   int rejected_histogram_count = 0;
   bool IsValidHistogram(int object_model_id, cv::Mat last_cv_obj_color_image, double threshold, double &base_distance);
 
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+namespace sbpl_perception {
+
+// Blocking FIFO with a fixed capacity, used to hand batches from one pipeline
+// stage to the next. Push blocks while the queue is full so that a fast
+// producer can be at most `capacity` batches ahead of the consumer.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity > 0 ? capacity : 1),
+    closed_(false) {}
+
+  // Returns false if the queue was closed before the item could be added.
+  bool Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]() {
+      return closed_ || items_.size() < capacity_;
+    });
+
+    if (closed_) {
+      return false;
+    }
+
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Blocks until an item is available. Returns false once the queue is closed
+  // and all items have been popped.
+  bool Pop(T *item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]() {
+      return closed_ || !items_.empty();
+    });
+
+    if (items_.empty()) {
+      return false;
+    }
+
+    *item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  // No more items will be pushed, wakes up every waiting thread.
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+ private:
+  const size_t capacity_;
+  bool closed_;
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+}  // namespace sbpl_perception
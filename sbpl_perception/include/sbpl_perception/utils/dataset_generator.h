@@ -41,6 +41,12 @@ class DatasetGenerator {
   std::vector<unsigned short> GetDepthImage(const std::vector<ObjectModel>
                                             &models_in_scene, const Eigen::Isometry3d &camera_pose);
 
+  // Depth images of the scene from every camera pose. Each render overlaps with
+  // the readback of the previous one.
+  std::vector<std::vector<unsigned short>> GetDepthImages(const std::vector<ObjectModel>
+                                                          &models_in_scene,
+                                                          const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>> &camera_poses);
+
 
   // A 'halo' camera - a circular ring of poses all pointing at a center point
   // focus_center: the center point
@@ -13,6 +13,7 @@ using namespace std;
 #include <boost/mpi.hpp>
 #include <XmlRpcValue.h>
 
+#include <cstdint>
 #include <functional>
 #include <string>
 #include <unordered_map>
@@ -114,9 +115,15 @@ struct ModelMetaData {
 struct EnvStats {
   int scenes_rendered;
   int scenes_valid;
+  // Greedy poses skipped because their cost reached the best cost of their model
+  int poses_pruned;
   double time;
   double icp_time;
   double peak_gpu_mem;
+  // Single object depth image cache
+  uint64_t render_cache_hits;
+  uint64_t render_cache_misses;
+  uint64_t render_cache_evictions;
 };
 
 typedef std::function<int(const GraphState &state)> Heuristic;
@@ -0,0 +1,124 @@
+#include <sbpl_perception/cost_executor.h>
+
+#include <omp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+namespace sbpl_perception {
+
+CostExecutor::CostExecutor() : running_(false), jobs_done_(0) {}
+
+void CostExecutor::Run(int num_jobs, int num_threads,
+                       const std::function<void(int)> &job) {
+  if (num_threads <= 1 || num_jobs <= 1) {
+    for (int ii = 0; ii < num_jobs; ++ii) {
+      job(ii);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = true;
+    render_thread_ = std::this_thread::get_id();
+    jobs_done_ = 0;
+    error_ = nullptr;
+  }
+
+  std::atomic<int> next_job(0);
+  // The master thread of the team is the calling thread.
+  #pragma omp parallel num_threads(num_threads + 1)
+  {
+    // The runtime may give a smaller team, serve renders only if somebody
+    // else runs the jobs.
+    const bool serve = omp_get_thread_num() == 0 && omp_get_num_threads() > 1;
+
+    if (serve) {
+      ServeRenders(num_jobs);
+    } else {
+      for (int ii = next_job++; ii < num_jobs; ii = next_job++) {
+        // Exceptions must not leave the parallel region, that terminates.
+        int finished = 1;
+        std::exception_ptr error;
+        try {
+          job(ii);
+        } catch (...) {
+          error = std::current_exception();
+          // Jobs not handed out yet are skipped, and counted as done so that
+          // the renders stop being served.
+          finished += std::max(num_jobs - next_job.exchange(num_jobs), 0);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error && !error_) {
+          error_ = error;
+        }
+        jobs_done_ += finished;
+        cv_.notify_all();
+      }
+    }
+  }
+
+  std::exception_ptr error;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+    std::swap(error, error_);
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void CostExecutor::Render(const std::function<void()> &render) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  if (!running_ || std::this_thread::get_id() == render_thread_) {
+    lock.unlock();
+    render();
+    return;
+  }
+
+  RenderRequest request = {&render, false, nullptr};
+  requests_.push_back(&request);
+  cv_.notify_all();
+  cv_.wait(lock, [&request]() {
+    return request.done;
+  });
+
+  if (request.error) {
+    std::rethrow_exception(request.error);
+  }
+}
+
+void CostExecutor::ServeRenders(int num_jobs) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (true) {
+    cv_.wait(lock, [this, num_jobs]() {
+      return !requests_.empty() || jobs_done_ == num_jobs;
+    });
+
+    if (requests_.empty()) {
+      return;
+    }
+
+    RenderRequest *request = requests_.front();
+    requests_.pop_front();
+    lock.unlock();
+    // Handed back to the waiting job instead of leaving the parallel region.
+    std::exception_ptr error;
+    try {
+      (*request->render)();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    lock.lock();
+    request->error = error;
+    request->done = true;
+    cv_.notify_all();
+  }
+}
+
+}  // namespace sbpl_perception
@@ -24,14 +24,10 @@ void GraphState::AppendObject(const ObjectState &object_state) {
 size_t GraphState::GetHash() const {
   size_t hash_val = 0;
 
+  // Summed so that the hash does not depend on object order, matching the
+  // permutation test in operator==.
   for (const auto &object_state : object_states()) {
-    const auto &disc_pose = object_state.disc_pose();
-    hash_val ^= std::hash<int>()(disc_pose.x())
-                ^ std::hash<int>()(disc_pose.y());
-
-    if (!object_state.symmetric()) {
-      hash_val ^= std::hash<int>()(disc_pose.yaw());
-    }
+    hash_val += object_state.GetHash();
   }
 
   return hash_val;
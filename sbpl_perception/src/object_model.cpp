@@ -332,6 +332,10 @@ void ObjectModel::SetObjectProperties() {
                                                        pcl::PointCloud<pcl::PointXYZ>);
   pcl::fromPCLPointCloud2(mesh_.cloud, *cloud);
 
+  Eigen::Vector4f centroid;
+  pcl::compute3DCentroid(*cloud, centroid);
+  mesh_centroid_ = centroid.head<3>();
+
   for (size_t ii = 0; ii < cloud->size(); ++ii) {
     auto point = cloud->points[ii];
     pcl::PointXYZ projected_point = point;
@@ -499,6 +503,15 @@ pcl::PolygonMeshPtr ObjectModel::GetTransformedMesh(const Eigen::Matrix4f
   return transformed_mesh;
 }
 
+Eigen::Matrix4f ObjectModel::GetShiftedTransform(ContPose &p) const {
+  Eigen::Matrix4f transform;
+  transform = p.GetTransform().matrix().cast<float>();
+  // The centroid of the transformed mesh is R * c + t, shifting by t - (R * c + t)
+  transform.block<3, 1>(0, 3) -= transform.block<3, 3>(0, 0) * mesh_centroid_;
+  p = ContPose(transform(0,3), transform(1,3), transform(2,3), p.qx(), p.qy(), p.qz(), p.qw());
+  return transform;
+}
+
 Eigen::Affine3f ObjectModel::GetRawModelToSceneTransform(
   const ContPose &p) const {
   Eigen::Matrix4f transform;
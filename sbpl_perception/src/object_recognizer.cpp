@@ -479,6 +479,10 @@ bool ObjectRecognizer::RunPlanner(vector<ContPose> *detected_poses) const {
       cout << env_stats.scenes_rendered << " " << env_stats.scenes_valid << " "  <<
            stats_vector[0].expands
            << " " << stats_vector[0].time << " " << stats_vector[0].cost << endl;
+      cout << "Poses pruned by cost bound: " << env_stats.poses_pruned << endl;
+      cout << "Render cache hits/misses/evictions: " << env_stats.render_cache_hits
+           << " " << env_stats.render_cache_misses << " "
+           << env_stats.render_cache_evictions << endl;
     }
 
     planning_finished = true;
@@ -4,10 +4,35 @@
 
 #include <angles/angles.h>
 
+#include <algorithm>
 #include <cmath>
+#include <deque>
+#include <functional>
+#include <mutex>
 
 namespace {
 constexpr double kFloatingPointTolerance = 1e-5;
+constexpr char kDefaultRenderRoot[] =
+  "/media/aditya/A69AFABA9AFA85D9/Cruzr/code/DOPE/catkin_ws/src/perception/sbpl_perception/data/YCB_Video_Dataset/rendered/";
+
+// A deque so that references handed out by RenderRoot stay valid as roots
+// are added.
+std::deque<std::string> &RenderRoots() {
+  static std::deque<std::string> roots(1, kDefaultRenderRoot);
+  return roots;
+}
+
+std::mutex &RenderRootMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+// Fixed-frame roll, then pitch, then yaw.
+Eigen::Quaterniond EulerToQuaternion(double roll, double pitch, double yaw) {
+  return Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ()) *
+         Eigen::AngleAxisd(pitch, Eigen::Vector3d::UnitY()) *
+         Eigen::AngleAxisd(roll, Eigen::Vector3d::UnitX());
+}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -19,6 +44,7 @@ ContPose::ContPose(double x, double y, double z, double roll, double pitch,
   roll_(angles::normalize_angle_positive(roll)),
   pitch_(angles::normalize_angle_positive(pitch)),
   yaw_(angles::normalize_angle_positive(yaw)) {
+  SetQuaternion(EulerToQuaternion(roll, pitch, yaw));
 };
 
 ContPose::ContPose(double x, double y, double z, double qx, double qy,
@@ -31,24 +57,18 @@ ContPose::ContPose(double x, double y, double z, double qx, double qy,
   x_ = x;
   y_ = y;
   z_ = z;
-  qx_ = qx;
-  qy_ = qy;
-  qz_ = qz;
-  qw_ = qw;
   roll_ = euler[0];
   pitch_ = euler[1];
   yaw_ = euler[2];
+  SetQuaternion(quaternion);
 };
 
 ContPose::ContPose(int external_pose_id, std::string external_render_path,
                    double x, double y, double z, double roll, double pitch,
                    double yaw) :
-  external_pose_id_(external_pose_id),
-  external_render_path_(external_render_path),
-  x_(x), y_(y), z_(z),
-  roll_(angles::normalize_angle_positive(roll)),
-  pitch_(angles::normalize_angle_positive(pitch)),
-  yaw_(angles::normalize_angle_positive(yaw)) {
+  ContPose(x, y, z, roll, pitch, yaw) {
+  external_pose_id_ = external_pose_id;
+  render_root_id_ = InternRenderRoot(external_render_path);
 };
 
 ContPose::ContPose(const DiscPose &disc_pose) {
@@ -60,20 +80,47 @@ ContPose::ContPose(const DiscPose &disc_pose) {
   roll_ = DiscretizationManager::DiscYawToContYaw(disc_pose.roll());
   pitch_ = DiscretizationManager::DiscYawToContYaw(disc_pose.pitch());
   yaw_ = DiscretizationManager::DiscYawToContYaw(disc_pose.yaw());
+  SetQuaternion(EulerToQuaternion(roll_, pitch_, yaw_));
 };
 
+int ContPose::InternRenderRoot(const std::string &render_root) {
+  std::lock_guard<std::mutex> lock(RenderRootMutex());
+  std::deque<std::string> &roots = RenderRoots();
+  auto it = std::find(roots.begin(), roots.end(), render_root);
+  if (it != roots.end()) {
+    return static_cast<int>(it - roots.begin());
+  }
+  roots.push_back(render_root);
+  return static_cast<int>(roots.size()) - 1;
+}
+
+const std::string &ContPose::RenderRoot(int render_root_id) {
+  std::lock_guard<std::mutex> lock(RenderRootMutex());
+  return RenderRoots().at(render_root_id);
+}
+
+void ContPose::SetQuaternion(const Eigen::Quaterniond &quaternion) {
+  // A zero quaternion has always meant "no rotation".
+  Eigen::Quaterniond q = quaternion.squaredNorm() == 0.0 ?
+                         Eigen::Quaterniond::Identity() : quaternion.normalized();
+  // q and -q are the same rotation, keep the one with qw >= 0.
+  if (q.w() < 0) {
+    q.coeffs() = -q.coeffs();
+  }
+  qx_ = q.x();
+  qy_ = q.y();
+  qz_ = q.z();
+  qw_ = q.w();
+}
+
 bool ContPose::operator==(const ContPose &other) const {
-  return fabs(x_ - other.x()) < kFloatingPointTolerance &&
-         fabs(y_ - other.y()) < kFloatingPointTolerance &&
-         fabs(z_ - other.z()) < kFloatingPointTolerance &&
-         fabs(roll_ - other.roll()) < kFloatingPointTolerance &&
-         fabs(pitch_ - other.pitch()) < kFloatingPointTolerance &&
-         fabs(yaw_ - other.yaw()) < kFloatingPointTolerance;
-         fabs(yaw_ - other.yaw()) < kFloatingPointTolerance &&
-         fabs(qx_ - other.qx()) < kFloatingPointTolerance &&
-         fabs(qy_ - other.qy()) < kFloatingPointTolerance &&
-         fabs(qz_ - other.qz()) < kFloatingPointTolerance &&
-         fabs(qw_ - other.qw()) < kFloatingPointTolerance;
+  return fabs(x_ - other.x_) < kFloatingPointTolerance &&
+         fabs(y_ - other.y_) < kFloatingPointTolerance &&
+         fabs(z_ - other.z_) < kFloatingPointTolerance &&
+         fabs(qx_ - other.qx_) < kFloatingPointTolerance &&
+         fabs(qy_ - other.qy_) < kFloatingPointTolerance &&
+         fabs(qz_ - other.qz_) < kFloatingPointTolerance &&
+         fabs(qw_ - other.qw_) < kFloatingPointTolerance;
 }
 
 bool ContPose::operator!=(const ContPose &other) const {
@@ -81,25 +128,15 @@ bool ContPose::operator!=(const ContPose &other) const {
 }
 
 Eigen::Isometry3d ContPose::GetTransform() const {
-  const Eigen::AngleAxisd roll_angle(roll_, Eigen::Vector3d::UnitX());
-  const Eigen::AngleAxisd pitch_angle(pitch_, Eigen::Vector3d::UnitY());
-  const Eigen::AngleAxisd yaw_angle(yaw_, Eigen::Vector3d::UnitZ());
-  Eigen::Quaterniond quaternion;
-  if (qw_ == 0 && qx_ == 0 && qy_ == 0 && qz_ == 0) {
-    // std::cout << "using euler\n";
-    quaternion = yaw_angle * pitch_angle * roll_angle;
-  } else {
-    quaternion = Eigen::Quaterniond(qw_, qx_, qy_, qz_);
-  }
-  quaternion.normalize();
+  const Eigen::Quaterniond quaternion(qw_, qx_, qy_, qz_);
   const Eigen::Isometry3d transform(Eigen::Translation3d(x_, y_, z_) * quaternion);
   return transform;
 }
 
 Eigen::Matrix4f ContPose::GetTransformMatrix() const {
   // Aditya
-  Eigen::Quaterniond quaternion = Eigen::Quaterniond(qw_, qx_, qy_, qz_);
-  Eigen::Matrix3f rotation = quaternion.normalized().toRotationMatrix().cast<float>();
+  const Eigen::Quaternionf quaternion(qw_, qx_, qy_, qz_);
+  Eigen::Matrix3f rotation = quaternion.toRotationMatrix();
   Eigen::Matrix4f transform;
   for (int i = 0; i < 3; i++) {
     for (int j = 0; j < 3; j++) {
@@ -117,9 +154,9 @@ Eigen::Matrix4f ContPose::GetTransformMatrix() const {
 Eigen::Affine3f ContPose::GetTransformAffine3f() const {
   // Aditya
   Eigen::Affine3f transform = Eigen::Affine3f::Identity();
-  Eigen::Quaterniond quaternion = Eigen::Quaterniond(qw_, qx_, qy_, qz_);
+  const Eigen::Quaternionf quaternion(qw_, qx_, qy_, qz_);
   transform.translation() << x_, y_, z_;
-  transform.rotate(quaternion.cast<float>());
+  transform.rotate(quaternion);
   return transform;
 }
 
@@ -236,6 +273,24 @@ bool ObjectState::operator!=(const ObjectState &other) const {
   return !(*this == other);
 }
 
+size_t ObjectState::GetHash() const {
+  // Symmetric objects compare by position only, so leave the angles out.
+  size_t hash_val = std::hash<int>()(id_);
+  auto combine = [&hash_val](int value) {
+    hash_val ^= std::hash<int>()(value) + 0x9e3779b9 + (hash_val << 6) +
+                (hash_val >> 2);
+  };
+  combine(disc_pose_.x());
+  combine(disc_pose_.y());
+  combine(disc_pose_.z());
+  if (!symmetric_) {
+    combine(disc_pose_.roll());
+    combine(disc_pose_.pitch());
+    combine(disc_pose_.yaw());
+  }
+  return hash_val;
+}
+
 std::ostream &operator<< (std::ostream &stream,
                           const ObjectState &object_state) {
   stream << "Object ID: " << object_state.id() << std::endl
@@ -0,0 +1,200 @@
+#include <sbpl_perception/pose_list.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+namespace sbpl_perception {
+
+namespace {
+// Parses one line of poses.txt, returns false if it doesn't hold a full pose
+bool ParsePoseLine(const std::string &line, double *pose) {
+  const char *begin = line.c_str();
+  char *end = nullptr;
+
+  for (uint32_t ii = 0; ii < kPoseListDim; ++ii) {
+    pose[ii] = strtod(begin, &end);
+
+    if (end == begin) {
+      return false;
+    }
+
+    begin = end;
+  }
+
+  return true;
+}
+
+bool ReadTextPoses(const std::string &txt_path, std::vector<double> *poses) {
+  std::ifstream file(txt_path);
+
+  if (!file.is_open()) {
+    return false;
+  }
+
+  poses->clear();
+  std::string line;
+  double pose[kPoseListDim];
+  int line_number = 0;
+
+  while (getline(file, line)) {
+    line_number++;
+
+    if (!ParsePoseLine(line, pose)) {
+      printf("Skipping line %d of %s, expected %d values\n", line_number,
+             txt_path.c_str(), kPoseListDim);
+      continue;
+    }
+
+    poses->insert(poses->end(), pose, pose + kPoseListDim);
+  }
+
+  return true;
+}
+}  // namespace
+
+PoseList::PoseList() : mapped_data_(nullptr), mapped_size_(0),
+  poses_(nullptr), num_poses_(0) {}
+
+PoseList::~PoseList() {
+  Close();
+}
+
+bool PoseList::Open(const std::string &bin_path) {
+  Close();
+  int fd = open(bin_path.c_str(), O_RDONLY);
+
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat file_stat;
+
+  if (fstat(fd, &file_stat) != 0 ||
+      file_stat.st_size < static_cast<off_t>(sizeof(PoseListHeader))) {
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  const PoseListHeader *header = static_cast<const PoseListHeader *>(data);
+  const size_t expected_size = sizeof(PoseListHeader) + header->num_poses *
+                               kPoseListDim * sizeof(double);
+
+  if (memcmp(header->magic, kPoseListMagic, sizeof(kPoseListMagic)) != 0 ||
+      header->version != kPoseListVersion || header->pose_dim != kPoseListDim ||
+      expected_size != static_cast<size_t>(file_stat.st_size)) {
+    printf("Invalid pose list : %s\n", bin_path.c_str());
+    munmap(data, file_stat.st_size);
+    return false;
+  }
+
+  // Poses are read in order, let the kernel read ahead
+  madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+  mapped_data_ = data;
+  mapped_size_ = file_stat.st_size;
+  num_poses_ = header->num_poses;
+  poses_ = reinterpret_cast<const double *>(static_cast<const char *>(data) +
+                                            sizeof(PoseListHeader));
+  return true;
+}
+
+bool PoseList::OpenText(const std::string &txt_path) {
+  Close();
+
+  if (!ReadTextPoses(txt_path, &text_poses_)) {
+    return false;
+  }
+
+  num_poses_ = text_poses_.size() / kPoseListDim;
+  poses_ = text_poses_.data();
+  return true;
+}
+
+void PoseList::Close() {
+  if (mapped_data_ != nullptr) {
+    munmap(mapped_data_, mapped_size_);
+  }
+
+  mapped_data_ = nullptr;
+  mapped_size_ = 0;
+  poses_ = nullptr;
+  num_poses_ = 0;
+  text_poses_.clear();
+}
+
+ContPose PoseList::pose(size_t index) const {
+  const double *p = poses_ + index * kPoseListDim;
+  return ContPose(p[0], p[1], p[2], p[3], p[4], p[5], p[6]);
+}
+
+int ConvertPoseListToBinary(const std::string &txt_path,
+                            const std::string &bin_path) {
+  std::vector<double> poses;
+
+  if (!ReadTextPoses(txt_path, &poses)) {
+    printf("Could not read pose list : %s\n", txt_path.c_str());
+    return -1;
+  }
+
+  PoseListHeader header;
+  memcpy(header.magic, kPoseListMagic, sizeof(kPoseListMagic));
+  header.version = kPoseListVersion;
+  header.pose_dim = kPoseListDim;
+  header.num_poses = poses.size() / kPoseListDim;
+
+  // Unique temporary name, several MPI processes may convert the same list
+  const std::string tmp_path = bin_path + ".tmp." + std::to_string(getpid());
+  FILE *file = fopen(tmp_path.c_str(), "wb");
+
+  if (file == nullptr) {
+    printf("Could not write pose list : %s\n", tmp_path.c_str());
+    return -1;
+  }
+
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                 fwrite(poses.data(), sizeof(double), poses.size(),
+                        file) == poses.size();
+  written = (fclose(file) == 0) && written;
+
+  if (!written || rename(tmp_path.c_str(), bin_path.c_str()) != 0) {
+    printf("Could not write pose list : %s\n", bin_path.c_str());
+    remove(tmp_path.c_str());
+    return -1;
+  }
+
+  return static_cast<int>(header.num_poses);
+}
+
+bool OpenModelPoseList(const std::string &model_dir, PoseList *pose_list) {
+  const std::string txt_path = model_dir + "/poses.txt";
+  const std::string bin_path = model_dir + "/poses.bin";
+
+  struct stat txt_stat, bin_stat;
+  const bool has_txt = stat(txt_path.c_str(), &txt_stat) == 0;
+  const bool has_bin = stat(bin_path.c_str(), &bin_stat) == 0;
+
+  if (has_txt && (!has_bin || bin_stat.st_mtime < txt_stat.st_mtime)) {
+    printf("Converting pose list %s\n", txt_path.c_str());
+
+    if (ConvertPoseListToBinary(txt_path, bin_path) < 0) {
+      return pose_list->OpenText(txt_path);
+    }
+  }
+
+  return pose_list->Open(bin_path);
+}
+
+}  // namespace sbpl_perception
@@ -0,0 +1,170 @@
+#include <sbpl_perception/render_cache.h>
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+namespace sbpl_perception {
+
+namespace {
+// Bookkeeping of one entry besides its pixels (list node and index slot)
+constexpr size_t kEntryOverheadBytes = 128;
+
+void HashCombine(size_t *seed, size_t value) {
+  *seed ^= value + 0x9e3779b9 + (*seed << 6) + (*seed >> 2);
+}
+}  // namespace
+
+size_t RenderCacheKeyHash::operator()(const RenderCacheKey &key) const {
+  size_t hash_val = std::hash<int>()(key.model_id);
+  HashCombine(&hash_val, std::hash<int>()(key.disc_pose.x()));
+  HashCombine(&hash_val, std::hash<int>()(key.disc_pose.y()));
+  HashCombine(&hash_val, std::hash<int>()(key.disc_pose.z()));
+  HashCombine(&hash_val, std::hash<int>()(key.disc_pose.roll()));
+  HashCombine(&hash_val, std::hash<int>()(key.disc_pose.pitch()));
+  HashCombine(&hash_val, std::hash<int>()(key.disc_pose.yaw()));
+  HashCombine(&hash_val, key.camera_hash);
+  return hash_val;
+}
+
+RenderCache::RenderCache(size_t budget_bytes) : budget_bytes_(budget_bytes),
+  size_bytes_(0), hits_(0), misses_(0), evictions_(0) {}
+
+void RenderCache::SetBudget(size_t budget_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_bytes_ = budget_bytes;
+  EvictToBudget();
+}
+
+void RenderCache::Insert(const RenderCacheKey &key,
+                         const std::vector<unsigned short> &image,
+                         int width, int height, unsigned short empty_depth) {
+  Entry entry;
+  entry.key = key;
+  entry.frame_width = width;
+  entry.frame_height = height;
+  entry.empty_depth = empty_depth;
+
+  int x_min = width, y_min = height, x_max = -1, y_max = -1;
+
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      if (image[x + y * width] != empty_depth) {
+        x_min = std::min(x_min, x);
+        x_max = std::max(x_max, x);
+        y_min = std::min(y_min, y);
+        y_max = std::max(y_max, y);
+      }
+    }
+  }
+
+  if (x_max < 0) {
+    // Object not visible, nothing but the frame size to store
+    entry.roi_x = entry.roi_y = entry.roi_width = entry.roi_height = 0;
+  } else {
+    entry.roi_x = x_min;
+    entry.roi_y = y_min;
+    entry.roi_width = x_max - x_min + 1;
+    entry.roi_height = y_max - y_min + 1;
+    entry.roi.resize(entry.roi_width * entry.roi_height);
+
+    for (int y = 0; y < entry.roi_height; ++y) {
+      std::copy(image.begin() + x_min + (y_min + y) * width,
+                image.begin() + x_min + (y_min + y) * width + entry.roi_width,
+                entry.roi.begin() + y * entry.roi_width);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+
+  if (it != index_.end()) {
+    Erase(it->second);
+  }
+
+  size_bytes_ += EntryBytes(entry);
+  entries_.push_front(std::move(entry));
+  index_[key] = entries_.begin();
+  EvictToBudget();
+}
+
+bool RenderCache::Lookup(const RenderCacheKey &key,
+                         std::vector<unsigned short> *image) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+
+  if (it == index_.end()) {
+    ++misses_;
+    return false;
+  }
+
+  ++hits_;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  const Entry &entry = *it->second;
+
+  image->assign(entry.frame_width * entry.frame_height, entry.empty_depth);
+
+  for (int y = 0; y < entry.roi_height; ++y) {
+    std::copy(entry.roi.begin() + y * entry.roi_width,
+              entry.roi.begin() + (y + 1) * entry.roi_width,
+              image->begin() + entry.roi_x + (entry.roi_y + y) * entry.frame_width);
+  }
+
+  return true;
+}
+
+void RenderCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  index_.clear();
+  size_bytes_ = 0;
+  hits_ = 0;
+  misses_ = 0;
+  evictions_ = 0;
+}
+
+size_t RenderCache::NumEntries() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+size_t RenderCache::SizeBytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_bytes_;
+}
+
+uint64_t RenderCache::hits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hits_;
+}
+
+uint64_t RenderCache::misses() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return misses_;
+}
+
+uint64_t RenderCache::evictions() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return evictions_;
+}
+
+size_t RenderCache::EntryBytes(const Entry &entry) {
+  return kEntryOverheadBytes + entry.roi.size() * sizeof(unsigned short);
+}
+
+void RenderCache::Erase(std::list<Entry>::iterator it) {
+  size_bytes_ -= EntryBytes(*it);
+  index_.erase(it->key);
+  entries_.erase(it);
+}
+
+void RenderCache::EvictToBudget() {
+  // The most recent entry is always kept, even if it alone exceeds the budget
+  while (budget_bytes_ > 0 && size_bytes_ > budget_bytes_ &&
+         entries_.size() > 1) {
+    Erase(std::prev(entries_.end()));
+    ++evictions_;
+  }
+}
+
+}  // namespace sbpl_perception
@@ -26,6 +26,7 @@
 #include <pcl/io/png_io.h>
 #include <pcl/io/vtk_lib_io.h>
 #include <pcl/common/common.h>
+#include <pcl/features/normal_3d_omp.h>
 #include <pcl/console/print.h>
 
 #include <opencv/highgui.h>
@@ -36,6 +37,13 @@
 #include <boost/lexical_cast.hpp>
 #include <omp.h>
 #include <algorithm>
+#include <cmath>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <set>
+#include <thread>
+#include <tuple>
 #include <pcl/point_cloud.h>
 #include <pcl/octree/octree2buf_base.h>
 #include <pcl/octree/octree_pointcloud_changedetector.h>
@@ -83,6 +91,93 @@ namespace {
 
   bool cost_debug_msgs = true;
 
+  // Keeps the top left pixel of every scale x scale block of a row major image
+  template <typename T>
+  std::vector<T> SubsampleImage(const std::vector<T> &image, int width,
+                                int scale) {
+    const int height = image.size() / width;
+    const int scaled_width = width / scale;
+    const int scaled_height = height / scale;
+    std::vector<T> scaled_image(scaled_width * scaled_height);
+
+    for (int v = 0; v < scaled_height; ++v) {
+      for (int u = 0; u < scaled_width; ++u) {
+        scaled_image[v * scaled_width + u] = image[v * scale * width + u * scale];
+      }
+    }
+
+    return scaled_image;
+  }
+
+  // Number of yaws on the 3-Dof successor grid
+  int NumGridYaws(double theta_res) {
+    return static_cast<int>(std::ceil(2 * M_PI / theta_res - 1e-6));
+  }
+
+  // Cell (model, x, y, yaw) of a 3-Dof state on the successor grid
+  std::tuple<int, int, int, int> GridCell(const sbpl_perception::ObjectState
+                                          &state, double res, double x_min, double y_min, double theta_res) {
+    const sbpl_perception::ContPose &pose = state.cont_pose();
+    const int num_yaws = NumGridYaws(theta_res);
+    return std::make_tuple(state.id(),
+                           static_cast<int>(std::lround((pose.x() - x_min) / res)),
+                           static_cast<int>(std::lround((pose.y() - y_min) / res)),
+                           static_cast<int>(std::lround(pose.yaw() / theta_res)) % num_yaws);
+  }
+
+  // Two stage pipeline : produce builds the next batch on its own thread while
+  // consume handles the previous ones on the calling thread, with at most depth
+  // batches waiting. produce returns false when there are no batches left.
+  // Exceptions of either stage are rethrown once the producer is joined.
+  template <typename Batch, typename Produce, typename Consume>
+  void RunBatchPipeline(int depth, Produce produce, Consume consume) {
+    sbpl_perception::BoundedQueue<Batch> batch_queue(depth);
+    std::exception_ptr producer_error;
+    std::thread batch_producer([&batch_queue, &producer_error, &produce]() {
+      try {
+        Batch batch;
+        while (produce(&batch)) {
+          if (!batch_queue.Push(std::move(batch))) {
+            break;
+          }
+        }
+      } catch (...) {
+        producer_error = std::current_exception();
+      }
+      batch_queue.Close();
+    });
+    // Closing the queue wakes a producer blocked in Push, so the thread is
+    // joined even when consume throws
+    struct ProducerJoiner {
+      sbpl_perception::BoundedQueue<Batch> &queue;
+      std::thread &producer;
+      ~ProducerJoiner() {
+        queue.Close();
+        if (producer.joinable()) producer.join();
+      }
+    } producer_joiner{batch_queue, batch_producer};
+
+    Batch batch;
+    while (batch_queue.Pop(&batch)) {
+      consume(batch);
+    }
+    batch_producer.join();
+    if (producer_error) std::rethrow_exception(producer_error);
+  }
+
+  // CIELAB color of a packed rgb value, same conversion as the renderer costs
+  Eigen::Vector3f RgbToLab(uint32_t rgb) {
+    Eigen::Vector3f lab;
+    cuda_renderer::color::rgb_to_lab(rgb >> 16, rgb >> 8, rgb, lab.data());
+    return lab;
+  }
+
+  // Whether a greedy cost can be kept as the lowest cost pose of its model
+  bool IsGreedyCandidate(const sbpl_perception::CostComputationOutput &output) {
+    return output.cost >= 0 &&
+           abs(output.state_properties.target_cost - output.state_properties.source_cost) < 30;
+  }
+
 }  // namespace
 
 namespace sbpl_perception {
@@ -91,7 +186,7 @@ EnvObjectRecognition::EnvObjectRecognition(const
                                            std::shared_ptr<boost::mpi::communicator> &comm) :
   mpi_comm_(comm),
   image_debug_(false), debug_dir_(ros::package::getPath("sbpl_perception") +
-                                  "/visualization/"), env_stats_ {0, 0, 0, 0, 0} {
+                                  "/visualization/"), camera_pose_hash_(0), env_stats_ {0, 0, 0, 0, 0, 0, 0, 0} {
 
   // OpenGL requires argc and argv
   char **argv;
@@ -178,7 +273,19 @@ EnvObjectRecognition::EnvObjectRecognition(const
     private_nh.param("/perch_params/debug_verbose", perch_params_.debug_verbose, false);
     private_nh.param("/perch_params/use_color_cost", perch_params_.use_color_cost, false);
     private_nh.param("/perch_params/gpu_batch_size", perch_params_.gpu_batch_size, 1000);
+    private_nh.param("/perch_params/gpu_pipeline_depth", perch_params_.gpu_pipeline_depth, 2);
     private_nh.param("/perch_params/use_gpu", perch_params_.use_gpu, true);
+    private_nh.param("/perch_params/use_cpu_renderer", perch_params_.use_cpu_renderer, false);
+    private_nh.param("/perch_params/use_coarse_to_fine", perch_params_.use_coarse_to_fine, false);
+    private_nh.param("/perch_params/coarse_image_scale", perch_params_.coarse_image_scale, 4);
+    private_nh.param("/perch_params/coarse_grid_factor", perch_params_.coarse_grid_factor, 2);
+    private_nh.param("/perch_params/coarse_top_k", perch_params_.coarse_top_k, 20);
+    private_nh.param("/perch_params/use_projective_association", perch_params_.use_projective_association, true);
+    private_nh.param("/perch_params/use_fused_cost", perch_params_.use_fused_cost, true);
+    private_nh.param("/perch_params/use_cost_bound", perch_params_.use_cost_bound, false);
+    private_nh.param("/perch_params/render_cache_mb", perch_params_.render_cache_mb, 512);
+    private_nh.param("/perch_params/num_cost_threads", perch_params_.num_cost_threads, 1);
+    private_nh.param("/perch_params/headless_render", perch_params_.headless_render, false);
     private_nh.param("/perch_params/color_distance_threshold", perch_params_.color_distance_threshold, 20.0);
     private_nh.param("/perch_params/gpu_stride", perch_params_.gpu_stride, 8.0);
     private_nh.param("/perch_params/use_cylinder_observed", perch_params_.use_cylinder_observed, true);
@@ -186,6 +293,16 @@ EnvObjectRecognition::EnvObjectRecognition(const
     private_nh.param("/perch_params/footprint_tolerance", perch_params_.footprint_tolerance, 0.05);
     private_nh.param("/perch_params/depth_median_blur", perch_params_.depth_median_blur, 17.0);
     private_nh.param("/perch_params/icp_type", perch_params_.icp_type, 0); // 0 - PCL 2d icp, 1 - gicp cpu 3d, 2 - gicp cuda 3d
+    private_nh.param("/perch_params/use_batch_icp", perch_params_.use_batch_icp, false);
+#ifndef CUDA_ON
+    perch_params_.use_cpu_renderer = true;
+#endif
+    if (perch_params_.use_cpu_renderer && perch_params_.icp_type == 3)
+    {
+      // ICP inside the renderer is only available on GPU, do it on the returned clouds instead
+      printf("ICP type 3 needs the GPU renderer, using gicp cpu 3d\n");
+      perch_params_.icp_type = 1;
+    }
     perch_params_.initialized = true;
 
     printf("----------PERCH Config-------------\n");
@@ -210,11 +327,24 @@ EnvObjectRecognition::EnvObjectRecognition(const
     printf("Use Color Cost: %d\n", perch_params_.use_color_cost);
     printf("Color Distance Threshold: %f\n", perch_params_.color_distance_threshold);
     printf("Use GPU: %d\n", perch_params_.use_gpu);
+    printf("Use CPU Renderer: %d\n", perch_params_.use_cpu_renderer);
     printf("GPU batch size: %d\n", perch_params_.gpu_batch_size);
+    printf("GPU pipeline depth: %d\n", perch_params_.gpu_pipeline_depth);
+    printf("Use Coarse to Fine: %d\n", perch_params_.use_coarse_to_fine);
+    printf("Coarse Image Scale: %d\n", perch_params_.coarse_image_scale);
+    printf("Coarse Grid Factor: %d\n", perch_params_.coarse_grid_factor);
+    printf("Coarse Top K: %d\n", perch_params_.coarse_top_k);
+    printf("Use Projective Association: %d\n", perch_params_.use_projective_association);
+    printf("Use Fused Cost: %d\n", perch_params_.use_fused_cost);
+    printf("Use Cost Bound: %d\n", perch_params_.use_cost_bound);
+    printf("Render Cache MB: %d\n", perch_params_.render_cache_mb);
+    printf("Cost Threads: %d\n", perch_params_.num_cost_threads);
+    printf("Headless Render: %d\n", perch_params_.headless_render);
     printf("GPU stride: %f\n", perch_params_.gpu_stride);
     printf("Use Cylinder Observed: %d\n", perch_params_.use_cylinder_observed);
     printf("Footprint Tolerance: %f\n", perch_params_.footprint_tolerance);
     printf("Depth Median Blur: %f\n", perch_params_.depth_median_blur);
+    printf("Use Batch ICP: %d\n", perch_params_.use_batch_icp);
     printf("\n");
     printf("----------Camera Config-------------\n");
     printf("Camera Width: %d\n", kCameraWidth);
@@ -237,11 +367,18 @@ EnvObjectRecognition::EnvObjectRecognition(const
     printf("ERROR: PERCH Params not initialized for process %d\n",
            mpi_comm_->rank());
   }
+
+  const size_t render_cache_bytes = static_cast<size_t>(std::max(perch_params_.render_cache_mb, 0)) << 20;
+  unadjusted_single_object_depth_image_cache_.SetBudget(render_cache_bytes);
+  adjusted_single_object_depth_image_cache_.SetBudget(render_cache_bytes);
   
   if (perch_params_.use_gpu == 0)
   {
     kinect_simulator_ = SimExample::Ptr(new SimExample(0, argv,
-                                                      kCameraHeight, kCameraWidth));
+                                                      kCameraHeight, kCameraWidth, true,
+                                                      perch_params_.headless_render ?
+                                                      SimExample::HEADLESS_EGL :
+                                                      SimExample::GLUT_WINDOW));
     scene_ = kinect_simulator_->scene_;
   }
 
@@ -260,8 +397,14 @@ void EnvObjectRecognition::LoadObjFiles(const ModelBank
   env_params_.num_models = static_cast<int>(model_names.size());
 
   obj_models_.clear();
-  tris.clear();
-  tris_model_count.clear();
+  scene_models_.clear();
+  model_render_handles_.clear();
+
+  // Render meshes stay registered in the renderer across requests, only models that were not requested
+  // before are read and uploaded. Models missing from this request are deactivated.
+  cuda_renderer::ModelRegistry &render_models = renderer_context_.models;
+  render_models.remove_all();
+
   for (int ii = 0; ii < env_params_.num_models; ++ii) {
     string model_name = model_names[ii];
     auto model_bank_it = model_bank.find(model_name);
@@ -283,6 +426,8 @@ void EnvObjectRecognition::LoadObjFiles(const ModelBank
                           model_meta_data.flipped,
                           env_params_.use_external_pose_list);
     obj_models_.push_back(obj_model);
+    scene_models_.push_back(PolygonMeshModel::Ptr(new PolygonMeshModel(GL_POLYGON,
+        pcl::PolygonMeshPtr(new pcl::PolygonMesh(obj_model.mesh())))));
 
     if (IsMaster(mpi_comm_)) {
       printf("Read %s with %d polygons and %d triangles from file %s\n", model_name.c_str(),
@@ -298,10 +443,15 @@ void EnvObjectRecognition::LoadObjFiles(const ModelBank
     }
     if (perch_params_.use_gpu)
     {
-        cuda_renderer::Model render_model(model_meta_data.file.c_str()); 
-        render_models_.push_back(render_model);
-        tris.insert(tris.end(), render_model.tris.begin(), render_model.tris.end());
-        tris_model_count.push_back(render_model.tris.size());
+        model_render_handles_.push_back(render_models.add(model_name, model_meta_data.file));
+    }
+  }
+
+  // Drop inactive meshes once they outweigh the requested ones, handles have to be looked up again
+  if (render_models.inactive_tris() > render_models.tris().size() / 2 &&
+      render_models.compact()) {
+    for (int ii = 0; ii < model_render_handles_.size(); ++ii) {
+      model_render_handles_[ii] = render_models.find(model_names[ii]);
     }
   }
 }
@@ -741,12 +891,10 @@ void EnvObjectRecognition::GetSuccs(int source_state_id,
       if (source_state.NumObjects() == 0) {
         // Cache first successors
         // depth_image_cache_[candidate_succ_ids[ii]] = output_unit.depth_image;
-        adjusted_single_object_depth_image_cache_[cost_computation_input[ii].child_state]
-          =
-            output_unit.depth_image;
-        unadjusted_single_object_depth_image_cache_[cost_computation_input[ii].child_state]
-          =
-            output_unit.unadjusted_depth_image;
+        CacheSingleObjectDepthImage(cost_computation_input[ii].child_state,
+                                    output_unit.depth_image, true);
+        CacheSingleObjectDepthImage(cost_computation_input[ii].child_state,
+                                    output_unit.unadjusted_depth_image, false);
 
         // adjusted_single_object_color_image_cache_[cost_computation_input[ii].child_state]
         //   =
@@ -969,49 +1117,82 @@ void EnvObjectRecognition::ComputeCostsInParallel(std::vector<CostComputationInp
                 &source_depth_image, &source_color_image,
                 &source_cv_depth_image, &source_cv_color_image);
 
-  // printf("recvcount : %d\n", recvcount);
-  for (int ii = 0; ii < recvcount; ++ii) {
-    if (cost_debug_msgs)
-      printf("State number being processed : %d\n", ii);
-    const auto &input_unit = input_partition[ii];
-    auto &output_unit = output_partition[ii];
-
-    // If this is a dummy input, skip computation.
-    if (input_unit.source_id == -1) {
-      output_unit.cost = -1;
-      continue;
+  // The render of the last object alone, which GetCost starts with, does not depend
+  // on anything else. So these are rendered back to back for a chunk of units before
+  // its costs, with their readbacks in flight, instead of one by one inside GetCost.
+  // A chunk fills the readback frames and gives every cost thread a unit, more would
+  // only hold more images at once.
+  const bool prerender = !lazy && env_params_.use_external_render == 0;
+  const int chunk_size = prerender ?
+                         std::max({kinect_simulator_->rl_->getReadbackFrames(),
+                                   perch_params_.num_cost_threads, 1}) :
+                         std::max(recvcount, 1);
+  vector<RenderedImages> last_object_images;
+
+  for (int chunk_start = 0; chunk_start < recvcount; chunk_start += chunk_size) {
+    const int chunk_count = std::min(chunk_size, recvcount - chunk_start);
+    if (prerender) {
+      vector<GraphState> last_object_states(chunk_count);
+      for (int jj = 0; jj < chunk_count; ++jj) {
+        const auto &input_unit = input_partition[chunk_start + jj];
+        if (input_unit.source_id == -1) {
+          continue;
+        }
+        const auto &last_object = input_unit.child_state.object_states().back();
+        last_object_states[jj].AppendObject(ObjectState(last_object.id(),
+                                                        obj_models_[last_object.id()].symmetric(),
+                                                        last_object.cont_pose()));
+      }
+      GetDepthImages(last_object_states, &last_object_images);
     }
 
-    if (!lazy) {
-      output_unit.cost = GetCost(input_unit.source_state, input_unit.child_state,
-                                 source_depth_image,
-                                 source_color_image,
-                                 input_unit.source_counted_pixels,
-                                 &output_unit.child_counted_pixels, &output_unit.adjusted_state,
-                                 &output_unit.state_properties, &output_unit.depth_image,
-                                 &output_unit.color_image,
-                                 &output_unit.unadjusted_depth_image,
-                                 &output_unit.unadjusted_color_image,
-                                 output_unit.histogram_score);
-    } else {
-      if (input_unit.unadjusted_last_object_depth_image.empty()) {
+    // printf("recvcount : %d\n", recvcount);
+    // Units only write their own output, the renders they need run on this thread
+    cost_executor_.Run(chunk_count, perch_params_.num_cost_threads, [&](int jj) {
+      const int ii = chunk_start + jj;
+      if (cost_debug_msgs)
+        printf("State number being processed : %d\n", ii);
+      const auto &input_unit = input_partition[ii];
+      auto &output_unit = output_partition[ii];
+
+      // If this is a dummy input, skip computation.
+      if (input_unit.source_id == -1) {
         output_unit.cost = -1;
+        return;
+      }
+
+      if (!lazy) {
+        output_unit.cost = GetCost(input_unit.source_state, input_unit.child_state,
+                                   source_depth_image,
+                                   source_color_image,
+                                   input_unit.source_counted_pixels,
+                                   &output_unit.child_counted_pixels, &output_unit.adjusted_state,
+                                   &output_unit.state_properties, &output_unit.depth_image,
+                                   &output_unit.color_image,
+                                   &output_unit.unadjusted_depth_image,
+                                   &output_unit.unadjusted_color_image,
+                                   output_unit.histogram_score,
+                                   prerender ? &last_object_images[jj] : nullptr);
       } else {
-        output_unit.cost = GetLazyCost(input_unit.source_state, input_unit.child_state,
-                                       source_depth_image,
-                                       source_color_image,
-                                       input_unit.unadjusted_last_object_depth_image,
-                                       input_unit.adjusted_last_object_depth_image,
-                                       input_unit.adjusted_last_object_state,
-                                       input_unit.source_counted_pixels,
-                                       input_unit.adjusted_last_object_histogram_score,
-                                       &output_unit.adjusted_state,
-                                       &output_unit.state_properties,
-                                       &output_unit.depth_image);
+        if (input_unit.unadjusted_last_object_depth_image.empty()) {
+          output_unit.cost = -1;
+        } else {
+          output_unit.cost = GetLazyCost(input_unit.source_state, input_unit.child_state,
+                                         source_depth_image,
+                                         source_color_image,
+                                         input_unit.unadjusted_last_object_depth_image,
+                                         input_unit.adjusted_last_object_depth_image,
+                                         input_unit.adjusted_last_object_state,
+                                         input_unit.source_counted_pixels,
+                                         input_unit.adjusted_last_object_histogram_score,
+                                         &output_unit.adjusted_state,
+                                         &output_unit.state_properties,
+                                         &output_unit.depth_image);
+        }
       }
-    }
-    // input_unit.source_depth_image.clear();
-    // input_unit.source_depth_image.shrink_to_fit();
+      // input_unit.source_depth_image.clear();
+      // input_unit.source_depth_image.shrink_to_fit();
+    });
   }
 
   boost::mpi::gather(*mpi_comm_, &output_partition[0], recvcount, *output,
@@ -1229,10 +1410,21 @@ void EnvObjectRecognition::GetICPAdjustedPosesCPU(const vector<ObjectState>& obj
       }
     }
 
+    // 3-Dof poses are refined together, the loop below only prints their clouds
+    const bool batch_icp = do_icp && perch_params_.use_batch_icp && env_params_.use_icp &&
+                           env_params_.use_external_pose_list == 0 &&
+                           !icp_target_tree_.pcd_buffer.empty();
+    if (batch_icp)
+    {
+      GetBatchICPAdjustedPoses(objects, cloud, transform, pose_occluded, modified_objects);
+    }
+
     // ICP on parallel GPU threads
     #pragma omp parallel for if (do_icp)
     for (int n = 0; n < num_poses; n++)
     {
+      if (batch_icp && !print_cloud)
+        continue;
       if (cost_debug_msgs)
         printf("ICP for Pose index : %d\n", n);
       PointCloudPtr cloud_in = cloud[n];
@@ -1257,7 +1449,7 @@ void EnvObjectRecognition::GetICPAdjustedPosesCPU(const vector<ObjectState>& obj
         std::this_thread::sleep_for(std::chrono::milliseconds(1000));
       }
       
-      if (do_icp)
+      if (do_icp && !batch_icp)
       {
         if(pose_occluded[n])
         {
@@ -1305,6 +1497,56 @@ void EnvObjectRecognition::GetICPAdjustedPosesCPU(const vector<ObjectState>& obj
           << elapsed_seconds.count()
           << " milliseconds\n";
 }
+void EnvObjectRecognition::GetBatchICPAdjustedPoses(const vector<ObjectState>& objects,
+                                                    const vector<PointCloudPtr>& clouds,
+                                                    const Eigen::Isometry3d& cloud_to_world,
+                                                    int* pose_occluded,
+                                                    vector<ObjectState>& modified_objects)
+{
+  // The clouds of all occluded poses back to back, pose_offsets[i] is the first point of the i-th
+  vector<Vec3f> model_pcds;
+  vector<uint32_t> pose_offsets(1, 0);
+  vector<int> batch_poses;
+  const Eigen::Affine3f to_world = cloud_to_world.cast<float>();
+  for (size_t n = 0; n < clouds.size(); n++)
+  {
+    if (!pose_occluded[n])
+    {
+      modified_objects[n] = objects[n];
+      continue;
+    }
+    for (const auto &point : clouds[n]->points)
+    {
+      const Eigen::Vector3f world_point = to_world * point.getVector3fMap();
+      model_pcds.push_back(Vec3f(world_point.x(), world_point.y(), world_point.z()));
+    }
+    pose_offsets.push_back(model_pcds.size());
+    batch_poses.push_back(n);
+  }
+
+  cuda_icp::ICPConvergenceCriteria criteria(1e-5f, 1e-5f, perch_params_.max_icp_iterations);
+  vector<cuda_icp::RegistrationResult> results =
+    cuda_icp::ICP_Point2Plane_cpu_batch(model_pcds, pose_offsets, icp_target_scene_, criteria);
+
+  for (size_t ii = 0; ii < batch_poses.size(); ii++)
+  {
+    const int n = batch_poses[ii];
+    const Mat4x4f &transformation = results[ii].transformation_;
+    ContPose pose_in = objects[n].cont_pose();
+
+    // Apply only x,y,yaw, as the PCL 3-Dof ICP does
+    double x = transformation[0][0] * pose_in.x() + transformation[0][1] * pose_in.y() +
+               transformation[0][2] * pose_in.z() + transformation[0][3];
+    double y = transformation[1][0] * pose_in.x() + transformation[1][1] * pose_in.y() +
+               transformation[1][2] * pose_in.z() + transformation[1][3];
+    double yaw = atan2(transformation[1][0], transformation[0][0]);
+    double total_yaw = atan2(sin(pose_in.yaw() + yaw), cos(pose_in.yaw() + yaw));
+    ContPose pose_out(x, y, pose_in.z(), pose_in.roll(), pose_in.pitch(), total_yaw);
+
+    modified_objects[n] = ObjectState(objects[n].id(), objects[n].symmetric(), pose_out,
+                                      objects[n].segmentation_label_id());
+  }
+}
 void EnvObjectRecognition::PrintGPUClouds(const vector<ObjectState>& objects,
                                           float* result_cloud, 
                                           uint8_t* result_cloud_color,
@@ -1502,36 +1744,13 @@ void EnvObjectRecognition::PrintGPUClouds(const vector<ObjectState>& objects,
 // }
 
 
-void EnvObjectRecognition::GetStateImagesUnifiedGPU(const string stage,
-                    const vector<ObjectState>& objects,
-                    const vector<vector<uint8_t>>& source_result_color,
-                    const vector<int32_t>& source_result_depth,
-                    vector<vector<uint8_t>>& result_color,
-                    vector<int32_t>& result_depth,
-                    int single_result_image,
-                    vector<float>& pose_clutter_cost,
-                    float* &result_cloud,
-                    uint8_t* &result_cloud_color,
-                    int& result_cloud_point_num,
-                    int* &result_dc_index,
-                    int* &result_cloud_pose_map,
-                    vector<cuda_renderer::Model::mat4x4>& adjusted_poses,
-                    float* &rendered_cost,
-                    float* &observed_cost,
-                    float* &points_diff_cost,
-                    float sensor_resolution,
-                    bool do_gpu_icp,
-                    int cost_type,
-                    bool calculate_observed_cost)
+void EnvObjectRecognition::GetGPURenderInputs(const vector<ObjectState> &objects,
+                                              GPURenderInputs *render_inputs)
 {
-   /*
-    Takes a bunch of ObjectState objects containing object ID and pose information and renders them. 
-    Possible outputs - 1 image output with multiple objects in different pose each in single image
-                     - Multiple images with different object in different poses, one object per image
-                     - Rendered point clouds from the GPU
-                     - Final costs from GPU with adjusted ICP poses
-  */
-  printf("GetStateImagesUnifiedGPU() for %d poses\n", objects.size());
+  /*
+   * Camera frame poses and per pose cost inputs of the unified GPU flow. Only reads the scene,
+   * so batches can be prepared on another thread while the previous one is rendered.
+   */
   Eigen::Isometry3d cam_z_front, cam_to_body;
   cam_to_body.matrix() << 0, 0, 1, 0,
                     -1, 0, 0, 0,
@@ -1540,10 +1759,14 @@ void EnvObjectRecognition::GetStateImagesUnifiedGPU(const string stage,
   cam_z_front = cam_to_world_ * cam_to_body;
   Eigen::Matrix4d cam_matrix =cam_z_front.matrix().inverse();
 
-  vector<cuda_renderer::Model::mat4x4> mat4_v;
-  vector<int> pose_model_map;
-  vector<int> pose_segmen_label;
-  vector<float> pose_obs_points_total;
+  vector<cuda_renderer::Model::mat4x4> &mat4_v = render_inputs->poses;
+  vector<int> &pose_model_map = render_inputs->pose_model_map;
+  vector<int> &pose_segmen_label = render_inputs->pose_segmentation_label;
+  vector<float> &pose_obs_points_total = render_inputs->pose_observed_points_total;
+  mat4_v.clear();
+  pose_model_map.clear();
+  pose_segmen_label.clear();
+  pose_obs_points_total.clear();
 
   // vector<int> tris_model_count;
   // vector<cuda_renderer::Model::Triangle> tris;
@@ -1574,7 +1797,7 @@ void EnvObjectRecognition::GetStateImagesUnifiedGPU(const string stage,
     // mat4.print();
     mat4_v.push_back(mat4);
 
-    pose_model_map.push_back(model_id);
+    pose_model_map.push_back(model_render_handles_[model_id]);
     model_id_prev = model_id;
 
     if (env_params_.use_external_pose_list == 1)
@@ -1620,6 +1843,53 @@ void EnvObjectRecognition::GetStateImagesUnifiedGPU(const string stage,
 
     }
   }
+}
+
+void EnvObjectRecognition::GetStateImagesUnifiedGPU(const string stage,
+                    const vector<ObjectState>& objects,
+                    const vector<vector<uint8_t>>& source_result_color,
+                    const vector<int32_t>& source_result_depth,
+                    vector<vector<uint8_t>>& result_color,
+                    vector<int32_t>& result_depth,
+                    int single_result_image,
+                    vector<float>& pose_clutter_cost,
+                    float* &result_cloud,
+                    uint8_t* &result_cloud_color,
+                    int& result_cloud_point_num,
+                    int* &result_dc_index,
+                    int* &result_cloud_pose_map,
+                    vector<cuda_renderer::Model::mat4x4>& adjusted_poses,
+                    float* &rendered_cost,
+                    float* &observed_cost,
+                    float* &points_diff_cost,
+                    float sensor_resolution,
+                    bool do_gpu_icp,
+                    int cost_type,
+                    bool calculate_observed_cost,
+                    int image_scale,
+                    const std::vector<float> &pose_cost_bound,
+                    const GPURenderInputs *render_inputs)
+{
+   /*
+    Takes a bunch of ObjectState objects containing object ID and pose information and renders them. 
+    Possible outputs - 1 image output with multiple objects in different pose each in single image
+                     - Multiple images with different object in different poses, one object per image
+                     - Rendered point clouds from the GPU
+                     - Final costs from GPU with adjusted ICP poses
+    With image_scale > 1, poses are rendered at 1/image_scale of the camera resolution against
+    a subsampled source image. Output images have the lower resolution.
+    With a pose_cost_bound, the FUSED_COST stage may return PRUNED_POSE_COST as rendered cost of poses
+    whose cost reaches their bound, when it runs fused (cuda_renderer::runs_fused_cost).
+    render_inputs are the GetGPURenderInputs of objects when already built, they are built here otherwise.
+  */
+  printf("GetStateImagesUnifiedGPU() for %d poses\n", objects.size());
+  GPURenderInputs built_render_inputs;
+  if (render_inputs == nullptr)
+  {
+    GetGPURenderInputs(objects, &built_render_inputs);
+    render_inputs = &built_render_inputs;
+  }
+
   double peak_memory_usage;
   // Old function that doesnt use .cuh files to separate render, cloud generator etc.
   // cuda_renderer::render_cuda_multi_unified_old(
@@ -1666,33 +1936,58 @@ void EnvObjectRecognition::GetStateImagesUnifiedGPU(const string stage,
   //                         peak_memory_usage);
   cuda_renderer::gpu_stats stats;
 
-  // Get outputs from CUDA
-  cuda_renderer::render_cuda_multi_unified(
+  // The projection matrix is normalized by the image size, so a lower resolution only changes
+  // the viewport and the intrinsics used to get clouds back from the depth images
+  const int render_width = env_params_.width / image_scale;
+  const int render_height = env_params_.height / image_scale;
+  vector<int32_t> scaled_source_depth;
+  vector<vector<uint8_t>> scaled_source_color(source_result_color.size());
+  vector<uint8_t> scaled_mask_image;
+  if (image_scale > 1)
+  {
+    scaled_source_depth = SubsampleImage(source_result_depth, env_params_.width, image_scale);
+    for (size_t c = 0; c < source_result_color.size(); c++)
+      scaled_source_color[c] = SubsampleImage(source_result_color[c], env_params_.width, image_scale);
+    if (!predicted_mask_image.empty())
+      scaled_mask_image = SubsampleImage(predicted_mask_image, env_params_.width, image_scale);
+  }
+
+  // Both backends have the same interface
+#ifdef CUDA_ON
+  auto render_multi_unified = perch_params_.use_cpu_renderer ?
+                              cuda_renderer::render_cpu_multi_unified :
+                              cuda_renderer::render_cuda_multi_unified;
+#else
+  auto render_multi_unified = cuda_renderer::render_cpu_multi_unified;
+#endif
+
+  // Get outputs from the renderer
+  render_multi_unified(
                           stage,
-                          tris,
-                          mat4_v,
-                          pose_model_map,
-                          tris_model_count,
-                          env_params_.width, env_params_.height, 
+                          renderer_context_.models.tris(),
+                          render_inputs->poses,
+                          render_inputs->pose_model_map,
+                          renderer_context_.models.tris_model_count(),
+                          render_width, render_height,
                           env_params_.proj_mat, 
-                          source_result_depth,
-                          source_result_color,
+                          image_scale > 1 ? scaled_source_depth : source_result_depth,
+                          image_scale > 1 ? scaled_source_color : source_result_color,
                           single_result_image,
                           pose_clutter_cost,
-                          predicted_mask_image,
-                          pose_segmen_label,
+                          image_scale > 1 ? scaled_mask_image : predicted_mask_image,
+                          render_inputs->pose_segmentation_label,
                           gpu_stride,
                           gpu_point_dim,
                           gpu_depth_factor,
-                          kCameraCX,
-                          kCameraCY,
-                          kCameraFX,
-                          kCameraFY,
+                          kCameraCX / image_scale,
+                          kCameraCY / image_scale,
+                          kCameraFX / image_scale,
+                          kCameraFY / image_scale,
                           result_observed_cloud,
                           result_observed_cloud_eigen,
                           result_observed_cloud_color,
                           observed_point_num,
-                          pose_obs_points_total,
+                          render_inputs->pose_observed_points_total,
                           result_observed_cloud_label,
                           cost_type,
                           calculate_observed_cost,
@@ -1711,7 +2006,12 @@ void EnvObjectRecognition::GetStateImagesUnifiedGPU(const string stage,
                           rendered_cost,
                           observed_cost,
                           points_diff_cost,
-                          stats);
+                          stats,
+                          &renderer_context_,
+                          perch_params_.use_projective_association ?
+                            cuda_renderer::NN_PROJECTIVE : cuda_renderer::NN_BRUTE_FORCE,
+                          result_observed_cloud_lab.empty() ? NULL : result_observed_cloud_lab.data(),
+                          pose_cost_bound.empty() ? NULL : pose_cost_bound.data());
   env_stats_.peak_gpu_mem = std::max(env_stats_.peak_gpu_mem, stats.peak_memory_usage);
   env_stats_.icp_time += (double) stats.icp_runtime;
 }
@@ -1779,10 +2079,34 @@ void EnvObjectRecognition::PrintStateGPU(GraphState state)
   );
   PrintGPUImages(source_result_depth, source_result_color, 1, "graph_state", random_poses_occluded);
 }
+int EnvObjectRecognition::GetGPUCostType() const {
+  // Convert different types of costs to a single variable that is used as a switch
+  if (env_params_.use_external_pose_list == 1)
+  {
+    // 6-Dof - depth only based cost and also use observed cost
+    return 2;
+  }
+  // 3-DOF
+  if (perch_params_.use_color_cost)
+  {
+    // Sameshape scenes
+    return 1;
+  }
+  return 0;
+}
+
+std::string EnvObjectRecognition::FusedCostStage() const {
+  if (perch_params_.use_fused_cost && perch_params_.use_projective_association) {
+    return "FUSED_COST";
+  }
+  return "COST";
+}
+
 void EnvObjectRecognition::ComputeGreedyCostsInParallelGPU(const std::vector<int32_t> &source_result_depth,
                                                           const std::vector<ObjectState> &last_object_states,
                                                           std::vector<CostComputationOutput> &output,
-                                                          int batch_index) {
+                                                          int batch_index,
+                                                          const GPURenderInputs *render_inputs) {
     /*
      * Calculate cost parallely on GPU using PERCH 2.0 flow
      */
@@ -1852,29 +2176,8 @@ void EnvObjectRecognition::ComputeGreedyCostsInParallelGPU(const std::vector<int
       stage = "DEBUG";
     } 
 
-    // Convert different types of costs to a single variable that is used as a switch
-    int cost_type;
-    bool calc_obs_cost = false;
-    if (env_params_.use_external_pose_list == 1)
-    {
-      // 6-Dof - depth only based cost and also use observed cost
-      cost_type = 2;
-      calc_obs_cost = true;
-    }
-    else
-    {
-      // 3-DOF
-      if (perch_params_.use_color_cost)
-      {
-        // Sameshape scenes
-        cost_type = 1;
-      }
-      else
-      {
-        cost_type = 0;
-      }
-      calc_obs_cost = true;
-    }
+    int cost_type = GetGPUCostType();
+    bool calc_obs_cost = true;
     printf("Using cost type : %d\n", cost_type);
 
     GetStateImagesUnifiedGPU(
@@ -1901,7 +2204,10 @@ void EnvObjectRecognition::ComputeGreedyCostsInParallelGPU(const std::vector<int
       perch_params_.sensor_resolution,
       (perch_params_.icp_type == 3), // Do ICP inside gpu for 6dof
       cost_type,
-      calc_obs_cost
+      calc_obs_cost,
+      1,
+      std::vector<float>(),
+      render_inputs
     );
 
     if (perch_params_.vis_expanded_states) {
@@ -1935,10 +2241,20 @@ void EnvObjectRecognition::ComputeGreedyCostsInParallelGPU(const std::vector<int
       //   random_modified_last_object_states, false, render_point_cloud_topic, true
       // );
 
-      stage = "COST";
+      stage = FusedCostStage();
       if (perch_params_.vis_expanded_states) {
         stage = "DEBUG";
       }    
+      // Poses can only replace the lowest cost pose of their model with a lower cost
+      std::vector<float> pose_cost_bound;
+      if (perch_params_.use_cost_bound && !perch_params_.vis_expanded_states) {
+        pose_cost_bound.resize(num_poses);
+        for (int i = 0; i < num_poses; i++) {
+          const int model_id = modified_last_object_states[i].id();
+          const int bound = model_id < greedy_cost_bound_.size() ? greedy_cost_bound_[model_id] : INT_MAX;
+          pose_cost_bound[i] = (bound == INT_MAX) ? std::numeric_limits<float>::max() : bound;
+        }
+      }
       GetStateImagesUnifiedGPU(
         stage,
         modified_last_object_states,
@@ -1960,7 +2276,9 @@ void EnvObjectRecognition::ComputeGreedyCostsInParallelGPU(const std::vector<int
         perch_params_.sensor_resolution,
         false,
         cost_type,
-        calc_obs_cost
+        calc_obs_cost,
+        1,
+        pose_cost_bound
       );
 
       if (perch_params_.vis_expanded_states) {
@@ -2018,8 +2336,13 @@ void EnvObjectRecognition::ComputeGreedyCostsInParallelGPU(const std::vector<int
         );
         object_state = modified_object_state;
       }
+      if ((int) rendered_cost_gpu[i] == PRUNED_POSE_COST)
+      {
+        env_stats_.poses_pruned++;
+        cur_unit.cost = -2;
+      }
       // TODO : fix less than 0 case, happens in greedy when no points in rendered scene for object
-      if ((int) rendered_cost_gpu[i] < 0)
+      else if ((int) rendered_cost_gpu[i] < 0)
       {
         cout << "Invalid " << object_state << endl;
         printf("Pose %d was invalid\n", i);
@@ -2049,6 +2372,136 @@ void EnvObjectRecognition::ComputeGreedyCostsInParallelGPU(const std::vector<int
       cur_unit.depth_image = source_depth_image;
       output[i + batch_index] = cur_unit;
     }
+
+    if (perch_params_.use_cost_bound) {
+      for (int i = 0; i < num_poses; i++) {
+        const CostComputationOutput &cur_unit = output[i + batch_index];
+        const int model_id = cur_unit.adjusted_state.object_states().back().id();
+        if (IsGreedyCandidate(cur_unit) && model_id < greedy_cost_bound_.size()) {
+          greedy_cost_bound_[model_id] = std::min(greedy_cost_bound_[model_id], cur_unit.cost);
+        }
+      }
+    }
+}
+
+void EnvObjectRecognition::ComputeCoarseCostsGPU(const std::vector<int32_t> &source_result_depth,
+                                                 const std::vector<ObjectState> &object_states,
+                                                 std::vector<int> *costs,
+                                                 const GPURenderInputs *render_inputs) {
+  /*
+   * Pre-ICP cost of states rendered at a lower resolution, only used to rank them for the full resolution pass.
+   * Rendered clouds are sparser by the image scale, the sensor resolution used to match points is scaled the same way
+   */
+  // Largest scale not above coarse_image_scale for which the stride still divides the image width
+  int image_scale = std::max(1, perch_params_.coarse_image_scale);
+  while (image_scale > 1 && (env_params_.width / image_scale) % gpu_stride != 0) {
+    image_scale--;
+  }
+  printf("Computing coarse costs for %d poses at image scale %d\n", (int) object_states.size(), image_scale);
+
+  std::vector<std::vector<uint8_t>> source_result_color(3,
+    std::vector<uint8_t>(kCameraWidth * kCameraHeight, 255));
+  std::vector<std::vector<uint8_t>> result_color;
+  std::vector<int32_t> result_depth;
+  std::vector<float> pose_clutter_cost(object_states.size(), 0.0);
+  float* result_cloud;
+  uint8_t* result_cloud_color;
+  int rendered_point_num;
+  int* dc_index;
+  int* cloud_pose_map;
+  std::vector<cuda_renderer::Model::mat4x4> adjusted_poses;
+  float* rendered_cost;
+  float* observed_cost;
+  float* points_diff_cost;
+
+  GetStateImagesUnifiedGPU(
+    FusedCostStage(),
+    object_states,
+    source_result_color,
+    source_result_depth,
+    result_color,
+    result_depth,
+    0,
+    pose_clutter_cost,
+    result_cloud,
+    result_cloud_color,
+    rendered_point_num,
+    dc_index,
+    cloud_pose_map,
+    adjusted_poses,
+    rendered_cost,
+    observed_cost,
+    points_diff_cost,
+    perch_params_.sensor_resolution * image_scale,
+    false,
+    GetGPUCostType(),
+    true,
+    image_scale,
+    std::vector<float>(),
+    render_inputs
+  );
+
+  for (size_t i = 0; i < object_states.size(); i++) {
+    costs->push_back((int) rendered_cost[i] < 0 ? -1 :
+                     (int) (rendered_cost[i] + observed_cost[i]));
+  }
+}
+
+std::vector<ObjectState> EnvObjectRecognition::GetCoarseToFineStates(
+  const std::vector<ObjectState> &coarse_states,
+  const std::vector<int> &coarse_costs,
+  const std::vector<ObjectState> &fine_states) {
+  // (cost, index) of the valid coarse states of every model
+  vector<vector<std::pair<int, int>>> model_costs(env_params_.num_models);
+  for (size_t ii = 0; ii < coarse_states.size(); ++ii) {
+    if (coarse_costs[ii] < 0) {
+      continue;
+    }
+    model_costs[coarse_states[ii].id()].push_back(std::make_pair(coarse_costs[ii], ii));
+  }
+
+  vector<ObjectState> survivors;
+  for (auto &costs : model_costs) {
+    const size_t top_k = std::min(costs.size(), (size_t) std::max(perch_params_.coarse_top_k, 1));
+    std::partial_sort(costs.begin(), costs.begin() + top_k, costs.end());
+    for (size_t kk = 0; kk < top_k; ++kk) {
+      survivors.push_back(coarse_states[costs[kk].second]);
+    }
+  }
+
+  if (fine_states.empty()) {
+    printf("Coarse to fine : %d of %d states kept\n", (int) survivors.size(), (int) coarse_states.size());
+    return survivors;
+  }
+
+  // Fine grid cells within half a coarse cell of a survivor
+  const int half_cell = std::max(perch_params_.coarse_grid_factor, 1) / 2;
+  const int num_yaws = NumGridYaws(env_params_.theta_res);
+  std::set<std::tuple<int, int, int, int>> refined_cells;
+  for (const auto &survivor : survivors) {
+    int model_id, x, y, yaw;
+    std::tie(model_id, x, y, yaw) = GridCell(survivor, GetSearchResolution(survivor.id()),
+                                             env_params_.x_min, env_params_.y_min, env_params_.theta_res);
+    for (int dx = -half_cell; dx <= half_cell; ++dx) {
+      for (int dy = -half_cell; dy <= half_cell; ++dy) {
+        for (int dyaw = -half_cell; dyaw <= half_cell; ++dyaw) {
+          refined_cells.insert(std::make_tuple(model_id, x + dx, y + dy,
+                                               ((yaw + dyaw) % num_yaws + num_yaws) % num_yaws));
+        }
+      }
+    }
+  }
+
+  vector<ObjectState> refined_states;
+  for (const auto &state : fine_states) {
+    if (refined_cells.count(GridCell(state, GetSearchResolution(state.id()),
+                                     env_params_.x_min, env_params_.y_min, env_params_.theta_res)) > 0) {
+      refined_states.push_back(state);
+    }
+  }
+  printf("Coarse to fine : %d survivors of %d coarse states, %d of %d fine states kept\n",
+         (int) survivors.size(), (int) coarse_states.size(), (int) refined_states.size(), (int) fine_states.size());
+  return refined_states;
 }
 
 void EnvObjectRecognition::ComputeCostsInParallelGPU(std::vector<CostComputationInput> &input,
@@ -2465,21 +2918,28 @@ GraphState EnvObjectRecognition::ComputeGreedyRenderPoses() {
 
   chrono::time_point<chrono::system_clock> start, end;
   start = chrono::system_clock::now();
+  greedy_cost_bound_.assign(env_params_.num_models, INT_MAX);
+
+  // With external pose lists on the GPU, valid poses are streamed batch by batch from the
+  // pose lists instead of generating every successor state up front
+  const bool stream_pose_list = env_params_.use_external_pose_list == 1 && perch_params_.use_gpu;
 
   GraphState source_state;
   vector<GraphState> candidate_succs;
-  GenerateSuccessorStates(source_state, &candidate_succs);
-  env_stats_.scenes_rendered += static_cast<int>(candidate_succs.size());
-
-  vector<int> candidate_succ_ids, candidate_costs;
-  candidate_succ_ids.resize(candidate_succs.size(), 0);
-
-
-  candidate_costs.resize(candidate_succ_ids.size());
+  if (!stream_pose_list)
+  {
+    GenerateSuccessorStates(source_state, &candidate_succs);
+    if (!perch_params_.use_coarse_to_fine)
+      env_stats_.scenes_rendered += static_cast<int>(candidate_succs.size());
+  }
 
   // Prepare the cost computation input vector.
-  vector<ObjectState> last_object_states(candidate_succ_ids.size());
-  vector<CostComputationOutput> cost_computation_output(candidate_succ_ids.size());
+  vector<ObjectState> last_object_states(candidate_succs.size());
+  vector<CostComputationOutput> cost_computation_output(candidate_succs.size());
+  for (size_t ii = 0; ii < last_object_states.size(); ++ii) {
+    last_object_states[ii] =
+       candidate_succs[ii].object_states()[candidate_succs[ii].object_states().size() - 1];
+  }
 
   // Initialize source image with observed depth image for occlusion handling
   std::vector<int32_t> source_result_depth(kCameraWidth * kCameraHeight, 0);
@@ -2496,32 +2956,102 @@ GraphState EnvObjectRecognition::ComputeGreedyRenderPoses() {
       // printf("source depth : %d\n", input_depth_image_vec[i]);
     }
   }
-  for (size_t ii = 0; ii < last_object_states.size(); ++ii) {
-    last_object_states[ii] =
-       candidate_succs[ii].object_states()[candidate_succs[ii].object_states().size() - 1];
+  // With coarse to fine, every state is first ranked at a lower resolution (only the coarse grid for 3-Dof)
+  // and only the best ones get the full resolution render and ICP below
+  vector<ObjectState> coarse_states;
+  vector<int> coarse_costs;
+  const bool grid_states = !stream_pose_list && env_params_.use_external_render != 1 &&
+                           env_params_.use_external_pose_list != 1;
+  // Batches are built on their own thread while the previous one is rendered : read and validated
+  // from the pose lists when streamed, sliced from the states otherwise, then turned into render inputs.
+  // At most gpu_pipeline_depth batches wait. Render, ICP and cost of a batch run in sequence in
+  // render_multi_unified on the default stream, there are no pinned staging buffers or per stage streams.
+  struct StateBatches {
+    EnvObjectRecognition *env;
+    const vector<ObjectState> &states;
+    size_t next_index;
+
+    bool operator()(GPUPoseBatch *batch) {
+      if (next_index >= states.size()) return false;
+      const size_t end_index = std::min(next_index + env->perch_params_.gpu_batch_size, states.size());
+      batch->start_index = static_cast<int>(next_index);
+      batch->states.assign(states.begin() + next_index, states.begin() + end_index);
+      env->GetGPURenderInputs(batch->states, &batch->render_inputs);
+      next_index = end_index;
+      return true;
+    }
+  };
+  int bi = 0;
+  auto compute_coarse_costs = [this, &bi, &coarse_states, &coarse_costs](const GPUPoseBatch &batch) -> void {
+    printf("\n\nGetting coarse costs for GPU batch : %d, num poses : %d\n", bi, batch.states.size());
+    ComputeCoarseCostsGPU(input_depth_image_vec, batch.states, &coarse_costs, &batch.render_inputs);
+    coarse_states.insert(coarse_states.end(), batch.states.begin(), batch.states.end());
+    bi++;
+  };
+  auto compute_greedy_costs = [this, &bi, &cost_computation_output](const GPUPoseBatch &batch) -> void {
+    if (cost_computation_output.size() < batch.start_index + batch.states.size())
+      cost_computation_output.resize(batch.start_index + batch.states.size());
+    printf("\n\nGetting costs for GPU batch : %d, num poses : %d\n", bi, batch.states.size());
+    ComputeGreedyCostsInParallelGPU(input_depth_image_vec, batch.states, cost_computation_output,
+                                    batch.start_index, &batch.render_inputs);
+    bi++;
+  };
+
+  if (stream_pose_list)
+  {
+    PoseListCursor pose_list_cursor;
+    int num_streamed = 0;
+    auto read_batches = [this, &pose_list_cursor, &num_streamed](GPUPoseBatch *batch) -> bool {
+      if (!GetNextExternalPoseBatch(&pose_list_cursor, perch_params_.gpu_batch_size, &batch->states))
+        return false;
+      batch->start_index = num_streamed;
+      num_streamed += static_cast<int>(batch->states.size());
+      GetGPURenderInputs(batch->states, &batch->render_inputs);
+      return true;
+    };
+    RunBatchPipeline<GPUPoseBatch>(perch_params_.gpu_pipeline_depth, read_batches,
+                                   [this, &compute_coarse_costs, &compute_greedy_costs](const GPUPoseBatch &batch) {
+      env_stats_.scenes_rendered += static_cast<int>(batch.states.size());
+      if (perch_params_.use_coarse_to_fine)
+        compute_coarse_costs(batch);
+      else
+        compute_greedy_costs(batch);
+    });
+  }
+  else if (perch_params_.use_coarse_to_fine)
+  {
+    const int grid_factor = std::max(perch_params_.coarse_grid_factor, 1);
+    vector<ObjectState> coarse_candidates;
+    for (const auto &state : last_object_states) {
+      if (grid_states) {
+        int model_id, x, y, yaw;
+        std::tie(model_id, x, y, yaw) = GridCell(state, GetSearchResolution(state.id()),
+                                                 env_params_.x_min, env_params_.y_min, env_params_.theta_res);
+        if (x % grid_factor != 0 || y % grid_factor != 0 || yaw % grid_factor != 0) continue;
+      }
+      coarse_candidates.push_back(state);
+    }
+    env_stats_.scenes_rendered += static_cast<int>(coarse_candidates.size());
+    RunBatchPipeline<GPUPoseBatch>(perch_params_.gpu_pipeline_depth, StateBatches{this, coarse_candidates, 0},
+                                   compute_coarse_costs);
+  }
+  if (perch_params_.use_coarse_to_fine)
+  {
+    // Poses from lists are not on a grid, only 3-Dof survivors are refined on the fine grid
+    last_object_states = GetCoarseToFineStates(coarse_states, coarse_costs,
+                                               grid_states ? last_object_states : vector<ObjectState>());
+    cost_computation_output.assign(last_object_states.size(), CostComputationOutput());
+    env_stats_.scenes_rendered += static_cast<int>(last_object_states.size());
   }
   // int gpu_batch_size = 2000;
-  int num_batches = candidate_succ_ids.size()/perch_params_.gpu_batch_size + 1;
-  printf("Num GPU batches for given batch size : %d\n", num_batches);
-  for (int bi = 0; bi < num_batches; bi++)
+  const bool batched_states = !stream_pose_list || perch_params_.use_coarse_to_fine;
+  if (batched_states)
   {
-    int start_index = bi * perch_params_.gpu_batch_size;
-    vector<ObjectState>::const_iterator batch_start = last_object_states.begin() + start_index;
-    // Take min of gpu batch size of number of poses left
-    int end_index = std::min((bi + 1) * perch_params_.gpu_batch_size, (int) candidate_succ_ids.size());
-    if (end_index > candidate_succ_ids.size() || start_index >= candidate_succ_ids.size()) break;
-
-    vector<ObjectState>::const_iterator batch_end = last_object_states.begin() + end_index;
-    vector<ObjectState> batch_last_object_states(batch_start, batch_end);
-    printf("\n\nGetting costs for GPU batch : %d, num poses : %d\n", bi, batch_last_object_states.size());
-
-    // vector<ObjectState>::iterator batch_start_cost_comp = cost_computation_output.begin() + bi * 10;
-    // vector<ObjectState>::iterator batch_end_cost_comp = batch_start_cost_comp + (bi + 1) * 10;
-    // vector<CostComputationOutput> batch_cost_computation_output(batch_start_cost_comp, batch_end_cost_comp);
-
-    ComputeGreedyCostsInParallelGPU(input_depth_image_vec, batch_last_object_states, cost_computation_output, start_index);
-    // ComputeGreedyCostsInParallelGPU(source_result_depth, batch_last_object_states, cost_computation_output, start_index);
-    batch_last_object_states.clear();
+    printf("Num GPU batches for given batch size : %d\n",
+           (int) ((last_object_states.size() + perch_params_.gpu_batch_size - 1) / perch_params_.gpu_batch_size));
+    bi = 0;
+    RunBatchPipeline<GPUPoseBatch>(perch_params_.gpu_pipeline_depth, StateBatches{this, last_object_states, 0},
+                                   compute_greedy_costs);
   }
 
 
@@ -2539,7 +3069,7 @@ GraphState EnvObjectRecognition::ComputeGreedyRenderPoses() {
   vector<int> lowest_cost_state_id_per_object(env_params_.num_models, -1);
   vector<int> lowest_preicp_cost_state_id_per_object(env_params_.num_models, -1);
   printf("State number,     label     preicp_target_cost    preicp_source_cost     target_cost    source_cost    last_level_cost    preicp_candidate_costs    candidate_costs\n");
-  for (size_t ii = 0; ii < candidate_succ_ids.size(); ++ii) {
+  for (size_t ii = 0; ii < cost_computation_output.size(); ++ii) {
       nlohmann::json pose_dump;
       const auto &output_unit = cost_computation_output[ii];
       const auto &adjusted_state = cost_computation_output[ii].adjusted_state;
@@ -2557,8 +3087,7 @@ GraphState EnvObjectRecognition::ComputeGreedyRenderPoses() {
 
       if (env_params_.use_external_pose_list == 1)
       {
-        if (output_unit.cost < lowest_cost_per_object[model_id]
-        && abs(output_unit.state_properties.target_cost - output_unit.state_properties.source_cost) < 30)
+        if (output_unit.cost < lowest_cost_per_object[model_id] && IsGreedyCandidate(output_unit))
         {
           lowest_cost_per_object[model_id] = output_unit.cost;
           lowest_cost_state_per_object[model_id] = adjusted_object_state;
@@ -2573,8 +3102,7 @@ GraphState EnvObjectRecognition::ComputeGreedyRenderPoses() {
       }
       else
       {
-        if (output_unit.cost < lowest_cost_per_object[model_id] 
-        && abs(output_unit.state_properties.target_cost - output_unit.state_properties.source_cost) < 30)
+        if (output_unit.cost < lowest_cost_per_object[model_id] && IsGreedyCandidate(output_unit))
         // && output_unit.cost > 0)
         {
           lowest_cost_per_object[model_id] = output_unit.cost;
@@ -3370,7 +3898,8 @@ int EnvObjectRecognition::GetCost(const GraphState &source_state,
                                   vector<vector<unsigned char>> *final_color_image,
                                   vector<unsigned short> *unadjusted_depth_image,
                                   vector<vector<unsigned char>> *unadjusted_color_image,
-                                  double &histogram_score) {
+                                  double &histogram_score,
+                                  RenderedImages *last_object_images) {
   if (cost_debug_msgs)
     std::cout << "GetCost() : Getting cost for state " << endl;
   assert(child_state.NumObjects() > 0);
@@ -3398,11 +3927,18 @@ int EnvObjectRecognition::GetCost(const GraphState &source_state,
 
   // Begin ICP Adjustment
   // Computing images after adding objects to scene
-  GraphState s_new_obj;
-  s_new_obj.AppendObject(ObjectState(last_object_id,
-                                     obj_models_[last_object_id].symmetric(), child_pose));
-  succ_depth_buffer = GetDepthImage(s_new_obj, &last_obj_depth_image, &last_obj_color_image,
-                                    &last_cv_obj_depth_image, &last_cv_obj_color_image);
+  if (last_object_images != nullptr) {
+    last_obj_depth_image.swap(last_object_images->depth_image);
+    last_obj_color_image.swap(last_object_images->color_image);
+    std::swap(last_cv_obj_depth_image, last_object_images->cv_depth_image);
+    std::swap(last_cv_obj_color_image, last_object_images->cv_color_image);
+  } else {
+    GraphState s_new_obj;
+    s_new_obj.AppendObject(ObjectState(last_object_id,
+                                       obj_models_[last_object_id].symmetric(), child_pose));
+    succ_depth_buffer = GetDepthImage(s_new_obj, &last_obj_depth_image, &last_obj_color_image,
+                                      &last_cv_obj_depth_image, &last_cv_obj_color_image);
+  }
 
   if (kUseHistogramLazy && child_state.NumObjects() == 1)
   // if (kUseHistogramLazy)
@@ -3885,34 +4421,18 @@ double EnvObjectRecognition::getColorDistanceCMC(uint32_t rgb_1, uint32_t rgb_2)
 }
 double EnvObjectRecognition::getColorDistance(uint32_t rgb_1, uint32_t rgb_2) const
 {
-    uint8_t r = (rgb_1 >> 16);
-    uint8_t g = (rgb_1 >> 8);
-    uint8_t b = (rgb_1);
-    ColorSpace::Rgb point_1_color(r, g, b);
-    // printf("observed_color point color: %d,%d,%d\n", r,g,b);
-
-    r = (rgb_2 >> 16);
-    g = (rgb_2 >> 8);
-    b = (rgb_2);
-    // printf("model point color: %d,%d,%d\n", r,g,b);
-    ColorSpace::Rgb point_2_color(r, g, b);
-
-    double color_distance =
-              ColorSpace::Cie2000Comparison::Compare(&point_1_color, &point_2_color);
-
-    return color_distance;
-
+    const Eigen::Vector3f lab_1 = RgbToLab(rgb_1);
+    const Eigen::Vector3f lab_2 = RgbToLab(rgb_2);
+    return cuda_renderer::color::ciede2000(lab_1[0], lab_1[1], lab_1[2],
+                                           lab_2[0], lab_2[1], lab_2[2]);
 }
 double EnvObjectRecognition::getColorDistance(uint8_t r1,uint8_t g1,uint8_t b1,uint8_t r2,uint8_t g2,uint8_t b2) const
 {
-    ColorSpace::Rgb point_1_color(r1, g1, b1);
-    ColorSpace::Rgb point_2_color(r2, g2, b2);
-
-    double color_distance =
-              ColorSpace::Cie2000Comparison::Compare(&point_1_color, &point_2_color);
-
-    return color_distance;
-
+    float lab_1[3], lab_2[3];
+    cuda_renderer::color::rgb_to_lab(r1, g1, b1, lab_1);
+    cuda_renderer::color::rgb_to_lab(r2, g2, b2, lab_2);
+    return cuda_renderer::color::ciede2000(lab_1[0], lab_1[1], lab_1[2],
+                                           lab_2[0], lab_2[1], lab_2[2]);
 }
 
 int EnvObjectRecognition::getNumColorNeighboursCMC(PointT point,
@@ -3939,12 +4459,15 @@ int EnvObjectRecognition::getNumColorNeighbours(PointT point,
                                               const PointCloudPtr point_cloud) const
 {
     uint32_t rgb_1 = *reinterpret_cast<int*>(&point.rgb);
+    const Eigen::Vector3f lab_1 = RgbToLab(rgb_1);
     int num_color_neighbors_found = 0;
     for (int i = 0; i < indices.size(); i++)
     {
         // Find color matching points in observed_color point cloud
         uint32_t rgb_2 = *reinterpret_cast<int*>(&point_cloud->points[indices[i]].rgb);
-        double color_distance = getColorDistance(rgb_1, rgb_2);
+        const Eigen::Vector3f lab_2 = RgbToLab(rgb_2);
+        double color_distance = cuda_renderer::color::ciede2000(lab_1[0], lab_1[1], lab_1[2],
+                                                                lab_2[0], lab_2[1], lab_2[2]);
         if (color_distance < perch_params_.color_distance_threshold) {
           // If color is close then this is a valid neighbour
           num_color_neighbors_found++;
@@ -3952,6 +4475,52 @@ int EnvObjectRecognition::getNumColorNeighbours(PointT point,
     }
     return num_color_neighbors_found;
 }
+
+int EnvObjectRecognition::getNumColorNeighbours(PointT point,
+                                              const vector<int> &indices,
+                                              const vector<Eigen::Vector3f> &cloud_lab) const
+{
+    uint32_t rgb_1 = *reinterpret_cast<int*>(&point.rgb);
+    const Eigen::Vector3f lab_1 = RgbToLab(rgb_1);
+    int num_color_neighbors_found = 0;
+    for (int i = 0; i < indices.size(); i++)
+    {
+        const Eigen::Vector3f &lab_2 = cloud_lab[indices[i]];
+        double color_distance = cuda_renderer::color::ciede2000(lab_1[0], lab_1[1], lab_1[2],
+                                                                lab_2[0], lab_2[1], lab_2[2]);
+        if (color_distance < perch_params_.color_distance_threshold) {
+          num_color_neighbors_found++;
+        }
+    }
+    return num_color_neighbors_found;
+}
+
+void EnvObjectRecognition::GetOpticalFramePoints(const PointCloudPtr &cloud,
+                                                 std::vector<Eigen::Vector3f> *optical_points) const
+{
+    optical_points->resize(cloud->points.size());
+    for (size_t i = 0; i < cloud->points.size(); ++i) {
+      const PointT &point = cloud->points[i];
+      (*optical_points)[i] = world_to_optical_ * Eigen::Vector3f(point.x, point.y, point.z);
+    }
+}
+
+int EnvObjectRecognition::ProjectiveRadiusSearch(const cuda_renderer::cpu::ProjectiveNN &projective_nn,
+                                                 const PointT &point, vector<int> &indices) const
+{
+    const float radius = perch_params_.sensor_resolution;
+    float sq_dist;
+    int index;
+    projective_nn.nearest(world_to_optical_ * Eigen::Vector3f(point.x, point.y, point.z),
+                          radius, sq_dist, index);
+    indices.clear();
+    if (index < 0 || sq_dist > radius * radius) {
+      return 0;
+    }
+    indices.push_back(index);
+    return 1;
+}
+
 int EnvObjectRecognition::GetColorCost(cv::Mat *cv_depth_image,cv::Mat *cv_color_image) {
   
     int cost = 0;
@@ -4059,10 +4628,15 @@ int EnvObjectRecognition::GetTargetCost(const PointCloudPtr
     PointT point = partial_rendered_cloud->points[ii];
     // std::cout<<point<<endl;
     // Search neighbours in observed_color point cloud
-    int num_neighbors_found = knn->radiusSearch(point,
-                                                perch_params_.sensor_resolution,
-                                                indices,
-                                                sqr_dists, 1);
+    int num_neighbors_found;
+    if (perch_params_.use_projective_association) {
+      num_neighbors_found = ProjectiveRadiusSearch(observed_projective_nn_, point, indices);
+    } else {
+      num_neighbors_found = knn->radiusSearch(point,
+                                              perch_params_.sensor_resolution,
+                                              indices,
+                                              sqr_dists, 1);
+    }
     const bool point_unexplained = num_neighbors_found == 0;
 
 
@@ -4086,7 +4660,7 @@ int EnvObjectRecognition::GetTargetCost(const PointCloudPtr
       if (env_params_.use_external_render == 1 || perch_params_.use_color_cost)
       {
         int num_color_neighbors_found =
-            getNumColorNeighbours(point, indices, observed_cloud_);
+            getNumColorNeighbours(point, indices, observed_cloud_lab_);
         total_color_neighbours += num_color_neighbors_found;
         if (num_color_neighbors_found == 0) {
           // If no color neighbours found then cost is 1.0
@@ -4143,9 +4717,20 @@ int EnvObjectRecognition::GetSourceCost(const PointCloudPtr
   assert(!last_level);
 
   // Compute the cost of points made infeasible in the observed_color point cloud.
+  // The pixel grid of the rendered cloud is a counting sort of its points,
+  // much cheaper to build for every state than a kd-tree.
   pcl::search::KdTree<PointT>::Ptr knn_reverse;
-  knn_reverse.reset(new pcl::search::KdTree<PointT>(true));
-  knn_reverse->setInputCloud(full_rendered_cloud);
+  // Per thread scratch, reused across the states a cost thread evaluates
+  static thread_local std::vector<Eigen::Vector3f> rendered_optical_points;
+  static thread_local cuda_renderer::cpu::ProjectiveNN rendered_projective_nn;
+  if (perch_params_.use_projective_association) {
+    GetOpticalFramePoints(full_rendered_cloud, &rendered_optical_points);
+    rendered_projective_nn.build(rendered_optical_points.data(), rendered_optical_points.size(),
+                                 kCameraWidth, kCameraHeight, 1, kCameraFX, kCameraFY, kCameraCX, kCameraCY);
+  } else {
+    knn_reverse.reset(new pcl::search::KdTree<PointT>(true));
+    knn_reverse->setInputCloud(full_rendered_cloud);
+  }
 
   child_counted_pixels->clear();
   *child_counted_pixels = parent_counted_pixels;
@@ -4286,10 +4871,15 @@ int EnvObjectRecognition::GetSourceCost(const PointCloudPtr
     PointT point = observed_cloud_->points[ii];
     vector<float> sqr_dists;
     vector<int> indices;
-    int num_neighbors_found = knn_reverse->radiusSearch(point,
-                                                        perch_params_.sensor_resolution,
-                                                        indices,
-                                                        sqr_dists, 1);
+    int num_neighbors_found;
+    if (perch_params_.use_projective_association) {
+      num_neighbors_found = ProjectiveRadiusSearch(rendered_projective_nn, point, indices);
+    } else {
+      num_neighbors_found = knn_reverse->radiusSearch(point,
+                                                      perch_params_.sensor_resolution,
+                                                      indices,
+                                                      sqr_dists, 1);
+    }
     bool point_unexplained = num_neighbors_found == 0;
 
     if (point_unexplained) {
@@ -4374,8 +4964,17 @@ int EnvObjectRecognition::GetLastLevelCost(const PointCloudPtr
 
   // Compute the cost of points made infeasible in the observed_color point cloud.
   pcl::search::KdTree<PointT>::Ptr knn_reverse;
-  knn_reverse.reset(new pcl::search::KdTree<PointT>(true));
-  knn_reverse->setInputCloud(full_rendered_cloud);
+  // Per thread scratch, reused across the states a cost thread evaluates
+  static thread_local std::vector<Eigen::Vector3f> rendered_optical_points;
+  static thread_local cuda_renderer::cpu::ProjectiveNN rendered_projective_nn;
+  if (perch_params_.use_projective_association) {
+    GetOpticalFramePoints(full_rendered_cloud, &rendered_optical_points);
+    rendered_projective_nn.build(rendered_optical_points.data(), rendered_optical_points.size(),
+                                 kCameraWidth, kCameraHeight, 1, kCameraFX, kCameraFY, kCameraCX, kCameraCY);
+  } else {
+    knn_reverse.reset(new pcl::search::KdTree<PointT>(true));
+    knn_reverse->setInputCloud(full_rendered_cloud);
+  }
 
   updated_counted_pixels->clear();
   *updated_counted_pixels = counted_pixels;
@@ -4403,10 +5002,15 @@ int EnvObjectRecognition::GetLastLevelCost(const PointCloudPtr
     PointT point = observed_cloud_->points[ii];
     vector<float> sqr_dists;
     vector<int> indices;
-    int num_neighbors_found = knn_reverse->radiusSearch(point,
-                                                        perch_params_.sensor_resolution,
-                                                        indices,
-                                                        sqr_dists, 1);
+    int num_neighbors_found;
+    if (perch_params_.use_projective_association) {
+      num_neighbors_found = ProjectiveRadiusSearch(rendered_projective_nn, point, indices);
+    } else {
+      num_neighbors_found = knn_reverse->radiusSearch(point,
+                                                      perch_params_.sensor_resolution,
+                                                      indices,
+                                                      sqr_dists, 1);
+    }
     bool point_unexplained = num_neighbors_found == 0;
 
     if (point_unexplained) {
@@ -5272,10 +5876,79 @@ const float *EnvObjectRecognition::GetDepthImage(GraphState &s,
                                                 int* num_occluders_in_input_cloud,
                                                 bool shift_centroid) {
 
+  // Cost workers can't use the OpenGL context, the thread running the cost executor renders for them
+  const float *depth_buffer = nullptr;
+  cost_executor_.Render([&]() {
+    depth_buffer = GetDepthImageOnRenderThread(s, depth_image, color_image, cv_depth_image,
+                                               cv_color_image, num_occluders_in_input_cloud,
+                                               shift_centroid);
+  });
+  return depth_buffer;
+}
+
+const float *EnvObjectRecognition::GetDepthImageOnRenderThread(GraphState &s,
+                                                std::vector<unsigned short> *depth_image,
+                                                std::vector<std::vector<unsigned char>> *color_image,
+                                                cv::Mat &cv_depth_image,
+                                                cv::Mat &cv_color_image,
+                                                int* num_occluders_in_input_cloud,
+                                                bool shift_centroid) {
+
   using milli = std::chrono::milliseconds;
   auto start = std::chrono::high_resolution_clock::now();
 
-  *num_occluders_in_input_cloud = 0;
+  // The depth is linearized to millimeters on the GPU, the raw depth buffer is
+  // not read back
+  const int frame = SubmitDepthImage(s, shift_centroid);
+  FetchDepthImage(frame, depth_image, color_image, cv_depth_image, cv_color_image,
+                  num_occluders_in_input_cloud);
+
+  auto finish = std::chrono::high_resolution_clock::now();
+  std::cout << "GetDepthImage() took "
+            << std::chrono::duration_cast<milli>(finish - start).count()
+            << " milliseconds\n";
+  return nullptr;
+}
+
+void EnvObjectRecognition::GetDepthImages(vector<GraphState> &states,
+                                          vector<RenderedImages> *images) {
+  cost_executor_.Render([&]() {
+    GetDepthImagesOnRenderThread(states, images);
+  });
+}
+
+void EnvObjectRecognition::GetDepthImagesOnRenderThread(vector<GraphState> &states,
+                                                        vector<RenderedImages> *images) {
+  images->clear();
+  images->resize(states.size());
+
+  const int max_in_flight = std::max(kinect_simulator_->rl_->getReadbackFrames(), 1);
+  // Submitted renders as (state index, frame), oldest first
+  std::deque<std::pair<size_t, int>> in_flight;
+  auto fetch_oldest = [&]() {
+    const size_t ii = in_flight.front().first;
+    int num_occluders = 0;
+    RenderedImages &rendered = (*images)[ii];
+    FetchDepthImage(in_flight.front().second, &rendered.depth_image, &rendered.color_image,
+                    rendered.cv_depth_image, rendered.cv_color_image, &num_occluders);
+    in_flight.pop_front();
+  };
+
+  for (size_t ii = 0; ii < states.size(); ++ii) {
+    if (states[ii].NumObjects() == 0) {
+      continue;
+    }
+    if (static_cast<int>(in_flight.size()) == max_in_flight) {
+      fetch_oldest();
+    }
+    in_flight.emplace_back(ii, SubmitDepthImage(states[ii], false));
+  }
+  while (!in_flight.empty()) {
+    fetch_oldest();
+  }
+}
+
+int EnvObjectRecognition::SubmitDepthImage(GraphState &s, bool shift_centroid) {
   if (scene_ == NULL) {
     printf("ERROR: Scene is not set\n");
   }
@@ -5290,20 +5963,20 @@ const float *EnvObjectRecognition::GetDepthImage(GraphState &s,
   // cout << "External Render :" << env_params_.use_external_render;
    for (size_t ii = 0; ii < object_states.size(); ++ii) {
       const auto &object_state = object_states[ii];
-      ObjectModel obj_model = obj_models_[object_state.id()];
+      const ObjectModel &obj_model = obj_models_[object_state.id()];
       ContPose p = object_state.cont_pose();
       // std::cout << "Object model in pose : " << p << endl;
 
       // std::cout << "Object model in pose after shift: " << p << endl;
-      pcl::PolygonMeshPtr transformed_mesh;
+      Eigen::Matrix4f transform;
       if (shift_centroid && ii == object_states.size()-1)
       {
-        transformed_mesh = obj_model.GetTransformedMeshWithShift(p);
+        transform = obj_model.GetShiftedTransform(p);
         object_states[ii] = ObjectState(object_state.id(), object_state.symmetric(), p);
       }
       else
       {
-        transformed_mesh = obj_model.GetTransformedMesh(p);
+        transform = p.GetTransform().matrix().cast<float>();
       }
       // std::string name;
       // name = "/media/jessy/Data/dataset/saved_ply/";
@@ -5320,21 +5993,27 @@ const float *EnvObjectRecognition::GetDepthImage(GraphState &s,
       // pcl::io::loadPolygonFilePLY(name,*transformed_mesh);
       
       //pcl::io::loadPCDFile(name,transformed_mesh->cloud);
-      PolygonMeshModel::Ptr model = PolygonMeshModel::Ptr (new PolygonMeshModel (
-                                                             GL_POLYGON, transformed_mesh));
-      scene_->add (model);
+      scene_->add (scene_models_[object_state.id()], transform);
       
       
     }
-    
-    kinect_simulator_->doSim(env_params_.camera_pose);
-    const float *depth_buffer = kinect_simulator_->rl_->getDepthBuffer();
-    kinect_simulator_->get_depth_image_uint(depth_buffer, depth_image);
+
+    return kinect_simulator_->doSimAsync(env_params_.camera_pose);
+}
+
+void EnvObjectRecognition::FetchDepthImage(int frame,
+                                           std::vector<unsigned short> *depth_image,
+                                           std::vector<std::vector<unsigned char>> *color_image,
+                                           cv::Mat &cv_depth_image,
+                                           cv::Mat &cv_color_image,
+                                           int* num_occluders_in_input_cloud) {
+    *num_occluders_in_input_cloud = 0;
+    kinect_simulator_->get_depth_image_uint(frame, depth_image);
     // kinect_simulator_->write_depth_image_uint(depth_buffer, "test_depth.png");
 
     if (perch_params_.use_color_cost) 
     {
-      const uint8_t *color_buffer = kinect_simulator_->rl_->getColorBuffer();
+      const uint8_t *color_buffer = kinect_simulator_->get_rgb_buffer(frame);
       kinect_simulator_->get_rgb_image_uchar(color_buffer, color_image);
       kinect_simulator_->get_rgb_image_cv(color_buffer, cv_color_image);
       cv::cvtColor(cv_color_image, cv_color_image, CV_BGR2RGB);
@@ -5343,7 +6022,7 @@ const float *EnvObjectRecognition::GetDepthImage(GraphState &s,
     // printf("depth vector max size :%d\n", (int) depth_image->max_size());
     // printf("color vector max size :%d\n", (int) color_image->max_size());
     // cv::Mat cv_image;
-    kinect_simulator_->get_depth_image_cv(depth_buffer, cv_depth_image);
+    cv::Mat(kCameraHeight, kCameraWidth, CV_16UC1, depth_image->data()).copyTo(cv_depth_image);
     // *cv_depth_image = cv_image;
     // cv_depth_image = cv::Mat(kCameraHeight, kCameraWidth, CV_16UC1, depth_image->data());
     // if (mpi_comm_->rank() == kMasterRank) {
@@ -5363,14 +6042,7 @@ const float *EnvObjectRecognition::GetDepthImage(GraphState &s,
         }
       }
     }
-
-    auto finish = std::chrono::high_resolution_clock::now();
-    std::cout << "GetDepthImage() took "
-              << std::chrono::duration_cast<milli>(finish - start).count()
-              << " milliseconds\n";
-    return depth_buffer;
-
-};
+}
 //GetDepthImage with cv:mat color image 
 const float *EnvObjectRecognition::GetDepthImage(GraphState s,
                              std::vector<unsigned short> *depth_image,
@@ -5379,6 +6051,21 @@ const float *EnvObjectRecognition::GetDepthImage(GraphState s,
                              cv::Mat *cv_color_image,
                              int* num_occluders_in_input_cloud) {
 
+  const float *depth_buffer = nullptr;
+  cost_executor_.Render([&]() {
+    depth_buffer = GetDepthImageOnRenderThread(s, depth_image, color_image, cv_depth_image,
+                                               cv_color_image, num_occluders_in_input_cloud);
+  });
+  return depth_buffer;
+}
+
+const float *EnvObjectRecognition::GetDepthImageOnRenderThread(GraphState s,
+                             std::vector<unsigned short> *depth_image,
+                             vector<vector<unsigned char>> *color_image,
+                             cv::Mat *cv_depth_image,
+                             cv::Mat *cv_color_image,
+                             int* num_occluders_in_input_cloud) {
+
   *num_occluders_in_input_cloud = 0;
   if (scene_ == NULL) {
     printf("ERROR: Scene is not set\n");
@@ -5469,14 +6156,10 @@ const float *EnvObjectRecognition::GetDepthImage(GraphState s,
     // TODO change this to just creating a blank image
     for (size_t ii = 0; ii < object_states.size(); ++ii) {
       const auto &object_state = object_states[ii];
-      ObjectModel obj_model = obj_models_[object_state.id()];
       ContPose p = object_state.cont_pose();
       // std::cout << "Object model in pose : " << p << endl;
-      auto transformed_mesh = obj_model.GetTransformedMesh(p);
-
-      PolygonMeshModel::Ptr model = PolygonMeshModel::Ptr (new PolygonMeshModel (
-                                                             GL_POLYGON, transformed_mesh));
-      scene_->add (model);
+      scene_->add (scene_models_[object_state.id()],
+                   p.GetTransform().matrix().cast<float>());
     }
 
     // kinect_simulator_->doSim(env_params_.camera_pose);
@@ -5516,6 +6199,14 @@ const float *EnvObjectRecognition::GetDepthImage(GraphState s,
 void EnvObjectRecognition::SetCameraPose(Eigen::Isometry3d camera_pose) {
   env_params_.camera_pose = camera_pose;
   cam_to_world_ = camera_pose;
+
+  camera_pose_hash_ = 0;
+
+  for (int ii = 0; ii < 16; ++ii) {
+    camera_pose_hash_ ^= std::hash<double>()(camera_pose.matrix().data()[ii]) +
+                         0x9e3779b9 + (camera_pose_hash_ << 6) + (camera_pose_hash_ >> 2);
+  }
+
   // cam_to_world_.matrix() << -0.000109327,    -0.496186,     0.868216,     0.436204,
   //                     -1,  5.42467e-05, -9.49191e-05,    0.0324911,
   //            -4.0826e-10,    -0.868216,    -0.496186,     0.573853,
@@ -5590,6 +6281,8 @@ void EnvObjectRecognition::SetObservation(int num_objects,
   if (perch_params_.use_downsampling) {
     observed_cloud_ = DownsamplePointCloud(observed_cloud_, perch_params_.downsampling_leaf_size);
   }
+  segmented_object_knn.clear();
+  segmented_object_clouds_xyz_.clear();
   for (int i = 0; i < segmented_object_clouds.size(); i++)
   {
     if (perch_params_.use_downsampling) {
@@ -5602,7 +6295,13 @@ void EnvObjectRecognition::SetObservation(int num_objects,
     object_knn.reset(new pcl::search::KdTree<PointT>(true));
     object_knn->setInputCloud(segmented_object_clouds[i]);
     segmented_object_knn.push_back(object_knn);
+
+    pcl::PointCloud<pcl::PointXYZ>::Ptr object_cloud_xyz(new pcl::PointCloud<pcl::PointXYZ>);
+    pcl::copyPointCloud(*segmented_object_clouds[i], *object_cloud_xyz);
+    segmented_object_clouds_xyz_.push_back(object_cloud_xyz);
   }
+  segmented_object_gicp_.assign(omp_get_max_threads(),
+    std::vector<std::shared_ptr<fast_gicp::FastGICP<pcl::PointXYZ, pcl::PointXYZ>>>(segmented_object_clouds.size()));
 
   // Remove outlier points - possible in 6D due to bad segmentation
   if (env_params_.use_external_pose_list == 1)
@@ -5621,6 +6320,12 @@ void EnvObjectRecognition::SetObservation(int num_objects,
       PrintPointCloud(downsampled_observed_cloud_, 1, downsampled_input_point_cloud_topic);
   }
 
+  // Colors of the observed points are compared to every rendered point near them, convert them once
+  observed_cloud_lab_.resize(observed_cloud_->points.size());
+  for (size_t i = 0; i < observed_cloud_->points.size(); ++i) {
+    observed_cloud_lab_[i] = RgbToLab(*reinterpret_cast<const uint32_t*>(&observed_cloud_->points[i].rgb));
+  }
+
   knn.reset(new pcl::search::KdTree<PointT>(true));
   printf("Setting knn with cloud of size : %d\n", observed_cloud_->points.size());
   // if (IsMaster(mpi_comm_)) {
@@ -5628,6 +6333,59 @@ void EnvObjectRecognition::SetObservation(int num_objects,
   // }
   knn->setInputCloud(observed_cloud_);
 
+  if (perch_params_.use_projective_association) {
+    // Inverse of the camera to world transforms the clouds are built with, getGlobalPointCV for
+    // external renders and getGlobalPoint otherwise, whose camera looks along -z
+    if (env_params_.use_external_render == 1) {
+      world_to_optical_ = cam_to_world_.cast<float>().inverse();
+    } else {
+      Eigen::Matrix4f cam_to_body;
+      cam_to_body << 0, 0, -1, 0,
+                    -1, 0,  0, 0,
+                     0, 1,  0, 0,
+                     0, 0,  0, 1;
+      Eigen::Affine3f camera_to_world;
+      camera_to_world.matrix() = cam_to_world_.matrix().cast<float>() * cam_to_body;
+      world_to_optical_ = Eigen::Scaling(1.0f, 1.0f, -1.0f) * camera_to_world.inverse();
+    }
+    GetOpticalFramePoints(observed_cloud_, &observed_optical_points_);
+    observed_projective_nn_.build(observed_optical_points_.data(), observed_optical_points_.size(),
+                                  kCameraWidth, kCameraHeight, 1, kCameraFX, kCameraFY, kCameraCX, kCameraCY);
+  }
+
+  // Target of every ICP against the whole observed cloud
+  icp_target_cloud_ = DownsamplePointCloud(observed_cloud_);
+  icp_target_knn_.reset(new pcl::search::KdTree<PointT>(true));
+  icp_target_knn_->setInputCloud(icp_target_cloud_);
+  if (perch_params_.use_batch_icp)
+  {
+    pcl::NormalEstimationOMP<PointT, pcl::Normal> normal_estimation;
+    pcl::PointCloud<pcl::Normal> normals;
+    normal_estimation.setInputCloud(icp_target_cloud_);
+    normal_estimation.setSearchMethod(icp_target_knn_);
+    normal_estimation.setKSearch(10);
+    normal_estimation.compute(normals);
+
+    vector<Vec3f> target_points, target_normals;
+    for (size_t ii = 0; ii < normals.points.size(); ++ii)
+    {
+      const pcl::Normal &normal = normals.points[ii];
+      if (!std::isfinite(normal.normal_x)) {
+        continue;
+      }
+      const PointT &point = icp_target_cloud_->points[ii];
+      target_points.push_back(Vec3f(point.x, point.y, point.z));
+      target_normals.push_back(Vec3f(normal.normal_x, normal.normal_y, normal.normal_z));
+    }
+    icp_target_tree_ = KDTree_linear();
+    if (!target_points.empty())
+    {
+      icp_target_tree_.build_tree(target_points, target_normals);
+      icp_target_scene_.init_Scene_nn_linear_cpu(icp_target_tree_);
+      icp_target_scene_.set_max_dist_diff(perch_params_.icp_max_correspondence);
+    }
+  }
+
   // Aditya commented
   // if (mpi_comm_->rank() == kMasterRank) {
   //   if (env_params_.use_external_pose_list == 0)
@@ -5730,6 +6488,7 @@ void EnvObjectRecognition::ResetEnvironmentState() {
   adjusted_states_.clear();
   env_stats_.scenes_rendered = 0;
   env_stats_.scenes_valid = 0;
+  env_stats_.poses_pruned = 0;
 
   const ObjectState special_goal_object_state(-1, false, DiscPose(0, 0, 0, 0, 0,
                                                                   0));
@@ -5757,8 +6516,8 @@ void EnvObjectRecognition::ResetEnvironmentState() {
   last_object_rendering_cost_.clear();
   depth_image_cache_.clear();
   counted_pixels_map_.clear();
-  adjusted_single_object_depth_image_cache_.clear();
-  unadjusted_single_object_depth_image_cache_.clear();
+  adjusted_single_object_depth_image_cache_.Clear();
+  unadjusted_single_object_depth_image_cache_.Clear();
   adjusted_single_object_state_cache_.clear();
   valid_indices_.clear();
 
@@ -5767,6 +6526,7 @@ void EnvObjectRecognition::ResetEnvironmentState() {
   g_value_map_[env_params_.start_state_id] = 0;
 
   observed_cloud_.reset(new PointCloud);
+  observed_cloud_lab_.clear();
   original_input_cloud_.reset(new PointCloud);
   projected_cloud_.reset(new PointCloud);
   observed_organized_cloud_.reset(new PointCloud);
@@ -5990,7 +6750,14 @@ void EnvObjectRecognition::SetInput(const RecognitionInput &input) {
       std::vector<ObjectState> last_object_states;
       vector<ObjectState> modified_last_object_states;
 
-      cuda_renderer::depth2cloud_global(
+#ifdef CUDA_ON
+      auto depth_to_cloud = perch_params_.use_cpu_renderer ?
+                            cuda_renderer::depth2cloud_global_cpu :
+                            cuda_renderer::depth2cloud_global;
+#else
+      auto depth_to_cloud = cuda_renderer::depth2cloud_global_cpu;
+#endif
+      depth_to_cloud(
           input_depth_image_vec, 
           input_color_image_vec, 
           result_observed_cloud_eigen,
@@ -6015,6 +6782,8 @@ void EnvObjectRecognition::SetInput(const RecognitionInput &input) {
           bounds, 
           camera_transform_ptr
       );
+      // Size the renderer buffers once for a full batch, they are reused by every batch of this and later scenes
+      renderer_context_.reserve(perch_params_.gpu_batch_size, env_params_.width, env_params_.height, gpu_stride);
       PrintGPUClouds(
         last_object_states, result_observed_cloud, result_observed_cloud_color, 
         observed_depth_data, observed_dc_index, 1, 
@@ -6194,6 +6963,14 @@ void EnvObjectRecognition::SetInput(const RecognitionInput &input) {
     }
   }
 
+  if (perch_params_.use_gpu)
+  {
+    // Lab colors for the color cost of every GPU/CPU renderer call on this scene
+    result_observed_cloud_lab.resize(3 * observed_point_num);
+    cuda_renderer::color::colors_to_lab(result_observed_cloud_color, observed_point_num,
+                                        result_observed_cloud_lab.data());
+  }
+
   // Precompute RCNN heuristics.
   if (depth_image.size() > 0)
   {
@@ -6279,22 +7056,22 @@ double EnvObjectRecognition::GetICPAdjustedPose(const PointCloudPtr cloud_in,
     }
   }
 
+  // Targets built in SetObservation come with their search tree, only the source side is set up here
   if (target_cloud == NULL)
   {
-    
-    PointCloudPtr remaining_observed_cloud;
     if (counted_indices.size() > 0)
     {
-      remaining_observed_cloud = perception_utils::IndexFilter(
+      PointCloudPtr remaining_observed_cloud = perception_utils::IndexFilter(
                                                       observed_cloud_, counted_indices, true);
+      const PointCloudPtr remaining_downsampled_observed_cloud =
+        DownsamplePointCloud(remaining_observed_cloud);
+      icp.setInputTarget(remaining_downsampled_observed_cloud);
     }
     else
     {
-      remaining_observed_cloud = observed_cloud_;
+      icp.setInputTarget(icp_target_cloud_);
+      icp.setSearchMethodTarget(icp_target_knn_, true);
     }
-    const PointCloudPtr remaining_downsampled_observed_cloud =
-      DownsamplePointCloud(remaining_observed_cloud);
-    icp.setInputTarget(remaining_downsampled_observed_cloud);
   }
   else
   {
@@ -6304,6 +7081,11 @@ double EnvObjectRecognition::GetICPAdjustedPose(const PointCloudPtr cloud_in,
       printf("Source cloud size : %d\n", cloud_in->points.size());
     }
     icp.setInputTarget(target_cloud);
+    const int segment = SegmentedObjectIndex(target_cloud);
+    if (segment >= 0)
+    {
+      icp.setSearchMethodTarget(segmented_object_knn[segment], true);
+    }
   }
   
   // icp.setInputTarget(downsampled_observed_cloud_);
@@ -6414,14 +7196,33 @@ double EnvObjectRecognition::GetVGICPAdjustedPose(const PointCloudPtr cloud_in,
 
   ///////////////////////////////
   auto start_v = std::chrono::high_resolution_clock::now();
-  fast_gicp::FastGICP<pcl::PointXYZ, pcl::PointXYZ> vgicp;
-  // fast_gicp::FastVGICP<pcl::PointXYZ, pcl::PointXYZ> vgicp;
-  pcl::PointCloud<pcl::PointXYZ>::Ptr vt(new pcl::PointCloud<pcl::PointXYZ>);
+  // fast_gicp reuses the target kd-tree and covariances while its input target stays the same cloud,
+  // so segmented object targets keep one registration object per thread across poses
+  std::shared_ptr<fast_gicp::FastGICP<pcl::PointXYZ, pcl::PointXYZ>> vgicp_ptr;
+  pcl::PointCloud<pcl::PointXYZ>::Ptr vt;
+  const int segment = SegmentedObjectIndex(target_cloud);
+  const int thread_id = omp_get_thread_num();
+  if (segment >= 0 && thread_id < segmented_object_gicp_.size())
+  {
+    vt = segmented_object_clouds_xyz_[segment];
+    vgicp_ptr = segmented_object_gicp_[thread_id][segment];
+    if (!vgicp_ptr)
+    {
+      vgicp_ptr.reset(new fast_gicp::FastGICP<pcl::PointXYZ, pcl::PointXYZ>);
+      segmented_object_gicp_[thread_id][segment] = vgicp_ptr;
+    }
+  }
+  else
+  {
+    // observed
+    vt.reset(new pcl::PointCloud<pcl::PointXYZ>);
+    pcl::copyPointCloud(*target_cloud, *vt);
+    vgicp_ptr.reset(new fast_gicp::FastGICP<pcl::PointXYZ, pcl::PointXYZ>);
+  }
+  fast_gicp::FastGICP<pcl::PointXYZ, pcl::PointXYZ> &vgicp = *vgicp_ptr;
+  // rendered
   pcl::PointCloud<pcl::PointXYZ>::Ptr vs(new pcl::PointCloud<pcl::PointXYZ>);
-  // observed
   pcl::copyPointCloud(*cloud_in, *vs);
-  // rendered
-  pcl::copyPointCloud(*target_cloud, *vt);
 
   printf("Target cloud size : %d\n", vt->points.size());
   printf("Source cloud size : %d\n", vs->points.size());
@@ -6430,9 +7231,6 @@ double EnvObjectRecognition::GetVGICPAdjustedPose(const PointCloudPtr cloud_in,
   // vgicp.setResolution(0.05);
   vgicp.setMaximumIterations(perch_params_.max_icp_iterations);
   vgicp.setCorrespondenceRandomness(10);
-  // fast_gicp reuses calculated covariances if an input cloud is the same as the previous one
-  // to prevent this for benchmarking, force clear source and target clouds
-  vgicp.clearTarget();
   vgicp.clearSource();
   vgicp.setInputTarget(vt);
   vgicp.setInputSource(vs);
@@ -6496,6 +7294,15 @@ double EnvObjectRecognition::GetVGICPAdjustedPose(const PointCloudPtr cloud_in,
 
 }
 
+int EnvObjectRecognition::SegmentedObjectIndex(const PointCloudPtr &cloud) const {
+  for (int i = 0; i < segmented_object_clouds.size(); i++) {
+    if (segmented_object_clouds[i] == cloud) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 // Feature-based and ICP Planners
 GraphState EnvObjectRecognition::ComputeGreedyICPPoses() {
   // BF-ICP baseline code
@@ -6774,6 +7581,12 @@ void EnvObjectRecognition::SetDebugDir(const string &debug_dir) {
 
 const EnvStats &EnvObjectRecognition::GetEnvStats() {
   env_stats_.scenes_valid = hash_manager_.Size() - 1; // Ignore the start state
+  env_stats_.render_cache_hits = unadjusted_single_object_depth_image_cache_.hits() +
+                                 adjusted_single_object_depth_image_cache_.hits();
+  env_stats_.render_cache_misses = unadjusted_single_object_depth_image_cache_.misses() +
+                                   adjusted_single_object_depth_image_cache_.misses();
+  env_stats_.render_cache_evictions = unadjusted_single_object_depth_image_cache_.evictions() +
+                                      adjusted_single_object_depth_image_cache_.evictions();
   return env_stats_;
 }
 
@@ -7053,6 +7866,20 @@ vector<PointCloudPtr> EnvObjectRecognition::GetObjectPointClouds(
   // // PrintGPUImages(result_depth, result_color, num_poses, "succ_post_shift", random_poses_occluded);
 // }
 
+double EnvObjectRecognition::GetSearchResolution(int model_id) const {
+  if (perch_params_.use_adaptive_resolution) {
+    return obj_models_[model_id].GetInscribedRadius();
+  }
+
+  if (perch_params_.use_model_specific_search_resolution) {
+    auto model_bank_it = model_bank_.find(obj_models_[model_id].name());
+    assert (model_bank_it != model_bank_.end());
+    return model_bank_it->second.search_resolution;
+  }
+
+  return env_params_.res;
+}
+
 void EnvObjectRecognition::GenerateSuccessorStates(const GraphState
                                                    &source_state, std::vector<GraphState> *succ_states) {
 
@@ -7077,16 +7904,7 @@ void EnvObjectRecognition::GenerateSuccessorStates(const GraphState
     auto model_bank_it = model_bank_.find(obj_models_[ii].name());
     assert (model_bank_it != model_bank_.end());
     const auto &model_meta_data = model_bank_it->second;
-    double search_resolution = 0;
-
-    if (perch_params_.use_model_specific_search_resolution) {
-      search_resolution = model_meta_data.search_resolution;
-    } else {
-      search_resolution = env_params_.res;
-    }
-
-    const double res = perch_params_.use_adaptive_resolution ?
-                       obj_models_[ii].GetInscribedRadius() : search_resolution;
+    const double res = GetSearchResolution(ii);
 
     if (env_params_.use_external_render == 1 || env_params_.use_external_pose_list == 1)
     {
@@ -7096,45 +7914,25 @@ void EnvObjectRecognition::GenerateSuccessorStates(const GraphState
         if (source_state.object_states().size() == 0)
         {
           string render_states_dir;
-          string render_states_path = env_params_.rendered_root_dir;
-          string render_states_path_parent = render_states_path;
           std::stringstream ss;
-          ss << render_states_path << "/" << obj_models_[ii].name();
+          ss << env_params_.rendered_root_dir << "/" << obj_models_[ii].name();
           render_states_dir = ss.str();
-          std::stringstream sst;
-          sst << render_states_path << "/" << obj_models_[ii].name() << "/" << "poses.txt";
-          render_states_path = sst.str();
-          // printf("Path for rendered states : %s\n", render_states_path.c_str());
 
-          std::ifstream file(render_states_path);
-          std::vector<std::vector<std::string> > dataList;
-          std::string line = "";
+          // Binary pose list converted once from poses.txt, mapped instead of parsed
+          PoseList pose_list;
+          if (!OpenModelPoseList(render_states_dir, &pose_list))
+          {
+            printf("No pose list found in %s\n", render_states_dir.c_str());
+          }
+          int required_object_id = distance(segmented_object_names.begin(), 
+              find(segmented_object_names.begin(), segmented_object_names.end(), obj_models_[ii].name()));
 
-          // Iterate through each line and split the content using delimeter
           int external_pose_id = 0;
           int succ_count = 0;
-          while (getline(file, line))
+          for (size_t pose_index = 0; pose_index < pose_list.size(); ++pose_index)
           {
-              std::vector<std::string> vec;
-              boost::algorithm::split(vec, line, boost::is_any_of(" "));
-              // cout << vec.size();
-              std::vector<double> doubleVector(vec.size());
-
-              std::transform(vec.begin(), vec.end(), doubleVector.begin(), [](const std::string& val)
-              {
-                  return std::stod(val);
-              });
-
-              ContPose p(doubleVector[0], doubleVector[1], doubleVector[2], doubleVector[3], doubleVector[4], doubleVector[5], doubleVector[6]);
+              ContPose p = pose_list.pose(pose_index);
               external_pose_id++;
-              // std::cout << "File Pose : " << doubleVector[0] << " " <<
-              //   doubleVector[1] <<  " " << doubleVector[2] <<  " " << doubleVector[3] <<  " " << doubleVector[4] << " " << doubleVector[5] << " " << endl;
-
-              // std::cout << "Cont Pose : " << p << endl;
-
-              // cout << doubleVector[0];
-              int required_object_id = distance(segmented_object_names.begin(), 
-                  find(segmented_object_names.begin(), segmented_object_names.end(), obj_models_[ii].name()));
 
               // Check for min points in neighbourhood of pose
               if (!IsValidPose(source_state, ii, p, false, required_object_id)) {
@@ -7201,8 +7999,7 @@ void EnvObjectRecognition::GenerateSuccessorStates(const GraphState
                 succ_states->push_back(s);
               }
           }
-          // Close the File
-          file.close();
+          pose_list.Close();
           
           if (perch_params_.use_gpu)
           {
@@ -7489,6 +8286,73 @@ void EnvObjectRecognition::GenerateSuccessorStates(const GraphState
   std::cout << "Size of successor states : " << succ_states->size() << endl;
 }
 
+bool EnvObjectRecognition::GetNextExternalPoseBatch(PoseListCursor *cursor,
+                                                    int batch_size,
+                                                    std::vector<ObjectState> *batch) {
+  /*
+   * Streaming version of GenerateSuccessorStates for the empty state with external pose lists.
+   * Reads the pose lists of all models in order, starting where the cursor stopped, and returns
+   * up to batch_size valid object states. Returns false once all lists are read.
+   */
+  assert(batch != nullptr);
+  batch->clear();
+  const GraphState source_state;
+
+  while ((int) batch->size() < batch_size && cursor->model_id < env_params_.num_models)
+  {
+    const int ii = cursor->model_id;
+    if (!cursor->pose_list.is_open())
+    {
+      std::stringstream ss;
+      ss << env_params_.rendered_root_dir << "/" << obj_models_[ii].name();
+      printf("States for model : %s\n", obj_models_[ii].name().c_str());
+      if (!OpenModelPoseList(ss.str(), &cursor->pose_list))
+      {
+        printf("No pose list found in %s\n", ss.str().c_str());
+        cursor->model_id++;
+        continue;
+      }
+      cursor->pose_index = 0;
+    }
+
+    int required_object_id = distance(segmented_object_names.begin(),
+        find(segmented_object_names.begin(), segmented_object_names.end(), obj_models_[ii].name()));
+
+    while (cursor->pose_index < cursor->pose_list.size() && (int) batch->size() < batch_size)
+    {
+      // Validate as many poses as are missing from the batch in parallel, keeping the file order
+      const size_t chunk_start = cursor->pose_index;
+      const size_t chunk_size = std::min(cursor->pose_list.size() - chunk_start,
+                                         (size_t) (batch_size - batch->size()));
+      vector<char> pose_valid(chunk_size, 0);
+      #pragma omp parallel for schedule(dynamic, 64)
+      for (size_t pi = 0; pi < chunk_size; ++pi)
+      {
+        pose_valid[pi] = IsValidPose(source_state, ii, cursor->pose_list.pose(chunk_start + pi),
+                                     false, required_object_id);
+      }
+      for (size_t pi = 0; pi < chunk_size; ++pi)
+      {
+        if (!pose_valid[pi]) {
+          continue;
+        }
+        const ObjectState new_object(ii, obj_models_[ii].symmetric(),
+                                     cursor->pose_list.pose(chunk_start + pi), required_object_id + 1);
+        batch->push_back(new_object);
+        valid_succ_cache[ii].push_back(new_object);
+      }
+      cursor->pose_index += chunk_size;
+    }
+
+    if (cursor->pose_index >= cursor->pose_list.size())
+    {
+      cursor->pose_list.Close();
+      cursor->model_id++;
+    }
+  }
+  return !batch->empty();
+}
+
 bool EnvObjectRecognition::GetComposedDepthImage(const vector<unsigned short> &source_depth_image,
                                                  const vector<vector<unsigned char>> &source_color_image,
                                                  const vector<unsigned short> &last_object_depth_image,
@@ -7552,6 +8416,31 @@ bool EnvObjectRecognition::GetComposedDepthImage(const vector<unsigned short>
   return true;
 }
 
+RenderCacheKey EnvObjectRecognition::GetRenderCacheKey(
+  const GraphState &single_object_graph_state) const {
+  assert(single_object_graph_state.NumObjects() == 1);
+  const ObjectState &object_state = single_object_graph_state.object_states()[0];
+  const DiscPose &disc_pose = object_state.disc_pose();
+
+  // Symmetric objects are equal regardless of rotation, see ObjectState::operator==
+  if (object_state.symmetric()) {
+    return {object_state.id(), DiscPose(disc_pose.x(), disc_pose.y(), disc_pose.z(), 0, 0, 0),
+            camera_pose_hash_};
+  }
+
+  return {object_state.id(), disc_pose, camera_pose_hash_};
+}
+
+void EnvObjectRecognition::CacheSingleObjectDepthImage(const GraphState
+                                                       &single_object_graph_state,
+                                                       const vector<unsigned short> &single_object_depth_image,
+                                                       bool after_refinement) {
+  auto &cache = after_refinement ? adjusted_single_object_depth_image_cache_ :
+                unadjusted_single_object_depth_image_cache_;
+  cache.Insert(GetRenderCacheKey(single_object_graph_state),
+               single_object_depth_image, kCameraWidth, kCameraHeight, kKinectMaxDepth);
+}
+
 bool EnvObjectRecognition::GetSingleObjectDepthImage(const GraphState
                                                      &single_object_graph_state, vector<unsigned short> *single_object_depth_image,
                                                      bool after_refinement) {
@@ -7560,18 +8449,32 @@ bool EnvObjectRecognition::GetSingleObjectDepthImage(const GraphState
 
   assert(single_object_graph_state.NumObjects() == 1);
 
-  auto &cache = after_refinement ? adjusted_single_object_depth_image_cache_ :
-                unadjusted_single_object_depth_image_cache_;
+  // Only states that were valid at the first level have been cached
+  auto adjusted_state_it = adjusted_single_object_state_cache_.find(
+                             single_object_graph_state);
 
-  // TODO: Verify there are no cases where this will fail.
-  if (cache.find(single_object_graph_state) ==
-      cache.end()) {
+  if (adjusted_state_it == adjusted_single_object_state_cache_.end()) {
     return false;
   }
 
-  *single_object_depth_image =
-    cache[single_object_graph_state];
+  auto &cache = after_refinement ? adjusted_single_object_depth_image_cache_ :
+                unadjusted_single_object_depth_image_cache_;
+
+  if (cache.Lookup(GetRenderCacheKey(single_object_graph_state),
+                   single_object_depth_image)) {
+    return true;
+  }
 
+  // Evicted, render it again. With an empty source the composed image of
+  // GetCost is the rendering of the (adjusted) object alone.
+  GraphState render_state = after_refinement ? adjusted_state_it->second :
+                            single_object_graph_state;
+  vector<vector<unsigned char>> color_image;
+  cv::Mat cv_depth_image, cv_color_image;
+  GetDepthImage(render_state, single_object_depth_image, &color_image,
+                &cv_depth_image, &cv_color_image);
+  CacheSingleObjectDepthImage(single_object_graph_state,
+                              *single_object_depth_image, after_refinement);
   return true;
 }
 
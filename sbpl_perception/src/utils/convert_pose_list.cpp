@@ -0,0 +1,56 @@
+// Converts the poses.txt of every model under a rendered root dir (or the
+// given poses.txt files) into the binary pose list read by
+// EnvObjectRecognition. Usage:
+//   convert_pose_list <rendered_root_dir>
+//   convert_pose_list <poses.txt> [<poses.txt> ...]
+#include <sbpl_perception/pose_list.h>
+
+#include <boost/filesystem.hpp>
+
+#include <cstdio>
+#include <string>
+
+using namespace sbpl_perception;
+using namespace std;
+
+namespace {
+bool Convert(const boost::filesystem::path &txt_path) {
+  const string bin_path = (txt_path.parent_path() / "poses.bin").string();
+  const int num_poses = ConvertPoseListToBinary(txt_path.string(), bin_path);
+
+  if (num_poses < 0) {
+    return false;
+  }
+
+  printf("%s : %d poses\n", bin_path.c_str(), num_poses);
+  return true;
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage : %s <rendered_root_dir> | <poses.txt> ...\n", argv[0]);
+    return 1;
+  }
+
+  bool success = true;
+
+  for (int ii = 1; ii < argc; ++ii) {
+    const boost::filesystem::path path(argv[ii]);
+
+    if (!boost::filesystem::is_directory(path)) {
+      success = Convert(path) && success;
+      continue;
+    }
+
+    for (boost::filesystem::directory_iterator it(path), end; it != end; ++it) {
+      const boost::filesystem::path txt_path = it->path() / "poses.txt";
+
+      if (boost::filesystem::is_regular_file(txt_path)) {
+        success = Convert(txt_path) && success;
+      }
+    }
+  }
+
+  return success ? 0 : 1;
+}
@@ -228,6 +228,47 @@ vector<unsigned short> DatasetGenerator::GetDepthImage(const
   return depth_image;
 }
 
+vector<vector<unsigned short>> DatasetGenerator::GetDepthImages(const
+                                                                std::vector<ObjectModel>
+                                                                &models_in_scene,
+                                                                const vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>> &camera_poses) {
+
+  auto &scene_ = kinect_simulator_->scene_;
+
+  if (scene_ == NULL) {
+    printf("ERROR: Scene is not set\n");
+  }
+
+  scene_->clear();
+
+  for (size_t ii = 0; ii < models_in_scene.size(); ++ii) {
+    const ObjectModel &object_model = models_in_scene[ii];
+    PolygonMeshModel::Ptr model = PolygonMeshModel::Ptr (new PolygonMeshModel (
+                                                           GL_POLYGON, pcl::PolygonMeshPtr(new pcl::PolygonMesh(object_model.mesh()))));
+    scene_->add (model);
+  }
+
+  // Fetch the image of pose ii - 1 after pose ii has been submitted
+  vector<vector<unsigned short>> depth_images(camera_poses.size());
+  int previous_frame = -1;
+
+  for (size_t ii = 0; ii < camera_poses.size(); ++ii) {
+    const int frame = kinect_simulator_->doSimAsync(camera_poses[ii]);
+
+    if (ii > 0) {
+      kinect_simulator_->get_depth_image_uint(previous_frame, &depth_images[ii - 1]);
+    }
+
+    previous_frame = frame;
+  }
+
+  if (!camera_poses.empty()) {
+    kinect_simulator_->get_depth_image_uint(previous_frame, &depth_images.back());
+  }
+
+  return depth_images;
+}
+
 void DatasetGenerator::GenerateCylindersDataset(double min_radius,
                                                 double max_radius,
                                                 double delta_radius, double height,
@@ -258,10 +299,11 @@ void DatasetGenerator::GenerateCylindersDataset(double min_radius,
         GenerateHaloPoses(focus_center, radius, z, num_poses, &camera_poses);
 
 
+        vector<vector<unsigned short>> depth_images = GetDepthImages(models_in_scene,
+                                                                     camera_poses);
+
         bool symmetric_object = false;
-        for (const auto &camera_pose : camera_poses) {
-          vector<unsigned short> depth_image = GetDepthImage(models_in_scene,
-                                                             camera_pose);
+        for (auto &depth_image : depth_images) {
           static cv::Mat cv_depth_image;
           // Don't keep re-rendering if object is rotationally symmetric.
           if (!symmetric_object) {
@@ -0,0 +1,92 @@
+#include <sbpl_perception/cost_executor.h>
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using sbpl_perception::CostExecutor;
+
+namespace {
+constexpr int kNumJobs = 200;
+}
+
+class CostExecutorTest : public testing::Test {
+ protected:
+  CostExecutor executor;
+};
+
+TEST_F(CostExecutorTest, RunsEveryJobWithRendersOnCallingThread) {
+  const thread::id caller = this_thread::get_id();
+
+  for (int num_threads : {1, 2, 8}) {
+    vector<int> outputs(kNumJobs, -1);
+    atomic<int> foreign_renders(0);
+    executor.Run(kNumJobs, num_threads, [&](int ii) {
+      int rendered = 0;
+      executor.Render([&]() {
+        if (this_thread::get_id() != caller) {
+          ++foreign_renders;
+        }
+        rendered = ii;
+      });
+      outputs[ii] = 2 * rendered;
+    });
+
+    EXPECT_EQ(foreign_renders, 0) << num_threads << " threads";
+    for (int ii = 0; ii < kNumJobs; ++ii) {
+      EXPECT_EQ(outputs[ii], 2 * ii) << num_threads << " threads";
+    }
+  }
+}
+
+TEST_F(CostExecutorTest, JobExceptionIsRethrown) {
+  for (int num_threads : {1, 2, 8}) {
+    atomic<int> jobs_run(0);
+    EXPECT_THROW(executor.Run(kNumJobs, num_threads, [&](int ii) {
+      ++jobs_run;
+      if (ii == 10) {
+        throw runtime_error("job failed");
+      }
+    }), runtime_error) << num_threads << " threads";
+    EXPECT_LT(jobs_run, kNumJobs) << num_threads << " threads";
+  }
+}
+
+TEST_F(CostExecutorTest, RenderExceptionReachesJobAndCaller) {
+  atomic<int> caught_in_job(0);
+  EXPECT_THROW(executor.Run(kNumJobs, 4, [&](int ii) {
+    try {
+      executor.Render([ii]() {
+        if (ii % 50 == 0) {
+          throw runtime_error("render failed");
+        }
+      });
+    } catch (const runtime_error &) {
+      ++caught_in_job;
+      throw;
+    }
+  }), runtime_error);
+  EXPECT_GE(caught_in_job, 1);
+}
+
+TEST_F(CostExecutorTest, UsableAfterFailedRun) {
+  EXPECT_THROW(executor.Run(kNumJobs, 4, [](int) {
+    throw runtime_error("job failed");
+  }), runtime_error);
+
+  atomic<int> jobs_run(0);
+  EXPECT_NO_THROW(executor.Run(kNumJobs, 4, [&](int) {
+    executor.Render([]() {});
+    ++jobs_run;
+  }));
+  EXPECT_EQ(jobs_run, kNumJobs);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
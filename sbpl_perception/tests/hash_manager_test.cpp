@@ -21,10 +21,10 @@ class HashManagerTest : public testing::Test {
 };
 
 TEST_F(HashManagerTest, Test1) {
-  ObjectState o1(1, true, ContPose(0.1, 10.0, M_PI / 10.0));
-  ObjectState o2(2, false, ContPose(1.0, 5.0, M_PI / 5.0));
-  ObjectState o3(3, false, ContPose(10.0, 2.0, M_PI / 3.0));
-  ObjectState o4(4, false, ContPose(10.0, 2.0, M_PI / 3.0));
+  ObjectState o1(1, true, ContPose(0.1, 10.0, 0.0, 0.0, 0.0, M_PI / 10.0));
+  ObjectState o2(2, false, ContPose(1.0, 5.0, 0.0, 0.0, 0.0, M_PI / 5.0));
+  ObjectState o3(3, false, ContPose(10.0, 2.0, 0.0, 0.0, 0.0, M_PI / 3.0));
+  ObjectState o4(4, false, ContPose(10.0, 2.0, 0.0, 0.0, 0.0, M_PI / 3.0));
 
   GraphState g1 ,g2, g3, g4, g5;
   g1.mutable_object_states() = {o1, o2, o3};
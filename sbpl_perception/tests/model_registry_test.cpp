@@ -0,0 +1,136 @@
+#include <cuda_renderer/model_registry.h>
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+using cuda_renderer::Model;
+using cuda_renderer::ModelRegistry;
+
+namespace {
+// Model of num_tris triangles, the first vertex of each is (tag, ii, 0)
+Model MakeModel(float tag, int num_tris) {
+  Model model;
+  for (int ii = 0; ii < num_tris; ++ii) {
+    Model::Triangle tri = {};
+    tri.v0.x = tag;
+    tri.v0.y = ii;
+    model.tris.push_back(tri);
+  }
+  return model;
+}
+
+// Tags of the triangles in the registry, in order
+vector<float> Tags(const ModelRegistry &registry) {
+  vector<float> tags;
+  for (const auto &tri : registry.tris()) {
+    tags.push_back(tri.v0.x);
+  }
+  return tags;
+}
+}
+
+class ModelRegistryTest : public testing::Test {
+ protected:
+  virtual void SetUp() {
+    EXPECT_EQ(registry.add("a", MakeModel(1, 2)), 0);
+    EXPECT_EQ(registry.add("b", MakeModel(2, 3)), 1);
+    EXPECT_EQ(registry.add("c", MakeModel(3, 1)), 2);
+  }
+
+  ModelRegistry registry;
+};
+
+TEST_F(ModelRegistryTest, Lookup) {
+  EXPECT_EQ(registry.num_models(), 3);
+  EXPECT_EQ(registry.find("a"), 0);
+  EXPECT_EQ(registry.find("b"), 1);
+  EXPECT_EQ(registry.find("c"), 2);
+  EXPECT_EQ(registry.find("d"), -1);
+  EXPECT_EQ(registry.find(""), -1);
+
+  EXPECT_EQ(Tags(registry), vector<float>({1, 1, 2, 2, 2, 3}));
+  EXPECT_EQ(registry.tris_model_count(), vector<int>({2, 3, 1}));
+  for (int handle = 0; handle < registry.num_models(); ++handle) {
+    EXPECT_TRUE(registry.active(handle));
+  }
+}
+
+TEST_F(ModelRegistryTest, ResidentModelIsNotAddedAgain) {
+  const int generation = registry.generation();
+
+  EXPECT_EQ(registry.add("b", MakeModel(4, 5)), 1);
+  // The mesh is resident, so the file is never read
+  EXPECT_EQ(registry.add("c", "/nonexistent/model.ply"), 2);
+
+  EXPECT_EQ(registry.num_models(), 3);
+  EXPECT_EQ(Tags(registry), vector<float>({1, 1, 2, 2, 2, 3}));
+  EXPECT_EQ(registry.generation(), generation);
+}
+
+TEST_F(ModelRegistryTest, RemoveKeepsMeshResident) {
+  const int generation = registry.generation();
+
+  registry.remove(1);
+  EXPECT_FALSE(registry.active(1));
+  EXPECT_TRUE(registry.active(0));
+  EXPECT_EQ(registry.find("b"), 1);
+  EXPECT_EQ(registry.inactive_tris(), 3u);
+
+  // Requesting it again reactivates the same handle
+  EXPECT_EQ(registry.add("b", "/nonexistent/model.ply"), 1);
+  EXPECT_TRUE(registry.active(1));
+  EXPECT_EQ(registry.inactive_tris(), 0u);
+
+  registry.remove_all();
+  for (int handle = 0; handle < registry.num_models(); ++handle) {
+    EXPECT_FALSE(registry.active(handle));
+  }
+  EXPECT_EQ(registry.inactive_tris(), 6u);
+  EXPECT_EQ(Tags(registry), vector<float>({1, 1, 2, 2, 2, 3}));
+  EXPECT_EQ(registry.generation(), generation);
+}
+
+TEST_F(ModelRegistryTest, CompactDropsInactiveModels) {
+  const int generation = registry.generation();
+  EXPECT_FALSE(registry.compact());
+  EXPECT_EQ(registry.generation(), generation);
+
+  registry.remove(0);
+  EXPECT_TRUE(registry.compact());
+  EXPECT_GT(registry.generation(), generation);
+
+  EXPECT_EQ(registry.num_models(), 2);
+  EXPECT_EQ(registry.find("a"), -1);
+  EXPECT_EQ(registry.find("b"), 0);
+  EXPECT_EQ(registry.find("c"), 1);
+  EXPECT_TRUE(registry.active(0));
+  EXPECT_TRUE(registry.active(1));
+  EXPECT_EQ(Tags(registry), vector<float>({2, 2, 2, 3}));
+  EXPECT_EQ(registry.tris_model_count(), vector<int>({3, 1}));
+  EXPECT_EQ(registry.inactive_tris(), 0u);
+
+  // New models are appended after the compacted ones
+  EXPECT_EQ(registry.add("a", MakeModel(1, 2)), 2);
+  EXPECT_EQ(Tags(registry), vector<float>({2, 2, 2, 3, 1, 1}));
+}
+
+TEST_F(ModelRegistryTest, Clear) {
+  const int generation = registry.generation();
+  registry.clear();
+
+  EXPECT_TRUE(registry.empty());
+  EXPECT_EQ(registry.num_models(), 0);
+  EXPECT_EQ(registry.find("a"), -1);
+  EXPECT_TRUE(registry.tris_model_count().empty());
+  EXPECT_GT(registry.generation(), generation);
+
+  EXPECT_EQ(registry.add("c", MakeModel(3, 1)), 0);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
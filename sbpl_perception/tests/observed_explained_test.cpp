@@ -0,0 +1,115 @@
+#include <cuda_renderer/observed_explained.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <set>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace cuda_renderer::observed_explained;
+
+namespace {
+constexpr int kNumPoses = 4;
+// Not a multiple of 32, so that the last word of every pose is partial
+constexpr int kObservedPoints = 70;
+
+// (pose, observed point) pairs explained by rendered points, with repeats
+const vector<pair<int, int>> kExplained = {
+  {0, 0}, {0, 31}, {0, 32}, {0, 69}, {0, 0}, {0, 69},
+  {1, 5}, {1, 5}, {1, 5},
+  {3, 1}, {3, 2}, {3, 33}, {3, 64}, {3, 65}, {3, 66}, {3, 67}, {3, 68},
+};
+
+// Distinct observed points explained by each pose
+vector<float> ExpectedCounts() {
+  vector<set<int>> points(kNumPoses);
+  for (const auto &explained : kExplained) {
+    points[explained.first].insert(explained.second);
+  }
+  vector<float> counts;
+  for (const auto &pose_points : points) {
+    counts.push_back(pose_points.size());
+  }
+  return counts;
+}
+}
+
+TEST(ObservedExplainedTest, Words) {
+  EXPECT_EQ(words(0), 0);
+  EXPECT_EQ(words(1), 1);
+  EXPECT_EQ(words(32), 1);
+  EXPECT_EQ(words(33), 2);
+  EXPECT_EQ(words(kObservedPoints), 3);
+}
+
+TEST(ObservedExplainedTest, BitsCountEachPointOnce) {
+  // As compute_render_cost marks and compute_observed_cost counts
+  const int num_words = words(kObservedPoints);
+  vector<unsigned int> bits(kNumPoses * num_words, 0);
+  for (const auto &explained : kExplained) {
+    bits[word_index(explained.first, explained.second, num_words)] |= bit(explained.second);
+  }
+
+  vector<float> counts(kNumPoses, 0);
+  for (size_t word = 0; word < bits.size(); ++word) {
+    counts[word / num_words] += popcount(bits[word]);
+  }
+  EXPECT_EQ(counts, ExpectedCounts());
+  EXPECT_EQ(popcount(0xffffffffu), 32);
+  EXPECT_EQ(popcount(0u), 0);
+}
+
+TEST(ObservedExplainedTest, KeysCountEachPointOnce) {
+  // As compute_render_cost marks and normalize_costs counts, with rendered
+  // points that explain nothing in between
+  vector<unsigned long long> keys;
+  for (const auto &explained : kExplained) {
+    keys.push_back(key(explained.first, explained.second, kObservedPoints));
+    keys.push_back(UNEXPLAINED_KEY);
+  }
+  reverse(keys.begin(), keys.end());
+
+  sort(keys.begin(), keys.end());
+  auto keys_end = unique(keys.begin(), keys.end());
+  keys_end = lower_bound(keys.begin(), keys_end, UNEXPLAINED_KEY);
+
+  vector<float> counts(kNumPoses, 0);
+  for (auto it = keys.begin(); it != keys_end; ++it) {
+    counts[key_pose(*it, kObservedPoints)] += 1;
+  }
+  EXPECT_EQ(counts, ExpectedCounts());
+}
+
+TEST(ObservedExplainedTest, KeysOfLargeBatches) {
+  // Past the range of 32 bit indices
+  const int num_poses = 2000;
+  const int observed_points = 3000000;
+  const unsigned long long last = key(num_poses - 1, observed_points - 1, observed_points);
+  EXPECT_EQ(last, 2000ULL * 3000000ULL - 1);
+  EXPECT_EQ(key_pose(last, observed_points), num_poses - 1);
+  EXPECT_LT(last, UNEXPLAINED_KEY);
+
+  // Keys are ordered by pose first
+  EXPECT_LT(key(10, observed_points - 1, observed_points), key(11, 0, observed_points));
+  EXPECT_EQ(key_pose(key(11, 0, observed_points), observed_points), 11);
+}
+
+TEST(ObservedExplainedTest, KeysUsedForSmallFootprints) {
+  // 2000 poses against 50k observed points take 12.5 MB of bits, against
+  // 100 MB for one byte per pair
+  EXPECT_EQ(bits_bytes(2000, 50000), 2000u * 1563u * 4u);
+  EXPECT_EQ(keys_bytes(1000), 8000u);
+
+  // Poses of 100 points cover a small part of the observed cloud
+  EXPECT_TRUE(use_keys(2000, 50000, 2000 * 100));
+  // Poses of 10k points are cheaper as bits
+  EXPECT_FALSE(use_keys(2000, 50000, 2000 * 10000));
+  EXPECT_FALSE(use_keys(2000, 0, 0));
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,211 @@
+#include <sbpl_perception/pose_list.h>
+
+#include <gtest/gtest.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace sbpl_perception;
+
+namespace {
+constexpr double kFloatingPointTolerance = 1e-5;
+
+// x y z qx qy qz qw of the valid lines of kPosesText, quaternions are unit
+// length with qw > 0 so ContPose keeps them as they are
+const vector<vector<double>> kPoses = {
+  {0.1, 0.2, 0.3, 0.0, 0.0, 0.0, 1.0},
+  {-1.5, 2.0, 0.75, 0.0, 0.0, 0.6, 0.8},
+  {3.0, -4.0, 5.0, 0.5, 0.5, 0.5, 0.5},
+};
+
+// Malformed lines are skipped, extra values after a full pose are ignored
+const char kPosesText[] =
+  "0.1 0.2 0.3 0 0 0 1\n"
+  "\n"
+  "1 2 3\n"
+  "-1.5 2.0 0.75 0 0 0.6 0.8 42\n"
+  "not a pose\n"
+  "1 2 3 4 5 six 7\n"
+  "3 -4 5 0.5 0.5 0.5 0.5\n";
+}
+
+class PoseListTest : public testing::Test {
+ protected:
+  virtual void SetUp() {
+    char dir_template[] = "/tmp/pose_list_testXXXXXX";
+    ASSERT_NE(mkdtemp(dir_template), nullptr);
+    dir = dir_template;
+    txt_path = dir + "/poses.txt";
+    bin_path = dir + "/poses.bin";
+  }
+
+  virtual void TearDown() {
+    remove(txt_path.c_str());
+    remove(bin_path.c_str());
+    rmdir(dir.c_str());
+  }
+
+  void WriteFile(const string &path, const string &contents) {
+    ofstream file(path, ios::binary);
+    file << contents;
+  }
+
+  string ReadFile(const string &path) {
+    ifstream file(path, ios::binary);
+    return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+  }
+
+  void ExpectPoses(const PoseList &pose_list) {
+    ASSERT_TRUE(pose_list.is_open());
+    ASSERT_EQ(pose_list.size(), kPoses.size());
+
+    for (size_t ii = 0; ii < kPoses.size(); ++ii) {
+      const ContPose pose = pose_list.pose(ii);
+      const vector<double> &expected = kPoses[ii];
+      EXPECT_NEAR(pose.x(), expected[0], kFloatingPointTolerance) << "pose " << ii;
+      EXPECT_NEAR(pose.y(), expected[1], kFloatingPointTolerance) << "pose " << ii;
+      EXPECT_NEAR(pose.z(), expected[2], kFloatingPointTolerance) << "pose " << ii;
+      EXPECT_NEAR(pose.qx(), expected[3], kFloatingPointTolerance) << "pose " << ii;
+      EXPECT_NEAR(pose.qy(), expected[4], kFloatingPointTolerance) << "pose " << ii;
+      EXPECT_NEAR(pose.qz(), expected[5], kFloatingPointTolerance) << "pose " << ii;
+      EXPECT_NEAR(pose.qw(), expected[6], kFloatingPointTolerance) << "pose " << ii;
+    }
+  }
+
+  string dir;
+  string txt_path;
+  string bin_path;
+};
+
+TEST_F(PoseListTest, TextSkipsMalformedLines) {
+  WriteFile(txt_path, kPosesText);
+
+  PoseList pose_list;
+  EXPECT_TRUE(pose_list.OpenText(txt_path));
+  ExpectPoses(pose_list);
+
+  pose_list.Close();
+  EXPECT_FALSE(pose_list.is_open());
+  EXPECT_EQ(pose_list.size(), 0u);
+}
+
+TEST_F(PoseListTest, ConvertedBinaryMatchesText) {
+  WriteFile(txt_path, kPosesText);
+  EXPECT_EQ(ConvertPoseListToBinary(txt_path, bin_path),
+            static_cast<int>(kPoses.size()));
+
+  const string data = ReadFile(bin_path);
+  ASSERT_EQ(data.size(), sizeof(PoseListHeader) +
+            kPoses.size() * kPoseListDim * sizeof(double));
+  PoseListHeader header;
+  memcpy(&header, data.data(), sizeof(header));
+  EXPECT_EQ(memcmp(header.magic, kPoseListMagic, sizeof(kPoseListMagic)), 0);
+  EXPECT_EQ(header.version, kPoseListVersion);
+  EXPECT_EQ(header.pose_dim, kPoseListDim);
+  EXPECT_EQ(header.num_poses, kPoses.size());
+
+  PoseList pose_list;
+  EXPECT_TRUE(pose_list.Open(bin_path));
+  ExpectPoses(pose_list);
+}
+
+TEST_F(PoseListTest, EmptyText) {
+  WriteFile(txt_path, "");
+  EXPECT_EQ(ConvertPoseListToBinary(txt_path, bin_path), 0);
+
+  PoseList pose_list;
+  EXPECT_TRUE(pose_list.Open(bin_path));
+  EXPECT_EQ(pose_list.size(), 0u);
+}
+
+TEST_F(PoseListTest, MissingFiles) {
+  PoseList pose_list;
+  EXPECT_FALSE(pose_list.OpenText(txt_path));
+  EXPECT_FALSE(pose_list.Open(bin_path));
+  EXPECT_EQ(ConvertPoseListToBinary(txt_path, bin_path), -1);
+  EXPECT_FALSE(OpenModelPoseList(dir, &pose_list));
+  EXPECT_FALSE(pose_list.is_open());
+}
+
+TEST_F(PoseListTest, RejectsInvalidBinary) {
+  WriteFile(txt_path, kPosesText);
+  ASSERT_GT(ConvertPoseListToBinary(txt_path, bin_path), 0);
+  const string valid = ReadFile(bin_path);
+  PoseList pose_list;
+
+  // Shorter than a header
+  WriteFile(bin_path, valid.substr(0, sizeof(PoseListHeader) - 1));
+  EXPECT_FALSE(pose_list.Open(bin_path));
+
+  // Last pose cut off
+  WriteFile(bin_path, valid.substr(0, valid.size() - sizeof(double)));
+  EXPECT_FALSE(pose_list.Open(bin_path));
+
+  // Trailing bytes
+  WriteFile(bin_path, valid + "x");
+  EXPECT_FALSE(pose_list.Open(bin_path));
+
+  string corrupted = valid;
+  corrupted[0] = 'X';
+  WriteFile(bin_path, corrupted);
+  EXPECT_FALSE(pose_list.Open(bin_path));
+
+  PoseListHeader header;
+  memcpy(&header, valid.data(), sizeof(header));
+  header.version = kPoseListVersion + 1;
+  corrupted = valid;
+  memcpy(&corrupted[0], &header, sizeof(header));
+  WriteFile(bin_path, corrupted);
+  EXPECT_FALSE(pose_list.Open(bin_path));
+
+  memcpy(&header, valid.data(), sizeof(header));
+  header.pose_dim = kPoseListDim - 1;
+  corrupted = valid;
+  memcpy(&corrupted[0], &header, sizeof(header));
+  WriteFile(bin_path, corrupted);
+  EXPECT_FALSE(pose_list.Open(bin_path));
+
+  EXPECT_FALSE(pose_list.is_open());
+  WriteFile(bin_path, valid);
+  EXPECT_TRUE(pose_list.Open(bin_path));
+  ExpectPoses(pose_list);
+}
+
+TEST_F(PoseListTest, ModelPoseListConvertsStaleBinary) {
+  WriteFile(txt_path, kPosesText);
+
+  // No binary yet, it is written next to the text
+  PoseList pose_list;
+  EXPECT_TRUE(OpenModelPoseList(dir, &pose_list));
+  ExpectPoses(pose_list);
+  struct stat bin_stat;
+  EXPECT_EQ(stat(bin_path.c_str(), &bin_stat), 0);
+
+  // A binary older than the text is converted again
+  WriteFile(txt_path, "1 2 3 0 0 0 1\n");
+  struct utimbuf times;
+  times.actime = times.modtime = bin_stat.st_mtime + 10;
+  ASSERT_EQ(utime(txt_path.c_str(), &times), 0);
+  EXPECT_TRUE(OpenModelPoseList(dir, &pose_list));
+  ASSERT_EQ(pose_list.size(), 1u);
+  EXPECT_NEAR(pose_list.pose(0).x(), 1.0, kFloatingPointTolerance);
+
+  // An up to date binary is used as is, even without the text
+  remove(txt_path.c_str());
+  EXPECT_TRUE(OpenModelPoseList(dir, &pose_list));
+  EXPECT_EQ(pose_list.size(), 1u);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,155 @@
+#include <sbpl_perception/discretization_manager.h>
+#include <sbpl_perception/render_cache.h>
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using namespace std;
+using namespace sbpl_perception;
+
+namespace {
+constexpr int kWidth = 8;
+constexpr int kHeight = 6;
+constexpr unsigned short kEmptyDepth = 20000;
+WorldResolutionParams params;
+
+RenderCacheKey Key(int model_id, int x, size_t camera_hash = 0) {
+  return {model_id, DiscPose(x, 0, 0, 0, 0, 0), camera_hash};
+}
+
+// Empty frame with a size x size square of depth at (x, y)
+vector<unsigned short> Image(int x, int y, int size, unsigned short depth) {
+  vector<unsigned short> image(kWidth * kHeight, kEmptyDepth);
+  for (int row = y; row < y + size; ++row) {
+    for (int col = x; col < x + size; ++col) {
+      image[col + row * kWidth] = depth + col + row * kWidth;
+    }
+  }
+  return image;
+}
+}
+
+class RenderCacheTest : public testing::Test {
+ protected:
+  // Size of an entry holding a 2 x 2 square
+  size_t SquareEntryBytes() {
+    RenderCache cache;
+    cache.Insert(Key(0, 0), Image(0, 0, 2, 1000), kWidth, kHeight, kEmptyDepth);
+    return cache.SizeBytes();
+  }
+
+  RenderCache cache;
+};
+
+TEST_F(RenderCacheTest, HitReturnsFullFrame) {
+  const vector<unsigned short> image = Image(3, 2, 3, 1000);
+  cache.Insert(Key(1, 5), image, kWidth, kHeight, kEmptyDepth);
+
+  vector<unsigned short> cached;
+  EXPECT_TRUE(cache.Lookup(Key(1, 5), &cached));
+  EXPECT_EQ(cached, image);
+  EXPECT_EQ(cache.hits(), 1u);
+  EXPECT_EQ(cache.misses(), 0u);
+
+  // Only the 3 x 3 square is stored
+  const vector<unsigned short> empty_image(kWidth * kHeight, kEmptyDepth);
+  RenderCache empty_cache;
+  empty_cache.Insert(Key(1, 5), empty_image, kWidth, kHeight, kEmptyDepth);
+  EXPECT_EQ(cache.SizeBytes() - empty_cache.SizeBytes(), 9 * sizeof(unsigned short));
+}
+
+TEST_F(RenderCacheTest, EmptyImage) {
+  const vector<unsigned short> image(kWidth * kHeight, kEmptyDepth);
+  cache.Insert(Key(1, 5), image, kWidth, kHeight, kEmptyDepth);
+
+  vector<unsigned short> cached;
+  EXPECT_TRUE(cache.Lookup(Key(1, 5), &cached));
+  EXPECT_EQ(cached, image);
+}
+
+TEST_F(RenderCacheTest, MissOnAnyKeyField) {
+  cache.Insert(Key(1, 5, 7), Image(0, 0, 2, 1000), kWidth, kHeight, kEmptyDepth);
+
+  vector<unsigned short> cached;
+  EXPECT_FALSE(cache.Lookup(Key(2, 5, 7), &cached));
+  EXPECT_FALSE(cache.Lookup(Key(1, 6, 7), &cached));
+  EXPECT_FALSE(cache.Lookup(Key(1, 5, 8), &cached));
+  EXPECT_EQ(cache.misses(), 3u);
+  EXPECT_EQ(cache.hits(), 0u);
+  EXPECT_TRUE(cache.Lookup(Key(1, 5, 7), &cached));
+  EXPECT_EQ(cache.hits(), 1u);
+}
+
+TEST_F(RenderCacheTest, InsertReplacesImage) {
+  cache.Insert(Key(1, 5), Image(0, 0, 2, 1000), kWidth, kHeight, kEmptyDepth);
+  const vector<unsigned short> image = Image(4, 3, 1, 2000);
+  cache.Insert(Key(1, 5), image, kWidth, kHeight, kEmptyDepth);
+
+  EXPECT_EQ(cache.NumEntries(), 1u);
+  vector<unsigned short> cached;
+  EXPECT_TRUE(cache.Lookup(Key(1, 5), &cached));
+  EXPECT_EQ(cached, image);
+}
+
+TEST_F(RenderCacheTest, EvictsLeastRecentlyUsed) {
+  cache.SetBudget(3 * SquareEntryBytes());
+  for (int x = 0; x < 3; ++x) {
+    cache.Insert(Key(1, x), Image(x, 0, 2, 1000), kWidth, kHeight, kEmptyDepth);
+  }
+  EXPECT_EQ(cache.NumEntries(), 3u);
+  EXPECT_EQ(cache.evictions(), 0u);
+
+  // Key 0 becomes the most recently used, so key 1 is evicted next
+  vector<unsigned short> cached;
+  EXPECT_TRUE(cache.Lookup(Key(1, 0), &cached));
+  cache.Insert(Key(1, 3), Image(3, 0, 2, 1000), kWidth, kHeight, kEmptyDepth);
+
+  EXPECT_EQ(cache.NumEntries(), 3u);
+  EXPECT_EQ(cache.evictions(), 1u);
+  EXPECT_LE(cache.SizeBytes(), 3 * SquareEntryBytes());
+  EXPECT_FALSE(cache.Lookup(Key(1, 1), &cached));
+  EXPECT_TRUE(cache.Lookup(Key(1, 0), &cached));
+  EXPECT_EQ(cached, Image(0, 0, 2, 1000));
+  EXPECT_TRUE(cache.Lookup(Key(1, 2), &cached));
+  EXPECT_TRUE(cache.Lookup(Key(1, 3), &cached));
+
+  // Shrinking the budget evicts right away
+  cache.SetBudget(SquareEntryBytes());
+  EXPECT_EQ(cache.NumEntries(), 1u);
+  EXPECT_EQ(cache.evictions(), 3u);
+  EXPECT_TRUE(cache.Lookup(Key(1, 3), &cached));
+}
+
+TEST_F(RenderCacheTest, KeepsNewestEntryOverBudget) {
+  cache.SetBudget(1);
+  cache.Insert(Key(1, 0), Image(0, 0, 2, 1000), kWidth, kHeight, kEmptyDepth);
+  cache.Insert(Key(1, 1), Image(0, 0, 3, 1000), kWidth, kHeight, kEmptyDepth);
+
+  EXPECT_EQ(cache.NumEntries(), 1u);
+  vector<unsigned short> cached;
+  EXPECT_TRUE(cache.Lookup(Key(1, 1), &cached));
+}
+
+TEST_F(RenderCacheTest, UnboundedAndClear) {
+  for (int x = 0; x < 100; ++x) {
+    cache.Insert(Key(1, x), Image(0, 0, 4, 1000), kWidth, kHeight, kEmptyDepth);
+  }
+  EXPECT_EQ(cache.NumEntries(), 100u);
+  EXPECT_EQ(cache.evictions(), 0u);
+
+  vector<unsigned short> cached;
+  EXPECT_TRUE(cache.Lookup(Key(1, 0), &cached));
+  cache.Clear();
+  EXPECT_EQ(cache.NumEntries(), 0u);
+  EXPECT_EQ(cache.SizeBytes(), 0u);
+  EXPECT_EQ(cache.hits(), 0u);
+  EXPECT_FALSE(cache.Lookup(Key(1, 0), &cached));
+}
+
+int main(int argc, char **argv) {
+  SetWorldResolutionParams(0.1, 0.1, M_PI / 18.0, 0.0, 0.0, params);
+  DiscretizationManager::Initialize(params);
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -28,28 +28,61 @@ class StatesTest : public testing::Test {
 };
 
 TEST_F(StatesTest, DiscPoseTest) {
-  DiscPose s1(10, 10, 1);
-  DiscPose s2(10, 10, 1);
-  DiscPose s3(10, 9, 1);
-  DiscPose s4(10, 10, 0);
+  DiscPose s1(10, 10, 0, 0, 0, 1);
+  DiscPose s2(10, 10, 0, 0, 0, 1);
+  DiscPose s3(10, 9, 0, 0, 0, 1);
+  DiscPose s4(10, 10, 0, 0, 0, 0);
   EXPECT_EQ(s1, s2);
   EXPECT_NE(s1, s3);
   EXPECT_NE(s1, s4);
 }
 
 TEST_F(StatesTest, ContPoseTest) {
-  ContPose s1(10.0, 10, 1);
-  ContPose s2(10, 10, 1.000000001);
-  ContPose s3(10, 9, 1.1);
-  ContPose s4(10, 10, 1.11);
+  ContPose s1(10.0, 10, 0.0, 0.0, 0.0, 1);
+  ContPose s2(10, 10, 0.0, 0.0, 0.0, 1.000000001);
+  ContPose s3(10, 9, 0.0, 0.0, 0.0, 1.1);
+  ContPose s4(10, 10, 0.0, 0.0, 0.0, 1.11);
   EXPECT_EQ(s1, s2);
   EXPECT_NE(s1, s3);
   EXPECT_NE(s1, s4);
 }
 
+TEST_F(StatesTest, ContPoseQuaternionTest) {
+  // Unnormalized, with qw < 0: stored normalized with the sign flipped.
+  ContPose s1(1.0, 2.0, 3.0, 0.0, 0.0, -2.0, -2.0);
+  EXPECT_NEAR(s1.qx(), 0.0, kFloatingPointTolerance);
+  EXPECT_NEAR(s1.qy(), 0.0, kFloatingPointTolerance);
+  EXPECT_NEAR(s1.qz(), sqrt(0.5), kFloatingPointTolerance);
+  EXPECT_NEAR(s1.qw(), sqrt(0.5), kFloatingPointTolerance);
+
+  // The same rotation from Euler angles and from either quaternion sign.
+  ContPose s2(1.0, 2.0, 3.0, 0.0, 0.0, M_PI / 2);
+  ContPose s3(1.0, 2.0, 3.0, 0.0, 0.0, sqrt(0.5), sqrt(0.5));
+  EXPECT_EQ(s1, s2);
+  EXPECT_EQ(s1, s3);
+  EXPECT_GE(s2.qw(), 0.0);
+  EXPECT_NEAR(s2.qx() * s2.qx() + s2.qy() * s2.qy() + s2.qz() * s2.qz() +
+              s2.qw() * s2.qw(), 1.0, kFloatingPointTolerance);
+
+  // A zero quaternion is the identity rotation.
+  ContPose s4(1.0, 2.0, 3.0, 0.0, 0.0, 0.0, 0.0);
+  EXPECT_EQ(s4, ContPose(1.0, 2.0, 3.0, 0.0, 0.0, 0.0));
+  EXPECT_NEAR(s4.qw(), 1.0, kFloatingPointTolerance);
+}
+
+TEST_F(StatesTest, ContPoseToleranceTest) {
+  ContPose s1(1.0, 2.0, 3.0, 0.0, 0.0, 0.5);
+  EXPECT_EQ(s1, ContPose(1.0 + 1e-6, 2.0, 3.0, 0.0, 0.0, 0.5));
+  EXPECT_EQ(s1, ContPose(1.0, 2.0, 3.0, 0.0, 0.0, 0.5 + 1e-6));
+  EXPECT_NE(s1, ContPose(1.0 + 1e-4, 2.0, 3.0, 0.0, 0.0, 0.5));
+  EXPECT_NE(s1, ContPose(1.0, 2.0, 3.0 + 1e-4, 0.0, 0.0, 0.5));
+  EXPECT_NE(s1, ContPose(1.0, 2.0, 3.0, 0.0, 0.0, 0.5 + 1e-3));
+  EXPECT_NE(s1, ContPose(1.0, 2.0, 3.0, 1e-3, 0.0, 0.5));
+}
+
 TEST_F(StatesTest, ContToDiscTest) {
-  DiscPose s1(10, 10, 2);
-  ContPose s2(1, 1, 2 * params.theta_res + 0.00005);
+  DiscPose s1(10, 10, 0, 0, 0, 2);
+  ContPose s2(1, 1, 0.0, 0.0, 0.0, 2 * params.theta_res + 0.00005);
   DiscPose s3(s2);
   ContPose s4(s3);
   EXPECT_EQ(s1, s3);
@@ -60,21 +93,22 @@ TEST_F(StatesTest, ContToDiscTest) {
 }
 
 TEST_F(StatesTest, DiscToContTest) {
-  DiscPose s1(10, 10, 2);
+  DiscPose s1(10, 10, 0, 0, 0, 2);
   ContPose s2(s1);
   DiscPose s3(s2);
   ContPose s4(s3);
   EXPECT_EQ(s1, s3);
   EXPECT_EQ(s2, s4);
-  EXPECT_EQ(s4.x(), 1.0);
-  EXPECT_EQ(s4.y(), 1.0);
-  EXPECT_EQ(s4.yaw(), 2 * params.theta_res);
+  // Poses are stored in single precision.
+  EXPECT_NEAR(s4.x(), 1.0, kFloatingPointTolerance);
+  EXPECT_NEAR(s4.y(), 1.0, kFloatingPointTolerance);
+  EXPECT_NEAR(s4.yaw(), 2 * params.theta_res, kFloatingPointTolerance);
 }
 
 TEST_F(StatesTest, SymmetricObjectStateTest) {
-  DiscPose s1(10, 10, 2);
+  DiscPose s1(10, 10, 0, 0, 0, 2);
   ContPose s2(s1);
-  ContPose s3(s2.x(), s2.y(), s2.yaw() + params.theta_res);
+  ContPose s3(s2.x(), s2.y(), 0.0, 0.0, 0.0, s2.yaw() + params.theta_res);
   ObjectState o1(1, true, s1);
   ObjectState o2(1, true, s2);
   ObjectState o3(2, true, s2);
@@ -88,9 +122,9 @@ TEST_F(StatesTest, SymmetricObjectStateTest) {
 }
 
 TEST_F(StatesTest, AsymmetricObjectStateTest) {
-  DiscPose s1(10, 10, 2);
+  DiscPose s1(10, 10, 0, 0, 0, 2);
   ContPose s2(s1);
-  ContPose s3(s2.x(), s2.y(), s2.yaw() + params.theta_res);
+  ContPose s3(s2.x(), s2.y(), 0.0, 0.0, 0.0, s2.yaw() + params.theta_res);
   ObjectState o1(1, false, s1);
   ObjectState o2(1, false, s2);
   ObjectState o3(2, false, s2);
@@ -104,10 +138,10 @@ TEST_F(StatesTest, AsymmetricObjectStateTest) {
 }
 
 TEST_F(StatesTest, GraphStateTest) {
-  ObjectState o1(1, true, ContPose(0.1, 10.0, M_PI / 10.0));
-  ObjectState o2(2, false, ContPose(1.0, 5.0, M_PI / 5.0));
-  ObjectState o3(3, false, ContPose(10.0, 2.0, M_PI / 3.0));
-  ObjectState o4(4, false, ContPose(10.0, 2.0, M_PI / 3.0));
+  ObjectState o1(1, true, ContPose(0.1, 10.0, 0.0, 0.0, 0.0, M_PI / 10.0));
+  ObjectState o2(2, false, ContPose(1.0, 5.0, 0.0, 0.0, 0.0, M_PI / 5.0));
+  ObjectState o3(3, false, ContPose(10.0, 2.0, 0.0, 0.0, 0.0, M_PI / 3.0));
+  ObjectState o4(4, false, ContPose(10.0, 2.0, 0.0, 0.0, 0.0, M_PI / 3.0));
   GraphState g1 ,g2, g3, g4;
   g1.mutable_object_states() = {o1, o2, o3};
   g2.mutable_object_states() = {o1, o2, o3};